@@ -0,0 +1,28 @@
+/*
+    libanxt_direct - Access NXTs without nxtd
+    aNXT - a NXt Toolkit
+    Libraries and tools for LEGO Mindstorms NXT robots
+    Copyright (C) 2008  Janosch Gräf <janosch.graef@gmx.net>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _NXT_DIRECT_H_
+#define _NXT_DIRECT_H_
+
+#include <anxt/nxt.h>
+
+nxt_t *nxt_open_direct(const char *name);
+
+#endif /* _NXT_DIRECT_H_ */
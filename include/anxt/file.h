@@ -32,13 +32,27 @@
 #define NXT_OREAD  4
 #define NXT_OWOVER 8 // can be or'd with write flags
 
+// Max. bytes per READ/WRITE telegram (telegrams are at most NXT_CON_BUFFERSIZE bytes)
+#define NXT_FILE_READ_MAX  (NXT_CON_BUFFERSIZE-6)
+#define NXT_FILE_WRITE_MAX (NXT_CON_BUFFERSIZE-3)
+
+/**
+ * Called during file transfers (see nxt_file_read_progress())
+ *  @param done How many bytes were transferred so far
+ *  @param total How many bytes are transferred in total
+ *  @param ctx Context
+ */
+typedef void (*nxt_file_progress_t)(size_t done,size_t total,void *ctx);
+
 int nxt_file_open_write(nxt_t *nxt,const char *file,size_t size);
 int nxt_file_open_write_linear(nxt_t *nxt,const char *file,size_t size);
 int nxt_file_open_append(nxt_t *nxt,const char *file,size_t *avail);
 int nxt_file_open_read(nxt_t *nxt,const char *file,size_t *filesize);
 int nxt_file_open(nxt_t *nxt,const char *file,int oflag,...);
 ssize_t nxt_file_read(nxt_t *nxt,int handle,void *dest,size_t count);
+ssize_t nxt_file_read_progress(nxt_t *nxt,int handle,void *dest,size_t count,nxt_file_progress_t func,void *ctx);
 ssize_t nxt_file_write(nxt_t *nxt,int handle,void *src,size_t count);
+ssize_t nxt_file_write_progress(nxt_t *nxt,int handle,const void *src,size_t count,nxt_file_progress_t func,void *ctx);
 int nxt_file_close(nxt_t *nxt,int handle);
 int nxt_file_remove(nxt_t *nxt,const char *file);
 int nxt_file_find_first(nxt_t *nxt,const char *wildcard,char **filename,size_t *filesize);
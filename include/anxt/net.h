@@ -25,27 +25,53 @@
 #include <stdio.h>
 #include <netinet/in.h>
 #include <stdint.h>
+#include <time.h>
+#include <pthread.h>
 
-/// Max. number of sockets
-#define NXTNET_SRV_MAXSOCKS   256
+/// Max. number of events handled per epoll_wait()
+#define NXTNET_SRV_MAXEVENTS  64
+/// Max. number of replies sent to a client with one system call
+#define NXTNET_SRV_MAXIOV     16
+/// Number of worker threads started with the server
+#define NXTNET_SRV_WORKERS    8
+/// Max. number of worker threads (more are started while all are busy)
+#define NXTNET_SRV_MAX_WORKERS 256
 /// Backlog size for listen
 #define NXTNET_SRV_LISTEN_MAX 32
-/// Send/Recv buffer size
+/// Max. number of queued replies before samples for a client are dropped
+#define NXTNET_SRV_MAXQUEUE   64
+/// Max. packet size before it was negotiated with HELLO
 #define NXTNET_BUFSIZE        128
+/// Max. packet size that can be negotiated (limited by 'size' in header)
+#define NXTNET_MAXSIZE        65535
+/// Initial size of receive buffers (grown for larger packets)
+#define NXTNET_RBUFSIZE       (8*NXTNET_BUFSIZE)
 /// Password length
 #define NXTNET_PWD_LEN        16
 /// Max. length of NXT name
 #define NXTNET_NXTNAME_LEN    16
 
+/// Protocol version (changes whenever the packet header changes)
+#define NXTNET_PROTO_VERSION     1
 /// Packet signature
-/// @note If you read these 4 bytes as string you get "NXT\0"
-#define NXTNET_PROTO_SIG         ('N'|('X'<<8)|('T'<<16))
+/// @note The highest byte is the protocol version, so clients and servers
+///       using another header don't understand each other's packets. Servers
+///       of version 0 close the connection of current clients.
+#define NXTNET_PROTO_SIG         ('N'|('X'<<8)|('T'<<16)|(NXTNET_PROTO_VERSION<<24))
+/// Packet signature of protocol version 0 (password in every packet header)
+/// @note The server still answers LIST, SEND and RECV of such clients. New
+///       clients need a server that understands version 1.
+#define NXTNET_PROTO_SIG_V0      ('N'|('X'<<8)|('T'<<16))
 /// Packet direction - Client to server - or'd with command
 #define NXTNET_PROTO_DIR_CS      0x00
 /// Packet direction - Server to client - or'd with command
 #define NXTNET_PROTO_DIR_SC      0x80
 /// Packet direction - Mask to get packet direction from command byte
 #define NXTNET_PROTO_DIR_MASK    0x80
+/// Packet flag - Reply is continued in next packet - or'd with command
+#define NXTNET_PROTO_FLAG_MORE   0x40
+/// Mask to get command from command byte
+#define NXTNET_PROTO_CMD_MASK    0x3F
 /// Packet command - Hello
 #define NXTNET_PROTO_CMD_HELLO   0x01
 /// Packet command - List NXTs
@@ -54,6 +80,27 @@
 #define NXTNET_PROTO_CMD_SEND    0x03
 /// Packet command - Recv data from NXT
 #define NXTNET_PROTO_CMD_RECV    0x04
+/// Packet command - Send data to NXT and receive its reply (tagged with request ID)
+#define NXTNET_PROTO_CMD_TRANSACT 0x05
+/// Packet command - Execute several transactions with NXT back-to-back
+#define NXTNET_PROTO_CMD_BATCH   0x06
+/// Packet command - Execute transactions with NXT periodically
+#define NXTNET_PROTO_CMD_SUBSCRIBE 0x07
+/// Packet command - Cancel subscription
+#define NXTNET_PROTO_CMD_UNSUBSCRIBE 0x08
+/// Packet command - Results of a subscription (only server to client)
+#define NXTNET_PROTO_CMD_SAMPLE  0x09
+/// Packet command - Get server statistics (reply data is text without
+/// terminating NUL, split into several packets like LIST)
+#define NXTNET_PROTO_CMD_STATS   0x0A
+
+/// Frame format - Packet header and data as defined by the structs below
+#define NXTNET_PROTO_FORMAT_PLAIN   0
+/// Frame format - Small header and varint fields (see nxtnet_proto_compact())
+#define NXTNET_PROTO_FORMAT_COMPACT 1
+/// Frame format - Plain packet of protocol version 0, whose header is
+/// followed by the password (never negotiated; see nxtnet_rbuf_accept_v0())
+#define NXTNET_PROTO_FORMAT_V0      2
 
 /// Error - No error
 #define NXTNET_ERROR_NOERROR 0
@@ -61,16 +108,30 @@
 #define NXTNET_ERROR_WROPWD  1
 /// Error - Function not implemented
 #define NXTNET_ERROR_NOTIMPL 2
+/// Error - Invalid request
+#define NXTNET_ERROR_INVAL   3
 
 /// Default TCP port
 ///  @note Changed to a private/dynamic port.
 ///  @todo Assign a correct port: http://www.iana.org/cgi-bin/usr-port-number.pl
 #define NXTNET_DEFAULT_PORT 51337
 
-/// Timeout in select() in seconds
+/// Directory of UNIX domain socket
+/// @note Must only be writable by its owner, who runs the server (or root)
+#ifndef NXTNET_UNIX_DIR
+#define NXTNET_UNIX_DIR "/var/run/nxtd"
+#endif
+
+/// Path of UNIX domain socket (formatted with TCP port)
+/// @note Clients connecting to localhost try this socket before TCP
+#define NXTNET_UNIX_PATH NXTNET_UNIX_DIR "/nxtnet-%d.sock"
+
+/// Timeout in epoll_wait() in seconds
 #define NXTNET_SELECT_TIMEOUT 10
 
 /// Packet
+/// @note The password is only sent once with HELLO. Requests with a request
+///       ID carry it as first field of their data.
 struct nxtnet_proto_packet {
   /// Signature (must be NXTNET_PROTO_SIG)
   uint32_t sig;
@@ -80,12 +141,34 @@ struct nxtnet_proto_packet {
   uint16_t size;
   /// Error code
   uint8_t error;
-  /// Password
-  char password[NXTNET_PWD_LEN];
   /// Data
   char data[0];
 } __attribute__ ((packed));
 
+/// Client to server data for HELLO command
+/// @note HELLO starts the session. If the server has a password, it answers
+///       all other requests with NXTNET_ERROR_WROPWD until HELLO was sent
+///       with the right password.
+struct nxtnet_proto_hello_cs {
+  /// Max. packet size the client wants to use
+  uint32_t max_size;
+  /// Password
+  char password[NXTNET_PWD_LEN];
+  /// Newest frame format the client understands (optional)
+  uint32_t format;
+} __attribute__ ((packed));
+
+/// Server to client data for HELLO command
+/// @note HELLO and its reply are sent as plain frames. All following packets
+///       use the frame format of the reply, in both directions.
+///       Old peers don't send 'format'; NXTNET_PROTO_FORMAT_PLAIN is used then.
+struct nxtnet_proto_hello_sc {
+  /// Max. packet size used on this connection (in both directions)
+  uint32_t max_size;
+  /// Frame format used on this connection (optional)
+  uint32_t format;
+} __attribute__ ((packed));
+
 /// List item for LIST's NXT list
 struct nxtnet_proto_list_nxts {
   /// NXT's handle
@@ -99,6 +182,8 @@ struct nxtnet_proto_list_nxts {
 } __attribute__ ((packed)) ;
 
 /// Server to client data for LIST command
+/// @note If the list does not fit into one packet it is split into several
+///       packets. All but the last have NXTNET_PROTO_FLAG_MORE set.
 struct nxtnet_proto_list_sc {
   /// Number of items in 'nxts'
   uint32_t num_items;
@@ -142,65 +227,354 @@ struct nxtnet_proto_recv_sc {
   char data[0];
 } __attribute__ ((packed));
 
-/// Descriptor for client's network connection
+/// Client to server data for TRANSACT command
+struct nxtnet_proto_transact_cs {
+  /// Request ID (echoed by server)
+  uint32_t id;
+  /// NXT ID
+  uint32_t handle;
+  /// How many bytes to receive after sending (0 for none)
+  uint32_t recv_size;
+  /// How many bytes to send
+  uint32_t send_size;
+  /// Data to send
+  char data[0];
+} __attribute__ ((packed));
+
+/// Server to client data for TRANSACT command
+struct nxtnet_proto_transact_sc {
+  /// Request ID
+  uint32_t id;
+  /// NXT ID
+  uint32_t handle;
+  /// How many bytes received (-1 on failure)
+  uint32_t size;
+  /// Received data
+  char data[0];
+} __attribute__ ((packed));
+
+/// Client to server data for BATCH command
+struct nxtnet_proto_batch_cs {
+  /// Request ID (echoed by server)
+  uint32_t id;
+  /// NXT ID
+  uint32_t handle;
+  /// Number of items in 'items'
+  uint32_t num_items;
+  /// Telegrams (struct nxtnet_proto_batch_item_cs)
+  char items[0];
+} __attribute__ ((packed));
+
+/// Telegram in BATCH command
+struct nxtnet_proto_batch_item_cs {
+  /// How many bytes to receive (0 for none)
+  uint16_t recv_size;
+  /// How many bytes to send
+  uint16_t send_size;
+  /// Data to send
+  char data[0];
+} __attribute__ ((packed));
+
+/// Server to client data for BATCH command
+struct nxtnet_proto_batch_sc {
+  /// Request ID
+  uint32_t id;
+  /// NXT ID
+  uint32_t handle;
+  /// Number of items in 'items'
+  uint32_t num_items;
+  /// Replies (struct nxtnet_proto_batch_item_sc)
+  char items[0];
+} __attribute__ ((packed));
+
+/// Reply in BATCH command
+struct nxtnet_proto_batch_item_sc {
+  /// How many bytes received (-1 on failure)
+  int16_t size;
+  /// Received data (always as many bytes as requested)
+  char data[0];
+} __attribute__ ((packed));
+
+/// Client to server data for SUBSCRIBE command
+struct nxtnet_proto_subscribe_cs {
+  /// Request ID (also identifies subscription)
+  uint32_t id;
+  /// NXT ID
+  uint32_t handle;
+  /// Sampling interval in microseconds
+  uint32_t interval;
+  /// Number of items in 'items'
+  uint32_t num_items;
+  /// Telegrams (struct nxtnet_proto_batch_item_cs)
+  char items[0];
+} __attribute__ ((packed));
+
+/// Server to client data for SUBSCRIBE and UNSUBSCRIBE command
+struct nxtnet_proto_subscribe_sc {
+  /// Request ID
+  uint32_t id;
+  /// NXT ID
+  uint32_t handle;
+} __attribute__ ((packed));
+
+/// Client to server data for UNSUBSCRIBE command
+struct nxtnet_proto_unsubscribe_cs {
+  /// ID of subscription
+  uint32_t id;
+  /// NXT ID
+  uint32_t handle;
+} __attribute__ ((packed));
+
+/// Server to client data for SAMPLE command
+struct nxtnet_proto_sample_sc {
+  /// ID of subscription
+  uint32_t id;
+  /// NXT ID
+  uint32_t handle;
+  /// Time of sample (seconds; monotonic clock of server)
+  uint32_t time_sec;
+  /// Time of sample (microseconds)
+  uint32_t time_usec;
+  /// Number of items in 'items'
+  uint32_t num_items;
+  /// Replies (struct nxtnet_proto_batch_item_sc)
+  char items[0];
+} __attribute__ ((packed));
+
+/// Telegram of a batch
+struct nxtnet_batch_item {
+  /// Data to send
+  const void *send_buf;
+  /// How many bytes to send
+  size_t send_size;
+  /// Buffer for received data
+  void *recv_buf;
+  /// How many bytes to receive (0 for none)
+  size_t recv_size;
+  /// How many bytes received (-1 on failure)
+  ssize_t ret;
+};
+
+/**
+ * Receives the results of a subscription
+ *  @param ctx Context passed on subscription
+ *  @param time Time of sample (CLOCK_MONOTONIC)
+ *  @param items Transactions with results
+ *  @param num_items Number of transactions
+ */
+typedef void (*nxtnet_sample_func_t)(void *ctx,const struct timespec *time,const struct nxtnet_batch_item *items,size_t num_items);
+
+/// Reply that arrived before the client waited for it
+struct nxtnet_cli_reply {
+  /// Next reply
+  struct nxtnet_cli_reply *next;
+  /// Packet
+  char packet[0];
+};
+
+/// Receive buffer (ring buffer) for framing packets of a connection
 typedef struct {
-  /// Socket
+  /// Buffer
+  char *data;
+  /// Capacity
+  size_t size;
+  /// Offset of first unread byte
+  size_t start;
+  /// Number of unread bytes
+  size_t fill;
+  /// Max. packet size accepted
+  size_t max;
+  /// Frame format of received packets
+  int format;
+  /// If first packet may be one of protocol version 0
+  int accept_v0;
+  /// Password of last packet of protocol version 0
+  char password[NXTNET_PWD_LEN];
+} nxtnet_rbuf_t;
+
+/// Operations of NXTNET server (implemented by nxtd)
+struct nxtnet_srv_ops {
+  /**
+   * Lists all NXTs
+   *  @param packer Packer function. Call this to add NXT to list
+   */
+  void (*list)(void (*packer)(int handle, char *name, void *id, int is_bt));
+  /**
+   * Sends data to NXT
+   *  @param handle NXT handle
+   *  @param buf Data to send
+   *  @param size How many bytes to send
+   *  @return How many bytes sent
+   */
+  ssize_t (*send)(int handle,const void *buf,size_t size);
+  /**
+   * Receives data from NXT
+   *  @param handle NXT handle
+   *  @param buf Buffer for received data
+   *  @param size How many bytes to receive
+   *  @return How many bytes received
+   */
+  ssize_t (*recv)(int handle,void *buf,size_t size);
+  /**
+   * Sends data to NXT and receives its reply (optional)
+   *  @param handle NXT handle
+   *  @param sbuf Data to send
+   *  @param ssize How many bytes to send
+   *  @param rbuf Buffer for received data
+   *  @param rsize How many bytes to receive (0 for none)
+   *  @return How many bytes received (-1 on failure)
+   *  @note If not set, send and recv are used
+   */
+  ssize_t (*transact)(int handle,const void *sbuf,size_t ssize,void *rbuf,size_t rsize);
+  /**
+   * Executes transactions back-to-back, without other requests for this
+   * NXT in between (optional)
+   *  @param handle NXT handle
+   *  @param items Transactions; 'ret' is set for each item
+   *  @param num_items Number of items
+   *  @return Number of successful transactions
+   *  @note If not set, transact (or send and recv) is used for each item
+   */
+  size_t (*batch)(int handle,struct nxtnet_batch_item *items,size_t num_items);
+  /**
+   * Executes transactions with NXT periodically (optional)
+   *  @param handle NXT handle
+   *  @param interval Sampling interval in microseconds
+   *  @param items Transactions (only valid during call)
+   *  @param num_items Number of items
+   *  @param sample Function called with the results of each sample
+   *  @param ctx Context for sample function
+   *  @return Subscription (NULL on failure)
+   */
+  void *(*subscribe)(int handle,unsigned int interval,const struct nxtnet_batch_item *items,size_t num_items,nxtnet_sample_func_t sample,void *ctx);
+  /**
+   * Cancels a subscription
+   *  @param sub Subscription
+   *  @note The sample function is not called anymore after this returned
+   *  @note May block until a running sample is finished. The server calls
+   *        it from worker threads only.
+   */
+  void (*unsubscribe)(void *sub);
+  /**
+   * Writes statistics as text (optional)
+   *  @param out Output stream
+   */
+  void (*stats)(FILE *out);
+};
+
+struct nxtnet_cli_sub;
+
+/// Descriptor for client's network connection
+typedef struct nxtnet_cli {
+  /// Socket (-1 for in-process client)
   int sock;
-  /// Send/Recv buffer
+  /// Operations called by in-process client (NULL for network connection)
+  const struct nxtnet_srv_ops *ops;
+  /// Receive buffer
+  nxtnet_rbuf_t *rbuf;
+  /// Send buffer
   struct nxtnet_proto_packet *buf;
+  /// Size of send buffer
+  size_t bufsize;
+  /// Packet received by reading thread
+  struct nxtnet_proto_packet *rpacket;
+  /// Size of received packet buffer
+  size_t rpacketsize;
+  /// Max. packet size (negotiated with HELLO)
+  size_t max_size;
+  /// Frame format (negotiated with HELLO)
+  int format;
   /// Password
   char password[NXTNET_PWD_LEN];
+  /// Next request ID
+  int next_id;
+  /// First request ID sent over current connection
+  int first_id;
+  /// Replies not yet taken by the thread waiting for them
+  struct nxtnet_cli_reply *replies;
+  /// If a thread is receiving replies for all threads
+  int reading;
+  /// Subscriptions of in-process client
+  struct nxtnet_cli_sub *subs;
+  /// Mutex for replies, reading thread and subscriptions
+  pthread_mutex_t mutex;
+  /// Signaled when a reply arrived or the reading thread is done
+  pthread_cond_t cond;
+  /// Mutex for send buffer, socket writes and request IDs
+  pthread_mutex_t send_mutex;
+  /// Serializes requests without request ID (LIST, SEND, RECV)
+  pthread_mutex_t request_mutex;
+  /// Reference count (see nxtnet_cli_connect_shared())
+  int refs;
+  /// If connection is broken (it is made again by the next request)
+  int broken;
+  /// Hostname of server (network connections)
+  char *hostname;
+  /// Port of server (network connections)
+  int port;
+  /// Next shared connection
+  struct nxtnet_cli *next;
 } nxtnet_cli_t;
 
+struct nxtnet_srv_client;
+struct nxtnet_srv_pool;
+
 /// Descriptor for server's network connection
 typedef struct {
   /// Server socket
   int sock;
+  /// Server socket for local clients (UNIX domain; -1 if not available)
+  int usock;
+  /// Path of UNIX domain socket
+  char upath[108];
   /// If server is only local
   int local;
   /// Operations
-  struct {
-    /**
-     * Lists all NXTs
-     *  @param packer Packer function. Call this to add NXT to list
-     */
-    void (*list)(void (*packer)(int handle, char *name, void *id, int is_bt));
-    /**
-     * Sends data to NXT
-     *  @param handle NXT handle
-     *  @param buf Data to send
-     *  @param size How many bytes to send
-     *  @return How many bytes sent
-     */
-    ssize_t (*send)(int handle,const void *buf,size_t size);
-    /**
-     * Receives data from NXT
-     *  @param handle NXT handle
-     *  @param buf Buffer for received data
-     *  @param size How many bytes to receive
-     *  @return How many bytes received
-     */
-    ssize_t (*recv)(int handle,void *buf,size_t size);
-  } ops;
-  /// Client sockets
-  int clients[NXTNET_SRV_MAXSOCKS];
+  struct nxtnet_srv_ops ops;
+  /// epoll descriptor
+  int epfd;
+  /// Connected clients
+  struct nxtnet_srv_client *clients;
+  /// Worker threads and their jobs
+  struct nxtnet_srv_pool *pool;
   /// Log file descriptor
   FILE *log;
   /// Password
   char password[NXTNET_PWD_LEN];
-  /// Send/Recv buffer
-  struct nxtnet_proto_packet *buf;
 } nxtnet_srv_t;
 
 // General
+nxtnet_rbuf_t *nxtnet_rbuf_create(size_t size);
+void nxtnet_rbuf_destroy(nxtnet_rbuf_t *rbuf);
+ssize_t nxtnet_rbuf_read(nxtnet_rbuf_t *rbuf,int sock);
+void nxtnet_rbuf_set_max(nxtnet_rbuf_t *rbuf,size_t max);
+void nxtnet_rbuf_set_format(nxtnet_rbuf_t *rbuf,int format);
+void nxtnet_rbuf_accept_v0(nxtnet_rbuf_t *rbuf);
+int nxtnet_rbuf_get(nxtnet_rbuf_t *rbuf,struct nxtnet_proto_packet **buf,size_t *bufsize);
+struct nxtnet_proto_packet *nxtnet_recv_buffered(int sock,nxtnet_rbuf_t *rbuf,struct nxtnet_proto_packet **buf,size_t *bufsize);
 struct nxtnet_proto_packet *nxtnet_recv(int sock,struct nxtnet_proto_packet *buf,int cmd);
-ssize_t nxtnet_send(int sock,struct nxtnet_proto_packet *buf);
+ssize_t nxtnet_send_iov(int sock,int format,struct nxtnet_proto_packet *buf,size_t head_size,const void *data,size_t data_size);
+ssize_t nxtnet_send(int sock,int format,struct nxtnet_proto_packet *buf);
+size_t nxtnet_proto_compact(struct nxtnet_proto_packet **packet);
+size_t nxtnet_proto_v0(struct nxtnet_proto_packet **packet);
 
 // Client
 nxtnet_cli_t *nxtnet_cli_connect(const char *hostname,int port,const char *password);
+nxtnet_cli_t *nxtnet_cli_connect_shared(const char *hostname,int port,const char *password);
+nxtnet_cli_t *nxtnet_cli_open_local(const struct nxtnet_srv_ops *ops);
 struct nxtnet_proto_list_sc *nxtnet_cli_list(nxtnet_cli_t *cli);
+char *nxtnet_cli_stats(nxtnet_cli_t *cli);
 ssize_t nxtnet_cli_send(nxtnet_cli_t *cli,int handle,const void *buf,size_t size);
 ssize_t nxtnet_cli_recv(nxtnet_cli_t *cli,int handle,void *buf,size_t size);
+int nxtnet_cli_submit(nxtnet_cli_t *cli,int handle,const void *buf,size_t size,size_t recv_size);
+ssize_t nxtnet_cli_wait(nxtnet_cli_t *cli,int id,void *buf,size_t size);
+int nxtnet_cli_poll(nxtnet_cli_t *cli);
+int nxtnet_cli_ready(nxtnet_cli_t *cli,int id);
+ssize_t nxtnet_cli_transact(nxtnet_cli_t *cli,int handle,const void *sbuf,size_t ssize,void *rbuf,size_t rsize);
+ssize_t nxtnet_cli_batch(nxtnet_cli_t *cli,int handle,struct nxtnet_batch_item *items,size_t num_items);
+int nxtnet_cli_subscribe(nxtnet_cli_t *cli,int handle,unsigned int interval,const struct nxtnet_batch_item *items,size_t num_items);
+int nxtnet_cli_sample(nxtnet_cli_t *cli,int id,struct nxtnet_batch_item *items,size_t num_items,struct timespec *time);
+int nxtnet_cli_unsubscribe(nxtnet_cli_t *cli,int handle,int id);
 void nxtnet_cli_disconnect(nxtnet_cli_t *cli);
 
 // Server
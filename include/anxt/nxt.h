@@ -84,6 +84,11 @@
 
 #define NXT_CON_BUFFERSIZE 64
 
+// Retries of telegrams that failed (see nxt_set_retry())
+#define NXT_RETRY_NUM   3
+#define NXT_RETRY_DELAY 100 /* milliseconds; doubled with each retry */
+#define NXT_RETRY_MAXDELAY 5000 /* milliseconds */
+
 // NXT error numbers
 #define NXT_ERR_SUCCESS                          0x00
 #define NXT_ERR_TRANSACTION_IN_PROGRESS          0x20
@@ -156,18 +161,36 @@ typedef enum {
 
 typedef char nxt_id_t[6];
 
+struct nxt_sub;
+struct nxt_async;
+
 typedef struct {
   char *name;
-  char *buffer;
-  char *ptr;
   int error;
   nxt_contype_t contype;
   nxtnet_cli_t *cli;
   int handle;
   nxt_id_t id;
   struct nxt_motor motors[3];
+  struct nxt_sub *subs;
+  pthread_mutex_t mutex;
+  unsigned int retries;
+  unsigned int retry_delay;
+  int retry_all;
 } nxt_t;
 
+/// Asynchronous request (see nxt_async_submit())
+typedef struct nxt_async nxt_async_t;
+
+/**
+ * Called when an asynchronous request completed
+ *  @param nxt NXT handle
+ *  @param req Request (freed after function returned)
+ *  @param ret Success?
+ *  @param ctx Context passed to nxt_async_submit()
+ */
+typedef void (*nxt_async_func_t)(nxt_t *nxt,nxt_async_t *req,int ret,void *ctx);
+
 struct nxt_sensor_values {
   int is_calibrated;
   int type;
@@ -187,10 +210,24 @@ void nxt_wait_after_communication_command(void);
 void nxt_wait_extra_long_after_communication_command(void);
 
 nxt_t *nxt_open_net(const char *name,const char *hostname,int port,const char *password);
+nxt_t *nxt_open_cli(const char *name,nxtnet_cli_t *cli);
 void nxt_close(nxt_t *nxt);
+int nxt_batch_begin(nxt_t *nxt);
+int nxt_batch_commit(nxt_t *nxt);
+void nxt_batch_abort(nxt_t *nxt);
+int nxt_subscribe(nxt_t *nxt,unsigned int interval);
+int nxt_sample(nxt_t *nxt,int id,struct timespec *time);
+int nxt_unsubscribe(nxt_t *nxt,int id);
+nxt_async_t *nxt_async_submit(nxt_t *nxt,nxt_async_func_t func,void *ctx);
+int nxt_async_fd(nxt_t *nxt);
+int nxt_async_dispatch(nxt_t *nxt);
+int nxt_async_done(nxt_async_t *req);
+int nxt_async_wait(nxt_async_t *req);
 int nxt_error(nxt_t *nxt);
 char *nxt_strerror(unsigned int error);
 void nxt_reset_error(nxt_t *nxt);
+void nxt_set_retry(nxt_t *nxt,unsigned int retries,unsigned int delay);
+void nxt_set_retry_all(nxt_t *nxt,int all);
 nxt_contype_t nxt_get_connection_type(nxt_t *nxt);
 int nxt_send_msg(nxt_t *nxt,int mailbox,char *data);
 char *nxt_recv_msg(nxt_t *nxt,int mailbox,int clear);
@@ -22,7 +22,10 @@
 #ifndef _NXT_TOOLS_H_
 #define _NXT_TOOLS_H_
 
+#include <stdio.h>
+
 #include <anxt/nxt.h>
+#include <anxt/file.h>
 
 #define NXT_BUTTON_STATUS_STR(s) ((s)?"pressed":"released")
 #define NXT_BUTTON_STATUS_INT(s) ((s)?1:0)
@@ -52,7 +55,23 @@ char *nxt_get_type(int i);
 char *nxt_get_mode(int i);
 
 int nxt_download(nxt_t *nxt,char *src,char *dest);
+int nxt_download_stream(nxt_t *nxt,char *src,FILE *output,nxt_file_progress_t func,void *ctx);
 int nxt_upload(nxt_t *nxt,char *src,char *dest,int oflag);
+int nxt_upload_stream(nxt_t *nxt,FILE *input,size_t size,char *dest,int oflag,nxt_file_progress_t func,void *ctx);
+
+// nxt_sync() flags
+#define NXT_SYNC_VERIFY   1 // read back files instead of using cached hashes
+#define NXT_SYNC_DRYRUN   2 // don't upload
+#define NXT_SYNC_PARALLEL 4 // one thread per NXT
+
+// nxt_sync() actions
+#define NXT_SYNC_UNCHANGED 0
+#define NXT_SYNC_NEW       1
+#define NXT_SYNC_CHANGED   2
+#define NXT_SYNC_FAILED    3
+
+typedef void (*nxt_sync_callback)(nxt_t *nxt,const char *filename,int action,void *data);
+int nxt_sync(nxt_t **nxts,size_t num_nxts,char **src,size_t num_src,const char *cache,int oflag,int flags,nxt_sync_callback callback,void *data);
 
 #endif /* _NXT_TOOLS_H_ */
 
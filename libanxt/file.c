@@ -19,6 +19,7 @@
 */
 
 #include <sys/types.h>
+#include <stdlib.h>
 #include <string.h>
 #include <stdarg.h>
 
@@ -141,73 +142,228 @@ int nxt_file_open(nxt_t *nxt,const char *file,int oflag,...) {
   return handle;
 }
 
+/// Telegrams per request of a file read (see nxt_file_transfer())
+#define NXT_FILE_WINDOW 16
+
+/// Requests of a file read that are in flight at the same time
+#define NXT_FILE_INFLIGHT 2
+
+/// Part of a file transfer that fits into one telegram
+struct nxt_file_chunk {
+  /// Buffer for data read or data to write
+  void *buf;
+  /// How many bytes to read or write
+  size_t count;
+  /// How many bytes were read or written (-1 on failure)
+  ssize_t done;
+};
+
 /**
- * Reads data from file from NXT (Lowlevel)
+ * Unpacks reply of READ
  *  @param nxt NXT handle
- *  @param handle File handle
- *  @param dest Buffer where to store data
- *  @param count How many bytes to read (max: 59 bytes)
- *  @return How many bytes read
+ *  @param arg Chunk
+ *  @return Success?
  */
-static ssize_t nxt_file_read_low(nxt_t *nxt,int handle,void *dest,size_t count) {
-  nxt_pack_start(nxt,0x82);
-  nxt_pack_byte(nxt,handle);
-  nxt_pack_word(nxt,count);
-  test(nxt_con_send(nxt));
-  test(nxt_con_recv(nxt,6+count));
+static int nxt_file_read_unpack(nxt_t *nxt,void *arg) {
+  struct nxt_file_chunk *chunk = (struct nxt_file_chunk*)arg;
+  size_t count;
+
   test(nxt_unpack_start(nxt,0x82));
   if (nxt_unpack_error(nxt)==0) {
     nxt_unpack_byte(nxt);
     count = nxt_unpack_word(nxt);
-    memcpy(dest,nxt_unpack_mem(nxt,count),count);
-    return count;
+    if (count>chunk->count) count = chunk->count;
+    memcpy(chunk->buf,nxt_unpack_mem(nxt,count),count);
+    chunk->done = count;
+    return NXT_SUCC;
   }
   else return NXT_FAIL;
 }
 
+/**
+ * Unpacks reply of WRITE
+ *  @param nxt NXT handle
+ *  @param arg Chunk
+ *  @return Success?
+ */
+static int nxt_file_write_unpack(nxt_t *nxt,void *arg) {
+  struct nxt_file_chunk *chunk = (struct nxt_file_chunk*)arg;
+
+  test(nxt_unpack_start(nxt,0x83));
+  if (nxt_unpack_error(nxt)==0) {
+    nxt_unpack_byte(nxt);
+    chunk->done = nxt_unpack_word(nxt);
+    return NXT_SUCC;
+  }
+  else return NXT_FAIL;
+}
+
+/**
+ * Packs READ or WRITE telegram of a chunk
+ *  @param nxt NXT handle
+ *  @param handle File handle
+ *  @param chunk Chunk
+ *  @param write Whether to write
+ *  @return How many bytes to receive as reply
+ */
+static size_t nxt_file_chunk_pack(nxt_t *nxt,int handle,struct nxt_file_chunk *chunk,int write) {
+  chunk->done = -1;
+  if (write) {
+    nxt_pack_start(nxt,0x83);
+    nxt_pack_byte(nxt,handle);
+    nxt_pack_mem(nxt,chunk->buf,chunk->count);
+    return 6;
+  }
+  else {
+    nxt_pack_start(nxt,0x82);
+    nxt_pack_byte(nxt,handle);
+    nxt_pack_word(nxt,chunk->count);
+    return 6+chunk->count;
+  }
+}
+
+/**
+ * Submits READ or WRITE telegrams of several chunks at once
+ *  @param nxt NXT handle
+ *  @param handle File handle
+ *  @param chunks Chunks
+ *  @param num_chunks Number of chunks
+ *  @param write Whether to write
+ *  @return Request (NULL if the calling thread has started a batch)
+ */
+static nxt_async_t *nxt_file_submit(nxt_t *nxt,int handle,struct nxt_file_chunk *chunks,size_t num_chunks,int write) {
+  size_t i,size;
+
+  if (nxt_batch_begin(nxt)!=NXT_SUCC) {
+    return NULL;
+  }
+  for (i=0;i<num_chunks;i++) {
+    size = nxt_file_chunk_pack(nxt,handle,chunks+i,write);
+    nxt_con_transact(nxt,size,write?nxt_file_write_unpack:nxt_file_read_unpack,chunks+i);
+  }
+  return nxt_async_submit(nxt,NULL,NULL);
+}
+
+/**
+ * Reads or writes data of a file
+ *  @param nxt NXT handle
+ *  @param handle File handle
+ *  @param buf Buffer for data read or data to write
+ *  @param count How many bytes to read or write
+ *  @param write Whether to write
+ *  @param func Function called after each part of the transfer (optional)
+ *  @param ctx Context for progress function
+ *  @return How many bytes read or written
+ *  @note Data is split into telegrams as big as the NXT accepts. Up to
+ *        NXT_FILE_INFLIGHT requests of NXT_FILE_WINDOW telegrams are in
+ *        flight at the same time, so nxtd sends the next telegram as soon
+ *        as the NXT replied to the previous one.
+ *  @note Writes send one telegram at a time, since the NXT executes all
+ *        telegrams of a request, even after one failed. Data after a failed
+ *        telegram would end up in the file otherwise.
+ *  @note If the calling thread started a batch, telegrams are sent one after
+ *        another
+ */
+static ssize_t nxt_file_transfer(nxt_t *nxt,int handle,void *buf,size_t count,int write,nxt_file_progress_t func,void *ctx) {
+  size_t max = write?NXT_FILE_WRITE_MAX:NXT_FILE_READ_MAX;
+  size_t num_chunks = (count+max-1)/max;
+  size_t window = write?1:NXT_FILE_WINDOW;
+  size_t num_windows = (num_chunks+window-1)/window;
+  size_t inflight = write?1:NXT_FILE_INFLIGHT;
+  struct nxt_file_chunk *chunks;
+  nxt_async_t *reqs[NXT_FILE_INFLIGHT];
+  size_t i,sub = 0,done = 0,len = 0;
+  int failed = 0;
+
+  if (count==0) {
+    return 0;
+  }
+
+  chunks = malloc(num_chunks*sizeof(struct nxt_file_chunk));
+  if (chunks==NULL) {
+    return NXT_FAIL;
+  }
+  for (i=0;i<num_chunks;i++) {
+    chunks[i].buf = buf+i*max;
+    chunks[i].count = i<num_chunks-1?max:count-i*max;
+    chunks[i].done = -1;
+  }
+
+  while (done<num_windows && !failed) {
+    // keep requests in flight
+    while (sub<num_windows && sub-done<inflight) {
+      size_t first = sub*window;
+      size_t n = num_chunks-first<window?num_chunks-first:window;
+
+      reqs[sub%NXT_FILE_INFLIGHT] = nxt_file_submit(nxt,handle,chunks+first,n,write);
+      if (reqs[sub%NXT_FILE_INFLIGHT]==NULL) {
+        break;
+      }
+      sub++;
+    }
+
+    if (done<sub) {
+      nxt_async_wait(reqs[done%NXT_FILE_INFLIGHT]);
+    }
+    else {
+      // can't submit, because caller started a batch
+      for (i=done*window;i<num_chunks && i<(done+1)*window;i++) {
+        size_t size = nxt_file_chunk_pack(nxt,handle,chunks+i,write);
+
+        if (nxt_con_send(nxt)==-1 || nxt_con_recv(nxt,size)==-1
+         || (write?nxt_file_write_unpack:nxt_file_read_unpack)(nxt,chunks+i)!=NXT_SUCC) {
+          break;
+        }
+      }
+    }
+
+    // stop at first telegram that failed or transferred less
+    for (i=done*window;i<num_chunks && i<(done+1)*window && !failed;i++) {
+      if (chunks[i].done>0) {
+        len += chunks[i].done;
+      }
+      failed = chunks[i].done!=chunks[i].count;
+    }
+    done++;
+
+    if (func!=NULL) {
+      func(len,count,ctx);
+    }
+  }
+
+  // wait for requests that are still in flight
+  for (;done<sub;done++) {
+    nxt_async_wait(reqs[done%NXT_FILE_INFLIGHT]);
+  }
+
+  free(chunks);
+  return failed && len==0?NXT_FAIL:len;
+}
+
 /**
  * Reads data from file from NXT
  *  @param nxt NXT handle
  *  @param handle File handle
  *  @param dest Buffer to store red data in
  *  @param count How many bytes to read
- *  @return How many bytes red
+ *  @return How many bytes red (NXT_FAIL if nothing could be read)
  */
 ssize_t nxt_file_read(nxt_t *nxt,int handle,void *dest,size_t count) {
-  int i;
-  ssize_t partlen;
-  int len = 0;
-  for (i=0;i<count/50;i++) {
-    partlen = nxt_file_read_low(nxt,handle,dest,50);
-    if (partlen==-1) return NXT_FAIL;
-    dest += partlen;
-    len += partlen;
-  }
-  if ((partlen = nxt_file_read_low(nxt,handle,dest,count%50))==-1) return NXT_FAIL;
-  len += partlen;
-  return len;
+  return nxt_file_transfer(nxt,handle,dest,count,0,NULL,NULL);
 }
 
 /**
- * Writes data to file from NXT (Lowlevel)
+ * Reads data from file from NXT and reports progress
  *  @param nxt NXT handle
  *  @param handle File handle
- *  @param src Data to write in file
- *  @param count How many bytes to write (max: 59 bytes)
- *  @return How many bytes written
+ *  @param dest Buffer to store red data in
+ *  @param count How many bytes to read
+ *  @param func Function called with number of bytes red so far (optional)
+ *  @param ctx Context for progress function
+ *  @return How many bytes red (NXT_FAIL if nothing could be read)
  */
-static ssize_t nxt_file_write_low(nxt_t *nxt,int handle,void *src,size_t count) {
-  nxt_pack_start(nxt,0x83);
-  nxt_pack_byte(nxt,handle);
-  nxt_pack_mem(nxt,src,count);
-  test(nxt_con_send(nxt));
-  test(nxt_con_recv(nxt,6));
-  test(nxt_unpack_start(nxt,0x83));
-  if (nxt_unpack_error(nxt)==0) {
-    nxt_unpack_byte(nxt);
-    return nxt_unpack_word(nxt);
-  }
-  else return NXT_FAIL;
+ssize_t nxt_file_read_progress(nxt_t *nxt,int handle,void *dest,size_t count,nxt_file_progress_t func,void *ctx) {
+  return nxt_file_transfer(nxt,handle,dest,count,0,func,ctx);
 }
 
 /**
@@ -216,20 +372,24 @@ static ssize_t nxt_file_write_low(nxt_t *nxt,int handle,void *src,size_t count)
  *  @param handle File handle
  *  @param src Data to write in file
  *  @param count How many bytes to write
- *  @return How many bytes written
+ *  @return How many bytes written (NXT_FAIL if nothing could be written)
  */
 ssize_t nxt_file_write(nxt_t *nxt,int handle,void *src,size_t count) {
-  int i,partlen;
-  int len = 0;
-  for (i=0;i<count/50;i++) {
-    partlen = nxt_file_write_low(nxt,handle,src,50);
-    if (partlen==-1) return -1;
-    src += partlen;
-    len += partlen;
-  }
-  if ((partlen = nxt_file_write_low(nxt,handle,src,count%50))==-1) return NXT_FAIL;
-  len += partlen;
-  return len;
+  return nxt_file_transfer(nxt,handle,src,count,1,NULL,NULL);
+}
+
+/**
+ * Writes data to file from NXT and reports progress
+ *  @param nxt NXT handle
+ *  @param handle File handle
+ *  @param src Data to write in file
+ *  @param count How many bytes to write
+ *  @param func Function called with number of bytes written so far (optional)
+ *  @param ctx Context for progress function
+ *  @return How many bytes written (NXT_FAIL if nothing could be written)
+ */
+ssize_t nxt_file_write_progress(nxt_t *nxt,int handle,const void *src,size_t count,nxt_file_progress_t func,void *ctx) {
+  return nxt_file_transfer(nxt,handle,(void*)src,count,1,func,ctx);
 }
 
 /**
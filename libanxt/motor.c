@@ -54,6 +54,17 @@ int nxt_motor_reset(nxt_t *nxt, int motor) {
   return NXT_SUCC;
 }
 
+/**
+ * Unpacks reply of SETOUTPUTSTATE
+ *  @param nxt NXT handle
+ *  @param arg Unused
+ *  @return Success?
+ */
+static int nxt_motor_set_state_unpack(nxt_t *nxt, void *arg) {
+  test(nxt_unpack_start(nxt, 0x04));
+  return nxt_unpack_error(nxt)==0?NXT_SUCC:NXT_FAIL;
+}
+
 /**
  * Sets state of a motor
  *  @param nxt NXT handle
@@ -89,32 +100,25 @@ int nxt_motor_set_state(nxt_t *nxt, int motor) {
   printf("  Run state:   %d\n", nxt->motors[motor].runstate);
   printf("  Tacho limit: %d\n", nxt->motors[motor].tacho_limit);*/
 
-  test(nxt_con_send(nxt));
-  test(nxt_con_recv(nxt, 3));
-  test(nxt_unpack_start(nxt, 0x04));
-  return nxt_unpack_error(nxt)==0?NXT_SUCC:NXT_FAIL;
+  return nxt_con_transact(nxt, 3, nxt_motor_set_state_unpack, NULL);
 }
 
 /**
- * Gets state of a motor
+ * Unpacks reply of GETOUTPUTSTATE
  *  @param nxt NXT handle
- *  @param motor Motor
+ *  @param arg Unused
  *  @return Success?
  */
-int nxt_motor_get_state(nxt_t *nxt, int motor) {
+static int nxt_motor_get_state_unpack(nxt_t *nxt, void *arg) {
+  int motor;
   int mode;
 
-  if (!NXT_VALID_MOTOR(motor)) {
-    return NXT_FAIL;
-  }
-
-  nxt_pack_start(nxt, 0x06);
-  nxt_pack_byte(nxt, motor);
-  test(nxt_con_send(nxt));
-  test(nxt_con_recv(nxt,25));
   test(nxt_unpack_start(nxt,0x06));
   if (nxt_unpack_error(nxt)==0) {
-    nxt_unpack_byte(nxt); // Motor
+    motor = nxt_unpack_byte(nxt); // Motor
+    if (!NXT_VALID_MOTOR(motor)) {
+      return NXT_FAIL;
+    }
     nxt->motors[motor].power = nxt_unpack_byte(nxt); // Power
     mode = nxt_unpack_byte(nxt); // Mode
     if (mode&NXT_MOTOR_ON) {
@@ -148,6 +152,22 @@ int nxt_motor_get_state(nxt_t *nxt, int motor) {
   }
 }
 
+/**
+ * Gets state of a motor
+ *  @param nxt NXT handle
+ *  @param motor Motor
+ *  @return Success?
+ */
+int nxt_motor_get_state(nxt_t *nxt, int motor) {
+  if (!NXT_VALID_MOTOR(motor)) {
+    return NXT_FAIL;
+  }
+
+  nxt_pack_start(nxt, 0x06);
+  nxt_pack_byte(nxt, motor);
+  return nxt_con_transact(nxt, 25, nxt_motor_get_state_unpack, NULL);
+}
+
 /**
  * Set state of motor if autoset is enabled
  *  @param nxt NXT handle
@@ -484,6 +504,17 @@ int nxt_motor_sync(nxt_t *nxt, int motor, int turnratio) {
   return nxt_motor_autoset(nxt, motor);
 }
 
+/**
+ * Unpacks reply of RESETMOTORPOSITION
+ *  @param nxt NXT handle
+ *  @param arg Unused
+ *  @return Success?
+ */
+static int nxt_motor_reset_tacho_unpack(nxt_t *nxt, void *arg) {
+  test(nxt_unpack_start(nxt,0x0A));
+  return nxt_unpack_error(nxt)==0?NXT_SUCC:NXT_FAIL;
+}
+
 /**
  * Resets current tacho value
  *  @param nxt NXT handle
@@ -499,10 +530,7 @@ int nxt_motor_reset_tacho(nxt_t *nxt,int motor,int relative) {
   nxt_pack_start(nxt,0x0A);
   nxt_pack_byte(nxt,motor);
   nxt_pack_byte(nxt,relative?1:0);
-  test(nxt_con_send(nxt));
-  test(nxt_con_recv(nxt,3));
-  test(nxt_unpack_start(nxt,0x0A));
-  return nxt_unpack_error(nxt)==0?NXT_SUCC:NXT_FAIL;
+  return nxt_con_transact(nxt,3,nxt_motor_reset_tacho_unpack,NULL);
 }
 
 int nxt_motor_get_tacho_count(nxt_t *nxt, int motor) {
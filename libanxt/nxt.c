@@ -96,24 +96,45 @@ void nxt_wait_extra_long_after_communication_command(void)
  *  @param password Password of nxtd daemon
  *  @return NXT handle
  *  @note You can pass a NULL pointer as name if you wish to use the first NXT found
+ *  @note All NXTs opened on the same nxtd share one connection, which is
+ *        made again if it breaks
+ *  @note A NXT handle can be used by several threads at the same time. Only
+ *        the cached state of a motor (see motor.h) should be used by one
+ *        thread.
+ *  @note Direct commands that fail, e.g. because the Bluetooth connection
+ *        dropped, are retried, if executing them twice does no harm (see
+ *        nxt_set_retry())
  */
 nxt_t *nxt_open_net(const char *name,const char *hostname,int port,const char *password) {
-  size_t i,num_nxts;
   nxtnet_cli_t *cli;
-  nxt_t *nxt;
-  nxt_id_t id;
 
-  // Connect to nxtd
-  cli = nxtnet_cli_connect(hostname,port,password);
+  // Connect to nxtd (or reuse connection)
+  cli = nxtnet_cli_connect_shared(hostname,port,password);
   if (cli==NULL) {
     fprintf(stderr,"Could not connect to nxtd, make sure nxtd is running\n");
     return NULL;
   }
 
+  return nxt_open_cli(name,cli);
+}
+
+/**
+ * Opens a NXT through a NXTNET client
+ *  @param name Name, Bluetooth address or ID of NXT
+ *  @param cli  NXTNET client (network connection or in-process client;
+ *              closed by nxt_close() or if NXT is not found)
+ *  @return NXT handle
+ *  @note You can pass a NULL pointer as name if you wish to use the first NXT found
+ */
+nxt_t *nxt_open_cli(const char *name,nxtnet_cli_t *cli) {
+  size_t i;
+  nxt_t *nxt;
+  nxt_id_t id;
+
   // Convert name to bluetooth address or ID (if possible)
   if (name==NULL ||
-     (sscanf(name,"%02x:%02x:%02x:%02x:%02x:%02x",&id[0],&id[1],&id[2],&id[3],&id[4],&id[5])!=6
-   && sscanf(name,"%02x%02x%02x%02x%02x%02x",&id[0],&id[1],&id[2],&id[3],&id[4],&id[5])!=6)) {
+     (sscanf(name,"%02hhx:%02hhx:%02hhx:%02hhx:%02hhx:%02hhx",&id[0],&id[1],&id[2],&id[3],&id[4],&id[5])!=6
+   && sscanf(name,"%02hhx%02hhx%02hhx%02hhx%02hhx%02hhx",&id[0],&id[1],&id[2],&id[3],&id[4],&id[5])!=6)) {
     memset(id,0,6);
   }
 
@@ -125,20 +146,28 @@ nxt_t *nxt_open_net(const char *name,const char *hostname,int port,const char *p
         nxt = malloc(sizeof(nxt_t));
         nxt->cli = cli;
         nxt->name = strdup(list->nxts[i].name);
-        nxt->buffer = malloc(NXT_CON_BUFFERSIZE);
+        nxt->subs = NULL;
+        pthread_mutex_init(&nxt->mutex,NULL);
         nxt->error = 0;
         nxt->contype = list->nxts[i].is_bt?NXT_CON_BT:NXT_CON_USB;
         nxt->handle = list->nxts[i].handle;
         memcpy(nxt->id, list->nxts[i].id, 6);
+        nxt->retries = NXT_RETRY_NUM;
+        nxt->retry_delay = NXT_RETRY_DELAY;
+        nxt->retry_all = 0;
         nxt_motor_reset(nxt, 0);
-        nxt_motor_get_state(nxt, 0);
         nxt_motor_reset(nxt, 1);
-        nxt_motor_get_state(nxt, 1);
         nxt_motor_reset(nxt, 2);
+        nxt_batch_begin(nxt);
+        nxt_motor_get_state(nxt, 0);
+        nxt_motor_get_state(nxt, 1);
         nxt_motor_get_state(nxt, 2);
+        nxt_batch_commit(nxt);
+        free(list);
         return nxt;
       }
     }
+    free(list);
   }
 
   nxtnet_cli_disconnect(cli);
@@ -149,11 +178,19 @@ nxt_t *nxt_open_net(const char *name,const char *hostname,int port,const char *p
 /**
  * Closes a NXT
  *  @param nxt NXT handle
+ *  @note Pending asynchronous requests of the calling thread are completed
+ *        first. No other thread must use the NXT anymore.
  */
 void nxt_close(nxt_t *nxt) {
+  nxt_batch_abort(nxt);
+  nxt_async_finish(nxt);
+  while (nxt->subs!=NULL) {
+    nxt_unsubscribe(nxt,nxt->subs->id);
+  }
+  nxt_con_sync(nxt);
   nxtnet_cli_disconnect(nxt->cli);
+  pthread_mutex_destroy(&nxt->mutex);
   free(nxt->name);
-  free(nxt->buffer);
   free(nxt);
 }
 
@@ -239,6 +276,39 @@ void nxt_reset_error(nxt_t *nxt) {
   nxt->error = 0;
 }
 
+/**
+ * Sets how telegrams that failed are retried
+ *  @param nxt NXT handle
+ *  @param retries Max. number of retries (0 to disable retrying)
+ *  @param delay Delay before first retry in milliseconds (doubled with each
+ *               retry, up to NXT_RETRY_MAXDELAY)
+ *  @note A telegram is executed twice, if the NXT received it, but its reply
+ *        was lost. So only direct commands that have the same effect when
+ *        executed twice are retried (including batches), e.g. getting sensor
+ *        values or setting motor power without tacho limit. See
+ *        nxt_set_retry_all(). System commands are never retried, they change
+ *        state on the NXT (e.g. file handles). Asynchronous requests and
+ *        subscriptions are not retried.
+ *  @note Defaults are NXT_RETRY_NUM and NXT_RETRY_DELAY
+ */
+void nxt_set_retry(nxt_t *nxt,unsigned int retries,unsigned int delay) {
+  nxt->retries = retries;
+  nxt->retry_delay = delay;
+}
+
+/**
+ * Sets whether all direct commands are retried
+ *  @param nxt NXT handle
+ *  @param all Whether direct commands that must not be executed twice are
+ *             retried, too (e.g. writing a message or moving a motor by a
+ *             tacho limit)
+ *  @note Default is to retry only commands that can be executed twice
+ *  @see nxt_set_retry()
+ */
+void nxt_set_retry_all(nxt_t *nxt,int all) {
+  nxt->retry_all = all;
+}
+
 /**
  * Returns connection type of NXT
  *  @param nxt NXT handle
@@ -339,6 +409,17 @@ int nxt_get_version(nxt_t *nxt,int *firmmaj,int *firmmin,int *protomaj,int *prot
   else return NXT_FAIL;
 }
 
+/**
+ * Unpacks reply of SETINPUTMODE
+ *  @param nxt NXT handle
+ *  @param arg Unused
+ *  @return Success?
+ */
+static int nxt_set_sensor_mode_unpack(nxt_t *nxt,void *arg) {
+  test(nxt_unpack_start(nxt,0x05));
+  return nxt_unpack_error(nxt)==0?NXT_SUCC:NXT_FAIL;
+}
+
 /**
  * Sets mode of sensor
  *  @param nxt NXT handle
@@ -353,10 +434,7 @@ int nxt_set_sensor_mode(nxt_t *nxt,int sensor,int type,int mode) {
   nxt_pack_byte(nxt,sensor);
   nxt_pack_byte(nxt,type);
   nxt_pack_byte(nxt,mode);
-  test(nxt_con_send(nxt));
-  test(nxt_con_recv(nxt,3));
-  test(nxt_unpack_start(nxt,0x05));
-  return nxt_unpack_error(nxt)==0?NXT_SUCC:NXT_FAIL;
+  return nxt_con_transact(nxt,3,nxt_set_sensor_mode_unpack,NULL);
 }
 
 /**
@@ -376,19 +454,16 @@ int nxt_get_sensor(nxt_t *nxt,int sensor) {
 }
 
 /**
- * Gets values of sensor
+ * Unpacks reply of GETINPUTVALUES
  *  @param nxt NXT handle
- *  @param sensor Sensor (0,1,2,3)
- *  @param values Pointer to structure for storing sensor values
+ *  @param arg Pointer to structure for storing sensor values
  *  @return 0 = Success
  *         -1 = Failure
+ *          1 = Values not valid yet
  */
-int nxt_get_sensor_values(nxt_t *nxt,int sensor,struct nxt_sensor_values *values) {
-  if (!NXT_VALID_SENSOR(sensor)) return NXT_FAIL;
-  nxt_pack_start(nxt,0x07);
-  nxt_pack_byte(nxt,sensor);
-  test(nxt_con_send(nxt));
-  test(nxt_con_recv(nxt,16));
+static int nxt_get_sensor_values_unpack(nxt_t *nxt,void *arg) {
+  struct nxt_sensor_values *values = (struct nxt_sensor_values*)arg;
+
   test(nxt_unpack_start(nxt,0x07));
   if (nxt_unpack_error(nxt)==0) {
     nxt_unpack_byte(nxt); // sensor port
@@ -405,13 +480,47 @@ int nxt_get_sensor_values(nxt_t *nxt,int sensor,struct nxt_sensor_values *values
       }
     }
     else {
-      nxt_wait_after_direct_command();
-      return nxt_get_sensor_values(nxt,sensor,values);
+      return 1;
     }
   }
   return NXT_FAIL;
 }
 
+/**
+ * Gets values of sensor
+ *  @param nxt NXT handle
+ *  @param sensor Sensor (0,1,2,3)
+ *  @param values Pointer to structure for storing sensor values
+ *  @return 0 = Success
+ *         -1 = Failure
+ *  @note In a batch the command fails if the values are not valid yet
+ */
+int nxt_get_sensor_values(nxt_t *nxt,int sensor,struct nxt_sensor_values *values) {
+  int ret;
+
+  if (!NXT_VALID_SENSOR(sensor)) return NXT_FAIL;
+  while (1) {
+    nxt_pack_start(nxt,0x07);
+    nxt_pack_byte(nxt,sensor);
+    ret = nxt_con_transact(nxt,16,nxt_get_sensor_values_unpack,values);
+    if (ret!=1) {
+      return ret;
+    }
+    nxt_wait_after_direct_command();
+  }
+}
+
+/**
+ * Unpacks reply of RESETINPUTSCALEDVALUE
+ *  @param nxt NXT handle
+ *  @param arg Unused
+ *  @return Success?
+ */
+static int nxt_reset_sensor_unpack(nxt_t *nxt,void *arg) {
+  test(nxt_unpack_start(nxt,0x08));
+  return nxt_unpack_error(nxt)==0?NXT_SUCC:NXT_FAIL;
+}
+
 /**
  * Resets a sensor
  *  @param nxt NXT handle
@@ -422,10 +531,7 @@ int nxt_reset_sensor(nxt_t *nxt,int sensor) {
   if (!NXT_VALID_SENSOR(sensor)) return NXT_FAIL;
   nxt_pack_start(nxt,0x08);
   nxt_pack_byte(nxt,sensor);
-  test(nxt_con_send(nxt));
-  test(nxt_con_recv(nxt,3));
-  test(nxt_unpack_start(nxt,0x08));
-  return nxt_unpack_error(nxt)==0?NXT_SUCC:NXT_FAIL;
+  return nxt_con_transact(nxt,3,nxt_reset_sensor_unpack,NULL);
 }
 
 /**
@@ -463,7 +569,6 @@ int nxt_stop_program(nxt_t *nxt) {
 char *nxt_get_program(nxt_t *nxt) {
   nxt_pack_start(nxt,0x11);
   if (nxt_con_send(nxt)==NXT_FAIL) return NULL;
-  usleep(60000); // latency of direct output commands: up to 60 ms
   if (nxt_con_recv(nxt,23)==NXT_FAIL) return NULL;
   if (nxt_unpack_start(nxt,0x11)==NXT_FAIL) return NULL;
   return nxt_unpack_error(nxt)==0?strdup(nxt_unpack_str(nxt,20)):NULL;
@@ -521,6 +626,17 @@ int nxt_keep_alive(nxt_t *nxt) {
   return nxt_unpack_error(nxt)==0?nxt_unpack_dword(nxt):NXT_FAIL;
 }
 
+/**
+ * Unpacks reply of PLAYTONE
+ *  @param nxt NXT handle
+ *  @param arg Unused
+ *  @return Success?
+ */
+static int nxt_beep_unpack(nxt_t *nxt,void *arg) {
+  test(nxt_unpack_start(nxt,0x03));
+  return nxt_unpack_error(nxt)==0?NXT_SUCC:NXT_FAIL;
+}
+
 /**
  * Beep (plays a tone)
  *  @param nxt NXT handle
@@ -532,10 +648,7 @@ int nxt_beep(nxt_t *nxt,unsigned int freq,unsigned int dur) {
   nxt_pack_start(nxt,0x03);
   nxt_pack_word(nxt,freq);
   nxt_pack_word(nxt,dur);
-  test(nxt_con_send(nxt));
-  test(nxt_con_recv(nxt,3));
-  test(nxt_unpack_start(nxt,0x03));
-  return nxt_unpack_error(nxt)==0?NXT_SUCC:NXT_FAIL;
+  return nxt_con_transact(nxt,3,nxt_beep_unpack,NULL);
 }
 
 /**
@@ -578,7 +691,6 @@ int nxt_run_program(nxt_t *nxt,char *filename) {
   nxt_pack_start(nxt,0x00);
   nxt_pack_str(nxt,filename,20);
   test(nxt_con_send(nxt));
-  usleep(60000);
   test(nxt_con_recv(nxt,3));
   test(nxt_unpack_start(nxt,0x00));
   return nxt_unpack_error(nxt)==0?NXT_SUCC:NXT_FAIL;
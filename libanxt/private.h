@@ -31,8 +31,97 @@ typedef enum {
   NXT_CMD_NONE = -1
 } nxt_cmd_t;
 
+/// Unpacks the reply of a telegram from the calling thread's connection context
+/// (replies of batched telegrams are copied there from their batch entry first)
+typedef int (*nxt_unpack_func_t)(nxt_t *nxt,void *arg);
+
+/// Telegram queued in a batch
+struct nxt_batch_entry {
+  /// Telegram
+  char send_buf[NXT_CON_BUFFERSIZE];
+  /// Size of telegram
+  size_t send_size;
+  /// Reply
+  char recv_buf[NXT_CON_BUFFERSIZE];
+  /// Size of reply
+  size_t recv_size;
+  /// Function unpacking the reply
+  nxt_unpack_func_t unpack;
+  /// Argument for unpack function
+  void *arg;
+};
+
+/// Telegrams queued between nxt_batch_begin() and nxt_batch_commit()
+struct nxt_batch {
+  /// Next batch of thread
+  struct nxt_batch *next;
+  /// NXT handle
+  nxt_t *nxt;
+  /// Number of queued telegrams
+  size_t num_entries;
+  /// Size of entries array
+  size_t max_entries;
+  /// Queued telegrams
+  struct nxt_batch_entry *entries;
+};
+
+/// Subscription to telegrams of a batch
+struct nxt_sub {
+  /// Next subscription
+  struct nxt_sub *next;
+  /// ID of subscription
+  int id;
+  /// Telegrams
+  struct nxt_batch *batch;
+  /// Transactions passed to libanxt_net
+  struct nxtnet_batch_item *items;
+};
+
+/// Telegrams submitted by nxt_async_submit()
+struct nxt_async {
+  /// Next pending request of thread
+  struct nxt_async *next;
+  /// NXT handle
+  nxt_t *nxt;
+  /// Telegrams (with own send and reply buffers)
+  struct nxt_batch *batch;
+  /// Transactions passed to libanxt_net
+  struct nxtnet_batch_item *items;
+  /// Request IDs of transactions (-1 if submitting failed)
+  int *ids;
+  /// Number of transactions whose reply arrived
+  size_t num_done;
+  /// If replies are unpacked
+  int done;
+  /// Result
+  int ret;
+  /// Completion function (NULL if waited for with nxt_async_wait())
+  nxt_async_func_t func;
+  /// Context for completion function
+  void *ctx;
+};
+
+/// Telegram buffer and open requests of a thread
+struct nxt_con_ctx {
+  /// Telegram being packed or unpacked
+  char buffer[NXT_CON_BUFFERSIZE];
+  /// Pack/unpack position in buffer
+  char *ptr;
+  /// NXT of deferred telegram
+  nxt_t *pending_nxt;
+  /// Size of deferred telegram (see nxt_con_send())
+  size_t pending;
+  /// Batches started by thread
+  struct nxt_batch *batches;
+  /// Asynchronous requests submitted by thread
+  struct nxt_async *async;
+};
+
 ssize_t nxt_con_send(nxt_t *nxt);
 ssize_t nxt_con_recv(nxt_t *nxt,size_t size);
+int nxt_con_sync(nxt_t *nxt);
+int nxt_con_transact(nxt_t *nxt,size_t size,nxt_unpack_func_t unpack,void *arg);
+void nxt_async_finish(nxt_t *nxt);
 void nxt_pack_byte(nxt_t *nxt,uint8_t val);
 void nxt_pack_word(nxt_t *nxt,uint16_t val);
 void nxt_pack_dword(nxt_t *nxt,uint32_t val);
@@ -20,23 +20,199 @@
 
 #include <sys/types.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
 
 #include <anxt/nxt.h>
 
 #include "private.h"
 
+static pthread_key_t ctx_key;
+static pthread_once_t ctx_once = PTHREAD_ONCE_INIT;
+
 /**
- * Send data
+ * Frees telegram context of a thread that exits
+ *  @param arg Context
+ *  @note Asynchronous requests the thread left pending are dropped without
+ *        waiting for their replies (their NXT may be closed already)
+ */
+static void nxt_con_free_ctx(void *arg) {
+  struct nxt_con_ctx *ctx = (struct nxt_con_ctx*)arg;
+  struct nxt_batch *batch;
+  struct nxt_async *req;
+
+  while ((batch = ctx->batches)!=NULL) {
+    ctx->batches = batch->next;
+    free(batch->entries);
+    free(batch);
+  }
+  while ((req = ctx->async)!=NULL) {
+    ctx->async = req->next;
+    free(req->ids);
+    free(req->items);
+    free(req->batch->entries);
+    free(req->batch);
+    free(req);
+  }
+  free(ctx);
+}
+
+static void nxt_con_init_ctx(void) {
+  pthread_key_create(&ctx_key,nxt_con_free_ctx);
+}
+
+/**
+ * Gets telegram context of calling thread
+ *  @return Context
+ *  @note Every thread packs and unpacks telegrams in its own buffer, so
+ *        threads can use the same NXT at the same time.
+ */
+static struct nxt_con_ctx *nxt_con_get_ctx(void) {
+  struct nxt_con_ctx *ctx;
+
+  pthread_once(&ctx_once,nxt_con_init_ctx);
+  ctx = pthread_getspecific(ctx_key);
+  if (ctx==NULL) {
+    ctx = malloc(sizeof(struct nxt_con_ctx));
+    memset(ctx,0,sizeof(struct nxt_con_ctx));
+    ctx->ptr = ctx->buffer;
+    pthread_setspecific(ctx_key,ctx);
+  }
+  return ctx;
+}
+
+/**
+ * Looks up handle of NXT again
  *  @param nxt NXT handle
+ *  @return Success? (fails if nxtd can't be reached)
+ *  @note nxtd gives a NXT that was removed and found again its old handle
+ *        back, if possible. If the NXT isn't listed (yet), the handle is kept.
+ */
+static int nxt_con_resolve(nxt_t *nxt) {
+  struct nxtnet_proto_list_sc *list = nxtnet_cli_list(nxt->cli);
+  size_t i;
+
+  if (list==NULL) {
+    return NXT_FAIL;
+  }
+  for (i=0;i<list->num_items;i++) {
+    if (memcmp(list->nxts[i].id,nxt->id,6)==0 && (list->nxts[i].is_bt!=0)==(nxt->contype==NXT_CON_BT)) {
+      // other threads read handle without lock, only write it if it changed
+      if (nxt->handle!=list->nxts[i].handle) {
+        nxt->handle = list->nxts[i].handle;
+      }
+      break;
+    }
+  }
+  free(list);
+  return NXT_SUCC;
+}
+
+/**
+ * Checks whether a telegram may be sent again after it failed
+ *  @param nxt NXT handle
+ *  @param telegram Telegram
+ *  @param size Size of telegram
+ *  @return Whether telegram may be retried
+ *  @note The NXT may have executed the telegram already, if only its reply
+ *        was lost. So unless nxt_set_retry_all() was used, only direct
+ *        commands are retried that have the same effect when executed twice.
+ */
+static int nxt_con_may_retry(nxt_t *nxt,const char *telegram,size_t size) {
+  if (size<2 || (telegram[0]&0x7F)!=NXT_TYPE_DIRECT_RESP) {
+    return 0;
+  }
+  if (nxt->retry_all) {
+    return 1;
+  }
+
+  switch ((unsigned char)telegram[1]) {
+    case 0x01: // STOPPROGRAM
+    case 0x05: // SETINPUTMODE
+    case 0x06: // GETOUTPUTSTATE
+    case 0x07: // GETINPUTVALUES
+    case 0x08: // RESETINPUTSCALEDVALUE
+    case 0x0A: // RESETMOTORPOSITION
+    case 0x0B: // GETBATTERYLEVEL
+    case 0x0C: // STOPSOUNDPLAYBACK
+    case 0x0D: // KEEPALIVE
+    case 0x0E: // LSGETSTATUS
+    case 0x11: // GETCURRENTPROGRAMNAME
+      return 1;
+    case 0x04: // SETOUTPUTSTATE (a tacho limit moves motor relatively)
+      return size>=12 && telegram[8]==0 && telegram[9]==0 && telegram[10]==0 && telegram[11]==0;
+    case 0x13: // MESSAGEREAD (unless message is removed)
+      return size>=5 && telegram[4]==0;
+    default:
+      return 0;
+  }
+}
+
+/**
+ * Waits before a telegram that failed is sent again
+ *  @param nxt NXT handle
+ *  @param attempt Number of failed attempts
+ *  @param may_retry Whether telegram may be retried (see nxt_con_may_retry())
+ *  @return Whether telegram should be sent again
+ *  @note If the connection to nxtd broke, looking up the NXT's handle
+ *        connects again (see nxtnet_cli_connect_shared())
+ *  @see nxt_set_retry()
+ */
+static int nxt_con_retry(nxt_t *nxt,unsigned int attempt,int may_retry) {
+  unsigned long delay = nxt->retry_delay;
+  struct timespec ts;
+
+  if (attempt>nxt->retries || !may_retry) {
+    return 0;
+  }
+
+  while (--attempt>0 && delay<NXT_RETRY_MAXDELAY) {
+    delay *= 2;
+  }
+  if (delay>NXT_RETRY_MAXDELAY) {
+    delay = NXT_RETRY_MAXDELAY;
+  }
+  ts.tv_sec = delay/1000;
+  ts.tv_nsec = (delay%1000)*1000000;
+  while (nanosleep(&ts,&ts)==-1 && errno==EINTR);
+  return nxt_con_resolve(nxt)==NXT_SUCC;
+}
+
+/**
+ * Sends a telegram that was deferred by nxt_con_send()
+ *  @param ctx Telegram context
  *  @return How many bytes sent
  */
-ssize_t nxt_con_send(nxt_t *nxt) {
-  ssize_t ret = nxtnet_cli_send(nxt->cli, nxt->handle, nxt->buffer, nxt->ptr-nxt->buffer);
+static ssize_t nxt_con_flush(struct nxt_con_ctx *ctx) {
+  nxt_t *nxt = ctx->pending_nxt;
+  unsigned int attempt = 1;
+  ssize_t ret;
+
+  while ((ret = nxtnet_cli_send(nxt->cli, nxt->handle, ctx->buffer, ctx->pending))==-1
+      && nxt_con_retry(nxt, attempt++, nxt_con_may_retry(nxt, ctx->buffer, ctx->pending)));
+  ctx->pending = 0;
   if (ret==-1) nxt->error = NXT_ERR_CONNECTION;
   return ret;
 }
 
+/**
+ * Send data
+ *  @param nxt NXT handle
+ *  @return How many bytes sent
+ *  @note The telegram is only marked as pending here. It is sent together
+ *        with the next nxt_con_recv() in one round trip to nxtd.
+ */
+ssize_t nxt_con_send(nxt_t *nxt) {
+  struct nxt_con_ctx *ctx = nxt_con_get_ctx();
+
+  ctx->pending_nxt = nxt;
+  ctx->pending = ctx->ptr-ctx->buffer;
+  return ctx->pending;
+}
+
 /**
  * Receive data
  *  @param nxt NXT handle
@@ -44,82 +220,653 @@ ssize_t nxt_con_send(nxt_t *nxt) {
  *  @return How many bytes received
  */
 ssize_t nxt_con_recv(nxt_t *nxt,size_t size) {
-  ssize_t ret = nxtnet_cli_recv(nxt->cli, nxt->handle, nxt->buffer, size);
+  struct nxt_con_ctx *ctx = nxt_con_get_ctx();
+  char telegram[NXT_CON_BUFFERSIZE];
+  unsigned int attempt = 1;
+  ssize_t ret;
+
+  if (ctx->pending>0 && ctx->pending_nxt==nxt) {
+    // reply overwrites telegram
+    memcpy(telegram, ctx->buffer, ctx->pending);
+    while ((ret = nxtnet_cli_transact(nxt->cli, nxt->handle, ctx->buffer, ctx->pending, ctx->buffer, size))==-1
+        && nxt_con_retry(nxt, attempt++, nxt_con_may_retry(nxt, telegram, ctx->pending))) {
+      memcpy(ctx->buffer, telegram, ctx->pending);
+    }
+    ctx->pending = 0;
+  }
+  else {
+    ret = nxtnet_cli_recv(nxt->cli, nxt->handle, ctx->buffer, size);
+  }
   if (ret==-1) nxt->error = NXT_ERR_CONNECTION;
   return ret;
 }
 
+/**
+ * Sends a deferred telegram that will not be followed by nxt_con_recv()
+ *  @param nxt NXT handle
+ *  @return Success?
+ */
+int nxt_con_sync(nxt_t *nxt) {
+  struct nxt_con_ctx *ctx = nxt_con_get_ctx();
+
+  if (ctx->pending>0) {
+    return nxt_con_flush(ctx)==-1?NXT_FAIL:NXT_SUCC;
+  }
+  return NXT_SUCC;
+}
+
+/**
+ * Finds batch the calling thread started for a NXT
+ *  @param ctx Telegram context
+ *  @param nxt NXT handle
+ *  @return Batch (NULL if none)
+ */
+static struct nxt_batch *nxt_batch_find(struct nxt_con_ctx *ctx,nxt_t *nxt) {
+  struct nxt_batch *batch;
+
+  for (batch=ctx->batches;batch!=NULL && batch->nxt!=nxt;batch=batch->next);
+  return batch;
+}
+
+/**
+ * Removes batch the calling thread started for a NXT
+ *  @param nxt NXT handle
+ *  @return Batch (NULL if none)
+ */
+static struct nxt_batch *nxt_batch_take(nxt_t *nxt) {
+  struct nxt_con_ctx *ctx = nxt_con_get_ctx();
+  struct nxt_batch **prev,*batch;
+
+  for (prev=&ctx->batches;*prev!=NULL && (*prev)->nxt!=nxt;prev=&(*prev)->next);
+  batch = *prev;
+  if (batch!=NULL) {
+    *prev = batch->next;
+  }
+  return batch;
+}
+
+/**
+ * Sends the packed telegram and unpacks its reply
+ *  @param nxt NXT handle
+ *  @param size How many bytes to receive
+ *  @param unpack Function that unpacks the reply
+ *  @param arg Argument for unpack function
+ *  @return Return value of unpack function (NXT_SUCC if telegram was queued)
+ *  @note Between nxt_batch_begin() and nxt_batch_commit() the telegram is only
+ *        queued and its reply is unpacked by nxt_batch_commit().
+ */
+int nxt_con_transact(nxt_t *nxt,size_t size,nxt_unpack_func_t unpack,void *arg) {
+  struct nxt_con_ctx *ctx = nxt_con_get_ctx();
+  struct nxt_batch *batch = nxt_batch_find(ctx,nxt);
+
+  if (batch!=NULL) {
+    struct nxt_batch_entry *entry;
+
+    if (batch->num_entries==batch->max_entries) {
+      batch->max_entries = batch->max_entries>0?2*batch->max_entries:8;
+      batch->entries = realloc(batch->entries,batch->max_entries*sizeof(struct nxt_batch_entry));
+    }
+    entry = batch->entries+batch->num_entries++;
+    entry->send_size = ctx->ptr-ctx->buffer;
+    memcpy(entry->send_buf,ctx->buffer,entry->send_size);
+    entry->recv_size = size;
+    entry->unpack = unpack;
+    entry->arg = arg;
+    return NXT_SUCC;
+  }
+  else {
+    test(nxt_con_send(nxt));
+    test(nxt_con_recv(nxt,size));
+    return unpack(nxt,arg);
+  }
+}
+
+/**
+ * Starts a batch. All batch-capable commands until nxt_batch_commit() are
+ * queued and then executed with one round trip to nxtd. Alternatively
+ * nxt_subscribe() lets nxtd execute them periodically.
+ *  @param nxt NXT handle
+ *  @return Success?
+ *  @note Batch-capable are nxt_motor_set_state(), nxt_motor_get_state(),
+ *        nxt_motor_reset_tacho(), the motor setters (with autoset), the motor
+ *        getters (with autoget), nxt_set_sensor_mode(),
+ *        nxt_get_sensor_values(), nxt_reset_sensor() and nxt_beep(). Their
+ *        results (return values of getters, sensor values) are only valid
+ *        after nxt_batch_commit(). Other commands are executed immediately.
+ *        Instead of committing the batch it can also be submitted
+ *        asynchronously with nxt_async_submit().
+ *  @note A batch only queues commands of the thread that started it
+ */
+int nxt_batch_begin(nxt_t *nxt) {
+  struct nxt_con_ctx *ctx = nxt_con_get_ctx();
+  struct nxt_batch *batch;
+
+  if (nxt_batch_find(ctx,nxt)!=NULL) {
+    return NXT_FAIL;
+  }
+  test(nxt_con_sync(nxt));
+  batch = malloc(sizeof(struct nxt_batch));
+  memset(batch,0,sizeof(struct nxt_batch));
+  batch->nxt = nxt;
+  batch->next = ctx->batches;
+  ctx->batches = batch;
+  return NXT_SUCC;
+}
+
+/**
+ * Builds transactions for libanxt_net from queued telegrams
+ *  @param batch Batch
+ *  @return Transactions (free with free())
+ */
+static struct nxtnet_batch_item *nxt_batch_items(struct nxt_batch *batch) {
+  struct nxtnet_batch_item *items;
+  size_t i;
+
+  items = malloc((batch->num_entries>0?batch->num_entries:1)*sizeof(struct nxtnet_batch_item));
+  for (i=0;i<batch->num_entries;i++) {
+    items[i].send_buf = batch->entries[i].send_buf;
+    items[i].send_size = batch->entries[i].send_size;
+    items[i].recv_buf = batch->entries[i].recv_buf;
+    items[i].recv_size = batch->entries[i].recv_size;
+    items[i].ret = -1;
+  }
+
+  return items;
+}
+
+/**
+ * Unpacks replies of queued telegrams
+ *  @param nxt NXT handle
+ *  @param batch Batch
+ *  @param items Transactions with results
+ *  @return Success? (fails if any telegram failed)
+ */
+static int nxt_batch_unpack(nxt_t *nxt,struct nxt_batch *batch,struct nxtnet_batch_item *items) {
+  struct nxt_con_ctx *ctx = nxt_con_get_ctx();
+  size_t i;
+  int ret = NXT_SUCC;
+
+  for (i=0;i<batch->num_entries;i++) {
+    if (items[i].ret!=items[i].recv_size) {
+      nxt->error = NXT_ERR_CONNECTION;
+      ret = NXT_FAIL;
+    }
+    else {
+      memcpy(ctx->buffer,batch->entries[i].recv_buf,items[i].recv_size);
+      if (batch->entries[i].unpack(nxt,batch->entries[i].arg)!=NXT_SUCC) {
+        ret = NXT_FAIL;
+      }
+    }
+  }
+
+  return ret;
+}
+
+/**
+ * Frees a batch
+ *  @param batch Batch
+ */
+static void nxt_batch_free(struct nxt_batch *batch) {
+  free(batch->entries);
+  free(batch);
+}
+
+/**
+ * Checks whether the telegrams of a batch may be sent again after one failed
+ *  @param nxt NXT handle
+ *  @param batch Batch
+ *  @param first First telegram to be sent again
+ *  @return Whether all telegrams from first on may be retried
+ */
+static int nxt_batch_may_retry(nxt_t *nxt,struct nxt_batch *batch,size_t first) {
+  size_t i;
+
+  for (i=first;i<batch->num_entries;i++) {
+    if (!nxt_con_may_retry(nxt,batch->entries[i].send_buf,batch->entries[i].send_size)) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/**
+ * Executes all commands queued since nxt_batch_begin()
+ *  @param nxt NXT handle
+ *  @return Success? (fails if any command failed)
+ */
+int nxt_batch_commit(nxt_t *nxt) {
+  struct nxt_batch *batch = nxt_batch_take(nxt);
+  struct nxtnet_batch_item *items;
+  unsigned int attempt = 1;
+  size_t i;
+  int ret;
+
+  if (batch==NULL) {
+    return NXT_FAIL;
+  }
+
+  items = nxt_batch_items(batch);
+  if (nxtnet_cli_batch(nxt->cli,nxt->handle,items,batch->num_entries)==-1) {
+    nxt->error = NXT_ERR_CONNECTION;
+    ret = NXT_FAIL;
+  }
+  else {
+    // nxtd stops at first telegram that failed, retry from there
+    for (i=0;i<batch->num_entries && items[i].ret==items[i].recv_size;i++);
+    while (i<batch->num_entries && nxt_con_retry(nxt,attempt++,nxt_batch_may_retry(nxt,batch,i))) {
+      if (nxtnet_cli_batch(nxt->cli,nxt->handle,items+i,batch->num_entries-i)==-1) {
+        break;
+      }
+      for (;i<batch->num_entries && items[i].ret==items[i].recv_size;i++);
+    }
+    ret = nxt_batch_unpack(nxt,batch,items);
+  }
+
+  free(items);
+  nxt_batch_free(batch);
+  return ret;
+}
+
+/**
+ * Discards all commands queued since nxt_batch_begin()
+ *  @param nxt NXT handle
+ */
+void nxt_batch_abort(nxt_t *nxt) {
+  struct nxt_batch *batch = nxt_batch_take(nxt);
+
+  if (batch!=NULL) {
+    nxt_batch_free(batch);
+  }
+}
+
+/**
+ * Subscribes to the commands queued since nxt_batch_begin(). Instead of
+ * executing them once, nxtd executes them periodically and sends the results
+ * to the client.
+ *  @param nxt NXT handle
+ *  @param interval Sampling interval (in microseconds)
+ *  @return ID of subscription (-1 on failure)
+ *  @note Use nxt_sample() to receive results
+ */
+int nxt_subscribe(nxt_t *nxt,unsigned int interval) {
+  struct nxt_batch *batch = nxt_batch_take(nxt);
+  struct nxt_sub *sub;
+
+  if (batch==NULL) {
+    return NXT_FAIL;
+  }
+
+  sub = malloc(sizeof(struct nxt_sub));
+  sub->batch = batch;
+  sub->items = nxt_batch_items(batch);
+  sub->id = nxtnet_cli_subscribe(nxt->cli,nxt->handle,interval,sub->items,batch->num_entries);
+  if (sub->id==-1) {
+    nxt->error = NXT_ERR_CONNECTION;
+    free(sub->items);
+    nxt_batch_free(batch);
+    free(sub);
+    return NXT_FAIL;
+  }
+
+  pthread_mutex_lock(&nxt->mutex);
+  sub->next = nxt->subs;
+  nxt->subs = sub;
+  pthread_mutex_unlock(&nxt->mutex);
+  return sub->id;
+}
+
+/**
+ * Receives next sample of a subscription. The replies are unpacked as by
+ * nxt_batch_commit().
+ *  @param nxt NXT handle
+ *  @param id ID of subscription
+ *  @param time Where to store time of sample (nxtd's monotonic clock; can be
+ *              NULL)
+ *  @return Success?
+ *  @note A subscription must only be sampled by one thread at a time
+ */
+int nxt_sample(nxt_t *nxt,int id,struct timespec *time) {
+  struct nxt_sub *sub;
+
+  pthread_mutex_lock(&nxt->mutex);
+  for (sub=nxt->subs;sub!=NULL && sub->id!=id;sub=sub->next);
+  pthread_mutex_unlock(&nxt->mutex);
+  if (sub==NULL) {
+    return NXT_FAIL;
+  }
+
+  if (nxtnet_cli_sample(nxt->cli,id,sub->items,sub->batch->num_entries,time)==-1) {
+    nxt->error = NXT_ERR_CONNECTION;
+    return NXT_FAIL;
+  }
+  return nxt_batch_unpack(nxt,sub->batch,sub->items);
+}
+
+/**
+ * Cancels a subscription
+ *  @param nxt NXT handle
+ *  @param id ID of subscription
+ *  @return Success?
+ */
+int nxt_unsubscribe(nxt_t *nxt,int id) {
+  struct nxt_sub **prev,*sub;
+  int ret;
+
+  pthread_mutex_lock(&nxt->mutex);
+  for (prev=&nxt->subs;*prev!=NULL && (*prev)->id!=id;prev=&(*prev)->next);
+  sub = *prev;
+  if (sub!=NULL) {
+    *prev = sub->next;
+  }
+  pthread_mutex_unlock(&nxt->mutex);
+  if (sub==NULL) {
+    return NXT_FAIL;
+  }
+
+  ret = nxtnet_cli_unsubscribe(nxt->cli,nxt->handle,id)==-1?NXT_FAIL:NXT_SUCC;
+  free(sub->items);
+  nxt_batch_free(sub->batch);
+  free(sub);
+  return ret;
+}
+
+/**
+ * Submits the commands queued since nxt_batch_begin() without waiting for
+ * their replies. Each telegram is sent as its own transaction and keeps its
+ * own buffers, so several requests can be in flight at the same time.
+ *  @param nxt NXT handle
+ *  @param func Function called when the request completed (NULL to wait for
+ *              it with nxt_async_wait())
+ *  @param ctx Context for completion function
+ *  @return Request (NULL on failure)
+ *  @note Replies are unpacked as by nxt_batch_commit() when the request
+ *        completes, so pointers passed to the queued commands must stay
+ *        valid until then. Requests complete in nxt_async_dispatch() or
+ *        nxt_async_wait() of the thread that submitted them. Requests
+ *        still pending when that thread exits are freed.
+ */
+nxt_async_t *nxt_async_submit(nxt_t *nxt,nxt_async_func_t func,void *ctx) {
+  struct nxt_batch *batch = nxt_batch_take(nxt);
+  struct nxt_async **prev,*req;
+  size_t i;
+
+  if (batch==NULL) {
+    return NULL;
+  }
+
+  req = malloc(sizeof(struct nxt_async));
+  req->next = NULL;
+  req->nxt = nxt;
+  req->batch = batch;
+  req->items = nxt_batch_items(batch);
+  req->ids = malloc((batch->num_entries>0?batch->num_entries:1)*sizeof(int));
+  req->num_done = 0;
+  req->done = 0;
+  req->ret = NXT_SUCC;
+  req->func = func;
+  req->ctx = ctx;
+
+  for (i=0;i<batch->num_entries;i++) {
+    req->ids[i] = nxtnet_cli_submit(nxt->cli,nxt->handle,req->items[i].send_buf,req->items[i].send_size,req->items[i].recv_size);
+    if (req->ids[i]==-1) {
+      req->num_done++;
+    }
+  }
+
+  // complete requests in order of submission
+  for (prev=&nxt_con_get_ctx()->async;*prev!=NULL;prev=&(*prev)->next);
+  *prev = req;
+  return req;
+}
+
+/**
+ * Returns file descriptor to watch for replies of asynchronous requests
+ *  @param nxt NXT handle
+ *  @return File descriptor (-1 if there is none)
+ *  @note Call nxt_async_dispatch() when it becomes readable. Replies may also
+ *        be received while waiting for other commands, so call it after
+ *        blocking commands, too. In-process NXTs (see nxt_open_cli()) have no
+ *        file descriptor, but their requests complete on submission.
+ */
+int nxt_async_fd(nxt_t *nxt) {
+  return nxt->cli->sock;
+}
+
+/**
+ * Unpacks the replies of a request whose transactions all completed
+ *  @param req Request
+ *  @note The completion function is called and the request freed, if it has
+ *        a completion function
+ */
+static void nxt_async_complete(struct nxt_async *req) {
+  nxt_t *nxt = req->nxt;
+
+  req->ret = nxt_batch_unpack(nxt,req->batch,req->items);
+  req->done = 1;
+
+  if (req->func!=NULL) {
+    req->func(nxt,req,req->ret,req->ctx);
+    free(req->ids);
+    free(req->items);
+    nxt_batch_free(req->batch);
+    free(req);
+  }
+}
+
+/**
+ * Removes request from list of pending requests
+ *  @param req Request
+ */
+static void nxt_async_unlink(struct nxt_async *req) {
+  struct nxt_async **prev;
+
+  for (prev=&nxt_con_get_ctx()->async;*prev!=NULL && *prev!=req;prev=&(*prev)->next);
+  if (*prev!=NULL) {
+    *prev = req->next;
+  }
+}
+
+/**
+ * Completes asynchronous requests whose replies arrived, without blocking
+ *  @param nxt NXT handle
+ *  @return Number of completed requests (-1 if connection is broken)
+ *  @note If the connection is broken, all pending requests complete with
+ *        failure
+ *  @note Only requests submitted by the calling thread are completed
+ */
+int nxt_async_dispatch(nxt_t *nxt) {
+  struct nxt_con_ctx *ctx = nxt_con_get_ctx();
+  struct nxt_async *req;
+  int broken = nxtnet_cli_poll(nxt->cli)==-1;
+  int num = 0;
+  size_t i;
+
+  req = ctx->async;
+  while (req!=NULL) {
+    if (req->nxt!=nxt) {
+      req = req->next;
+      continue;
+    }
+    for (i=0;i<req->batch->num_entries;i++) {
+      if (req->ids[i]!=-1 && (broken || nxtnet_cli_ready(nxt->cli,req->ids[i]))) {
+        req->items[i].ret = nxtnet_cli_wait(nxt->cli,req->ids[i],req->items[i].recv_buf,req->items[i].recv_size);
+        req->ids[i] = -1;
+        req->num_done++;
+      }
+    }
+
+    if (req->num_done==req->batch->num_entries) {
+      nxt_async_unlink(req);
+      nxt_async_complete(req);
+      num++;
+      // completion function may have submitted or waited for requests
+      req = ctx->async;
+    }
+    else {
+      req = req->next;
+    }
+  }
+
+  if (broken) {
+    nxt->error = NXT_ERR_CONNECTION;
+    return -1;
+  }
+  return num;
+}
+
+/**
+ * Waits for the replies of all transactions of a request
+ *  @param req Request
+ */
+static void nxt_async_collect(struct nxt_async *req) {
+  nxt_t *nxt = req->nxt;
+  size_t i;
+
+  for (i=0;i<req->batch->num_entries;i++) {
+    if (req->ids[i]!=-1) {
+      req->items[i].ret = nxtnet_cli_wait(nxt->cli,req->ids[i],req->items[i].recv_buf,req->items[i].recv_size);
+      req->ids[i] = -1;
+      req->num_done++;
+    }
+  }
+}
+
+/**
+ * Completes all pending asynchronous requests
+ *  @param nxt NXT handle
+ *  @note Used by nxt_close(). Requests without completion function still
+ *        have to be freed with nxt_async_wait().
+ */
+void nxt_async_finish(nxt_t *nxt) {
+  struct nxt_con_ctx *ctx = nxt_con_get_ctx();
+  struct nxt_async *req;
+
+  do {
+    for (req=ctx->async;req!=NULL && req->nxt!=nxt;req=req->next);
+    if (req!=NULL) {
+      nxt_async_collect(req);
+      nxt_async_unlink(req);
+      nxt_async_complete(req);
+    }
+  } while (req!=NULL);
+}
+
+/**
+ * Checks if an asynchronous request completed
+ *  @param req Request (without completion function)
+ *  @return If completed (nxt_async_wait() won't block then)
+ */
+int nxt_async_done(nxt_async_t *req) {
+  return req->done;
+}
+
+/**
+ * Waits for an asynchronous request and frees it
+ *  @param req Request (without completion function)
+ *  @return Success? (fails if any command failed)
+ */
+int nxt_async_wait(nxt_async_t *req) {
+  int ret;
+
+  if (!req->done) {
+    nxt_async_collect(req);
+    nxt_async_unlink(req);
+    nxt_async_complete(req);
+  }
+
+  ret = req->ret;
+  free(req->ids);
+  free(req->items);
+  nxt_batch_free(req->batch);
+  free(req);
+  return ret;
+}
+
 /// Functions for packing packages
 void nxt_pack_byte(nxt_t *nxt,uint8_t val) {
-  *(nxt->ptr)++ = val;
+  struct nxt_con_ctx *ctx = nxt_con_get_ctx();
+  *(ctx->ptr)++ = val;
 }
 
 void nxt_pack_word(nxt_t *nxt,uint16_t val) {
-  set_word(nxt->ptr,val);
-  nxt->ptr += 2;
+  struct nxt_con_ctx *ctx = nxt_con_get_ctx();
+  set_word(ctx->ptr,val);
+  ctx->ptr += 2;
 }
 
 void nxt_pack_dword(nxt_t *nxt,uint32_t val) {
-  set_dword(nxt->ptr,val);
-  nxt->ptr += 4;
+  struct nxt_con_ctx *ctx = nxt_con_get_ctx();
+  set_dword(ctx->ptr,val);
+  ctx->ptr += 4;
 }
 
 void nxt_pack_start(nxt_t *nxt,nxt_cmd_t cmd) {
-  nxt->buffer[0] = cmd<0x80?NXT_TYPE_DIRECT_RESP:NXT_TYPE_SYSTEM_RESP;
-  nxt->buffer[1] = cmd;
-  nxt->ptr = nxt->buffer+2;
+  struct nxt_con_ctx *ctx = nxt_con_get_ctx();
+  nxt_con_sync(nxt);
+  ctx->buffer[0] = cmd<0x80?NXT_TYPE_DIRECT_RESP:NXT_TYPE_SYSTEM_RESP;
+  ctx->buffer[1] = cmd;
+  ctx->ptr = ctx->buffer+2;
 }
 
 void nxt_pack_mem(nxt_t *nxt,void *buf,size_t len) {
-  memcpy(nxt->ptr,buf,len);
-  nxt->ptr += len;
+  struct nxt_con_ctx *ctx = nxt_con_get_ctx();
+  memcpy(ctx->ptr,buf,len);
+  ctx->ptr += len;
 }
 
 void nxt_pack_str(nxt_t *nxt,const char *str,size_t maxlen) {
-  strncpy(nxt->ptr,str,maxlen);
-  nxt->ptr += maxlen;
+  struct nxt_con_ctx *ctx = nxt_con_get_ctx();
+  strncpy(ctx->ptr,str,maxlen);
+  ctx->ptr += maxlen;
 }
 
 /// Functions for unpacking packages
 uint8_t nxt_unpack_byte(nxt_t *nxt) {
-  return *(nxt->ptr)++;
+  struct nxt_con_ctx *ctx = nxt_con_get_ctx();
+  return *(ctx->ptr)++;
 }
 
 uint16_t nxt_unpack_word(nxt_t *nxt) {
-  uint16_t ret = get_word(nxt->ptr);
-  nxt->ptr += 2;
+  struct nxt_con_ctx *ctx = nxt_con_get_ctx();
+  uint16_t ret = get_word(ctx->ptr);
+  ctx->ptr += 2;
   return ret;
 }
 
 uint32_t nxt_unpack_dword(nxt_t *nxt) {
-  uint32_t ret = get_dword(nxt->ptr);
-  nxt->ptr += 4;
+  struct nxt_con_ctx *ctx = nxt_con_get_ctx();
+  uint32_t ret = get_dword(ctx->ptr);
+  ctx->ptr += 4;
   return ret;
 }
 
 int nxt_unpack_start(nxt_t *nxt,nxt_cmd_t cmd) {
-  if ((nxt->buffer[0]&0xFF)!=NXT_TYPE_REPLY || (nxt->buffer[1]&0xFF)!=cmd) return NXT_FAIL;
+  struct nxt_con_ctx *ctx = nxt_con_get_ctx();
+  if ((ctx->buffer[0]&0xFF)!=NXT_TYPE_REPLY || (ctx->buffer[1]&0xFF)!=cmd) return NXT_FAIL;
   else {
-    nxt->ptr = nxt->buffer+2;
+    ctx->ptr = ctx->buffer+2;
     return NXT_SUCC;
   }
 }
 
 int nxt_unpack_error(nxt_t *nxt) {
-  int error = (*(nxt->ptr)++)&0xFF;
+  struct nxt_con_ctx *ctx = nxt_con_get_ctx();
+  int error = (*(ctx->ptr)++)&0xFF;
   if (error!=0) nxt->error = error;
   return error;
 }
 
 void *nxt_unpack_mem(nxt_t *nxt,size_t len) {
-  void *ret = nxt->ptr;
-  nxt->ptr += len;
+  struct nxt_con_ctx *ctx = nxt_con_get_ctx();
+  void *ret = ctx->ptr;
+  ctx->ptr += len;
   return ret;
 }
 
 void *nxt_unpack_str(nxt_t *nxt,size_t len) {
-  char *ret = nxt->ptr;
+  struct nxt_con_ctx *ctx = nxt_con_get_ctx();
+  char *ret = ctx->ptr;
   ret[len-1] = 0;
-  nxt->ptr += len;
+  ctx->ptr += len;
   return ret;
 }
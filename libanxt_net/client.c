@@ -18,38 +18,178 @@
     along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+// for struct ucred
+#define _GNU_SOURCE
+
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <netdb.h>
+#include <poll.h>
+#include <errno.h>
+#include <stddef.h>
 #include <stdlib.h>
+#include <stdio.h>
 #include <string.h>
+#include <unistd.h>
 
 #include <anxt/net.h>
 
+/// Subscription of an in-process client
+struct nxtnet_cli_sub {
+  /// Next subscription
+  struct nxtnet_cli_sub *next;
+  /// Client
+  nxtnet_cli_t *cli;
+  /// ID of subscription
+  int id;
+  /// Subscription returned by ops.subscribe
+  void *sub;
+};
+
+static struct nxtnet_proto_list_sc *packer_list;
+static size_t packer_num;
+static pthread_mutex_t packer_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static nxtnet_cli_t *shared_first = NULL;
+static pthread_mutex_t shared_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static struct nxtnet_cli_reply *nxtnet_cli_wait_packet(nxtnet_cli_t *cli,int cmd,int id);
+
 /**
- * Connects to NXTNET server
+ * Checks whether a request was sent over the current connection
+ *  @param cli NXTNET client descriptor
+ *  @param id Request ID (-1 for requests without ID)
+ *  @return Whether its reply can still arrive
+ *  @note cli->mutex must be locked. Requests without ID hold request_mutex
+ *        while waiting, so there is no reconnect meanwhile.
+ */
+static int nxtnet_cli_current(nxtnet_cli_t *cli,int id) {
+  return id==-1 || ((id-cli->first_id)&0x7FFFFFFF)<((cli->next_id-cli->first_id)&0x7FFFFFFF);
+}
+
+/**
+ * Starts session with server: authenticates with password and negotiates
+ * max. packet size and frame format
+ *  @param cli NXTNET client descriptor
+ *  @param max Max. packet size the client accepts
+ *  @return Success? (fails if password is wrong)
+ *  @note Servers of protocol version 0 don't accept the signature and close
+ *        the connection, so current clients can't talk to them.
+ */
+static int nxtnet_cli_hello(nxtnet_cli_t *cli,size_t max) {
+  struct nxtnet_proto_hello_cs *hello_cs = (struct nxtnet_proto_hello_cs*)cli->buf->data;
+  struct nxtnet_cli_reply *reply;
+  struct nxtnet_proto_packet *packet;
+  size_t cs_size = sizeof(struct nxtnet_proto_packet)+sizeof(struct nxtnet_proto_hello_cs);
+  size_t max_size;
+
+  cli->buf->sig = NXTNET_PROTO_SIG;
+  cli->buf->cmd = NXTNET_PROTO_DIR_CS|NXTNET_PROTO_CMD_HELLO;
+  cli->buf->size = cs_size;
+  cli->buf->error = 0;
+  hello_cs->max_size = htonl(max);
+  memcpy(hello_cs->password,cli->password,NXTNET_PWD_LEN);
+  hello_cs->format = htonl(NXTNET_PROTO_FORMAT_COMPACT);
+
+  if (nxtnet_send(cli->sock,cli->format,cli->buf)!=cs_size) {
+    return -1;
+  }
+  reply = nxtnet_cli_wait_packet(cli,NXTNET_PROTO_DIR_SC|NXTNET_PROTO_CMD_HELLO,-1);
+  if (reply==NULL) {
+    return -1;
+  }
+  packet = (struct nxtnet_proto_packet*)reply->packet;
+  if (packet->error==NXTNET_ERROR_WROPWD) {
+    free(reply);
+    return -1;
+  }
+  else if (packet->error!=NXTNET_ERROR_NOERROR || packet->size<sizeof(struct nxtnet_proto_packet)+offsetof(struct nxtnet_proto_hello_sc,format)) {
+    free(reply);
+    return 0;
+  }
+
+  max_size = ntohl(((struct nxtnet_proto_hello_sc*)packet->data)->max_size);
+  // servers that don't know compact frames send no format
+  if (packet->size>=sizeof(struct nxtnet_proto_packet)+sizeof(struct nxtnet_proto_hello_sc)
+   && ntohl(((struct nxtnet_proto_hello_sc*)packet->data)->format)==NXTNET_PROTO_FORMAT_COMPACT) {
+    cli->format = NXTNET_PROTO_FORMAT_COMPACT;
+    nxtnet_rbuf_set_format(cli->rbuf,cli->format);
+  }
+  free(reply);
+  if (max_size>NXTNET_BUFSIZE) {
+    cli->max_size = max_size>max?max:max_size;
+    nxtnet_rbuf_set_max(cli->rbuf,cli->max_size);
+    if (cli->bufsize<cli->max_size) {
+      cli->buf = realloc(cli->buf,cli->max_size);
+      cli->bufsize = cli->max_size;
+    }
+  }
+
+  return 0;
+}
+
+/**
+ * Connects to UNIX domain socket of a local NXTNET server
+ *  @param port TCP port of server (selects path of socket)
+ *  @return Socket (-1 on failure)
+ *  @note The password is sent over the socket, so the server must run as
+ *        root, as the calling user or as owner of NXTNET_UNIX_DIR (if nobody
+ *        else can write there). Otherwise it could be any local user.
+ */
+static int nxtnet_cli_connect_unix(int port) {
+  struct sockaddr_un server;
+  struct ucred cred;
+  socklen_t len = sizeof(cred);
+  struct stat st;
+  int sock;
+
+  sock = socket(AF_UNIX,SOCK_STREAM,0);
+  if (sock==-1) return -1;
+
+  memset(&server,0,sizeof(server));
+  server.sun_family = AF_UNIX;
+  snprintf(server.sun_path,sizeof(server.sun_path),NXTNET_UNIX_PATH,port);
+  if (connect(sock,(struct sockaddr*)&server,sizeof(server))<0) {
+    close(sock);
+    return -1;
+  }
+
+  if (getsockopt(sock,SOL_SOCKET,SO_PEERCRED,&cred,&len)==-1
+   || (cred.uid!=0 && cred.uid!=getuid()
+    && (lstat(NXTNET_UNIX_DIR,&st)==-1 || !S_ISDIR(st.st_mode) || st.st_uid!=cred.uid || (st.st_mode&(S_IWGRP|S_IWOTH))!=0))) {
+    close(sock);
+    return -1;
+  }
+
+  return sock;
+}
+
+/**
+ * Connects to TCP socket of NXTNET server
  *  @param hostname Hostname of NXTNET server
  *  @param port TCP port
- *  @param password Server password (NULL for no password)
- *  @return NXTNET client descriptor
+ *  @return Socket (-1 on failure)
  */
-nxtnet_cli_t *nxtnet_cli_connect(const char *hostname,int port,const char *password) {
-  nxtnet_cli_t *cli;
+static int nxtnet_cli_connect_tcp(const char *hostname,int port) {
   struct hostent *hent;
   struct sockaddr_in server;
   int sock;
+  int on = 1;
 
   // create socket
   sock = socket(AF_INET,SOCK_STREAM,0);
-  if (sock==-1) return NULL;
+  if (sock==-1) return -1;
 
   // get hostname
   hent = gethostbyname(hostname);
   if (hent==NULL) {
     close(sock);
-    return NULL;
+    return -1;
   }
 
   // connect
@@ -58,97 +198,1364 @@ nxtnet_cli_t *nxtnet_cli_connect(const char *hostname,int port,const char *passw
   server.sin_port = htons(port);
   if (connect(sock,(struct sockaddr *)&server,sizeof(server))<0) {
     close(sock);
-    return NULL;
+    return -1;
   }
 
+  // requests are written at once; don't delay them
+  setsockopt(sock,IPPROTO_TCP,TCP_NODELAY,&on,sizeof(on));
+
+  return sock;
+}
+
+/**
+ * Opens socket to NXTNET server
+ *  @param hostname Hostname of NXTNET server
+ *  @param port TCP port
+ *  @return Socket (-1 on failure)
+ *  @note For "localhost" the server's UNIX domain socket is tried first
+ */
+static int nxtnet_cli_connect_sock(const char *hostname,int port) {
+  int sock = -1;
+
+  if (strcmp(hostname,"localhost")==0 || strcmp(hostname,"127.0.0.1")==0) {
+    sock = nxtnet_cli_connect_unix(port);
+  }
+  if (sock==-1) {
+    sock = nxtnet_cli_connect_tcp(hostname,port);
+  }
+  return sock;
+}
+
+/**
+ * Connects to NXTNET server
+ *  @param hostname Hostname of NXTNET server
+ *  @param port TCP port
+ *  @param password Server password (NULL for no password)
+ *  @return NXTNET client descriptor (NULL on failure or wrong password)
+ *  @note The password is checked and the max. packet size is negotiated
+ *        with the server on connect
+ *  @note For "localhost" the server's UNIX domain socket is tried first
+ */
+nxtnet_cli_t *nxtnet_cli_connect(const char *hostname,int port,const char *password) {
+  nxtnet_cli_t *cli;
+  int sock;
+
+  sock = nxtnet_cli_connect_sock(hostname,port);
+  if (sock==-1) return NULL;
+
   // Build client descriptor
   cli = malloc(sizeof(nxtnet_cli_t));
   memset(cli,0,sizeof(nxtnet_cli_t));
+  pthread_mutex_init(&cli->mutex,NULL);
+  pthread_cond_init(&cli->cond,NULL);
+  pthread_mutex_init(&cli->send_mutex,NULL);
+  pthread_mutex_init(&cli->request_mutex,NULL);
   cli->sock = sock;
+  cli->refs = 1;
   cli->buf = malloc(NXTNET_BUFSIZE);
+  cli->bufsize = NXTNET_BUFSIZE;
+  cli->max_size = NXTNET_BUFSIZE;
+  cli->format = NXTNET_PROTO_FORMAT_PLAIN;
+  cli->rbuf = nxtnet_rbuf_create(NXTNET_RBUFSIZE);
+  cli->hostname = strdup(hostname);
+  cli->port = port;
   if (password!=NULL) strncpy(cli->password,password,NXTNET_PWD_LEN);
 
+  if (nxtnet_cli_hello(cli,NXTNET_MAXSIZE)==-1) {
+    nxtnet_cli_disconnect(cli);
+    return NULL;
+  }
+
+  return cli;
+}
+
+/**
+ * Connects again to NXTNET server, if connection is broken
+ *  @param cli NXTNET client descriptor
+ *  @return Success?
+ *  @note Replies and samples of requests sent over the broken connection
+ *        never arrive, waiting for them fails. Subscriptions have to be made
+ *        again. NXTs keep their handles, unless they were removed meanwhile.
+ *  @note The send buffer isn't moved, so callers may keep pointers into it
+ */
+static int nxtnet_cli_reconnect(nxtnet_cli_t *cli) {
+  struct nxtnet_cli_reply *reply;
+  int sock,ret = 0;
+
+  pthread_mutex_lock(&cli->request_mutex);
+  pthread_mutex_lock(&cli->send_mutex);
+  pthread_mutex_lock(&cli->mutex);
+  if (cli->broken) {
+    // wake up a thread that is still receiving
+    shutdown(cli->sock,SHUT_RDWR);
+  }
+  while (cli->reading) {
+    pthread_cond_wait(&cli->cond,&cli->mutex);
+  }
+  if (!cli->broken) {
+    // another thread reconnected already
+    pthread_mutex_unlock(&cli->mutex);
+  }
+  else if ((sock = nxtnet_cli_connect_sock(cli->hostname,cli->port))==-1) {
+    pthread_mutex_unlock(&cli->mutex);
+    ret = -1;
+  }
+  else {
+    close(cli->sock);
+    cli->sock = sock;
+    nxtnet_rbuf_destroy(cli->rbuf);
+    cli->rbuf = nxtnet_rbuf_create(NXTNET_RBUFSIZE);
+    cli->max_size = NXTNET_BUFSIZE;
+    cli->format = NXTNET_PROTO_FORMAT_PLAIN;
+    while (cli->replies!=NULL) {
+      reply = cli->replies;
+      cli->replies = reply->next;
+      free(reply);
+    }
+    cli->first_id = cli->next_id;
+    cli->broken = 0;
+    pthread_mutex_unlock(&cli->mutex);
+
+    if (nxtnet_cli_hello(cli,cli->bufsize)==-1) {
+      pthread_mutex_lock(&cli->mutex);
+      cli->broken = 1;
+      pthread_mutex_unlock(&cli->mutex);
+      ret = -1;
+    }
+  }
+  pthread_mutex_unlock(&cli->send_mutex);
+  pthread_mutex_unlock(&cli->request_mutex);
+
+  return ret;
+}
+
+/**
+ * Makes sure a request can be sent
+ *  @param cli NXTNET client descriptor
+ *  @return Success? (fails if connection is broken and can't be made again)
+ *  @note Must be called before any mutex of the client is locked
+ */
+static int nxtnet_cli_check(nxtnet_cli_t *cli) {
+  int broken;
+
+  if (cli->ops!=NULL) {
+    return 0;
+  }
+  pthread_mutex_lock(&cli->mutex);
+  broken = cli->broken;
+  pthread_mutex_unlock(&cli->mutex);
+  return broken?nxtnet_cli_reconnect(cli):0;
+}
+
+/**
+ * Connects to NXTNET server or reuses a connection to it. NXTs opened through
+ * the same connection are distinguished by their handle.
+ *  @param hostname Hostname of server
+ *  @param port TCP port
+ *  @param password Server password (NULL for no password)
+ *  @return NXTNET client descriptor (release it with nxtnet_cli_disconnect())
+ *  @note The connection is shared by all threads of the process. If it
+ *        breaks, the next request connects again for all its users.
+ */
+nxtnet_cli_t *nxtnet_cli_connect_shared(const char *hostname,int port,const char *password) {
+  char pwd[NXTNET_PWD_LEN];
+  nxtnet_cli_t *cli;
+
+  memset(pwd,0,NXTNET_PWD_LEN);
+  if (password!=NULL) strncpy(pwd,password,NXTNET_PWD_LEN);
+
+  pthread_mutex_lock(&shared_mutex);
+  for (cli=shared_first;cli!=NULL;cli=cli->next) {
+    if (cli->port==port
+     && strcmp(cli->hostname,hostname)==0 && memcmp(cli->password,pwd,NXTNET_PWD_LEN)==0) {
+      cli->refs++;
+      pthread_mutex_unlock(&shared_mutex);
+      return cli;
+    }
+  }
+  pthread_mutex_unlock(&shared_mutex);
+
+  cli = nxtnet_cli_connect(hostname,port,password);
+  if (cli!=NULL) {
+    pthread_mutex_lock(&shared_mutex);
+    cli->next = shared_first;
+    shared_first = cli;
+    pthread_mutex_unlock(&shared_mutex);
+  }
+
   return cli;
 }
 
+/**
+ * Opens an in-process client. Instead of sending requests to a server, the
+ * server operations are called directly.
+ *  @param ops Server operations (e.g. of nxtd linked into the program)
+ *  @return NXTNET client descriptor
+ *  @note Subscriptions need 'subscribe' and 'unsubscribe', all other
+ *        operations need at least 'send' and 'recv'.
+ */
+nxtnet_cli_t *nxtnet_cli_open_local(const struct nxtnet_srv_ops *ops) {
+  nxtnet_cli_t *cli;
+
+  cli = malloc(sizeof(nxtnet_cli_t));
+  memset(cli,0,sizeof(nxtnet_cli_t));
+  pthread_mutex_init(&cli->mutex,NULL);
+  pthread_cond_init(&cli->cond,NULL);
+  pthread_mutex_init(&cli->send_mutex,NULL);
+  pthread_mutex_init(&cli->request_mutex,NULL);
+  cli->sock = -1;
+  cli->refs = 1;
+  cli->ops = ops;
+  cli->buf = malloc(NXTNET_BUFSIZE);
+  cli->bufsize = NXTNET_BUFSIZE;
+  cli->max_size = NXTNET_MAXSIZE;
+
+  return cli;
+}
+
+/**
+ * Executes a transaction of an in-process client
+ *  @param cli NXTNET client descriptor
+ *  @param handle NXT handle
+ *  @param sbuf Data to send
+ *  @param ssize How many bytes to send
+ *  @param rbuf Buffer for received data
+ *  @param rsize How many bytes to receive (0 for none)
+ *  @return How many bytes received (-1 on failure)
+ */
+static ssize_t nxtnet_cli_local_transact(nxtnet_cli_t *cli,int handle,const void *sbuf,size_t ssize,void *rbuf,size_t rsize) {
+  if (cli->ops->transact!=NULL) {
+    return cli->ops->transact(handle,sbuf,ssize,rbuf,rsize);
+  }
+  else if (cli->ops->send==NULL || cli->ops->recv==NULL || cli->ops->send(handle,sbuf,ssize)!=ssize) {
+    return -1;
+  }
+  else {
+    return rsize>0?cli->ops->recv(handle,rbuf,rsize):0;
+  }
+}
+
+/**
+ * Queues a reply for an in-process client
+ *  @param cli NXTNET client descriptor
+ *  @param reply Reply (ownership is taken)
+ *  @note Like the server, samples are dropped if the client doesn't receive
+ *        them fast enough.
+ */
+static void nxtnet_cli_local_queue(nxtnet_cli_t *cli,struct nxtnet_cli_reply *reply) {
+  struct nxtnet_cli_reply **prev;
+  size_t num = 0;
+
+  pthread_mutex_lock(&cli->mutex);
+  for (prev=&cli->replies;*prev!=NULL;prev=&(*prev)->next) {
+    num++;
+  }
+  if (num>=NXTNET_SRV_MAXQUEUE && ((struct nxtnet_proto_packet*)reply->packet)->cmd==(NXTNET_PROTO_DIR_SC|NXTNET_PROTO_CMD_SAMPLE)) {
+    free(reply);
+  }
+  else {
+    reply->next = NULL;
+    *prev = reply;
+    pthread_cond_broadcast(&cli->cond);
+  }
+  pthread_mutex_unlock(&cli->mutex);
+}
+
+/**
+ * Allocates a reply for an in-process client
+ *  @param cmd Command byte
+ *  @param size Size of packet
+ *  @return Reply (header in host byte order)
+ */
+static struct nxtnet_cli_reply *nxtnet_cli_local_reply(int cmd,size_t size) {
+  struct nxtnet_cli_reply *reply = malloc(sizeof(struct nxtnet_cli_reply)+size);
+  struct nxtnet_proto_packet *packet = (struct nxtnet_proto_packet*)reply->packet;
+
+  memset(packet,0,sizeof(struct nxtnet_proto_packet));
+  packet->sig = NXTNET_PROTO_SIG;
+  packet->cmd = cmd;
+  packet->size = size;
+  packet->error = NXTNET_ERROR_NOERROR;
+
+  return reply;
+}
+
+/**
+ * Receives the results of a subscription of an in-process client
+ *  @param ctx Subscription
+ *  @param time Time of sample
+ *  @param items Transactions with results
+ *  @param num_items Number of transactions
+ *  @note Called by the sampler of the server operations. The results are
+ *        queued as SAMPLE packet, so nxtnet_cli_sample() works as usual.
+ */
+static void nxtnet_cli_local_sample(void *ctx,const struct timespec *time,const struct nxtnet_batch_item *items,size_t num_items) {
+  struct nxtnet_cli_sub *sub = (struct nxtnet_cli_sub*)ctx;
+  struct nxtnet_cli_reply *reply;
+  struct nxtnet_proto_sample_sc *sample_sc;
+  size_t size = sizeof(struct nxtnet_proto_packet)+sizeof(struct nxtnet_proto_sample_sc);
+  size_t i;
+  char *ptr;
+
+  for (i=0;i<num_items;i++) {
+    size += sizeof(struct nxtnet_proto_batch_item_sc)+items[i].recv_size;
+  }
+  reply = nxtnet_cli_local_reply(NXTNET_PROTO_DIR_SC|NXTNET_PROTO_CMD_SAMPLE,size);
+
+  sample_sc = (struct nxtnet_proto_sample_sc*)((struct nxtnet_proto_packet*)reply->packet)->data;
+  sample_sc->id = htonl(sub->id);
+  sample_sc->handle = 0;
+  sample_sc->time_sec = htonl(time->tv_sec);
+  sample_sc->time_usec = htonl(time->tv_nsec/1000);
+  sample_sc->num_items = htonl(num_items);
+  for (i=0,ptr=sample_sc->items;i<num_items;i++) {
+    struct nxtnet_proto_batch_item_sc *item_sc = (struct nxtnet_proto_batch_item_sc*)ptr;
+
+    item_sc->size = htons(items[i].ret);
+    if (items[i].ret>0) {
+      memcpy(item_sc->data,items[i].recv_buf,items[i].ret);
+    }
+    ptr += sizeof(struct nxtnet_proto_batch_item_sc)+items[i].recv_size;
+  }
+
+  nxtnet_cli_local_queue(sub->cli,reply);
+}
+
+/**
+ * Waits for a reply of an in-process client
+ *  @param cli NXTNET client descriptor
+ *  @param cmd Command byte of reply
+ *  @param id Request ID
+ *  @return Reply (free it with free(); NULL on failure)
+ *  @note Only samples arrive later; other replies are queued by the request
+ */
+static struct nxtnet_cli_reply *nxtnet_cli_local_wait_packet(nxtnet_cli_t *cli,int cmd,int id) {
+  struct nxtnet_cli_reply **prev,*reply = NULL;
+  struct nxtnet_proto_packet *packet;
+  struct nxtnet_cli_sub *sub;
+
+  pthread_mutex_lock(&cli->mutex);
+  while (reply==NULL) {
+    for (prev=&cli->replies;*prev!=NULL;prev=&(*prev)->next) {
+      packet = (struct nxtnet_proto_packet*)(*prev)->packet;
+      if (packet->cmd==cmd && ntohl(*(uint32_t*)packet->data)==id) {
+        reply = *prev;
+        *prev = reply->next;
+        break;
+      }
+    }
+    if (reply==NULL) {
+      // wait for samples as long as the subscription exists
+      for (sub=cli->subs;sub!=NULL && sub->id!=id;sub=sub->next);
+      if (cmd!=(NXTNET_PROTO_DIR_SC|NXTNET_PROTO_CMD_SAMPLE) || sub==NULL) {
+        break;
+      }
+      pthread_cond_wait(&cli->cond,&cli->mutex);
+    }
+  }
+  pthread_mutex_unlock(&cli->mutex);
+
+  return reply;
+}
+
+static void nxtnet_cli_local_packer(int handle,char *name,void *id,int is_bt) {
+  struct nxtnet_proto_list_nxts *item;
+
+  packer_list = realloc(packer_list,sizeof(struct nxtnet_proto_list_sc)+(packer_num+1)*sizeof(struct nxtnet_proto_list_nxts));
+  item = packer_list->nxts+packer_num++;
+  memset(item,0,sizeof(struct nxtnet_proto_list_nxts));
+  item->handle = handle;
+  strncpy(item->name,name,NXTNET_NXTNAME_LEN);
+  memcpy(item->id,id,6);
+  item->is_bt = is_bt;
+}
+
+/**
+ * Receives the reply packet of a request without request ID
+ *  @param cli NXTNET client descriptor
+ *  @param cmd Command byte to check for
+ *  @return Reply (free it with free(); NULL on failure)
+ *  @note Requests without ID must be serialized with request_mutex
+ */
+static struct nxtnet_cli_reply *nxtnet_cli_recv_packet(nxtnet_cli_t *cli,int cmd) {
+  return nxtnet_cli_wait_packet(cli,cmd,-1);
+}
+
 /**
  * Lists all NXTs
+ *  @param cli NXTNET client descriptor
+ *  @return List of NXTs (free it with free(); NULL on failure)
+ *  @note Lists split into several packets by the server are joined
  */
 struct nxtnet_proto_list_sc *nxtnet_cli_list(nxtnet_cli_t *cli) {
+  struct nxtnet_proto_list_sc *list = NULL;
+  struct nxtnet_cli_reply *reply;
+  struct nxtnet_proto_packet *packet;
+  size_t i,num_items = 0;
+  int more,failed = 0;
+
+  if (nxtnet_cli_check(cli)==-1) {
+    return NULL;
+  }
+
+  if (cli->ops!=NULL) {
+    if (cli->ops->list==NULL) {
+      return NULL;
+    }
+    pthread_mutex_lock(&packer_mutex);
+    packer_list = malloc(sizeof(struct nxtnet_proto_list_sc));
+    packer_num = 0;
+    cli->ops->list(nxtnet_cli_local_packer);
+    list = packer_list;
+    list->num_items = packer_num;
+    pthread_mutex_unlock(&packer_mutex);
+    return list;
+  }
+
+  pthread_mutex_lock(&cli->request_mutex);
+  pthread_mutex_lock(&cli->send_mutex);
   cli->buf->sig = NXTNET_PROTO_SIG;
   cli->buf->cmd = NXTNET_PROTO_DIR_CS|NXTNET_PROTO_CMD_LIST;
   cli->buf->size = sizeof(struct nxtnet_proto_packet);
   cli->buf->error = 0;
-  strcpy(cli->buf->password,cli->password);
-  nxtnet_send(cli->sock,cli->buf);
-  if (nxtnet_recv(cli->sock,cli->buf,NXTNET_PROTO_DIR_SC|NXTNET_PROTO_CMD_LIST)!=NULL) {
-    struct nxtnet_proto_list_sc *list = (struct nxtnet_proto_list_sc*)cli->buf->data;
-    size_t i;
+  nxtnet_send(cli->sock,cli->format,cli->buf);
+  pthread_mutex_unlock(&cli->send_mutex);
+
+  do {
+    struct nxtnet_proto_list_sc *part;
+    size_t n;
 
-    // convert all multibyte values to host byte order
-    list->num_items = ntohl(list->num_items);
-    for (i=0;i<list->num_items;i++) {
-      list->nxts[i].handle = ntohl(list->nxts[i].handle);
+    reply = nxtnet_cli_recv_packet(cli,NXTNET_PROTO_DIR_SC|NXTNET_PROTO_CMD_LIST);
+    if (reply==NULL) {
+      failed = 1;
+      break;
+    }
+    packet = (struct nxtnet_proto_packet*)reply->packet;
+    part = (struct nxtnet_proto_list_sc*)packet->data;
+    n = packet->size>=sizeof(struct nxtnet_proto_packet)+sizeof(struct nxtnet_proto_list_sc)?ntohl(part->num_items):0;
+    if (packet->error!=NXTNET_ERROR_NOERROR || packet->size<sizeof(struct nxtnet_proto_packet)+sizeof(struct nxtnet_proto_list_sc)
+     || sizeof(struct nxtnet_proto_packet)+sizeof(struct nxtnet_proto_list_sc)+n*sizeof(struct nxtnet_proto_list_nxts)>packet->size) {
+      free(reply);
+      failed = 1;
+      break;
     }
 
-    return list;
+    list = realloc(list,sizeof(struct nxtnet_proto_list_sc)+(num_items+n)*sizeof(struct nxtnet_proto_list_nxts));
+    memcpy(list->nxts+num_items,part->nxts,n*sizeof(struct nxtnet_proto_list_nxts));
+    num_items += n;
+    more = packet->cmd&NXTNET_PROTO_FLAG_MORE;
+    free(reply);
+  } while (more);
+  pthread_mutex_unlock(&cli->request_mutex);
+
+  if (failed) {
+    free(list);
+    return NULL;
+  }
+
+  // convert all multibyte values to host byte order
+  list->num_items = num_items;
+  for (i=0;i<num_items;i++) {
+    list->nxts[i].handle = ntohl(list->nxts[i].handle);
+  }
+
+  return list;
+}
+
+/**
+ * Gets server statistics
+ *  @param cli NXTNET client descriptor
+ *  @return Statistics as NUL-terminated text (free it with free(); NULL on
+ *          failure or if server has no statistics)
+ */
+char *nxtnet_cli_stats(nxtnet_cli_t *cli) {
+  struct nxtnet_cli_reply *reply;
+  struct nxtnet_proto_packet *packet;
+  char *text = NULL;
+  size_t size = 0,n;
+  int more,failed = 0;
+  FILE *out;
+
+  if (nxtnet_cli_check(cli)==-1) {
+    return NULL;
+  }
+
+  if (cli->ops!=NULL) {
+    if (cli->ops->stats==NULL || (out = open_memstream(&text,&size))==NULL) {
+      return NULL;
+    }
+    cli->ops->stats(out);
+    fclose(out);
+    return text;
+  }
+
+  pthread_mutex_lock(&cli->request_mutex);
+  pthread_mutex_lock(&cli->send_mutex);
+  cli->buf->sig = NXTNET_PROTO_SIG;
+  cli->buf->cmd = NXTNET_PROTO_DIR_CS|NXTNET_PROTO_CMD_STATS;
+  cli->buf->size = sizeof(struct nxtnet_proto_packet);
+  cli->buf->error = 0;
+  nxtnet_send(cli->sock,cli->format,cli->buf);
+  pthread_mutex_unlock(&cli->send_mutex);
+
+  do {
+    reply = nxtnet_cli_recv_packet(cli,NXTNET_PROTO_DIR_SC|NXTNET_PROTO_CMD_STATS);
+    if (reply==NULL) {
+      failed = 1;
+      break;
+    }
+    packet = (struct nxtnet_proto_packet*)reply->packet;
+    if (packet->error!=NXTNET_ERROR_NOERROR || packet->size<sizeof(struct nxtnet_proto_packet)) {
+      free(reply);
+      failed = 1;
+      break;
+    }
+
+    n = packet->size-sizeof(struct nxtnet_proto_packet);
+    text = realloc(text,size+n+1);
+    memcpy(text+size,packet->data,n);
+    size += n;
+    text[size] = 0;
+    more = packet->cmd&NXTNET_PROTO_FLAG_MORE;
+    free(reply);
+  } while (more);
+  pthread_mutex_unlock(&cli->request_mutex);
+
+  if (failed) {
+    free(text);
+    return NULL;
   }
-  else return NULL;
+  return text;
 }
 
 ssize_t nxtnet_cli_send(nxtnet_cli_t *cli,int handle,const void *buf,size_t size) {
   struct nxtnet_proto_send_cs *send_cs = (struct nxtnet_proto_send_cs*)cli->buf->data;
+  struct nxtnet_cli_reply *reply;
+  ssize_t ret = -1;
+
+  if (nxtnet_cli_check(cli)==-1) {
+    return -1;
+  }
 
+  if (cli->ops!=NULL) {
+    return cli->ops->send!=NULL?cli->ops->send(handle,buf,size):-1;
+  }
+  if (sizeof(struct nxtnet_proto_packet)+sizeof(struct nxtnet_proto_send_cs)+size>cli->max_size) {
+    return -1;
+  }
+
+  pthread_mutex_lock(&cli->request_mutex);
+  pthread_mutex_lock(&cli->send_mutex);
   cli->buf->sig = NXTNET_PROTO_SIG;
   cli->buf->cmd = NXTNET_PROTO_DIR_CS|NXTNET_PROTO_CMD_SEND;
   cli->buf->size = sizeof(struct nxtnet_proto_packet)+sizeof(struct nxtnet_proto_send_cs)+size;
   cli->buf->error = 0;
-  strcpy(cli->buf->password,cli->password);
 
   send_cs->handle = htonl(handle);
   send_cs->size = htonl(size);
-  memcpy(send_cs->data,buf,size);
 
-  nxtnet_send(cli->sock,cli->buf);
+  nxtnet_send_iov(cli->sock,cli->format,cli->buf,sizeof(struct nxtnet_proto_packet)+sizeof(struct nxtnet_proto_send_cs),buf,size);
+  pthread_mutex_unlock(&cli->send_mutex);
+
+  if ((reply = nxtnet_cli_recv_packet(cli,NXTNET_PROTO_DIR_SC|NXTNET_PROTO_CMD_SEND))!=NULL) {
+    struct nxtnet_proto_send_sc *send_sc = (struct nxtnet_proto_send_sc*)((struct nxtnet_proto_packet*)reply->packet)->data;
+    ret = ntohl(send_sc->size);
+    free(reply);
+  }
+  pthread_mutex_unlock(&cli->request_mutex);
+
+  return ret;
+}
+
+/**
+ * Gets how many bytes of data a reply holds
+ *  @param packet Reply packet
+ *  @param head_size Size of packet header and reply structure
+ *  @param size Size field of reply structure (may be unaligned)
+ *  @return Size of data (-1 on failure or if reply doesn't hold that much data)
+ *  @note A reply that is shorter than it claims is treated like one the server
+ *        failed with NXTNET_ERROR_INVAL.
+ */
+static ssize_t nxtnet_cli_data_size(struct nxtnet_proto_packet *packet,size_t head_size,const void *size) {
+  uint32_t size_be;
+  ssize_t ret;
 
-  if (nxtnet_recv(cli->sock,cli->buf,NXTNET_PROTO_DIR_SC|NXTNET_PROTO_CMD_SEND)!=NULL) {
-    struct nxtnet_proto_send_sc *send_sc = (struct nxtnet_proto_send_sc*)cli->buf->data;
-    return ntohl(send_sc->size);
+  if (packet->error!=NXTNET_ERROR_NOERROR) {
+    return -1;
+  }
+  if (packet->size<head_size) {
+    packet->error = NXTNET_ERROR_INVAL;
+    return -1;
   }
-  else return -1;
+  memcpy(&size_be,size,sizeof(size_be));
+  ret = (int32_t)ntohl(size_be);
+  if (ret>(ssize_t)(packet->size-head_size)) {
+    packet->error = NXTNET_ERROR_INVAL;
+    return -1;
+  }
+  return ret;
 }
 
 ssize_t nxtnet_cli_recv(nxtnet_cli_t *cli,int handle,void *buf,size_t size) {
   struct nxtnet_proto_recv_cs *recv_cs = (struct nxtnet_proto_recv_cs*)cli->buf->data;
+  struct nxtnet_cli_reply *reply;
+  ssize_t ret = -1;
+
+  if (nxtnet_cli_check(cli)==-1) {
+    return -1;
+  }
 
+  if (cli->ops!=NULL) {
+    return cli->ops->recv!=NULL?cli->ops->recv(handle,buf,size):-1;
+  }
+  if (sizeof(struct nxtnet_proto_packet)+sizeof(struct nxtnet_proto_recv_sc)+size>cli->max_size) {
+    return -1;
+  }
+
+  pthread_mutex_lock(&cli->request_mutex);
+  pthread_mutex_lock(&cli->send_mutex);
   cli->buf->sig = NXTNET_PROTO_SIG;
   cli->buf->cmd = NXTNET_PROTO_DIR_CS|NXTNET_PROTO_CMD_RECV;
   cli->buf->size = sizeof(struct nxtnet_proto_packet)+sizeof(struct nxtnet_proto_recv_cs);
   cli->buf->error = 0;
-  strcpy(cli->buf->password,cli->password);
 
   recv_cs->handle = htonl(handle);
   recv_cs->size = htonl(size);
 
-  nxtnet_send(cli->sock,cli->buf);
-  if (nxtnet_recv(cli->sock,cli->buf,NXTNET_PROTO_DIR_SC|NXTNET_PROTO_CMD_SEND)!=NULL) {
-    struct nxtnet_proto_recv_sc *recv_sc = (struct nxtnet_proto_recv_sc*)cli->buf->data;
-    ssize_t size = ntohl(recv_sc->size);
+  nxtnet_send(cli->sock,cli->format,cli->buf);
+  pthread_mutex_unlock(&cli->send_mutex);
+
+  if ((reply = nxtnet_cli_recv_packet(cli,NXTNET_PROTO_DIR_SC|NXTNET_PROTO_CMD_SEND))!=NULL) {
+    struct nxtnet_proto_packet *packet = (struct nxtnet_proto_packet*)reply->packet;
+    struct nxtnet_proto_recv_sc *recv_sc = (struct nxtnet_proto_recv_sc*)packet->data;
+
+    ret = nxtnet_cli_data_size(packet,sizeof(struct nxtnet_proto_packet)+sizeof(struct nxtnet_proto_recv_sc),&recv_sc->size);
+    if (ret>0) {
+      memcpy(buf,recv_sc->data,ret<size?ret:size);
+    }
+    free(reply);
+  }
+  pthread_mutex_unlock(&cli->request_mutex);
+
+  return ret;
+}
+
+/**
+ * Submits a transaction (send data and receive reply) without waiting for it
+ *  @param cli NXTNET client descriptor
+ *  @param handle NXT handle
+ *  @param buf Data to send
+ *  @param size How many bytes to send
+ *  @param recv_size How many bytes to receive afterwards (0 for none)
+ *  @return Request ID to pass to nxtnet_cli_wait() (-1 on failure)
+ *  @note Several transactions can be in flight at the same time
+ */
+int nxtnet_cli_submit(nxtnet_cli_t *cli,int handle,const void *buf,size_t size,size_t recv_size) {
+  struct nxtnet_proto_transact_cs *transact_cs = (struct nxtnet_proto_transact_cs*)cli->buf->data;
+  size_t packet_size = sizeof(struct nxtnet_proto_packet)+sizeof(struct nxtnet_proto_transact_cs)+size;
+  int id;
+
+  if (nxtnet_cli_check(cli)==-1) {
+    return -1;
+  }
+
+  if (packet_size>cli->max_size || sizeof(struct nxtnet_proto_packet)+sizeof(struct nxtnet_proto_transact_sc)+recv_size>cli->max_size) {
+    return -1;
+  }
+
+  pthread_mutex_lock(&cli->send_mutex);
+  id = cli->next_id;
+  cli->next_id = (cli->next_id+1)&0x7FFFFFFF;
+
+  if (cli->ops!=NULL) {
+    // execute transaction now and queue its reply
+    pthread_mutex_unlock(&cli->send_mutex);
+    struct nxtnet_cli_reply *reply = nxtnet_cli_local_reply(NXTNET_PROTO_DIR_SC|NXTNET_PROTO_CMD_TRANSACT,sizeof(struct nxtnet_proto_packet)+sizeof(struct nxtnet_proto_transact_sc)+recv_size);
+    struct nxtnet_proto_transact_sc *transact_sc = (struct nxtnet_proto_transact_sc*)((struct nxtnet_proto_packet*)reply->packet)->data;
+    ssize_t ret = nxtnet_cli_local_transact(cli,handle,buf,size,transact_sc->data,recv_size);
+
+    transact_sc->id = htonl(id);
+    transact_sc->handle = htonl(handle);
+    transact_sc->size = htonl(ret);
+    nxtnet_cli_local_queue(cli,reply);
+    return id;
+  }
+
+  cli->buf->sig = NXTNET_PROTO_SIG;
+  cli->buf->cmd = NXTNET_PROTO_DIR_CS|NXTNET_PROTO_CMD_TRANSACT;
+  cli->buf->size = packet_size;
+  cli->buf->error = 0;
+
+  transact_cs->id = htonl(id);
+  transact_cs->handle = htonl(handle);
+  transact_cs->recv_size = htonl(recv_size);
+  transact_cs->send_size = htonl(size);
+
+  if (nxtnet_send_iov(cli->sock,cli->format,cli->buf,sizeof(struct nxtnet_proto_packet)+sizeof(struct nxtnet_proto_transact_cs),buf,size)!=packet_size) {
+    cli->broken = 1;
+    id = -1;
+  }
+  pthread_mutex_unlock(&cli->send_mutex);
+
+  return id;
+}
+
+/**
+ * Keeps a reply until it is waited for
+ *  @param cli NXTNET client descriptor
+ *  @param packet Packet (copied)
+ *  @note cli->mutex must be locked
+ *  @note Like for in-process clients, samples are dropped if the client
+ *        doesn't receive them fast enough.
+ */
+static void nxtnet_cli_keep(nxtnet_cli_t *cli,const struct nxtnet_proto_packet *packet) {
+  struct nxtnet_cli_reply **prev,*reply;
+  size_t num = 0;
+
+  // keep replies in order of arrival
+  for (prev=&cli->replies;*prev!=NULL;prev=&(*prev)->next) {
+    num++;
+  }
+  if (num>=NXTNET_SRV_MAXQUEUE && packet->cmd==(NXTNET_PROTO_DIR_SC|NXTNET_PROTO_CMD_SAMPLE)) {
+    return;
+  }
+  reply = malloc(sizeof(struct nxtnet_cli_reply)+packet->size);
+  if (reply==NULL) {
+    // a waiting request would never get its reply
+    cli->broken = 1;
+    return;
+  }
+  memcpy(reply->packet,packet,packet->size);
+  reply->next = NULL;
+  *prev = reply;
+}
+
+/**
+ * Takes a kept reply
+ *  @param cli NXTNET client descriptor
+ *  @param cmd Command byte of reply (NXTNET_PROTO_FLAG_MORE is ignored)
+ *  @param id Request ID (-1 for requests without ID)
+ *  @return Reply (NULL if it didn't arrive yet)
+ *  @note cli->mutex must be locked
+ */
+static struct nxtnet_cli_reply *nxtnet_cli_take(nxtnet_cli_t *cli,int cmd,int id) {
+  struct nxtnet_cli_reply **prev,*reply;
+  struct nxtnet_proto_packet *packet;
+
+  for (prev=&cli->replies;*prev!=NULL;prev=&(*prev)->next) {
+    reply = *prev;
+    packet = (struct nxtnet_proto_packet*)reply->packet;
+    // error replies without request ID go to any request of that command
+    if ((packet->cmd&~NXTNET_PROTO_FLAG_MORE)==cmd && (id==-1 || packet->size<sizeof(struct nxtnet_proto_packet)+sizeof(uint32_t) || ntohl(*(uint32_t*)packet->data)==id)) {
+      *prev = reply->next;
+      return reply;
+    }
+  }
+
+  return NULL;
+}
+
+/**
+ * Receives the reply packet of a request
+ *  @param cli NXTNET client descriptor
+ *  @param cmd Command byte of reply (NXTNET_PROTO_FLAG_MORE is ignored)
+ *  @param id Request ID (-1 for requests without ID)
+ *  @return Reply (free it with free(); NULL on failure)
+ *  @note One waiting thread at a time receives from the socket and keeps the
+ *        replies for the others, which wait until theirs arrived.
+ */
+static struct nxtnet_cli_reply *nxtnet_cli_wait_packet(nxtnet_cli_t *cli,int cmd,int id) {
+  struct nxtnet_cli_reply *reply;
+  struct nxtnet_proto_packet *packet;
+
+  if (cli->ops!=NULL) {
+    return nxtnet_cli_local_wait_packet(cli,cmd,id);
+  }
+
+  pthread_mutex_lock(&cli->mutex);
+  while ((reply = nxtnet_cli_take(cli,cmd,id))==NULL && !cli->broken && nxtnet_cli_current(cli,id)) {
+    if (cli->reading) {
+      pthread_cond_wait(&cli->cond,&cli->mutex);
+    }
+    else {
+      // receive next reply for whoever waits for it
+      cli->reading = 1;
+      pthread_mutex_unlock(&cli->mutex);
+      packet = nxtnet_recv_buffered(cli->sock,cli->rbuf,&cli->rpacket,&cli->rpacketsize);
+      pthread_mutex_lock(&cli->mutex);
+      cli->reading = 0;
+      if (packet==NULL) {
+        cli->broken = 1;
+      }
+      else {
+        nxtnet_cli_keep(cli,packet);
+      }
+      pthread_cond_broadcast(&cli->cond);
+    }
+  }
+  pthread_mutex_unlock(&cli->mutex);
+
+  return reply;
+}
+
+/**
+ * Receives replies that already arrived, without blocking
+ *  @param cli NXTNET client descriptor
+ *  @return Success? (fails if connection is broken)
+ *  @note Use nxtnet_cli_ready() to check which transactions are complete
+ *        afterwards. Replies of an in-process client are queued by the
+ *        request itself, so nothing has to be received for it. If another
+ *        thread is receiving, it keeps the replies and nothing is done.
+ */
+int nxtnet_cli_poll(nxtnet_cli_t *cli) {
+  struct pollfd pfd;
+  int ret;
+
+  if (cli->ops!=NULL) {
+    return 0;
+  }
+
+  pthread_mutex_lock(&cli->mutex);
+  if (cli->reading || cli->broken) {
+    ret = cli->broken?-1:0;
+    pthread_mutex_unlock(&cli->mutex);
+    return ret;
+  }
+  cli->reading = 1;
+  pthread_mutex_unlock(&cli->mutex);
+
+  pfd.fd = cli->sock;
+  pfd.events = POLLIN;
+  do {
+    // keep all complete packets (error replies without request ID, too;
+    // nxtnet_cli_take() gives them to a request of that command)
+    while ((ret = nxtnet_rbuf_get(cli->rbuf,&cli->rpacket,&cli->rpacketsize))==1) {
+      pthread_mutex_lock(&cli->mutex);
+      nxtnet_cli_keep(cli,cli->rpacket);
+      pthread_mutex_unlock(&cli->mutex);
+    }
+    if (ret==-1) {
+      break;
+    }
+
+    do ret = poll(&pfd,1,0);
+    while (ret==-1 && errno==EINTR);
+    if (ret>0 && nxtnet_rbuf_read(cli->rbuf,cli->sock)<=0) {
+      ret = -1;
+    }
+  } while (ret>0);
+
+  pthread_mutex_lock(&cli->mutex);
+  cli->reading = 0;
+  if (ret==-1) {
+    cli->broken = 1;
+  }
+  pthread_cond_broadcast(&cli->cond);
+  pthread_mutex_unlock(&cli->mutex);
+
+  return ret==-1?-1:0;
+}
+
+/**
+ * Checks if the reply of a submitted transaction arrived
+ *  @param cli NXTNET client descriptor
+ *  @param id Request ID returned by nxtnet_cli_submit()
+ *  @return If reply arrived (nxtnet_cli_wait() won't block then)
+ *  @note Only replies received by nxtnet_cli_poll() or while waiting for
+ *        other requests are seen
+ */
+int nxtnet_cli_ready(nxtnet_cli_t *cli,int id) {
+  struct nxtnet_cli_reply *reply;
+  struct nxtnet_proto_packet *packet;
+  int ready = 0;
+
+  pthread_mutex_lock(&cli->mutex);
+  for (reply=cli->replies;reply!=NULL && !ready;reply=reply->next) {
+    packet = (struct nxtnet_proto_packet*)reply->packet;
+    ready = (packet->cmd&~NXTNET_PROTO_FLAG_MORE)==(NXTNET_PROTO_DIR_SC|NXTNET_PROTO_CMD_TRANSACT)
+         && (packet->size<sizeof(struct nxtnet_proto_packet)+sizeof(uint32_t) || ntohl(*(uint32_t*)packet->data)==id);
+  }
+  pthread_mutex_unlock(&cli->mutex);
+
+  return ready;
+}
+
+/**
+ * Waits for the reply of a submitted transaction
+ *  @param cli NXTNET client descriptor
+ *  @param id Request ID returned by nxtnet_cli_submit()
+ *  @param buf Buffer for received data
+ *  @param size Size of buffer
+ *  @return How many bytes received (-1 on failure)
+ *  @note Replies for other requests that arrive meanwhile are kept until they
+ *        are waited for.
+ */
+ssize_t nxtnet_cli_wait(nxtnet_cli_t *cli,int id,void *buf,size_t size) {
+  struct nxtnet_cli_reply *reply = nxtnet_cli_wait_packet(cli,NXTNET_PROTO_DIR_SC|NXTNET_PROTO_CMD_TRANSACT,id);
+  struct nxtnet_proto_packet *packet;
+  struct nxtnet_proto_transact_sc *transact_sc;
+  ssize_t ret = -1;
+
+  if (reply==NULL) {
+    return -1;
+  }
+
+  packet = (struct nxtnet_proto_packet*)reply->packet;
+  transact_sc = (struct nxtnet_proto_transact_sc*)packet->data;
+  ret = nxtnet_cli_data_size(packet,sizeof(struct nxtnet_proto_packet)+sizeof(struct nxtnet_proto_transact_sc),&transact_sc->size);
+  if (ret>0) {
+    memcpy(buf,transact_sc->data,ret<size?ret:size);
+  }
+  free(reply);
+  return ret;
+}
+
+/**
+ * Sends data to NXT and receives its reply in one round trip
+ *  @param cli NXTNET client descriptor
+ *  @param handle NXT handle
+ *  @param sbuf Data to send
+ *  @param ssize How many bytes to send
+ *  @param rbuf Buffer for received data
+ *  @param rsize How many bytes to receive
+ *  @return How many bytes received (-1 on failure)
+ */
+ssize_t nxtnet_cli_transact(nxtnet_cli_t *cli,int handle,const void *sbuf,size_t ssize,void *rbuf,size_t rsize) {
+  int id;
+
+  if (cli->ops!=NULL) {
+    return nxtnet_cli_local_transact(cli,handle,sbuf,ssize,rbuf,rsize);
+  }
+
+  id = nxtnet_cli_submit(cli,handle,sbuf,ssize,rsize);
+  if (id==-1) {
+    return -1;
+  }
+  else {
+    return nxtnet_cli_wait(cli,id,rbuf,rsize);
+  }
+}
+
+/**
+ * Packs telegrams of a batch or subscription
+ *  @param ptr Where to pack telegrams
+ *  @param items Telegrams
+ *  @param num_items Number of telegrams
+ *  @return Size of packed telegrams
+ */
+static size_t nxtnet_cli_pack_items(char *ptr,const struct nxtnet_batch_item *items,size_t num_items) {
+  size_t i,size = 0;
+
+  for (i=0;i<num_items;i++) {
+    struct nxtnet_proto_batch_item_cs *item_cs = (struct nxtnet_proto_batch_item_cs*)(ptr+size);
+
+    item_cs->recv_size = htons(items[i].recv_size);
+    item_cs->send_size = htons(items[i].send_size);
+    memcpy(item_cs->data,items[i].send_buf,items[i].send_size);
+    size += sizeof(struct nxtnet_proto_batch_item_cs)+items[i].send_size;
+  }
+
+  return size;
+}
+
+/**
+ * Unpacks replies of a batch or subscription
+ *  @param ptr Packed replies
+ *  @param size Size of packed replies
+ *  @param items Telegrams; 'ret' is set for each item
+ *  @param num_items Number of telegrams
+ *  @return Number of successful transactions (-1 if replies don't fit into
+ *          'size' bytes)
+ */
+static ssize_t nxtnet_cli_unpack_items(const char *ptr,size_t size,struct nxtnet_batch_item *items,size_t num_items) {
+  size_t i,num_succ = 0;
 
-    if (size>0) {
-      memcpy(buf,recv_sc->data,size);
+  for (i=0;i<num_items;i++) {
+    struct nxtnet_proto_batch_item_sc *item_sc = (struct nxtnet_proto_batch_item_sc*)ptr;
+
+    if (sizeof(struct nxtnet_proto_batch_item_sc)+items[i].recv_size>size) {
+      return -1;
+    }
+    size -= sizeof(struct nxtnet_proto_batch_item_sc)+items[i].recv_size;
+    items[i].ret = (int16_t)ntohs(item_sc->size);
+    if (items[i].ret>0) {
+      memcpy(items[i].recv_buf,item_sc->data,items[i].ret<items[i].recv_size?items[i].ret:items[i].recv_size);
     }
-    return size;
+    if (items[i].ret>=0) {
+      num_succ++;
+    }
+    ptr += sizeof(struct nxtnet_proto_batch_item_sc)+items[i].recv_size;
   }
-  else return -1;
+
+  return num_succ;
+}
+
+/**
+ * Executes several transactions with as few round trips as possible
+ *  @param cli NXTNET client descriptor
+ *  @param handle NXT handle
+ *  @param items Transactions; 'ret' is set for each item
+ *  @param num_items Number of items
+ *  @return Number of successful transactions (-1 on failure)
+ *  @note The server executes the transactions of a batch without other
+ *        requests for the NXT in between. Batches too big for one packet are
+ *        split and all parts are submitted before waiting for the first reply.
+ */
+ssize_t nxtnet_cli_batch(nxtnet_cli_t *cli,int handle,struct nxtnet_batch_item *items,size_t num_items) {
+  size_t head_size = sizeof(struct nxtnet_proto_packet)+sizeof(struct nxtnet_proto_batch_cs);
+  size_t sc_head_size = sizeof(struct nxtnet_proto_packet)+sizeof(struct nxtnet_proto_batch_sc);
+  size_t i,j,first,num_frames = 0;
+  size_t *frame_first;
+  int *frame_id;
+  ssize_t num_succ = 0;
+
+  if (nxtnet_cli_check(cli)==-1) {
+    return -1;
+  }
+
+  // check that every item fits into a packet on its own
+  for (i=0;i<num_items;i++) {
+    items[i].ret = -1;
+    if (head_size+sizeof(struct nxtnet_proto_batch_item_cs)+items[i].send_size>cli->max_size
+     || head_size+sizeof(struct nxtnet_proto_batch_item_sc)+items[i].recv_size>cli->max_size) {
+      return -1;
+    }
+  }
+
+  if (cli->ops!=NULL) {
+    if (cli->ops->batch!=NULL) {
+      return cli->ops->batch(handle,items,num_items);
+    }
+    for (i=0;i<num_items;i++) {
+      items[i].ret = nxtnet_cli_local_transact(cli,handle,items[i].send_buf,items[i].send_size,items[i].recv_buf,items[i].recv_size);
+      if (items[i].ret>=0) {
+        num_succ++;
+      }
+    }
+    return num_succ;
+  }
+
+  frame_first = malloc((num_items+1)*sizeof(size_t));
+  frame_id = malloc((num_items+1)*sizeof(int));
+
+  // submit packets
+  for (i=0;i<num_items;) {
+    struct nxtnet_proto_batch_cs *batch_cs = (struct nxtnet_proto_batch_cs*)cli->buf->data;
+    size_t cs_size = head_size;
+    size_t sc_size = head_size;
+
+    first = i;
+    while (i<num_items
+        && cs_size+sizeof(struct nxtnet_proto_batch_item_cs)+items[i].send_size<=cli->max_size
+        && sc_size+sizeof(struct nxtnet_proto_batch_item_sc)+items[i].recv_size<=cli->max_size) {
+      cs_size += sizeof(struct nxtnet_proto_batch_item_cs)+items[i].send_size;
+      sc_size += sizeof(struct nxtnet_proto_batch_item_sc)+items[i].recv_size;
+      i++;
+    }
+    pthread_mutex_lock(&cli->send_mutex);
+    nxtnet_cli_pack_items(batch_cs->items,items+first,i-first);
+
+    frame_first[num_frames] = first;
+    frame_id[num_frames] = cli->next_id;
+    cli->next_id = (cli->next_id+1)&0x7FFFFFFF;
+
+    cli->buf->sig = NXTNET_PROTO_SIG;
+    cli->buf->cmd = NXTNET_PROTO_DIR_CS|NXTNET_PROTO_CMD_BATCH;
+    cli->buf->size = cs_size;
+    cli->buf->error = 0;
+
+    batch_cs->id = htonl(frame_id[num_frames]);
+    batch_cs->handle = htonl(handle);
+    batch_cs->num_items = htonl(i-first);
+
+    if (nxtnet_send(cli->sock,cli->format,cli->buf)!=cs_size) {
+      cli->broken = 1;
+      pthread_mutex_unlock(&cli->send_mutex);
+      break;
+    }
+    pthread_mutex_unlock(&cli->send_mutex);
+    num_frames++;
+  }
+  frame_first[num_frames] = i;
+
+  // wait for replies
+  for (j=0;j<num_frames;j++) {
+    struct nxtnet_cli_reply *reply = nxtnet_cli_wait_packet(cli,NXTNET_PROTO_DIR_SC|NXTNET_PROTO_CMD_BATCH,frame_id[j]);
+    struct nxtnet_proto_packet *packet;
+
+    if (reply==NULL) {
+      num_succ = -1;
+      break;
+    }
+    packet = (struct nxtnet_proto_packet*)reply->packet;
+    if (packet->error==NXTNET_ERROR_NOERROR && packet->size>=sc_head_size) {
+      ssize_t n = nxtnet_cli_unpack_items(((struct nxtnet_proto_batch_sc*)packet->data)->items,packet->size-sc_head_size,items+frame_first[j],frame_first[j+1]-frame_first[j]);
+
+      if (n==-1) {
+        // reply is shorter than it claims
+        for (i=frame_first[j];i<frame_first[j+1];i++) {
+          items[i].ret = -1;
+        }
+      }
+      else {
+        num_succ += n;
+      }
+    }
+    free(reply);
+  }
+
+  free(frame_first);
+  free(frame_id);
+  return num_succ;
+}
+
+/**
+ * Subscribes to periodic transactions with NXT. The server executes the
+ * transactions every interval and pushes the results to the client.
+ *  @param cli NXTNET client descriptor
+ *  @param handle NXT handle
+ *  @param interval Sampling interval in microseconds
+ *  @param items Telegrams ('recv_buf' and 'ret' are not used)
+ *  @param num_items Number of telegrams
+ *  @return ID of subscription (-1 on failure)
+ *  @note Samples are kept until they are received with nxtnet_cli_sample()
+ */
+int nxtnet_cli_subscribe(nxtnet_cli_t *cli,int handle,unsigned int interval,const struct nxtnet_batch_item *items,size_t num_items) {
+  struct nxtnet_proto_subscribe_cs *subscribe_cs = (struct nxtnet_proto_subscribe_cs*)cli->buf->data;
+  struct nxtnet_cli_reply *reply;
+  size_t cs_size = sizeof(struct nxtnet_proto_packet)+sizeof(struct nxtnet_proto_subscribe_cs);
+  size_t sc_size = sizeof(struct nxtnet_proto_packet)+sizeof(struct nxtnet_proto_sample_sc);
+  size_t i;
+  int id;
+
+  if (nxtnet_cli_check(cli)==-1) {
+    return -1;
+  }
+
+  // samples must fit into one packet
+  for (i=0;i<num_items;i++) {
+    cs_size += sizeof(struct nxtnet_proto_batch_item_cs)+items[i].send_size;
+    sc_size += sizeof(struct nxtnet_proto_batch_item_sc)+items[i].recv_size;
+  }
+  if (num_items==0 || cs_size>cli->max_size || sc_size>cli->max_size) {
+    return -1;
+  }
+
+  pthread_mutex_lock(&cli->send_mutex);
+  id = cli->next_id;
+  cli->next_id = (cli->next_id+1)&0x7FFFFFFF;
+
+  if (cli->ops!=NULL) {
+    struct nxtnet_cli_sub *sub;
+
+    pthread_mutex_unlock(&cli->send_mutex);
+    if (cli->ops->subscribe==NULL || cli->ops->unsubscribe==NULL) {
+      return -1;
+    }
+    sub = malloc(sizeof(struct nxtnet_cli_sub));
+    sub->cli = cli;
+    sub->id = id;
+    sub->sub = cli->ops->subscribe(handle,interval,items,num_items,nxtnet_cli_local_sample,sub);
+    if (sub->sub==NULL) {
+      free(sub);
+      return -1;
+    }
+    pthread_mutex_lock(&cli->mutex);
+    sub->next = cli->subs;
+    cli->subs = sub;
+    pthread_mutex_unlock(&cli->mutex);
+    return id;
+  }
+
+  cli->buf->sig = NXTNET_PROTO_SIG;
+  cli->buf->cmd = NXTNET_PROTO_DIR_CS|NXTNET_PROTO_CMD_SUBSCRIBE;
+  cli->buf->size = cs_size;
+  cli->buf->error = 0;
+
+  subscribe_cs->id = htonl(id);
+  subscribe_cs->handle = htonl(handle);
+  subscribe_cs->interval = htonl(interval);
+  subscribe_cs->num_items = htonl(num_items);
+  nxtnet_cli_pack_items(subscribe_cs->items,items,num_items);
+
+  if (nxtnet_send(cli->sock,cli->format,cli->buf)!=cs_size) {
+    cli->broken = 1;
+    pthread_mutex_unlock(&cli->send_mutex);
+    return -1;
+  }
+  pthread_mutex_unlock(&cli->send_mutex);
+
+  reply = nxtnet_cli_wait_packet(cli,NXTNET_PROTO_DIR_SC|NXTNET_PROTO_CMD_SUBSCRIBE,id);
+  if (reply==NULL) {
+    return -1;
+  }
+  if (((struct nxtnet_proto_packet*)reply->packet)->error!=NXTNET_ERROR_NOERROR) {
+    id = -1;
+  }
+  free(reply);
+  return id;
+}
+
+/**
+ * Receives the next sample of a subscription
+ *  @param cli NXTNET client descriptor
+ *  @param id ID of subscription
+ *  @param items Telegrams as passed to nxtnet_cli_subscribe(); 'ret' is set
+ *               for each item
+ *  @param num_items Number of telegrams
+ *  @param time Where to store time of sample (server's monotonic clock; can
+ *              be NULL)
+ *  @return Success?
+ */
+int nxtnet_cli_sample(nxtnet_cli_t *cli,int id,struct nxtnet_batch_item *items,size_t num_items,struct timespec *time) {
+  struct nxtnet_cli_reply *reply = nxtnet_cli_wait_packet(cli,NXTNET_PROTO_DIR_SC|NXTNET_PROTO_CMD_SAMPLE,id);
+  struct nxtnet_proto_packet *packet;
+  struct nxtnet_proto_sample_sc *sample_sc;
+  size_t head_size = sizeof(struct nxtnet_proto_packet)+sizeof(struct nxtnet_proto_sample_sc);
+
+  if (reply==NULL) {
+    return -1;
+  }
+
+  packet = (struct nxtnet_proto_packet*)reply->packet;
+  sample_sc = (struct nxtnet_proto_sample_sc*)packet->data;
+  if (packet->error!=NXTNET_ERROR_NOERROR || packet->size<head_size || ntohl(sample_sc->num_items)!=num_items
+   || nxtnet_cli_unpack_items(sample_sc->items,packet->size-head_size,items,num_items)==-1) {
+    free(reply);
+    return -1;
+  }
+  if (time!=NULL) {
+    time->tv_sec = ntohl(sample_sc->time_sec);
+    time->tv_nsec = ntohl(sample_sc->time_usec)*1000;
+  }
+
+  free(reply);
+  return 0;
+}
+
+/**
+ * Cancels a subscription
+ *  @param cli NXTNET client descriptor
+ *  @param handle NXT handle
+ *  @param id ID of subscription
+ *  @return Success?
+ */
+int nxtnet_cli_unsubscribe(nxtnet_cli_t *cli,int handle,int id) {
+  struct nxtnet_proto_unsubscribe_cs *unsubscribe_cs = (struct nxtnet_proto_unsubscribe_cs*)cli->buf->data;
+  struct nxtnet_cli_reply **prev,*reply;
+  size_t cs_size = sizeof(struct nxtnet_proto_packet)+sizeof(struct nxtnet_proto_unsubscribe_cs);
+  int ret;
+
+  if (nxtnet_cli_check(cli)==-1) {
+    return -1;
+  }
+
+  if (cli->ops!=NULL) {
+    struct nxtnet_cli_sub **sprev,*sub;
+
+    pthread_mutex_lock(&cli->mutex);
+    for (sprev=&cli->subs;*sprev!=NULL && (*sprev)->id!=id;sprev=&(*sprev)->next);
+    sub = *sprev;
+    if (sub!=NULL) {
+      *sprev = sub->next;
+    }
+    pthread_mutex_unlock(&cli->mutex);
+    if (sub!=NULL) {
+      cli->ops->unsubscribe(sub->sub);
+      free(sub);
+    }
+    ret = sub!=NULL?0:-1;
+  }
+  else {
+    pthread_mutex_lock(&cli->send_mutex);
+    cli->buf->sig = NXTNET_PROTO_SIG;
+    cli->buf->cmd = NXTNET_PROTO_DIR_CS|NXTNET_PROTO_CMD_UNSUBSCRIBE;
+    cli->buf->size = cs_size;
+    cli->buf->error = 0;
+
+    unsubscribe_cs->id = htonl(id);
+    unsubscribe_cs->handle = htonl(handle);
+
+    if (nxtnet_send(cli->sock,cli->format,cli->buf)!=cs_size) {
+      cli->broken = 1;
+      pthread_mutex_unlock(&cli->send_mutex);
+      return -1;
+    }
+    pthread_mutex_unlock(&cli->send_mutex);
+
+    reply = nxtnet_cli_wait_packet(cli,NXTNET_PROTO_DIR_SC|NXTNET_PROTO_CMD_UNSUBSCRIBE,id);
+    ret = reply!=NULL && ((struct nxtnet_proto_packet*)reply->packet)->error==NXTNET_ERROR_NOERROR?0:-1;
+    free(reply);
+  }
+
+  // drop samples nobody will receive anymore
+  pthread_mutex_lock(&cli->mutex);
+  for (prev=&cli->replies;*prev!=NULL;) {
+    struct nxtnet_proto_packet *stashed = (struct nxtnet_proto_packet*)(*prev)->packet;
+
+    reply = *prev;
+    if (stashed->cmd==(NXTNET_PROTO_DIR_SC|NXTNET_PROTO_CMD_SAMPLE) && ntohl(*(uint32_t*)stashed->data)==id) {
+      *prev = reply->next;
+      free(reply);
+    }
+    else {
+      prev = &reply->next;
+    }
+  }
+  pthread_mutex_unlock(&cli->mutex);
+
+  return ret;
 }
 
 /**
  * Disconnects from NXTNET server
  *  @param cli NXTNET client descriptor
+ *  @note Shared connections are closed when their last user disconnects
  */
 void nxtnet_cli_disconnect(nxtnet_cli_t *cli) {
-  close(cli->sock);
+  struct nxtnet_cli_reply *reply;
+  struct nxtnet_cli_sub *sub;
+  nxtnet_cli_t **prev;
+
+  pthread_mutex_lock(&shared_mutex);
+  if (--cli->refs>0) {
+    pthread_mutex_unlock(&shared_mutex);
+    return;
+  }
+  for (prev=&shared_first;*prev!=NULL;prev=&(*prev)->next) {
+    if (*prev==cli) {
+      *prev = cli->next;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&shared_mutex);
+
+  // cancel subscriptions of in-process client, so no samples arrive anymore
+  while (cli->subs!=NULL) {
+    sub = cli->subs;
+    cli->subs = sub->next;
+    cli->ops->unsubscribe(sub->sub);
+    free(sub);
+  }
+
+  while (cli->replies!=NULL) {
+    reply = cli->replies;
+    cli->replies = reply->next;
+    free(reply);
+  }
+
+  if (cli->sock!=-1) {
+    close(cli->sock);
+  }
+  if (cli->rbuf!=NULL) {
+    nxtnet_rbuf_destroy(cli->rbuf);
+  }
+  pthread_cond_destroy(&cli->cond);
+  pthread_mutex_destroy(&cli->mutex);
+  pthread_mutex_destroy(&cli->send_mutex);
+  pthread_mutex_destroy(&cli->request_mutex);
   free(cli->buf);
+  free(cli->rpacket);
+  free(cli->hostname);
   free(cli);
 }
\ No newline at end of file
@@ -20,20 +20,594 @@
 
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <netdb.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
+#include <errno.h>
 
 #include <anxt/net.h>
 
+/// Max. size of compact frame header (command, info, length and fields)
+#define NXTNET_COMPACT_HEADMAX 40
+/// Max. number of bytes of length in compact frame header
+#define NXTNET_COMPACT_LENMAX  3
+
+/// Number of leading uint32 fields of command specific data, which are sent
+/// as varints in compact frames (indexed by command; client to server,
+/// server to client)
+static const uint8_t nxtnet_proto_fields[][2] = {
+  [NXTNET_PROTO_CMD_HELLO] = {1,2},
+  [NXTNET_PROTO_CMD_LIST] = {0,1},
+  [NXTNET_PROTO_CMD_SEND] = {2,2},
+  [NXTNET_PROTO_CMD_RECV] = {2,2},
+  [NXTNET_PROTO_CMD_TRANSACT] = {4,3},
+  [NXTNET_PROTO_CMD_BATCH] = {3,3},
+  [NXTNET_PROTO_CMD_SUBSCRIBE] = {4,2},
+  [NXTNET_PROTO_CMD_UNSUBSCRIBE] = {2,2},
+  [NXTNET_PROTO_CMD_SAMPLE] = {0,5},
+  [NXTNET_PROTO_CMD_STATS] = {0,0}
+};
+
+/**
+ * Creates a receive buffer
+ *  @param size Initial capacity in bytes
+ *  @return Receive buffer
+ *  @note The buffer accepts packets up to NXTNET_BUFSIZE bytes until
+ *        nxtnet_rbuf_set_max() is called. It grows if a packet does not fit.
+ */
+nxtnet_rbuf_t *nxtnet_rbuf_create(size_t size) {
+  nxtnet_rbuf_t *rbuf = malloc(sizeof(nxtnet_rbuf_t));
+
+  rbuf->data = malloc(size);
+  rbuf->size = size;
+  rbuf->start = 0;
+  rbuf->fill = 0;
+  rbuf->max = NXTNET_BUFSIZE;
+  rbuf->format = NXTNET_PROTO_FORMAT_PLAIN;
+  rbuf->accept_v0 = 0;
+  memset(rbuf->password,0,NXTNET_PWD_LEN);
+
+  return rbuf;
+}
+
+/**
+ * Sets maximum packet size accepted by receive buffer
+ *  @param rbuf Receive buffer
+ *  @param max Maximum packet size (at most NXTNET_MAXSIZE)
+ */
+void nxtnet_rbuf_set_max(nxtnet_rbuf_t *rbuf,size_t max) {
+  rbuf->max = max>NXTNET_MAXSIZE?NXTNET_MAXSIZE:max;
+}
+
+/**
+ * Sets frame format of packets in receive buffer
+ *  @param rbuf Receive buffer
+ *  @param format Frame format (NXTNET_PROTO_FORMAT_*)
+ */
+void nxtnet_rbuf_set_format(nxtnet_rbuf_t *rbuf,int format) {
+  rbuf->format = format;
+}
+
+/**
+ * Lets receive buffer switch to NXTNET_PROTO_FORMAT_V0, if the first packet
+ * has the signature of protocol version 0
+ *  @param rbuf Receive buffer (in plain format)
+ *  @note Only servers call this; clients of version 0 send no HELLO.
+ */
+void nxtnet_rbuf_accept_v0(nxtnet_rbuf_t *rbuf) {
+  rbuf->accept_v0 = 1;
+}
+
+/**
+ * Destroys a receive buffer
+ *  @param rbuf Receive buffer
+ */
+void nxtnet_rbuf_destroy(nxtnet_rbuf_t *rbuf) {
+  free(rbuf->data);
+  free(rbuf);
+}
+
+/**
+ * Reads as many bytes as fit into receive buffer with one system call
+ *  @param rbuf Receive buffer
+ *  @param sock Socket
+ *  @return Number of bytes read (0 on hang up, -1 on failure)
+ *  @note On non-blocking sockets errno is EAGAIN if nothing was available
+ */
+ssize_t nxtnet_rbuf_read(nxtnet_rbuf_t *rbuf,int sock) {
+  struct iovec iov[2];
+  size_t end = (rbuf->start+rbuf->fill)%rbuf->size;
+  size_t avail = rbuf->size-rbuf->fill;
+  int iovcnt = 1;
+  ssize_t size;
+
+  if (avail==0) {
+    errno = ENOBUFS;
+    return -1;
+  }
+
+  // free space may wrap around end of buffer
+  iov[0].iov_base = rbuf->data+end;
+  if (end+avail>rbuf->size) {
+    iov[0].iov_len = rbuf->size-end;
+    iov[1].iov_base = rbuf->data;
+    iov[1].iov_len = avail-iov[0].iov_len;
+    iovcnt = 2;
+  }
+  else {
+    iov[0].iov_len = avail;
+  }
+
+  do size = readv(sock,iov,iovcnt);
+  while (size==-1 && errno==EINTR);
+
+  if (size>0) {
+    rbuf->fill += size;
+  }
+
+  return size;
+}
+
+/**
+ * Copies unread bytes out of receive buffer
+ *  @param rbuf Receive buffer
+ *  @param offset Offset from first unread byte
+ *  @param dest Destination
+ *  @param len How many bytes to copy
+ */
+static void nxtnet_rbuf_copy(nxtnet_rbuf_t *rbuf,size_t offset,void *dest,size_t len) {
+  size_t start = (rbuf->start+offset)%rbuf->size;
+  size_t first = rbuf->size-start;
+
+  if (len<=first) {
+    memcpy(dest,rbuf->data+start,len);
+  }
+  else {
+    memcpy(dest,rbuf->data+start,first);
+    memcpy(((char*)dest)+first,rbuf->data,len-first);
+  }
+}
+
+/**
+ * Removes bytes from start of receive buffer
+ *  @param rbuf Receive buffer
+ *  @param len How many bytes to remove
+ */
+static void nxtnet_rbuf_skip(nxtnet_rbuf_t *rbuf,size_t len) {
+  rbuf->start = (rbuf->start+len)%rbuf->size;
+  rbuf->fill -= len;
+  if (rbuf->fill==0) {
+    rbuf->start = 0;
+  }
+}
+
+/**
+ * Grows receive buffer so that it can hold a packet
+ *  @param rbuf Receive buffer
+ *  @param size Packet size
+ *  @return 0 on success, -1 on failure
+ */
+static int nxtnet_rbuf_grow(nxtnet_rbuf_t *rbuf,size_t size) {
+  char *data;
+
+  if (size<=rbuf->size) {
+    return 0;
+  }
+
+  // unread bytes are moved to start of new buffer
+  data = malloc(size);
+  if (data==NULL) {
+    return -1;
+  }
+  nxtnet_rbuf_copy(rbuf,0,data,rbuf->fill);
+  free(rbuf->data);
+  rbuf->data = data;
+  rbuf->size = size;
+  rbuf->start = 0;
+
+  return 0;
+}
+
+/**
+ * Makes sure that buffer for a packet is big enough
+ *  @param buf Reference to buffer for packet. If it is NULL or smaller than
+ *             the packet, it is (re)allocated
+ *  @param bufsize Reference to size of buffer
+ *  @param size Packet size
+ *  @return 0 on success, -1 on failure
+ */
+static int nxtnet_packet_alloc(struct nxtnet_proto_packet **buf,size_t *bufsize,size_t size) {
+  struct nxtnet_proto_packet *packet;
+
+  if (*buf==NULL || *bufsize<size) {
+    packet = realloc(*buf,size);
+    if (packet==NULL) {
+      return -1;
+    }
+    *buf = packet;
+    *bufsize = size;
+  }
+
+  return 0;
+}
+
+/**
+ * Encodes a varint (7 bits per byte, least significant first)
+ *  @param buf Buffer (at least 5 bytes)
+ *  @param value Value
+ *  @return Number of bytes written
+ */
+static size_t nxtnet_varint_put(uint8_t *buf,uint32_t value) {
+  size_t len = 0;
+
+  while (value>=0x80) {
+    buf[len++] = (value&0x7F)|0x80;
+    value >>= 7;
+  }
+  buf[len++] = value;
+
+  return len;
+}
+
+/**
+ * Decodes a varint
+ *  @param buf Buffer
+ *  @param size Size of buffer
+ *  @param value Reference for value
+ *  @return Number of bytes read (0 if buffer ends before varint, -1 if
+ *          varint is longer than 5 bytes)
+ */
+static int nxtnet_varint_get(const uint8_t *buf,size_t size,uint32_t *value) {
+  size_t len;
+
+  *value = 0;
+  for (len=0;len<size && len<5;len++) {
+    *value |= (uint32_t)(buf[len]&0x7F)<<(7*len);
+    if ((buf[len]&0x80)==0) {
+      return len+1;
+    }
+  }
+
+  return len==5?-1:0;
+}
+
+/**
+ * Returns number of varint fields of a command in compact frames
+ *  @param cmd Command byte
+ *  @return Number of fields
+ */
+static size_t nxtnet_proto_num_fields(uint8_t cmd) {
+  unsigned int i = cmd&NXTNET_PROTO_CMD_MASK;
+
+  if (i>=sizeof(nxtnet_proto_fields)/sizeof(nxtnet_proto_fields[0])) {
+    return 0;
+  }
+  return nxtnet_proto_fields[i][(cmd&NXTNET_PROTO_DIR_MASK)==NXTNET_PROTO_DIR_SC];
+}
+
+/**
+ * Encodes header and varint fields of a compact frame
+ *  @param packet Packet (header in host byte order)
+ *  @param head_size How many bytes of packet are in 'packet'
+ *  @param head Buffer for encoded header (NXTNET_COMPACT_HEADMAX bytes)
+ *  @param plain_head Reference for size of encoded part in plain packet
+ *  @return Size of encoded header
+ *  @note Fields that aren't (completely) in 'packet' are not encoded, so short
+ *        error replies stay short.
+ */
+static size_t nxtnet_proto_compact_head(const struct nxtnet_proto_packet *packet,size_t head_size,uint8_t *head,size_t *plain_head) {
+  uint8_t fields[NXTNET_COMPACT_HEADMAX];
+  size_t num_fields = nxtnet_proto_num_fields(packet->cmd);
+  size_t fields_len = 0;
+  size_t len = 0;
+  uint32_t value;
+  size_t i;
+
+  if (head_size>packet->size) {
+    head_size = packet->size;
+  }
+  if (num_fields>(head_size-sizeof(struct nxtnet_proto_packet))/sizeof(uint32_t)) {
+    num_fields = (head_size-sizeof(struct nxtnet_proto_packet))/sizeof(uint32_t);
+  }
+  *plain_head = sizeof(struct nxtnet_proto_packet)+num_fields*sizeof(uint32_t);
+
+  for (i=0;i<num_fields;i++) {
+    memcpy(&value,packet->data+i*sizeof(uint32_t),sizeof(uint32_t));
+    fields_len += nxtnet_varint_put(fields+fields_len,ntohl(value));
+  }
+
+  head[len++] = packet->cmd;
+  head[len++] = (packet->error<<3)|num_fields;
+  len += nxtnet_varint_put(head+len,fields_len+packet->size-*plain_head);
+  memcpy(head+len,fields,fields_len);
+
+  return len+fields_len;
+}
+
+/**
+ * Converts a packet to a compact frame
+ *  @param packet Reference to packet (header in host byte order). It may be
+ *                reallocated.
+ *  @return Size of compact frame (0 on failure)
+ *  @note A compact frame consists of
+ *          - command byte
+ *          - info byte (error<<3 | number of varint fields)
+ *          - varint with number of bytes following it
+ *          - the leading uint32 fields of the command specific data (see
+ *            nxtnet_proto_fields) as varints
+ *          - the rest of the packet as is
+ *        There is no signature; the connection is already checked by HELLO.
+ */
+size_t nxtnet_proto_compact(struct nxtnet_proto_packet **packet) {
+  uint8_t head[NXTNET_COMPACT_HEADMAX];
+  size_t plain_head,head_len,rest;
+  struct nxtnet_proto_packet *buf;
+
+  head_len = nxtnet_proto_compact_head(*packet,(*packet)->size,head,&plain_head);
+  rest = (*packet)->size-plain_head;
+
+  // only large field values make the header grow
+  if (head_len>plain_head) {
+    buf = realloc(*packet,head_len+rest);
+    if (buf==NULL) {
+      return 0;
+    }
+    *packet = buf;
+  }
+  memmove(((char*)*packet)+head_len,((char*)*packet)+plain_head,rest);
+  memcpy(*packet,head,head_len);
+
+  return head_len+rest;
+}
+
+/**
+ * Converts packet to protocol version 0 (for sending)
+ *  @param packet Reference to packet in host byte order. It is reallocated.
+ *  @return Size of converted packet (0 on failure)
+ *  @note The header is followed by an empty password and the packet is
+ *        brought into network byte order.
+ */
+size_t nxtnet_proto_v0(struct nxtnet_proto_packet **packet) {
+  struct nxtnet_proto_packet *buf;
+  size_t size = (*packet)->size+NXTNET_PWD_LEN;
+
+  buf = realloc(*packet,size);
+  if (buf==NULL) {
+    return 0;
+  }
+  memmove(buf->data+NXTNET_PWD_LEN,buf->data,buf->size-sizeof(struct nxtnet_proto_packet));
+  memset(buf->data,0,NXTNET_PWD_LEN);
+  buf->sig = htonl(NXTNET_PROTO_SIG_V0);
+  buf->size = htons(size);
+  *packet = buf;
+
+  return size;
+}
+
+/**
+ * Takes next complete packet of protocol version 0 out of receive buffer
+ *  @param rbuf Receive buffer
+ *  @param buf Reference to buffer for packet
+ *  @param bufsize Reference to size of buffer
+ *  @return 1 if a packet was taken, 0 if more data is needed, -1 if data is
+ *          not a valid packet
+ *  @note The password is removed from the packet and kept in rbuf->password
+ */
+static int nxtnet_rbuf_get_v0(nxtnet_rbuf_t *rbuf,struct nxtnet_proto_packet **buf,size_t *bufsize) {
+  struct nxtnet_proto_packet header;
+  struct nxtnet_proto_packet *packet;
+  size_t head_size = sizeof(struct nxtnet_proto_packet)+NXTNET_PWD_LEN;
+  uint16_t packet_size;
+
+  if (rbuf->fill<head_size) {
+    return 0;
+  }
+
+  // Check header
+  nxtnet_rbuf_copy(rbuf,0,&header,sizeof(header));
+  packet_size = ntohs(header.size);
+  if (ntohl(header.sig)!=NXTNET_PROTO_SIG_V0 || packet_size<head_size || packet_size>rbuf->max) {
+    return -1;
+  }
+  if (rbuf->fill<packet_size) {
+    return nxtnet_rbuf_grow(rbuf,packet_size);
+  }
+
+  // Take whole packet, but keep password apart
+  if (nxtnet_packet_alloc(buf,bufsize,packet_size-NXTNET_PWD_LEN)==-1) {
+    return -1;
+  }
+  packet = *buf;
+  nxtnet_rbuf_copy(rbuf,0,packet,sizeof(header));
+  nxtnet_rbuf_copy(rbuf,sizeof(header),rbuf->password,NXTNET_PWD_LEN);
+  nxtnet_rbuf_copy(rbuf,head_size,packet->data,packet_size-head_size);
+  nxtnet_rbuf_skip(rbuf,packet_size);
+
+  // Bring header in host byteorder and make it look like a current one
+  packet->sig = NXTNET_PROTO_SIG;
+  packet->size = packet_size-NXTNET_PWD_LEN;
+
+  return 1;
+}
+
+/**
+ * Takes next complete plain frame out of receive buffer
+ *  @param rbuf Receive buffer
+ *  @param buf Reference to buffer for packet
+ *  @param bufsize Reference to size of buffer
+ *  @return 1 if a packet was taken, 0 if more data is needed, -1 if data is
+ *          not a valid packet
+ */
+static int nxtnet_rbuf_get_plain(nxtnet_rbuf_t *rbuf,struct nxtnet_proto_packet **buf,size_t *bufsize) {
+  struct nxtnet_proto_packet header;
+  struct nxtnet_proto_packet *packet;
+  uint16_t packet_size;
+
+  if (rbuf->fill<sizeof(struct nxtnet_proto_packet)) {
+    return 0;
+  }
+
+  // Check header
+  nxtnet_rbuf_copy(rbuf,0,&header,sizeof(header));
+  packet_size = ntohs(header.size);
+  if (rbuf->accept_v0 && ntohl(header.sig)==NXTNET_PROTO_SIG_V0) {
+    rbuf->accept_v0 = 0;
+    rbuf->format = NXTNET_PROTO_FORMAT_V0;
+    return nxtnet_rbuf_get_v0(rbuf,buf,bufsize);
+  }
+  if (ntohl(header.sig)!=NXTNET_PROTO_SIG || packet_size<sizeof(struct nxtnet_proto_packet) || packet_size>rbuf->max) {
+    return -1;
+  }
+  if (rbuf->fill<packet_size) {
+    return nxtnet_rbuf_grow(rbuf,packet_size);
+  }
+  rbuf->accept_v0 = 0;
+
+  // Take whole packet
+  if (nxtnet_packet_alloc(buf,bufsize,packet_size)==-1) {
+    return -1;
+  }
+  packet = *buf;
+  nxtnet_rbuf_copy(rbuf,0,packet,packet_size);
+  nxtnet_rbuf_skip(rbuf,packet_size);
+
+  // Bring header in host byteorder
+  packet->sig = NXTNET_PROTO_SIG;
+  packet->size = packet_size;
+
+  return 1;
+}
+
+/**
+ * Takes next complete compact frame out of receive buffer
+ *  @param rbuf Receive buffer
+ *  @param buf Reference to buffer for packet
+ *  @param bufsize Reference to size of buffer
+ *  @return 1 if a packet was taken, 0 if more data is needed, -1 if data is
+ *          not a valid packet
+ *  @note The frame is expanded to a plain packet (see nxtnet_proto_compact())
+ */
+static int nxtnet_rbuf_get_compact(nxtnet_rbuf_t *rbuf,struct nxtnet_proto_packet **buf,size_t *bufsize) {
+  uint8_t head[NXTNET_COMPACT_HEADMAX];
+  struct nxtnet_proto_packet *packet;
+  size_t head_len,avail,frame_size,num_fields,rest,packet_size,i;
+  uint32_t body_size,value;
+  int len;
+
+  if (rbuf->fill<3) {
+    return 0;
+  }
+
+  // Check header
+  head_len = rbuf->fill<NXTNET_COMPACT_HEADMAX?rbuf->fill:NXTNET_COMPACT_HEADMAX;
+  nxtnet_rbuf_copy(rbuf,0,head,head_len);
+  len = nxtnet_varint_get(head+2,head_len-2,&body_size);
+  if (len==0) {
+    return 0;
+  }
+  num_fields = head[1]&0x07;
+  if (len==-1 || len>NXTNET_COMPACT_LENMAX || body_size>rbuf->max || num_fields>nxtnet_proto_num_fields(head[0])) {
+    return -1;
+  }
+  frame_size = 2+len+body_size;
+  if (rbuf->fill<frame_size) {
+    return nxtnet_rbuf_grow(rbuf,frame_size);
+  }
+
+  // Decode fields
+  if (head_len>frame_size) {
+    head_len = frame_size;
+  }
+  avail = head_len;
+  packet_size = sizeof(struct nxtnet_proto_packet)+num_fields*sizeof(uint32_t);
+  if (nxtnet_packet_alloc(buf,bufsize,packet_size+body_size)==-1) {
+    return -1;
+  }
+  packet = *buf;
+  head_len = 2+len;
+  for (i=0;i<num_fields;i++) {
+    len = nxtnet_varint_get(head+head_len,avail-head_len,&value);
+    if (len<=0) {
+      return -1;
+    }
+    value = htonl(value);
+    memcpy(packet->data+i*sizeof(uint32_t),&value,sizeof(uint32_t));
+    head_len += len;
+  }
+
+  // Take rest of packet
+  rest = frame_size-head_len;
+  packet_size += rest;
+  if (packet_size>rbuf->max) {
+    return -1;
+  }
+  nxtnet_rbuf_copy(rbuf,head_len,((char*)packet)+packet_size-rest,rest);
+  nxtnet_rbuf_skip(rbuf,frame_size);
+
+  packet->sig = NXTNET_PROTO_SIG;
+  packet->cmd = head[0];
+  packet->size = packet_size;
+  packet->error = head[1]>>3;
+
+  return 1;
+}
+
+/**
+ * Takes next complete packet out of receive buffer
+ *  @param rbuf Receive buffer
+ *  @param buf Reference to buffer for packet. If it is NULL or smaller than
+ *             the packet, it is (re)allocated
+ *  @param bufsize Reference to size of buffer
+ *  @return 1 if a packet was taken, 0 if more data is needed, -1 if data is
+ *          not a valid packet
+ *  @note Header of packet is brought into host byte order. Compact frames are
+ *        expanded, so the packet always looks like a plain one.
+ */
+int nxtnet_rbuf_get(nxtnet_rbuf_t *rbuf,struct nxtnet_proto_packet **buf,size_t *bufsize) {
+  if (rbuf->format==NXTNET_PROTO_FORMAT_COMPACT) {
+    return nxtnet_rbuf_get_compact(rbuf,buf,bufsize);
+  }
+  else if (rbuf->format==NXTNET_PROTO_FORMAT_V0) {
+    return nxtnet_rbuf_get_v0(rbuf,buf,bufsize);
+  }
+  else {
+    return nxtnet_rbuf_get_plain(rbuf,buf,bufsize);
+  }
+}
+
+/**
+ * Receives NXTNET packet through a receive buffer
+ *  @param sock Socket (blocking)
+ *  @param rbuf Receive buffer
+ *  @param buf Reference to buffer for packet (grown if needed)
+ *  @param bufsize Reference to size of buffer
+ *  @return Packet received (NULL on failure or hang up)
+ *  @note Packets that arrive together are read with one system call and
+ *        returned by subsequent calls without reading from socket again.
+ */
+struct nxtnet_proto_packet *nxtnet_recv_buffered(int sock,nxtnet_rbuf_t *rbuf,struct nxtnet_proto_packet **buf,size_t *bufsize) {
+  int ret;
+
+  while ((ret = nxtnet_rbuf_get(rbuf,buf,bufsize))==0) {
+    if (nxtnet_rbuf_read(rbuf,sock)<=0) {
+      return NULL;
+    }
+  }
+
+  return ret==1?*buf:NULL;
+}
+
 /**
  * Receives NXTNET packet
  *  @param sock Socket
  *  @param buf Buffer
  *  @param cmd Command byte to check for (0 for all)
  *  @return Packet received
+ *  @note Prefer nxtnet_recv_buffered()
  */
 struct nxtnet_proto_packet *nxtnet_recv(int sock,struct nxtnet_proto_packet *buf,int cmd) {
   ssize_t size;
@@ -41,62 +615,114 @@ struct nxtnet_proto_packet *nxtnet_recv(int sock,struct nxtnet_proto_packet *buf
   uint16_t packet_size;
 
   // Receive header
-  do size = recv(sock,buf,sizeof(struct nxtnet_proto_packet),MSG_PEEK);
-  while (size>0 && size<sizeof(struct nxtnet_proto_packet));
+  size = recv(sock,buf,sizeof(struct nxtnet_proto_packet),MSG_WAITALL);
+  if (size!=sizeof(struct nxtnet_proto_packet)) {
+    return NULL;
+  }
 
   packet_sig = ntohl(buf->sig);
   packet_size = ntohs(buf->size);
 
-  /*if (size>0) {
-    printf("[RECV PACKET(%d)]\n",size);
-    printf("Sig:      %s\n",&(packet_sig));
-    printf("Size:     %d\n",packet_size);
-    printf("Command:  0x%x\n",buf->cmd);
-    printf("Error:    0x%x\n",buf->error);
-    printf("Password: %s\n",buf->password);
-  }*/
-
   // Check header
-  if (size>0 && packet_sig==NXTNET_PROTO_SIG && (cmd==0 || buf->cmd==cmd) && packet_size<=NXTNET_BUFSIZE) {
+  if (packet_sig!=NXTNET_PROTO_SIG || packet_size<sizeof(struct nxtnet_proto_packet) || packet_size>NXTNET_BUFSIZE) {
+    return NULL;
+  }
 
-    // Receive whole packet
-    size = 0;
-    while (size<packet_size) size += recv(sock,buf+size,packet_size-size,0);
+  // Receive rest of packet
+  if (packet_size>size) {
+    if (recv(sock,((char*)buf)+size,packet_size-size,MSG_WAITALL)!=packet_size-size) {
+      return NULL;
+    }
+  }
 
-    // Bring header in host byteorder
-    buf->sig = packet_sig;
-    buf->size = packet_size;
+  // Bring header in host byteorder
+  buf->sig = packet_sig;
+  buf->size = packet_size;
 
-    return buf;
-  }
-  else return NULL;
+  return cmd==0 || buf->cmd==cmd?buf:NULL;
 }
 
 /**
- * Sends NXTNET packet
+ * Sends NXTNET packet whose data is split into two buffers
  *  @param sock Socket
- *  @param buf Buffer
- *  @return Number of bytes sent
+ *  @param format Frame format (NXTNET_PROTO_FORMAT_*)
+ *  @param buf Packet header and command specific data
+ *  @param head_size Size of 'buf'
+ *  @param data Additional data appended to packet (can be NULL)
+ *  @param data_size Size of 'data'
+ *  @return Size of packet (-1 on failure)
+ *  @note buf->size must be the size of the whole packet (head_size+data_size)
  */
-ssize_t nxtnet_send(int sock,struct nxtnet_proto_packet *buf) {
+ssize_t nxtnet_send_iov(int sock,int format,struct nxtnet_proto_packet *buf,size_t head_size,const void *data,size_t data_size) {
+  uint8_t head[NXTNET_COMPACT_HEADMAX];
+  size_t plain_head;
+  struct iovec iov[3];
+  struct msghdr msg;
   size_t size = 0;
   size_t packet_size = buf->size;
+  size_t frame_size;
+  int iovcnt;
+  ssize_t c;
 
-/*
-  printf("[SEND PACKET]\n");
-  printf("Sig:      %s\n",&(buf->sig));
-  printf("Size:     %d\n",buf->size);
-  printf("Command:  0x%x\n",buf->cmd);
-  printf("Error:    0x%x\n",buf->error);
-  printf("Password: %s\n",buf->password);
-*/
+  if (format==NXTNET_PROTO_FORMAT_COMPACT) {
+    // Encode header and fields; the rest is sent from the packet
+    iov[0].iov_base = head;
+    iov[0].iov_len = nxtnet_proto_compact_head(buf,head_size,head,&plain_head);
+    iov[1].iov_base = ((char*)buf)+plain_head;
+    iov[1].iov_len = head_size-plain_head;
+    frame_size = iov[0].iov_len+packet_size-plain_head;
+  }
+  else {
+    // Bring header in network byte order
+    buf->sig = htonl(buf->sig);
+    buf->size = htons(packet_size);
 
-  // Bring header in network byte order
-  buf->sig = htonl(buf->sig);
-  buf->size = htons(packet_size);
+    iov[0].iov_base = buf;
+    iov[0].iov_len = head_size;
+    iov[1].iov_len = 0;
+    frame_size = packet_size;
+  }
+  iovcnt = iov[1].iov_len>0?2:1;
+  if (data_size>0) {
+    iov[iovcnt].iov_base = (void*)data;
+    iov[iovcnt].iov_len = data_size;
+    iovcnt++;
+  }
+  memset(&msg,0,sizeof(msg));
+  msg.msg_iov = iov;
+  msg.msg_iovlen = iovcnt;
 
-  // Send packet
-  while (size<packet_size) size += send(sock,buf,packet_size-size,0);
+  // Send packet with as few system calls as possible
+  while (size<frame_size) {
+    c = sendmsg(sock,&msg,MSG_NOSIGNAL);
+    if (c==-1) {
+      if (errno==EINTR) continue;
+      break;
+    }
+    size += c;
 
-  return size;
+    // skip what was sent
+    while (msg.msg_iovlen>0 && c>=msg.msg_iov->iov_len) {
+      c -= msg.msg_iov->iov_len;
+      msg.msg_iov++;
+      msg.msg_iovlen--;
+    }
+    if (msg.msg_iovlen>0) {
+      msg.msg_iov->iov_base = ((char*)msg.msg_iov->iov_base)+c;
+      msg.msg_iov->iov_len -= c;
+    }
+  }
+
+  return size<frame_size?-1:(ssize_t)packet_size;
+}
+
+/**
+ * Sends NXTNET packet
+ *  @param sock Socket
+ *  @param format Frame format (NXTNET_PROTO_FORMAT_*)
+ *  @param buf Buffer
+ *  @return Size of packet (-1 on failure)
+ */
+ssize_t nxtnet_send(int sock,int format,struct nxtnet_proto_packet *buf) {
+  return nxtnet_send_iov(sock,format,buf,buf->size,NULL,0);
 }
@@ -20,19 +20,138 @@
 
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
 #include <sys/time.h>
+#include <sys/epoll.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <netdb.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 #include <stdio.h>
 #include <stdarg.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
 
 #include <anxt/net.h>
 
-static struct nxtnet_proto_list_sc *packer_buf;
+/// Reply queued for a client
+struct nxtnet_srv_reply {
+  /// Next reply
+  struct nxtnet_srv_reply *next;
+  /// Packet (in network byte order)
+  struct nxtnet_proto_packet *packet;
+  /// Size of packet
+  size_t size;
+};
+
+/// Connected client
+struct nxtnet_srv_client {
+  /// Next client
+  struct nxtnet_srv_client *next;
+  /// Socket
+  int sock;
+  /// Reference count (reactor + queued jobs; protected by mutex)
+  int refs;
+  /// If client hung up
+  int closed;
+  /// Receive buffer
+  nxtnet_rbuf_t *rbuf;
+  /// Max. packet size (negotiated with HELLO)
+  size_t max_size;
+  /// If client sent the right password with HELLO (or server has none)
+  int authed;
+  /// Frame format of replies (negotiated with HELLO; protected by mutex)
+  int format;
+  /// Mutex for reply queue
+  pthread_mutex_t mutex;
+  /// First queued reply
+  struct nxtnet_srv_reply *out_first;
+  /// Last queued reply
+  struct nxtnet_srv_reply *out_last;
+  /// How many bytes of first reply are already sent
+  size_t out_pos;
+  /// Number of queued replies
+  size_t out_num;
+  /// Subscriptions of client
+  struct nxtnet_srv_sub *subs;
+};
+
+/// Subscription of a client
+struct nxtnet_srv_sub {
+  /// Next subscription of client
+  struct nxtnet_srv_sub *next;
+  /// Server
+  nxtnet_srv_t *srv;
+  /// Client (holds a reference)
+  struct nxtnet_srv_client *client;
+  /// ID of subscription (request ID of SUBSCRIBE)
+  uint32_t id;
+  /// NXT handle
+  int handle;
+  /// Subscription returned by ops.subscribe
+  void *sub;
+};
+
+/// Job for a worker thread
+struct nxtnet_srv_job {
+  /// Next job
+  struct nxtnet_srv_job *next;
+  /// Client that sent the request
+  struct nxtnet_srv_client *client;
+  /// Request packet; reply is built in place (NULL if job cancels 'sub')
+  struct nxtnet_proto_packet *packet;
+  /// Subscription to cancel (of a client that hung up)
+  struct nxtnet_srv_sub *sub;
+  /// NXT handle (-1 if job is not bound to a NXT)
+  int handle;
+};
+
+/// Worker thread
+struct nxtnet_srv_worker {
+  /// Thread ID
+  pthread_t tid;
+  /// Server
+  nxtnet_srv_t *srv;
+  /// NXT handle of running job (-1 if none)
+  int handle;
+};
+
+/// Worker threads and their job queue
+struct nxtnet_srv_pool {
+  /// Mutex for everything in here
+  pthread_mutex_t mutex;
+  /// Signaled when a job is queued
+  pthread_cond_t cond;
+  /// First queued job
+  struct nxtnet_srv_job *first;
+  /// Last queued job
+  struct nxtnet_srv_job *last;
+  /// Worker threads
+  struct nxtnet_srv_worker workers[NXTNET_SRV_MAX_WORKERS];
+  /// Number of worker threads
+  size_t num_workers;
+  /// Number of workers waiting for a job
+  size_t idle;
+  /// Number of waiting workers that were signaled, but didn't wake up yet
+  size_t wakeups;
+  /// If workers have to quit
+  int quit;
+};
+
+static struct nxtnet_proto_list_nxts *packer_nxts;
+static size_t packer_num;
+static size_t packer_max;
+static pthread_mutex_t packer_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void nxtnet_srv_reply(nxtnet_srv_t *srv,struct nxtnet_srv_client *client,struct nxtnet_proto_packet *packet);
 
 /**
  * Writes a log message
@@ -46,29 +165,87 @@ static int nxtnet_srv_log(nxtnet_srv_t *srv,const char *fmt,...) {
     va_list args;
     va_start(args,fmt);
     time_t timer = time(NULL);
-    struct tm *tm = localtime(&timer);
+    struct tm tm_buf;
+    struct tm *tm = localtime_r(&timer,&tm_buf);
+    flockfile(srv->log);
     ret += fprintf(srv->log,"[%02d:%02d:%02d %04d/%02d/%02d] ",tm->tm_hour,tm->tm_min,tm->tm_sec,tm->tm_year+1900,tm->tm_mon+1,tm->tm_mday);
     ret += vfprintf(srv->log,fmt,args);
+    funlockfile(srv->log);
     va_end(args);
   }
   return ret;
 }
 
+/**
+ * Creates UNIX domain socket for local clients
+ *  @param srv NXTNET server descriptor
+ *  @param port TCP port (selects path of socket)
+ *  @return Socket (-1 on failure)
+ *  @note The socket is only created in NXTNET_UNIX_DIR if nobody but us (or
+ *        root) can write there, since clients send their password to
+ *        whoever listens on it. A socket left over by a crashed server is
+ *        replaced, but not one of a running server.
+ */
+static int nxtnet_srv_create_unix(nxtnet_srv_t *srv,int port) {
+  struct sockaddr_un address;
+  struct stat st;
+  int sock;
+
+  mkdir(NXTNET_UNIX_DIR,0755);
+  if (lstat(NXTNET_UNIX_DIR,&st)==-1 || !S_ISDIR(st.st_mode)
+   || (st.st_uid!=geteuid() && st.st_uid!=0) || (st.st_mode&(S_IWGRP|S_IWOTH))!=0) {
+    nxtnet_srv_log(srv,"Not creating UNIX domain socket: %s is missing or writable by others\n",NXTNET_UNIX_DIR);
+    return -1;
+  }
+
+  memset(&address,0,sizeof(address));
+  address.sun_family = AF_UNIX;
+  snprintf(address.sun_path,sizeof(address.sun_path),NXTNET_UNIX_PATH,port);
+
+  // check if a server is listening on the socket
+  sock = socket(AF_UNIX,SOCK_STREAM,0);
+  if (sock==-1) return -1;
+  if (connect(sock,(struct sockaddr*)&address,sizeof(address))==0) {
+    nxtnet_srv_log(srv,"Not creating UNIX domain socket: %s is in use\n",address.sun_path);
+    close(sock);
+    return -1;
+  }
+  close(sock);
+  unlink(address.sun_path);
+
+  sock = socket(AF_UNIX,SOCK_STREAM,0);
+  if (sock==-1) return -1;
+  if (bind(sock,(struct sockaddr*)&address,sizeof(address))==-1) {
+    close(sock);
+    return -1;
+  }
+
+  // access is controlled by password, like with TCP
+  chmod(address.sun_path,0666);
+  strcpy(srv->upath,address.sun_path);
+
+  return sock;
+}
+
 /**
  * Creates a NXTNET server
  *  @param port TCP port to listen on
  *  @param password Server password (NULL for no password)
  *  @param logfile Logfile stream (NULL for no logfile)
  *  @return NXTNET server descriptor
+ *  @note Local clients can also connect through the UNIX domain socket
+ *        NXTNET_UNIX_PATH.
  */
 nxtnet_srv_t *nxtnet_srv_create(int port,const char *password,FILE *logfile,int local) {
   int sock;
+  int on = 1;
   struct sockaddr_in address;
   nxtnet_srv_t *srv;
 
   // create master socket
   sock = socket(AF_INET,SOCK_STREAM,0);
   if (sock==-1) return NULL;
+  setsockopt(sock,SOL_SOCKET,SO_REUSEADDR,&on,sizeof(on));
 
   // bind socket
   address.sin_family = AF_INET;
@@ -82,47 +259,123 @@ nxtnet_srv_t *nxtnet_srv_create(int port,const char *password,FILE *logfile,int
   srv->sock = sock;
   if (password!=NULL) strncpy(srv->password,password,NXTNET_PWD_LEN);
   srv->log = logfile;
-  srv->buf = malloc(NXTNET_BUFSIZE);
   srv->local = local;
+  srv->epfd = -1;
+  srv->usock = nxtnet_srv_create_unix(srv,port);
 
   nxtnet_srv_log(srv,"NXTNET Server is running now\n");
+  if (srv->usock!=-1) {
+    nxtnet_srv_log(srv,"Local clients can connect to %s\n",srv->upath);
+  }
 
   return srv;
 }
 
 static void packer_func(int handle, char *name, void *id, int is_bt) {
-  size_t i = ntohl(packer_buf->num_items);
-  packer_buf->nxts[i].handle = htonl(handle);
-  packer_buf->nxts[i].is_bt = is_bt;
-  strncpy(packer_buf->nxts[i].name,name,NXTNET_NXTNAME_LEN);
-  memcpy(packer_buf->nxts[i].id, id,6);
-  packer_buf->num_items = htonl(i+1);
+  if (packer_num==packer_max) {
+    packer_max = packer_max>0?2*packer_max:16;
+    packer_nxts = realloc(packer_nxts,packer_max*sizeof(struct nxtnet_proto_list_nxts));
+  }
+  memset(packer_nxts+packer_num,0,sizeof(struct nxtnet_proto_list_nxts));
+  packer_nxts[packer_num].handle = htonl(handle);
+  packer_nxts[packer_num].is_bt = is_bt;
+  strncpy(packer_nxts[packer_num].name,name,NXTNET_NXTNAME_LEN);
+  memcpy(packer_nxts[packer_num].id, id,6);
+  packer_num++;
 }
 
 /**
  * Lists NXTs
- *  @param packet NXTNET packet
+ *  @param srv NXTNET server descriptor
+ *  @param client Client
+ *  @param packet NXTNET packet (client->max_size bytes)
+ *  @note If the list does not fit into one packet, all but the last part are
+ *        queued as replies with NXTNET_PROTO_FLAG_MORE. The last part is left
+ *        in 'packet'. Clients of protocol version 0 only get the first part.
  */
-static void nxtnet_srv_list(nxtnet_srv_t *srv, struct nxtnet_proto_packet *packet) {
+static void nxtnet_srv_list(nxtnet_srv_t *srv,struct nxtnet_srv_client *client,struct nxtnet_proto_packet *packet) {
   struct nxtnet_proto_list_sc *list = (struct nxtnet_proto_list_sc*)packet->data;
+  size_t head_size = sizeof(struct nxtnet_proto_packet)+sizeof(struct nxtnet_proto_list_sc);
+  size_t per_packet = (client->max_size-head_size)/sizeof(struct nxtnet_proto_list_nxts);
+  size_t i = 0,n = 0;
+  int v0;
 
   nxtnet_srv_log(srv,"Listing NXTs\n");
 
-  list->num_items = 0;
-  packer_buf = list;
+  pthread_mutex_lock(&client->mutex);
+  v0 = client->format==NXTNET_PROTO_FORMAT_V0;
+  pthread_mutex_unlock(&client->mutex);
 
   if (srv->ops.list!=NULL) {
+    pthread_mutex_lock(&packer_mutex);
+    packer_num = 0;
     srv->ops.list(packer_func);
+
+    for (i=0;!v0 && packer_num-i>per_packet;i+=per_packet) {
+      struct nxtnet_proto_packet *part = malloc(head_size+per_packet*sizeof(struct nxtnet_proto_list_nxts));
+      struct nxtnet_proto_list_sc *part_list = (struct nxtnet_proto_list_sc*)part->data;
+
+      memcpy(part,packet,sizeof(struct nxtnet_proto_packet));
+      part->cmd = NXTNET_PROTO_DIR_SC|NXTNET_PROTO_FLAG_MORE|NXTNET_PROTO_CMD_LIST;
+      part->size = head_size+per_packet*sizeof(struct nxtnet_proto_list_nxts);
+      part->error = 0;
+      part_list->num_items = htonl(per_packet);
+      memcpy(part_list->nxts,packer_nxts+i,per_packet*sizeof(struct nxtnet_proto_list_nxts));
+      nxtnet_srv_reply(srv,client,part);
+    }
+    n = packer_num-i>per_packet?per_packet:packer_num-i;
+    memcpy(list->nxts,packer_nxts+i,n*sizeof(struct nxtnet_proto_list_nxts));
+    pthread_mutex_unlock(&packer_mutex);
     packet->error = 0;
   }
   else packet->error = NXTNET_ERROR_NOTIMPL;
 
+  list->num_items = htonl(n);
   packet->cmd = NXTNET_PROTO_DIR_SC|NXTNET_PROTO_CMD_LIST;
-  packet->size = sizeof(struct nxtnet_proto_packet)+sizeof(struct nxtnet_proto_list_sc)+ntohl(list->num_items)*sizeof(struct nxtnet_proto_list_nxts);
-  packet->error = 0;
+  packet->size = head_size+n*sizeof(struct nxtnet_proto_list_nxts);
+}
+
+/**
+ * Handles STATS command
+ *  @param srv NXTNET server descriptor
+ *  @param client Client
+ *  @param packet Request packet (max_size bytes); becomes reply
+ *  @note Text that doesn't fit into one packet is sent in several packets.
+ *        All but the last have NXTNET_PROTO_FLAG_MORE set.
+ */
+static void nxtnet_srv_stats(nxtnet_srv_t *srv,struct nxtnet_srv_client *client,struct nxtnet_proto_packet *packet) {
+  size_t per_packet = client->max_size-sizeof(struct nxtnet_proto_packet);
+  char *text = NULL;
+  size_t size = 0,i = 0;
+  FILE *out;
+
+  nxtnet_srv_log(srv,"Sending statistics\n");
+
+  if (srv->ops.stats!=NULL && (out = open_memstream(&text,&size))!=NULL) {
+    srv->ops.stats(out);
+    fclose(out);
+
+    for (i=0;size-i>per_packet;i+=per_packet) {
+      struct nxtnet_proto_packet *part = malloc(sizeof(struct nxtnet_proto_packet)+per_packet);
+
+      memcpy(part,packet,sizeof(struct nxtnet_proto_packet));
+      part->cmd = NXTNET_PROTO_DIR_SC|NXTNET_PROTO_FLAG_MORE|NXTNET_PROTO_CMD_STATS;
+      part->size = sizeof(struct nxtnet_proto_packet)+per_packet;
+      part->error = 0;
+      memcpy(part->data,text+i,per_packet);
+      nxtnet_srv_reply(srv,client,part);
+    }
+    memcpy(packet->data,text+i,size-i);
+    free(text);
+    packet->error = 0;
+  }
+  else packet->error = NXTNET_ERROR_NOTIMPL;
+
+  packet->cmd = NXTNET_PROTO_DIR_SC|NXTNET_PROTO_CMD_STATS;
+  packet->size = sizeof(struct nxtnet_proto_packet)+size-i;
 }
 
-static void nxtnet_srv_send(nxtnet_srv_t *srv,struct nxtnet_proto_packet *packet) {
+static void nxtnet_srv_send(nxtnet_srv_t *srv,struct nxtnet_srv_client *client,struct nxtnet_proto_packet *packet) {
   struct nxtnet_proto_send_cs *send_cs = (struct nxtnet_proto_send_cs*)packet->data;
   struct nxtnet_proto_send_sc *send_sc = (struct nxtnet_proto_send_sc*)packet->data;
   size_t size = ntohl(send_cs->size);
@@ -130,7 +383,11 @@ static void nxtnet_srv_send(nxtnet_srv_t *srv,struct nxtnet_proto_packet *packet
 
   //nxtnet_srv_log(srv,"Sending %u bytes to NXT %u: %02x %02x\n",size,handle,send_cs->data[0]&0xFF,send_cs->data[1]&0xFF);
 
-  if (srv->ops.send!=NULL) {
+  if (sizeof(struct nxtnet_proto_packet)+sizeof(struct nxtnet_proto_send_cs)+size>packet->size) {
+    size = -1;
+    packet->error = NXTNET_ERROR_INVAL;
+  }
+  else if (srv->ops.send!=NULL) {
     size = srv->ops.send(handle,send_cs->data,size);
     packet->error = 0;
   }
@@ -140,10 +397,9 @@ static void nxtnet_srv_send(nxtnet_srv_t *srv,struct nxtnet_proto_packet *packet
   send_sc->size = htonl(size);
   packet->cmd = NXTNET_PROTO_DIR_SC|NXTNET_PROTO_CMD_SEND;
   packet->size = sizeof(struct nxtnet_proto_packet)+sizeof(struct nxtnet_proto_send_sc);
-  packet->error = 0;
 }
 
-static void nxtnet_srv_recv(nxtnet_srv_t *srv,struct nxtnet_proto_packet *packet) {
+static void nxtnet_srv_recv(nxtnet_srv_t *srv,struct nxtnet_srv_client *client,struct nxtnet_proto_packet *packet) {
   struct nxtnet_proto_recv_cs *recv_cs = (struct nxtnet_proto_recv_cs*)packet->data;
   struct nxtnet_proto_recv_sc *recv_sc = (struct nxtnet_proto_recv_sc*)packet->data;
   ssize_t size = ntohl(recv_cs->size);
@@ -151,7 +407,11 @@ static void nxtnet_srv_recv(nxtnet_srv_t *srv,struct nxtnet_proto_packet *packet
 
   //nxtnet_srv_log(srv,"Receiving %u bytes from NXT %u\n",size,handle);
 
-  if (srv->ops.recv!=NULL) {
+  if (sizeof(struct nxtnet_proto_packet)+sizeof(struct nxtnet_proto_recv_sc)+size>client->max_size) {
+    size = -1;
+    packet->error = NXTNET_ERROR_INVAL;
+  }
+  else if (srv->ops.recv!=NULL) {
     size = srv->ops.recv(handle,recv_sc->data,size);
     packet->error = 0;
   }
@@ -161,74 +421,1081 @@ static void nxtnet_srv_recv(nxtnet_srv_t *srv,struct nxtnet_proto_packet *packet
   recv_sc->size = htonl(size);
   packet->cmd = NXTNET_PROTO_DIR_SC|NXTNET_PROTO_CMD_SEND;
   packet->size = sizeof(struct nxtnet_proto_packet)+sizeof(struct nxtnet_proto_recv_sc)+(size>0?size:0);
+}
+
+static void nxtnet_srv_transact(nxtnet_srv_t *srv,struct nxtnet_srv_client *client,struct nxtnet_proto_packet *packet) {
+  struct nxtnet_proto_transact_cs *transact_cs = (struct nxtnet_proto_transact_cs*)packet->data;
+  struct nxtnet_proto_transact_sc *transact_sc = (struct nxtnet_proto_transact_sc*)packet->data;
+  uint32_t id = ntohl(transact_cs->id);
+  int handle = ntohl(transact_cs->handle);
+  size_t send_size = ntohl(transact_cs->send_size);
+  size_t recv_size = ntohl(transact_cs->recv_size);
+  ssize_t size = -1;
+
+  if (sizeof(struct nxtnet_proto_packet)+sizeof(struct nxtnet_proto_transact_sc)+recv_size>client->max_size
+   || sizeof(struct nxtnet_proto_packet)+sizeof(struct nxtnet_proto_transact_cs)+send_size>packet->size) {
+    packet->error = NXTNET_ERROR_INVAL;
+  }
+  else if (srv->ops.transact!=NULL) {
+    // copy data, since reply overlaps it
+    char *data = malloc(send_size>0?send_size:1);
+    memcpy(data,transact_cs->data,send_size);
+    size = srv->ops.transact(handle,data,send_size,transact_sc->data,recv_size);
+    free(data);
+    packet->error = 0;
+  }
+  else if (srv->ops.send!=NULL && srv->ops.recv!=NULL) {
+    size = srv->ops.send(handle,transact_cs->data,send_size);
+    if (size==send_size) {
+      size = recv_size>0?srv->ops.recv(handle,transact_sc->data,recv_size):0;
+    }
+    else {
+      size = -1;
+    }
+    packet->error = 0;
+  }
+  else {
+    packet->error = NXTNET_ERROR_NOTIMPL;
+  }
+
+  transact_sc->id = htonl(id);
+  transact_sc->handle = htonl(handle);
+  transact_sc->size = htonl(size);
+  packet->cmd = NXTNET_PROTO_DIR_SC|NXTNET_PROTO_CMD_TRANSACT;
+  packet->size = sizeof(struct nxtnet_proto_packet)+sizeof(struct nxtnet_proto_transact_sc)+(size>0?size:0);
+}
+
+/**
+ * Parses telegrams of a BATCH or SUBSCRIBE packet
+ *  @param packet NXTNET packet
+ *  @param cs_size Size of packet up to first telegram
+ *  @param sc_size Size of reply up to first reply; is increased by the size of
+ *                 the replies
+ *  @param items Where to store telegrams ('recv_buf' is not set)
+ *  @param num_items Number of telegrams
+ *  @param max_size Max. size of reply
+ *  @return Success? (fails if packet or reply doesn't fit)
+ */
+static int nxtnet_srv_parse_items(struct nxtnet_proto_packet *packet,size_t cs_size,size_t *sc_size,struct nxtnet_batch_item *items,size_t num_items,size_t max_size) {
+  char *ptr = ((char*)packet)+cs_size;
+  size_t i;
+
+  for (i=0;i<num_items;i++) {
+    struct nxtnet_proto_batch_item_cs *item_cs = (struct nxtnet_proto_batch_item_cs*)ptr;
+
+    if (cs_size+sizeof(struct nxtnet_proto_batch_item_cs)>packet->size) {
+      return -1;
+    }
+    items[i].send_buf = item_cs->data;
+    items[i].send_size = ntohs(item_cs->send_size);
+    items[i].recv_buf = NULL;
+    items[i].recv_size = ntohs(item_cs->recv_size);
+    items[i].ret = -1;
+    cs_size += sizeof(struct nxtnet_proto_batch_item_cs)+items[i].send_size;
+    *sc_size += sizeof(struct nxtnet_proto_batch_item_sc)+items[i].recv_size;
+    if (cs_size>packet->size || *sc_size>max_size) {
+      return -1;
+    }
+    ptr += sizeof(struct nxtnet_proto_batch_item_cs)+items[i].send_size;
+  }
+
+  return 0;
+}
+
+/**
+ * Allocates telegrams of a BATCH or SUBSCRIBE packet
+ *  @param packet NXTNET packet
+ *  @param cs_size Size of packet up to first telegram
+ *  @param num_items Number of telegrams (as sent by client)
+ *  @return Telegrams (NULL if there can't be that many telegrams in packet or
+ *          if out of memory)
+ */
+static struct nxtnet_batch_item *nxtnet_srv_alloc_items(struct nxtnet_proto_packet *packet,size_t cs_size,size_t num_items) {
+  if (packet->size<cs_size || num_items>(packet->size-cs_size)/sizeof(struct nxtnet_proto_batch_item_cs)) {
+    return NULL;
+  }
+  return malloc((num_items>0?num_items:1)*sizeof(struct nxtnet_batch_item));
+}
+
+/**
+ * Packs replies of a BATCH or SAMPLE packet
+ *  @param ptr Where to pack replies
+ *  @param items Transactions
+ *  @param num_items Number of transactions
+ *  @note Received data is copied only if it isn't at its place already
+ */
+static void nxtnet_srv_pack_items(char *ptr,const struct nxtnet_batch_item *items,size_t num_items) {
+  size_t i;
+
+  for (i=0;i<num_items;i++) {
+    struct nxtnet_proto_batch_item_sc *item_sc = (struct nxtnet_proto_batch_item_sc*)ptr;
+
+    item_sc->size = htons(items[i].ret);
+    if (items[i].ret>0 && items[i].recv_buf!=item_sc->data) {
+      memcpy(item_sc->data,items[i].recv_buf,items[i].ret);
+    }
+    ptr += sizeof(struct nxtnet_proto_batch_item_sc)+items[i].recv_size;
+  }
+}
+
+static void nxtnet_srv_batch(nxtnet_srv_t *srv,struct nxtnet_srv_client *client,struct nxtnet_proto_packet *packet) {
+  struct nxtnet_proto_batch_sc *batch_sc = (struct nxtnet_proto_batch_sc*)packet->data;
+  struct nxtnet_proto_packet *request = malloc(packet->size);
+  struct nxtnet_proto_batch_cs *batch_cs = (struct nxtnet_proto_batch_cs*)request->data;
+  struct nxtnet_batch_item *items;
+  size_t num_items,i;
+  size_t cs_size = sizeof(struct nxtnet_proto_packet)+sizeof(struct nxtnet_proto_batch_cs);
+  size_t sc_size = sizeof(struct nxtnet_proto_packet)+sizeof(struct nxtnet_proto_batch_sc);
+  uint32_t id;
+  int handle;
+  char *ptr;
+
+  // copy request, since reply overlaps it
+  memcpy(request,packet,packet->size);
+  id = ntohl(batch_cs->id);
+  handle = ntohl(batch_cs->handle);
+  num_items = packet->size>=cs_size?ntohl(batch_cs->num_items):0;
+  items = nxtnet_srv_alloc_items(packet,cs_size,num_items);
+
+  if (items==NULL || nxtnet_srv_parse_items(request,cs_size,&sc_size,items,num_items,client->max_size)==-1) {
+    num_items = 0;
+    sc_size = sizeof(struct nxtnet_proto_packet)+sizeof(struct nxtnet_proto_batch_sc);
+    packet->error = NXTNET_ERROR_INVAL;
+  }
+  else {
+    // replies are received directly into the reply packet
+    ptr = batch_sc->items;
+    for (i=0;i<num_items;i++) {
+      items[i].recv_buf = ptr+sizeof(struct nxtnet_proto_batch_item_sc);
+      ptr += sizeof(struct nxtnet_proto_batch_item_sc)+items[i].recv_size;
+    }
+
+    if (srv->ops.batch!=NULL) {
+      srv->ops.batch(handle,items,num_items);
+      packet->error = 0;
+    }
+    else if (srv->ops.transact!=NULL || (srv->ops.send!=NULL && srv->ops.recv!=NULL)) {
+      for (i=0;i<num_items;i++) {
+        if (srv->ops.transact!=NULL) {
+          items[i].ret = srv->ops.transact(handle,items[i].send_buf,items[i].send_size,items[i].recv_buf,items[i].recv_size);
+        }
+        else if (srv->ops.send(handle,items[i].send_buf,items[i].send_size)==items[i].send_size) {
+          items[i].ret = items[i].recv_size>0?srv->ops.recv(handle,items[i].recv_buf,items[i].recv_size):0;
+        }
+      }
+      packet->error = 0;
+    }
+    else {
+      num_items = 0;
+      sc_size = sizeof(struct nxtnet_proto_packet)+sizeof(struct nxtnet_proto_batch_sc);
+      packet->error = NXTNET_ERROR_NOTIMPL;
+    }
+  }
+
+  nxtnet_srv_pack_items(batch_sc->items,items,num_items);
+  free(items);
+  free(request);
+
+  batch_sc->id = htonl(id);
+  batch_sc->handle = htonl(handle);
+  batch_sc->num_items = htonl(num_items);
+  packet->cmd = NXTNET_PROTO_DIR_SC|NXTNET_PROTO_CMD_BATCH;
+  packet->size = sc_size;
+}
+
+/**
+ * Releases a reference to a client. Frees client if it was the last one.
+ *  @param client Client
+ */
+static void nxtnet_srv_client_put(struct nxtnet_srv_client *client) {
+  struct nxtnet_srv_reply *reply;
+  int last;
+
+  pthread_mutex_lock(&client->mutex);
+  last = --client->refs==0;
+  pthread_mutex_unlock(&client->mutex);
+
+  if (last) {
+    while (client->out_first!=NULL) {
+      reply = client->out_first;
+      client->out_first = reply->next;
+      free(reply->packet);
+      free(reply);
+    }
+    close(client->sock);
+    pthread_mutex_destroy(&client->mutex);
+    nxtnet_rbuf_destroy(client->rbuf);
+    free(client);
+  }
+}
+
+/**
+ * Sends as much of client's queued replies as possible without blocking
+ *  @param srv NXTNET server descriptor
+ *  @param client Client
+ *  @note Client's mutex must be locked
+ */
+static void nxtnet_srv_client_flush(nxtnet_srv_t *srv,struct nxtnet_srv_client *client) {
+  struct nxtnet_srv_reply *reply;
+  struct iovec iov[NXTNET_SRV_MAXIOV];
+  struct epoll_event ev;
+  ssize_t c;
+  int iovcnt;
+
+  while (client->out_first!=NULL) {
+    // gather queued replies to send them with one system call
+    iovcnt = 0;
+    for (reply=client->out_first;reply!=NULL && iovcnt<NXTNET_SRV_MAXIOV;reply=reply->next) {
+      iov[iovcnt].iov_base = (char*)reply->packet;
+      iov[iovcnt].iov_len = reply->size;
+      iovcnt++;
+    }
+    iov[0].iov_base = ((char*)iov[0].iov_base)+client->out_pos;
+    iov[0].iov_len -= client->out_pos;
+
+    c = writev(client->sock,iov,iovcnt);
+    if (c==-1) {
+      if (errno==EINTR) {
+        continue;
+      }
+      else if (errno==EAGAIN || errno==EWOULDBLOCK) {
+        break;
+      }
+      else {
+        // connection broken; reactor notices hang up
+        return;
+      }
+    }
+
+    // free replies that were sent completely
+    c += client->out_pos;
+    while ((reply = client->out_first)!=NULL && c>=reply->size) {
+      c -= reply->size;
+      client->out_first = reply->next;
+      client->out_num--;
+      free(reply->packet);
+      free(reply);
+    }
+    if (client->out_first==NULL) {
+      client->out_last = NULL;
+    }
+    client->out_pos = c;
+  }
+
+  // wait for socket to become writable if there is something left
+  ev.events = EPOLLIN|(client->out_first!=NULL?EPOLLOUT:0);
+  ev.data.ptr = client;
+  epoll_ctl(srv->epfd,EPOLL_CTL_MOD,client->sock,&ev);
+}
+
+/**
+ * Queues a reply for client
+ *  @param srv NXTNET server descriptor
+ *  @param client Client
+ *  @param packet Packet in host byte order (ownership is taken)
+ */
+static void nxtnet_srv_reply(nxtnet_srv_t *srv,struct nxtnet_srv_client *client,struct nxtnet_proto_packet *packet) {
+  struct nxtnet_srv_reply *reply;
+
+  pthread_mutex_lock(&client->mutex);
+  if (client->closed) {
+    free(packet);
+  }
+  else {
+    reply = malloc(sizeof(struct nxtnet_srv_reply));
+    reply->next = NULL;
+    if (client->format==NXTNET_PROTO_FORMAT_COMPACT) {
+      reply->size = nxtnet_proto_compact(&packet);
+    }
+    else if (client->format==NXTNET_PROTO_FORMAT_V0) {
+      reply->size = nxtnet_proto_v0(&packet);
+    }
+    else {
+      reply->size = packet->size;
+      packet->sig = htonl(packet->sig);
+      packet->size = htons(packet->size);
+    }
+    reply->packet = packet;
+    client->out_num++;
+
+    if (client->out_last!=NULL) {
+      client->out_last->next = reply;
+    }
+    else {
+      client->out_first = reply;
+    }
+    client->out_last = reply;
+
+    // only try to send, if there was nothing queued before
+    if (client->out_first==reply) {
+      nxtnet_srv_client_flush(srv,client);
+    }
+  }
+  pthread_mutex_unlock(&client->mutex);
+}
+
+/**
+ * Sends a sample of a subscription to its client
+ *  @param ctx Subscription
+ *  @param time Time of sample
+ *  @param items Transactions with results
+ *  @param num_items Number of transactions
+ *  @note Samples are dropped if the client doesn't receive its replies fast
+ *        enough.
+ */
+static void nxtnet_srv_sample(void *ctx,const struct timespec *time,const struct nxtnet_batch_item *items,size_t num_items) {
+  struct nxtnet_srv_sub *sub = (struct nxtnet_srv_sub*)ctx;
+  struct nxtnet_proto_packet *packet;
+  struct nxtnet_proto_sample_sc *sample_sc;
+  size_t size = sizeof(struct nxtnet_proto_packet)+sizeof(struct nxtnet_proto_sample_sc);
+  size_t i;
+  int drop;
+
+  pthread_mutex_lock(&sub->client->mutex);
+  drop = sub->client->out_num>=NXTNET_SRV_MAXQUEUE;
+  pthread_mutex_unlock(&sub->client->mutex);
+  if (drop) {
+    return;
+  }
+
+  for (i=0;i<num_items;i++) {
+    size += sizeof(struct nxtnet_proto_batch_item_sc)+items[i].recv_size;
+  }
+
+  packet = malloc(size);
+  memset(packet,0,sizeof(struct nxtnet_proto_packet));
+  packet->sig = NXTNET_PROTO_SIG;
+  packet->cmd = NXTNET_PROTO_DIR_SC|NXTNET_PROTO_CMD_SAMPLE;
+  packet->size = size;
+  packet->error = 0;
+
+  sample_sc = (struct nxtnet_proto_sample_sc*)packet->data;
+  sample_sc->id = htonl(sub->id);
+  sample_sc->handle = htonl(sub->handle);
+  sample_sc->time_sec = htonl(time->tv_sec);
+  sample_sc->time_usec = htonl(time->tv_nsec/1000);
+  sample_sc->num_items = htonl(num_items);
+  nxtnet_srv_pack_items(sample_sc->items,items,num_items);
+
+  nxtnet_srv_reply(sub->srv,sub->client,packet);
+}
+
+/**
+ * Cancels a subscription and frees it
+ *  @param srv NXTNET server descriptor
+ *  @param sub Subscription (already removed from client's list)
+ *  @note ops.unsubscribe may block until the NXT finished a sample, so this
+ *        must not be called by the reactor
+ */
+static void nxtnet_srv_sub_free(nxtnet_srv_t *srv,struct nxtnet_srv_sub *sub) {
+  srv->ops.unsubscribe(sub->sub);
+  nxtnet_srv_client_put(sub->client);
+  free(sub);
+}
+
+static void nxtnet_srv_subscribe(nxtnet_srv_t *srv,struct nxtnet_srv_client *client,struct nxtnet_proto_packet *packet) {
+  struct nxtnet_proto_subscribe_cs *subscribe_cs = (struct nxtnet_proto_subscribe_cs*)packet->data;
+  struct nxtnet_proto_subscribe_sc *subscribe_sc = (struct nxtnet_proto_subscribe_sc*)packet->data;
+  struct nxtnet_batch_item *items;
+  struct nxtnet_srv_sub *sub;
+  size_t cs_size = sizeof(struct nxtnet_proto_packet)+sizeof(struct nxtnet_proto_subscribe_cs);
+  size_t sc_size = sizeof(struct nxtnet_proto_packet)+sizeof(struct nxtnet_proto_sample_sc);
+  size_t num_items = packet->size>=cs_size?ntohl(subscribe_cs->num_items):0;
+  uint32_t id = ntohl(subscribe_cs->id);
+  int handle = ntohl(subscribe_cs->handle);
+  unsigned int interval = ntohl(subscribe_cs->interval);
+
+  nxtnet_srv_log(srv,"Subscription %u to NXT %d: %u telegrams every %u us\n",id,handle,(unsigned int)num_items,interval);
+
+  items = nxtnet_srv_alloc_items(packet,cs_size,num_items);
+  if (srv->ops.subscribe==NULL || srv->ops.unsubscribe==NULL) {
+    packet->error = NXTNET_ERROR_NOTIMPL;
+  }
+  else if (items==NULL || num_items==0 || nxtnet_srv_parse_items(packet,cs_size,&sc_size,items,num_items,client->max_size)==-1) {
+    packet->error = NXTNET_ERROR_INVAL;
+  }
+  else {
+    sub = malloc(sizeof(struct nxtnet_srv_sub));
+    sub->srv = srv;
+    sub->client = client;
+    sub->id = id;
+    sub->handle = handle;
+
+    pthread_mutex_lock(&client->mutex);
+    client->refs++;
+    pthread_mutex_unlock(&client->mutex);
+
+    sub->sub = srv->ops.subscribe(handle,interval,items,num_items,nxtnet_srv_sample,sub);
+    if (sub->sub==NULL) {
+      nxtnet_srv_client_put(client);
+      free(sub);
+      packet->error = NXTNET_ERROR_INVAL;
+    }
+    else {
+      pthread_mutex_lock(&client->mutex);
+      if (client->closed) {
+        // client hung up meanwhile
+        pthread_mutex_unlock(&client->mutex);
+        nxtnet_srv_sub_free(srv,sub);
+      }
+      else {
+        sub->next = client->subs;
+        client->subs = sub;
+        pthread_mutex_unlock(&client->mutex);
+      }
+      packet->error = 0;
+    }
+  }
+  free(items);
+
+  subscribe_sc->id = htonl(id);
+  subscribe_sc->handle = htonl(handle);
+  packet->cmd = NXTNET_PROTO_DIR_SC|NXTNET_PROTO_CMD_SUBSCRIBE;
+  packet->size = sizeof(struct nxtnet_proto_packet)+sizeof(struct nxtnet_proto_subscribe_sc);
+}
+
+static void nxtnet_srv_unsubscribe(nxtnet_srv_t *srv,struct nxtnet_srv_client *client,struct nxtnet_proto_packet *packet) {
+  struct nxtnet_proto_unsubscribe_cs *unsubscribe_cs = (struct nxtnet_proto_unsubscribe_cs*)packet->data;
+  struct nxtnet_proto_subscribe_sc *subscribe_sc = (struct nxtnet_proto_subscribe_sc*)packet->data;
+  struct nxtnet_srv_sub **prev,*sub = NULL;
+  uint32_t id = ntohl(unsubscribe_cs->id);
+  int handle = ntohl(unsubscribe_cs->handle);
+
+  nxtnet_srv_log(srv,"Cancel subscription %u to NXT %d\n",id,handle);
+
+  pthread_mutex_lock(&client->mutex);
+  for (prev=&client->subs;*prev!=NULL;prev=&(*prev)->next) {
+    if ((*prev)->id==id) {
+      sub = *prev;
+      *prev = sub->next;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&client->mutex);
+
+  if (sub!=NULL) {
+    nxtnet_srv_sub_free(srv,sub);
+    packet->error = 0;
+  }
+  else {
+    packet->error = NXTNET_ERROR_INVAL;
+  }
+
+  subscribe_sc->id = htonl(id);
+  subscribe_sc->handle = htonl(handle);
+  packet->cmd = NXTNET_PROTO_DIR_SC|NXTNET_PROTO_CMD_UNSUBSCRIBE;
+  packet->size = sizeof(struct nxtnet_proto_packet)+sizeof(struct nxtnet_proto_subscribe_sc);
+}
+
+/**
+ * Returns how big the buffer for the reply to a request must be
+ *  @param client Client
+ *  @param packet Request packet (at least nxtnet_srv_request_size() bytes)
+ *  @return Size of reply buffer
+ *  @note Sizes requested by the client are limited to client->max_size. The
+ *        handlers check the request against that limit.
+ */
+static size_t nxtnet_srv_reply_size(struct nxtnet_srv_client *client,struct nxtnet_proto_packet *packet) {
+  size_t size;
+
+  if (packet->cmd==NXTNET_PROTO_CMD_SEND) {
+    size = sizeof(struct nxtnet_proto_packet)+sizeof(struct nxtnet_proto_send_sc);
+  }
+  else if (packet->cmd==NXTNET_PROTO_CMD_RECV) {
+    size = sizeof(struct nxtnet_proto_packet)+sizeof(struct nxtnet_proto_recv_sc)+ntohl(((struct nxtnet_proto_recv_cs*)packet->data)->size);
+  }
+  else if (packet->cmd==NXTNET_PROTO_CMD_TRANSACT) {
+    size = sizeof(struct nxtnet_proto_packet)+sizeof(struct nxtnet_proto_transact_sc)+ntohl(((struct nxtnet_proto_transact_cs*)packet->data)->recv_size);
+  }
+  else if (packet->cmd==NXTNET_PROTO_CMD_SUBSCRIBE || packet->cmd==NXTNET_PROTO_CMD_UNSUBSCRIBE) {
+    size = sizeof(struct nxtnet_proto_packet)+sizeof(struct nxtnet_proto_subscribe_sc);
+  }
+  else {
+    // LIST, BATCH and STATS fill up to a whole packet
+    size = client->max_size;
+  }
+
+  if (size>client->max_size) {
+    size = client->max_size;
+  }
+  return size>packet->size?size:packet->size;
+}
+
+/**
+ * Checks whether a job for a NXT would have to wait for another job
+ *  @param pool Worker pool
+ *  @param handle NXT handle
+ *  @param until Queued job up to which is checked (NULL for whole queue)
+ *  @return Whether a worker runs a job for the NXT or an earlier job for it
+ *          is queued
+ *  @note Must be called with pool's mutex locked
+ */
+static int nxtnet_srv_pool_busy(struct nxtnet_srv_pool *pool,int handle,struct nxtnet_srv_job *until) {
+  struct nxtnet_srv_job *job;
+  size_t i;
+
+  if (handle==-1) {
+    return 0;
+  }
+  for (i=0;i<pool->num_workers;i++) {
+    if (pool->workers[i].handle==handle) {
+      return 1;
+    }
+  }
+  for (job=pool->first;job!=until;job=job->next) {
+    if (job->handle==handle) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/**
+ * Takes the first queued job that can run now
+ *  @param pool Worker pool
+ *  @return Job (NULL if there is none)
+ *  @note Must be called with pool's mutex locked
+ */
+static struct nxtnet_srv_job *nxtnet_srv_pool_take(struct nxtnet_srv_pool *pool) {
+  struct nxtnet_srv_job *job,*prev = NULL;
+
+  for (job=pool->first;job!=NULL;prev=job,job=job->next) {
+    if (!nxtnet_srv_pool_busy(pool,job->handle,job)) {
+      if (prev!=NULL) {
+        prev->next = job->next;
+      }
+      else {
+        pool->first = job->next;
+      }
+      if (pool->last==job) {
+        pool->last = prev;
+      }
+      return job;
+    }
+  }
+  return NULL;
+}
+
+/**
+ * Executes a job
+ *  @param srv NXTNET server descriptor
+ *  @param job Job (is freed)
+ */
+static void nxtnet_srv_run(nxtnet_srv_t *srv,struct nxtnet_srv_job *job) {
+  if (job->packet==NULL) {
+    nxtnet_srv_sub_free(srv,job->sub);
+    free(job);
+    return;
+  }
+
+  // request packets are allocated with their exact size
+  job->packet = realloc(job->packet,nxtnet_srv_reply_size(job->client,job->packet));
+
+  if (job->packet->cmd==NXTNET_PROTO_CMD_LIST) {
+    nxtnet_srv_list(srv,job->client,job->packet);
+  }
+  else if (job->packet->cmd==NXTNET_PROTO_CMD_SEND) {
+    nxtnet_srv_send(srv,job->client,job->packet);
+  }
+  else if (job->packet->cmd==NXTNET_PROTO_CMD_RECV) {
+    nxtnet_srv_recv(srv,job->client,job->packet);
+  }
+  else if (job->packet->cmd==NXTNET_PROTO_CMD_TRANSACT) {
+    nxtnet_srv_transact(srv,job->client,job->packet);
+  }
+  else if (job->packet->cmd==NXTNET_PROTO_CMD_BATCH) {
+    nxtnet_srv_batch(srv,job->client,job->packet);
+  }
+  else if (job->packet->cmd==NXTNET_PROTO_CMD_SUBSCRIBE) {
+    nxtnet_srv_subscribe(srv,job->client,job->packet);
+  }
+  else if (job->packet->cmd==NXTNET_PROTO_CMD_UNSUBSCRIBE) {
+    nxtnet_srv_unsubscribe(srv,job->client,job->packet);
+  }
+  else if (job->packet->cmd==NXTNET_PROTO_CMD_STATS) {
+    nxtnet_srv_stats(srv,job->client,job->packet);
+  }
+
+  nxtnet_srv_reply(srv,job->client,job->packet);
+  nxtnet_srv_client_put(job->client);
+  free(job);
+}
+
+/**
+ * Worker thread. Executes NXT operations, so that a slow NXT does not block
+ * the server.
+ *  @param arg Worker
+ *  @note A worker takes any job, except one for a NXT that another worker is
+ *        busy with. So jobs for a NXT run in the order they arrived, but a
+ *        slow NXT only keeps one worker busy.
+ */
+static void *nxtnet_srv_worker(void *arg) {
+  struct nxtnet_srv_worker *worker = (struct nxtnet_srv_worker*)arg;
+  nxtnet_srv_t *srv = worker->srv;
+  struct nxtnet_srv_pool *pool = srv->pool;
+  struct nxtnet_srv_job *job;
+
+  pthread_mutex_lock(&pool->mutex);
+  while (1) {
+    while ((job = nxtnet_srv_pool_take(pool))==NULL && !pool->quit) {
+      pool->idle++;
+      pthread_cond_wait(&pool->cond,&pool->mutex);
+      pool->idle--;
+      if (pool->wakeups>0) {
+        pool->wakeups--;
+      }
+    }
+    if (job==NULL) {
+      break;
+    }
+
+    worker->handle = job->handle;
+    pthread_mutex_unlock(&pool->mutex);
+    nxtnet_srv_run(srv,job);
+    pthread_mutex_lock(&pool->mutex);
+    worker->handle = -1;
+  }
+  pthread_mutex_unlock(&pool->mutex);
+
+  return NULL;
+}
+
+/**
+ * Starts a worker thread
+ *  @param srv NXTNET server descriptor
+ *  @return Success?
+ *  @note Must be called with pool's mutex locked
+ */
+static int nxtnet_srv_pool_grow(nxtnet_srv_t *srv) {
+  struct nxtnet_srv_pool *pool = srv->pool;
+  struct nxtnet_srv_worker *worker = pool->workers+pool->num_workers;
+
+  if (pool->num_workers>=NXTNET_SRV_MAX_WORKERS) {
+    return -1;
+  }
+  worker->srv = srv;
+  worker->handle = -1;
+  if (pthread_create(&worker->tid,NULL,nxtnet_srv_worker,worker)!=0) {
+    return -1;
+  }
+  pool->num_workers++;
+  return 0;
+}
+
+/**
+ * Queues a job for the worker threads
+ *  @param srv NXTNET server descriptor
+ *  @param job Job
+ *  @note If no worker is free for a job that can run now, another worker is
+ *        started.
+ */
+static void nxtnet_srv_queue(nxtnet_srv_t *srv,struct nxtnet_srv_job *job) {
+  struct nxtnet_srv_pool *pool = srv->pool;
+
+  job->next = NULL;
+  pthread_mutex_lock(&pool->mutex);
+  if (!nxtnet_srv_pool_busy(pool,job->handle,NULL)) {
+    // job can run now; make sure a worker takes it
+    if (pool->idle>pool->wakeups) {
+      pool->wakeups++;
+      pthread_cond_signal(&pool->cond);
+    }
+    else {
+      nxtnet_srv_pool_grow(srv);
+    }
+  }
+  if (pool->last!=NULL) {
+    pool->last->next = job;
+  }
+  else {
+    pool->first = job;
+  }
+  pool->last = job;
+  pthread_mutex_unlock(&pool->mutex);
+}
+
+/**
+ * Hands request over to a worker thread
+ *  @param srv NXTNET server descriptor
+ *  @param client Client
+ *  @param packet Request packet (ownership is taken)
+ *  @note Requests for the same NXT are executed one after another in the
+ *        order they arrived.
+ */
+static void nxtnet_srv_dispatch(nxtnet_srv_t *srv,struct nxtnet_srv_client *client,struct nxtnet_proto_packet *packet) {
+  struct nxtnet_srv_job *job;
+  int handle;
+
+  if (packet->cmd==NXTNET_PROTO_CMD_SEND || packet->cmd==NXTNET_PROTO_CMD_RECV) {
+    // handle is first field of SEND and RECV data
+    handle = ntohl(((struct nxtnet_proto_send_cs*)packet->data)->handle);
+  }
+  else if (packet->cmd==NXTNET_PROTO_CMD_TRANSACT) {
+    handle = ntohl(((struct nxtnet_proto_transact_cs*)packet->data)->handle);
+  }
+  else if (packet->cmd==NXTNET_PROTO_CMD_BATCH) {
+    handle = ntohl(((struct nxtnet_proto_batch_cs*)packet->data)->handle);
+  }
+  else if (packet->cmd==NXTNET_PROTO_CMD_SUBSCRIBE || packet->cmd==NXTNET_PROTO_CMD_UNSUBSCRIBE) {
+    // handle is second field of SUBSCRIBE and UNSUBSCRIBE data
+    handle = ntohl(((struct nxtnet_proto_unsubscribe_cs*)packet->data)->handle);
+  }
+  else {
+    handle = -1;
+  }
+
+  pthread_mutex_lock(&client->mutex);
+  client->refs++;
+  pthread_mutex_unlock(&client->mutex);
+
+  job = malloc(sizeof(struct nxtnet_srv_job));
+  job->client = client;
+  job->packet = packet;
+  job->sub = NULL;
+  job->handle = handle<0?-1:handle;
+  nxtnet_srv_queue(srv,job);
+}
+
+/**
+ * Accepts a new client
+ *  @param srv NXTNET server descriptor
+ *  @param master Listening socket (TCP or UNIX domain)
+ */
+static void nxtnet_srv_accept(nxtnet_srv_t *srv,int master) {
+  struct sockaddr_storage addr_storage;
+  struct sockaddr_in *addr = (struct sockaddr_in*)&addr_storage;
+  socklen_t addrlen = sizeof(addr_storage);
+  struct nxtnet_srv_client *client;
+  struct epoll_event ev;
+  char hostname[INET_ADDRSTRLEN];
+  int sock;
+  int on = 1;
+
+  if ((sock = accept(master,(struct sockaddr*)&addr_storage,&addrlen))<0) {
+    return;
+  }
+  if (addr->sin_family==AF_INET) {
+    if (srv->local && addr->sin_addr.s_addr!=0x0100007F) {
+      close(sock);
+      return;
+    }
+    // replies are written at once; don't delay them
+    setsockopt(sock,IPPROTO_TCP,TCP_NODELAY,&on,sizeof(on));
+    inet_ntop(AF_INET,&addr->sin_addr,hostname,INET_ADDRSTRLEN);
+  }
+  else {
+    strcpy(hostname,"local");
+  }
+
+  client = malloc(sizeof(struct nxtnet_srv_client));
+  memset(client,0,sizeof(struct nxtnet_srv_client));
+  client->sock = sock;
+  client->refs = 1;
+  client->rbuf = nxtnet_rbuf_create(NXTNET_RBUFSIZE);
+  nxtnet_rbuf_accept_v0(client->rbuf);
+  client->max_size = NXTNET_BUFSIZE;
+  client->authed = srv->password[0]==0;
+  client->format = NXTNET_PROTO_FORMAT_PLAIN;
+  pthread_mutex_init(&client->mutex,NULL);
+  fcntl(sock,F_SETFL,fcntl(sock,F_GETFL,0)|O_NONBLOCK);
+
+  ev.events = EPOLLIN;
+  ev.data.ptr = client;
+  if (epoll_ctl(srv->epfd,EPOLL_CTL_ADD,sock,&ev)==-1) {
+    nxtnet_srv_client_put(client);
+    return;
+  }
+
+  client->next = srv->clients;
+  srv->clients = client;
+
+  nxtnet_srv_log(srv,"New client %s on sock %d\n",hostname,sock);
+}
+
+/**
+ * Disconnects a client
+ *  @param srv NXTNET server descriptor
+ *  @param client Client
+ */
+static void nxtnet_srv_hangup(nxtnet_srv_t *srv,struct nxtnet_srv_client *client) {
+  struct nxtnet_srv_client **prev;
+  struct nxtnet_srv_sub *subs,*sub;
+  struct nxtnet_srv_job *job;
+
+  nxtnet_srv_log(srv,"Client sock %d hang up\n",client->sock);
+
+  for (prev=&srv->clients;*prev!=NULL;prev=&(*prev)->next) {
+    if (*prev==client) {
+      *prev = client->next;
+      break;
+    }
+  }
+
+  epoll_ctl(srv->epfd,EPOLL_CTL_DEL,client->sock,NULL);
+  pthread_mutex_lock(&client->mutex);
+  client->closed = 1;
+  subs = client->subs;
+  client->subs = NULL;
+  pthread_mutex_unlock(&client->mutex);
+
+  // cancel client's subscriptions (by workers, since that may block)
+  while (subs!=NULL) {
+    sub = subs;
+    subs = sub->next;
+    if (srv->pool!=NULL) {
+      job = malloc(sizeof(struct nxtnet_srv_job));
+      job->client = client;
+      job->packet = NULL;
+      job->sub = sub;
+      job->handle = sub->handle<0?-1:sub->handle;
+      nxtnet_srv_queue(srv,job);
+    }
+    else {
+      nxtnet_srv_sub_free(srv,sub);
+    }
+  }
+  shutdown(client->sock,SHUT_RDWR);
+  nxtnet_srv_client_put(client);
+}
+
+/**
+ * Returns the minimum size of a request
+ *  @param cmd Command
+ *  @param format Frame format of client
+ *  @return Size of header and fixed command specific data (0 if command is
+ *          unknown)
+ */
+static size_t nxtnet_srv_request_size(int cmd,int format) {
+  size_t size = sizeof(struct nxtnet_proto_packet);
+
+  // protocol version 0 only knows LIST, SEND and RECV
+  if (format==NXTNET_PROTO_FORMAT_V0 && cmd!=NXTNET_PROTO_CMD_LIST && cmd!=NXTNET_PROTO_CMD_SEND && cmd!=NXTNET_PROTO_CMD_RECV) return 0;
+
+  if (cmd==NXTNET_PROTO_CMD_HELLO) return size+offsetof(struct nxtnet_proto_hello_cs,format);
+  else if (cmd==NXTNET_PROTO_CMD_LIST) return size;
+  else if (cmd==NXTNET_PROTO_CMD_SEND) return size+sizeof(struct nxtnet_proto_send_cs);
+  else if (cmd==NXTNET_PROTO_CMD_RECV) return size+sizeof(struct nxtnet_proto_recv_cs);
+  else if (cmd==NXTNET_PROTO_CMD_TRANSACT) return size+sizeof(struct nxtnet_proto_transact_cs);
+  else if (cmd==NXTNET_PROTO_CMD_BATCH) return size+sizeof(struct nxtnet_proto_batch_cs);
+  else if (cmd==NXTNET_PROTO_CMD_SUBSCRIBE) return size+sizeof(struct nxtnet_proto_subscribe_cs);
+  else if (cmd==NXTNET_PROTO_CMD_UNSUBSCRIBE) return size+sizeof(struct nxtnet_proto_unsubscribe_cs);
+  else if (cmd==NXTNET_PROTO_CMD_STATS) return size;
+  else return 0;
+}
+
+/**
+ * Starts session of client: checks password and negotiates max. packet size
+ *  @param srv NXTNET server descriptor
+ *  @param client Client
+ *  @param packet HELLO packet
+ *  @note Runs in the reactor, since it changes the client's receive buffer.
+ *        Clients must send HELLO before any other request, if the server
+ *        has a password.
+ */
+static void nxtnet_srv_hello(nxtnet_srv_t *srv,struct nxtnet_srv_client *client,struct nxtnet_proto_packet *packet) {
+  struct nxtnet_proto_hello_cs *hello_cs = (struct nxtnet_proto_hello_cs*)packet->data;
+  struct nxtnet_proto_hello_sc *hello_sc = (struct nxtnet_proto_hello_sc*)packet->data;
+  size_t max_size = ntohl(hello_cs->max_size);
+  int format = NXTNET_PROTO_FORMAT_PLAIN;
+
+  client->authed = memcmp(hello_cs->password,srv->password,NXTNET_PWD_LEN)==0;
+  if (!client->authed) {
+    nxtnet_srv_log(srv,"Client sock %d sent wrong password\n",client->sock);
+    packet->cmd = NXTNET_PROTO_DIR_SC|NXTNET_PROTO_CMD_HELLO;
+    packet->error = NXTNET_ERROR_WROPWD;
+    packet->size = sizeof(struct nxtnet_proto_packet);
+    nxtnet_srv_reply(srv,client,packet);
+    return;
+  }
+
+  if (max_size<NXTNET_BUFSIZE) {
+    max_size = NXTNET_BUFSIZE;
+  }
+  else if (max_size>NXTNET_MAXSIZE) {
+    max_size = NXTNET_MAXSIZE;
+  }
+  client->max_size = max_size;
+  nxtnet_rbuf_set_max(client->rbuf,max_size);
+
+  // old clients don't send a format and only understand plain frames
+  if (packet->size>=sizeof(struct nxtnet_proto_packet)+sizeof(struct nxtnet_proto_hello_cs)
+   && ntohl(hello_cs->format)>=NXTNET_PROTO_FORMAT_COMPACT) {
+    format = NXTNET_PROTO_FORMAT_COMPACT;
+  }
+
+  nxtnet_srv_log(srv,"Client sock %d uses packets up to %u bytes (%s frames)\n",client->sock,(unsigned int)max_size,format==NXTNET_PROTO_FORMAT_COMPACT?"compact":"plain");
+
+  hello_sc->max_size = htonl(max_size);
+  hello_sc->format = htonl(format);
+  packet->cmd = NXTNET_PROTO_DIR_SC|NXTNET_PROTO_CMD_HELLO;
+  packet->size = sizeof(struct nxtnet_proto_packet)+sizeof(struct nxtnet_proto_hello_sc);
   packet->error = 0;
+
+  // reply to HELLO is still sent in the old format
+  nxtnet_srv_reply(srv,client,packet);
+  pthread_mutex_lock(&client->mutex);
+  client->format = format;
+  pthread_mutex_unlock(&client->mutex);
+  nxtnet_rbuf_set_format(client->rbuf,format);
+}
+
+/**
+ * Checks password of a request of protocol version 0
+ *  @param srv NXTNET server descriptor
+ *  @param client Client
+ *  @note Such clients send no HELLO, but the password with every request.
+ *        They get their replies in the old format, with at most
+ *        NXTNET_BUFSIZE bytes.
+ */
+static void nxtnet_srv_v0(nxtnet_srv_t *srv,struct nxtnet_srv_client *client) {
+  if (client->format!=NXTNET_PROTO_FORMAT_V0) {
+    nxtnet_srv_log(srv,"Client sock %d uses protocol version 0\n",client->sock);
+    client->max_size = NXTNET_BUFSIZE-NXTNET_PWD_LEN;
+    pthread_mutex_lock(&client->mutex);
+    client->format = NXTNET_PROTO_FORMAT_V0;
+    pthread_mutex_unlock(&client->mutex);
+  }
+  client->authed = strncmp(client->rbuf->password,srv->password,NXTNET_PWD_LEN)==0;
+}
+
+/**
+ * Handles a request from client
+ *  @param srv NXTNET server descriptor
+ *  @param client Client
+ *  @param packet Request packet (ownership is taken)
+ */
+static void nxtnet_srv_request(nxtnet_srv_t *srv,struct nxtnet_srv_client *client,struct nxtnet_proto_packet *packet) {
+  size_t min_size;
+
+  if (client->rbuf->format==NXTNET_PROTO_FORMAT_V0) {
+    nxtnet_srv_v0(srv,client);
+  }
+  min_size = nxtnet_srv_request_size(packet->cmd,client->format);
+
+  if (min_size>0 && packet->size<min_size) {
+    packet->cmd = (packet->cmd&(~NXTNET_PROTO_DIR_MASK))|NXTNET_PROTO_DIR_SC;
+    packet->error = NXTNET_ERROR_INVAL;
+    packet->size = sizeof(struct nxtnet_proto_packet);
+    nxtnet_srv_reply(srv,client,packet);
+  }
+  else if (packet->cmd==NXTNET_PROTO_CMD_HELLO && min_size>0) {
+    nxtnet_srv_hello(srv,client,packet);
+  }
+  else if (!client->authed) {
+    packet->cmd = (packet->cmd&(~NXTNET_PROTO_DIR_MASK))|NXTNET_PROTO_DIR_SC;
+    packet->error = NXTNET_ERROR_WROPWD;
+    packet->size = sizeof(struct nxtnet_proto_packet);
+    nxtnet_srv_reply(srv,client,packet);
+  }
+  else if (min_size>0) {
+    nxtnet_srv_dispatch(srv,client,packet);
+  }
+  else {
+    packet->cmd = (packet->cmd&(~NXTNET_PROTO_DIR_MASK))|NXTNET_PROTO_DIR_SC;
+    packet->error = NXTNET_ERROR_NOTIMPL;
+    packet->size = sizeof(struct nxtnet_proto_packet);
+    nxtnet_srv_reply(srv,client,packet);
+  }
+}
+
+/**
+ * Reads from client and handles all complete requests
+ *  @param srv NXTNET server descriptor
+ *  @param client Client
+ *  @return 0 on success, -1 if client hung up or sent garbage
+ */
+static int nxtnet_srv_read(nxtnet_srv_t *srv,struct nxtnet_srv_client *client) {
+  struct nxtnet_proto_packet *packet;
+  size_t packet_size;
+  ssize_t size;
+  int ret;
+
+  size = nxtnet_rbuf_read(client->rbuf,client->sock);
+  if (size==0 || (size==-1 && errno!=EAGAIN && errno!=EWOULDBLOCK)) {
+    return -1;
+  }
+
+  // there may be zero or more requests in buffer
+  while (1) {
+    packet = NULL;
+    packet_size = 0;
+    ret = nxtnet_rbuf_get(client->rbuf,&packet,&packet_size);
+    if (ret==1) {
+      nxtnet_srv_request(srv,client,packet);
+    }
+    else {
+      free(packet);
+      return ret;
+    }
+  }
 }
 
+/**
+ * Runs the server
+ *  @param srv NXTNET server descriptor
+ *  @return 0 on success, -1 on failure
+ *  @note Sockets are handled by this thread; NXT operations run on
+ *        worker threads (at least NXTNET_SRV_WORKERS, one more per busy NXT).
+ */
 int nxtnet_srv_mainloop(nxtnet_srv_t *srv) {
-  fd_set fds_master;
-  fd_set fds_read;
-  int fds_max = srv->sock;
-  int i;
-  struct timeval timeout;
+  struct epoll_event ev,events[NXTNET_SRV_MAXEVENTS];
+  struct nxtnet_srv_client *client;
+  int i,n;
+
+  if (listen(srv->sock,NXTNET_SRV_LISTEN_MAX)==-1) return -1;
 
-  if (listen(srv->sock,NXTNET_SRV_LISTEN_MAX)==-1) return;
+  srv->epfd = epoll_create1(0);
+  if (srv->epfd==-1) return -1;
+
+  ev.events = EPOLLIN;
+  ev.data.ptr = NULL;
+  if (epoll_ctl(srv->epfd,EPOLL_CTL_ADD,srv->sock,&ev)==-1) return -1;
+
+  // UNIX domain socket is optional
+  if (srv->usock!=-1) {
+    ev.events = EPOLLIN;
+    ev.data.ptr = &srv->usock;
+    if (listen(srv->usock,NXTNET_SRV_LISTEN_MAX)==-1 || epoll_ctl(srv->epfd,EPOLL_CTL_ADD,srv->usock,&ev)==-1) {
+      close(srv->usock);
+      unlink(srv->upath);
+      srv->usock = -1;
+    }
+  }
 
-  FD_ZERO(&fds_master);
-  FD_ZERO(&fds_read);
-  FD_SET(srv->sock,&fds_master);
+  // start workers
+  srv->pool = malloc(sizeof(struct nxtnet_srv_pool));
+  memset(srv->pool,0,sizeof(struct nxtnet_srv_pool));
+  pthread_mutex_init(&srv->pool->mutex,NULL);
+  pthread_cond_init(&srv->pool->cond,NULL);
+  pthread_mutex_lock(&srv->pool->mutex);
+  for (i=0;i<NXTNET_SRV_WORKERS;i++) {
+    nxtnet_srv_pool_grow(srv);
+  }
+  pthread_mutex_unlock(&srv->pool->mutex);
 
   while (1) {
-    fds_read = fds_master;
-    timeout.tv_sec = NXTNET_SELECT_TIMEOUT;
-    timeout.tv_usec = 0;
-    if (select(fds_max+1,&fds_read,NULL,NULL,&timeout)==-1) {
-      perror("select of server socket");
-    }
-    for (i=0;i<=fds_max;i++) {
-      if (FD_ISSET(i,&fds_read)) {
-        if (i==srv->sock) { // master socket
-          struct sockaddr_in addr;
-          int sock;
-          int addrlen = sizeof(struct sockaddr_in);
-          if ((sock = accept(srv->sock,(struct sockaddr*)&addr,&addrlen))>=0) {
-            if (srv->local && addr.sin_addr.s_addr!=0x0100007F) close(sock);
-            else {
-              FD_SET(sock,&fds_master);
-              if (sock>fds_max) fds_max = sock;
-              char hostname[INET_ADDRSTRLEN];
-              nxtnet_srv_log(srv,"New client %s on sock %d\n",inet_ntop(addr.sin_family,&addr.sin_addr,hostname,INET_ADDRSTRLEN),sock);
-            }
-          }
+    n = epoll_wait(srv->epfd,events,NXTNET_SRV_MAXEVENTS,NXTNET_SELECT_TIMEOUT*1000);
+    if (n==-1) {
+      if (errno!=EINTR) perror("epoll_wait of server socket");
+      continue;
+    }
+    for (i=0;i<n;i++) {
+      client = (struct nxtnet_srv_client*)events[i].data.ptr;
+      if (client==NULL) { // master socket
+        nxtnet_srv_accept(srv,srv->sock);
+      }
+      else if (events[i].data.ptr==&srv->usock) { // UNIX domain master socket
+        nxtnet_srv_accept(srv,srv->usock);
+      }
+      else { // client socket
+        if (events[i].events&EPOLLOUT) {
+          pthread_mutex_lock(&client->mutex);
+          nxtnet_srv_client_flush(srv,client);
+          pthread_mutex_unlock(&client->mutex);
         }
-        else { // client socket
-          struct nxtnet_proto_packet *packet = nxtnet_recv(i,srv->buf,0);
-          if (packet==NULL) { // client disconnected/error
-            nxtnet_srv_log(srv,"Client sock %d hang up\n",i);
-            close(i);
-            FD_CLR(i,&fds_master);
-            if (i==fds_max) fds_max--;
-          }
-          else {
-            if (strcmp(packet->password,srv->password)==0) {
-              if (packet->cmd==NXTNET_PROTO_CMD_LIST) {
-                nxtnet_srv_list(srv,packet);
-                nxtnet_send(i,packet);
-              }
-              else if (packet->cmd==NXTNET_PROTO_CMD_SEND) {
-                nxtnet_srv_send(srv,packet);
-                nxtnet_send(i,packet);
-              }
-              else if (packet->cmd==NXTNET_PROTO_CMD_RECV) {
-                nxtnet_srv_recv(srv,packet);
-                nxtnet_send(i,packet);
-              }
-            }
-            else {
-              packet->cmd = (packet->cmd&(~NXTNET_PROTO_DIR_MASK))|NXTNET_PROTO_DIR_SC;
-              packet->error = NXTNET_ERROR_WROPWD;
-              packet->size = 0;
-              nxtnet_send(i,packet);
-            }
+        if (events[i].events&(EPOLLIN|EPOLLHUP|EPOLLERR)) {
+          if (nxtnet_srv_read(srv,client)==-1) { // client disconnected/error
+            nxtnet_srv_hangup(srv,client);
           }
         }
       }
@@ -242,10 +1509,30 @@ void nxtnet_srv_destroy(nxtnet_srv_t *srv) {
   int i;
 
   nxtnet_srv_log(srv,"Shutting server down\n");
-  for (i=0;i<NXTNET_SRV_MAXSOCKS;i++) {
-    if (srv->clients[i]>0) close(srv->clients[i]);
+
+  // stop workers (queued jobs are done first)
+  if (srv->pool!=NULL) {
+    pthread_mutex_lock(&srv->pool->mutex);
+    srv->pool->quit = 1;
+    pthread_cond_broadcast(&srv->pool->cond);
+    pthread_mutex_unlock(&srv->pool->mutex);
+    for (i=0;i<srv->pool->num_workers;i++) {
+      pthread_join(srv->pool->workers[i].tid,NULL);
+    }
+    pthread_cond_destroy(&srv->pool->cond);
+    pthread_mutex_destroy(&srv->pool->mutex);
+    free(srv->pool);
+    srv->pool = NULL;
+  }
+
+  while (srv->clients!=NULL) {
+    nxtnet_srv_hangup(srv,srv->clients);
+  }
+  if (srv->epfd!=-1) close(srv->epfd);
+  if (srv->usock!=-1) {
+    close(srv->usock);
+    unlink(srv->upath);
   }
   close(srv->sock);
-  free(srv->buf);
   free(srv);
 }
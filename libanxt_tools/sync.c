@@ -0,0 +1,565 @@
+/*
+    libanxt_tools/sync.c - Uploads only files that differ from those on NXTs
+    aNXT - a NXt Toolkit
+    Libraries and tools for LEGO Mindstorms NXT robots
+    Copyright (C) 2008  Janosch Gräf <janosch.graef@gmx.net>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <anxt/tools.h>
+#include <anxt/file.h>
+
+/// Block size for hashing files
+#define NXT_SYNC_BUFSIZE 4096
+
+/// Initial value of hash (64 bit FNV-1a)
+#define NXT_SYNC_HASH_INIT  UINT64_C(0xcbf29ce484222325)
+/// Prime of hash (64 bit FNV-1a)
+#define NXT_SYNC_HASH_PRIME UINT64_C(0x100000001b3)
+
+/// File on host to synchronize
+struct nxt_sync_file {
+  /// Filename on host
+  char *src;
+  /// Filename on NXT
+  char *dest;
+  /// Size
+  size_t size;
+  /// Hash of content
+  uint64_t hash;
+};
+
+/// File on NXT (or entry of hash cache)
+struct nxt_sync_entry {
+  /// Filename
+  char *name;
+  /// Size
+  size_t size;
+  /// Hash of content
+  uint64_t hash;
+  /// If hash is known
+  int hashed;
+  /// Next entry
+  struct nxt_sync_entry *next;
+};
+
+/// Synchronization of one NXT (see nxt_sync_nxt())
+struct nxt_sync_job {
+  /// NXT handle
+  nxt_t *nxt;
+  /// Files to synchronize
+  struct nxt_sync_file *files;
+  /// Number of files
+  size_t num_files;
+  /// Cache directory (NULL if there is no cache)
+  const char *cache;
+  /// Open flags for nxt_file_open
+  int oflag;
+  /// Flags (NXT_SYNC_*)
+  int flags;
+  /// Called for each file
+  nxt_sync_callback callback;
+  /// Data for callback
+  void *data;
+  /// Success?
+  int ret;
+};
+
+/**
+ * Hashes data
+ *  @param hash Hash of previous data (NXT_SYNC_HASH_INIT at start)
+ *  @param buf Data
+ *  @param len Size of data
+ *  @return Hash
+ */
+static uint64_t nxt_sync_hash(uint64_t hash,const void *buf,size_t len) {
+  const unsigned char *p = buf;
+
+  while (len-->0) {
+    hash ^= *p++;
+    hash *= NXT_SYNC_HASH_PRIME;
+  }
+  return hash;
+}
+
+/**
+ * Hashes a file on host
+ *  @param file File
+ *  @return Success?
+ */
+static int nxt_sync_hash_host(struct nxt_sync_file *file) {
+  FILE *input;
+  char *buf;
+  size_t len;
+  int ret = 0;
+
+  input = fopen(file->src,"r");
+  if (input==NULL) {
+    fprintf(stderr,"Error: %s: %s\n",file->src,strerror(errno));
+    return -1;
+  }
+
+  buf = malloc(NXT_SYNC_BUFSIZE);
+  file->size = 0;
+  file->hash = NXT_SYNC_HASH_INIT;
+  while ((len = fread(buf,1,NXT_SYNC_BUFSIZE,input))>0) {
+    file->hash = nxt_sync_hash(file->hash,buf,len);
+    file->size += len;
+  }
+  if (ferror(input)) {
+    fprintf(stderr,"Error: %s: %s\n",file->src,strerror(errno));
+    ret = -1;
+  }
+
+  free(buf);
+  fclose(input);
+  return ret;
+}
+
+/**
+ * Hashes a file on NXT by reading it back
+ *  @param nxt NXT handle
+ *  @param entry File
+ *  @return Success?
+ */
+static int nxt_sync_hash_nxt(nxt_t *nxt,struct nxt_sync_entry *entry) {
+  char *buf;
+  size_t size,n;
+  size_t done = 0;
+  int handle;
+  int ret = 0;
+
+  handle = nxt_file_open(nxt,entry->name,NXT_OREAD,&size);
+  if (handle<0) {
+    fprintf(stderr,"Error: %s: %s\n",entry->name,nxt_strerror(nxt_error(nxt)));
+    return -1;
+  }
+
+  buf = malloc(NXT_SYNC_BUFSIZE);
+  entry->hash = NXT_SYNC_HASH_INIT;
+  while (done<size) {
+    n = size-done<NXT_SYNC_BUFSIZE?size-done:NXT_SYNC_BUFSIZE;
+    if (nxt_file_read(nxt,handle,buf,n)!=n) {
+      fprintf(stderr,"Error: %s: %s\n",entry->name,nxt_strerror(nxt_error(nxt)));
+      ret = -1;
+      break;
+    }
+    entry->hash = nxt_sync_hash(entry->hash,buf,n);
+    done += n;
+  }
+  entry->size = size;
+  entry->hashed = ret==0;
+
+  free(buf);
+  nxt_file_close(nxt,handle);
+  return ret;
+}
+
+/**
+ * Adds an entry to a list
+ *  @param list Reference to list
+ *  @param name Filename
+ *  @param size Size of file
+ *  @return Entry
+ */
+static struct nxt_sync_entry *nxt_sync_entry_add(struct nxt_sync_entry **list,const char *name,size_t size) {
+  struct nxt_sync_entry *entry = malloc(sizeof(struct nxt_sync_entry));
+
+  entry->name = strdup(name);
+  entry->size = size;
+  entry->hash = 0;
+  entry->hashed = 0;
+  entry->next = *list;
+  *list = entry;
+  return entry;
+}
+
+/**
+ * Finds an entry in a list
+ *  @param list List
+ *  @param name Filename
+ *  @return Entry (NULL if not found)
+ */
+static struct nxt_sync_entry *nxt_sync_entry_find(struct nxt_sync_entry *list,const char *name) {
+  for (;list!=NULL && strcmp(list->name,name)!=0;list = list->next);
+  return list;
+}
+
+/**
+ * Frees a list
+ *  @param list List
+ */
+static void nxt_sync_entry_free(struct nxt_sync_entry *list) {
+  struct nxt_sync_entry *next;
+
+  for (;list!=NULL;list = next) {
+    next = list->next;
+    free(list->name);
+    free(list);
+  }
+}
+
+/**
+ * Lists files on NXT
+ *  @param nxt NXT handle
+ *  @param list Reference for list of files
+ *  @return Success?
+ */
+static int nxt_sync_list(nxt_t *nxt,struct nxt_sync_entry **list) {
+  char *filename;
+  size_t filesize;
+  int handle,last;
+  int error;
+
+  *list = NULL;
+  if ((handle = nxt_file_find_first(nxt,"*.*",&filename,&filesize))>=0) {
+    do {
+      last = handle;
+      nxt_sync_entry_add(list,filename,filesize);
+      free(filename);
+    }
+    while ((handle = nxt_file_find_next(nxt,last,&filename,&filesize))>=0);
+    error = nxt_error(nxt);
+    // the NXT may have closed the handle already
+    nxt_file_close(nxt,last);
+  }
+  else error = nxt_error(nxt);
+
+  // listing ends with "file not found" (or "no more files")
+  if (error!=NXT_ERR_FILE_NOT_FOUND && error!=NXT_ERR_NO_MORE_FILES) {
+    fprintf(stderr,"Error: %s\n",nxt_strerror(error));
+    nxt_sync_entry_free(*list);
+    *list = NULL;
+    return -1;
+  }
+  nxt_reset_error(nxt);
+  return 0;
+}
+
+/**
+ * Gets filename of a NXT's hash cache
+ *  @param nxt NXT handle
+ *  @param dir Cache directory
+ *  @return Filename (pass to free())
+ */
+static char *nxt_sync_cache_file(nxt_t *nxt,const char *dir) {
+  char *path = malloc(strlen(dir)+14);
+  const unsigned char *id = (const unsigned char*)nxt->id;
+
+  sprintf(path,"%s/%02X%02X%02X%02X%02X%02X",dir,id[0],id[1],id[2],id[3],id[4],id[5]);
+  return path;
+}
+
+/**
+ * Loads hash cache of a NXT
+ *  @param nxt NXT handle
+ *  @param dir Cache directory
+ *  @return List of files with hashes (NULL if there is no cache)
+ *  @note Each line of the cache is: hash size filename
+ */
+static struct nxt_sync_entry *nxt_sync_cache_load(nxt_t *nxt,const char *dir) {
+  struct nxt_sync_entry *list = NULL;
+  struct nxt_sync_entry *entry;
+  char *path = nxt_sync_cache_file(nxt,dir);
+  char line[256];
+  uint64_t hash;
+  size_t size;
+  int n;
+  FILE *cache;
+
+  cache = fopen(path,"r");
+  free(path);
+  if (cache==NULL) {
+    return NULL;
+  }
+
+  while (fgets(line,sizeof(line),cache)!=NULL) {
+    line[strcspn(line,"\n")] = 0;
+    if (sscanf(line,"%"SCNx64" %zu %n",&hash,&size,&n)==2 && line[n]!=0) {
+      entry = nxt_sync_entry_add(&list,line+n,size);
+      entry->hash = hash;
+      entry->hashed = 1;
+    }
+  }
+
+  fclose(cache);
+  return list;
+}
+
+/**
+ * Saves hash cache of a NXT
+ *  @param nxt NXT handle
+ *  @param dir Cache directory
+ *  @param list Files on NXT (only those with known hash are saved)
+ *  @note The cache is replaced atomically, so NXTs synchronized at the same
+ *        time never see a partially written cache
+ */
+static void nxt_sync_cache_save(nxt_t *nxt,const char *dir,struct nxt_sync_entry *list) {
+  char *path = nxt_sync_cache_file(nxt,dir);
+  char *tmp = malloc(strlen(path)+5);
+  FILE *cache;
+  int ret = 0;
+
+  sprintf(tmp,"%s.tmp",path);
+  cache = fopen(tmp,"w");
+  if (cache!=NULL) {
+    for (;list!=NULL;list = list->next) {
+      if (list->hashed) {
+        fprintf(cache,"%016"PRIx64" %zu %s\n",list->hash,list->size,list->name);
+      }
+    }
+    ret = fclose(cache);
+    if (ret==0) {
+      ret = rename(tmp,path);
+    }
+    if (ret!=0) {
+      unlink(tmp);
+    }
+  }
+  if (cache==NULL || ret!=0) {
+    fprintf(stderr,"Warning: Could not save cache %s: %s\n",path,strerror(errno));
+  }
+
+  free(tmp);
+  free(path);
+}
+
+/**
+ * Creates a directory and its parents
+ *  @param dir Directory
+ *  @return Success?
+ */
+static int nxt_sync_mkdir(const char *dir) {
+  char *path = strdup(dir);
+  char *p;
+  int ret = 0;
+
+  for (p = strchr(path+1,'/');ret==0;p = strchr(p+1,'/')) {
+    if (p!=NULL) {
+      *p = 0;
+    }
+    if (mkdir(path,0755)!=0 && errno!=EEXIST) {
+      ret = -1;
+    }
+    if (p==NULL) {
+      break;
+    }
+    *p = '/';
+  }
+
+  free(path);
+  return ret;
+}
+
+/**
+ * Gets default cache directory
+ *  @return Cache directory (pass to free(); NULL if there is no home directory)
+ *  @note $XDG_CACHE_HOME/anxt/sync or ~/.cache/anxt/sync
+ */
+static char *nxt_sync_cache_default(void) {
+  const char *base = getenv("XDG_CACHE_HOME");
+  const char *sub = "/anxt/sync";
+  char *dir;
+
+  if (base==NULL || *base==0) {
+    base = getenv("HOME");
+    if (base==NULL || *base==0) {
+      return NULL;
+    }
+    sub = "/.cache/anxt/sync";
+  }
+
+  dir = malloc(strlen(base)+strlen(sub)+1);
+  sprintf(dir,"%s%s",base,sub);
+  return dir;
+}
+
+/**
+ * Synchronizes files with one NXT
+ *  @param arg Job
+ *  @return NULL
+ */
+static void *nxt_sync_nxt(void *arg) {
+  struct nxt_sync_job *job = (struct nxt_sync_job*)arg;
+  struct nxt_sync_entry *files,*cache;
+  struct nxt_sync_entry *entry,*cached;
+  struct nxt_sync_file *file;
+  size_t i;
+  int action;
+
+  job->ret = 0;
+  if (nxt_sync_list(job->nxt,&files)!=0) {
+    for (i=0;i<job->num_files;i++) {
+      job->callback(job->nxt,job->files[i].dest,NXT_SYNC_FAILED,job->data);
+    }
+    job->ret = -1;
+    return NULL;
+  }
+  if (job->cache!=NULL) {
+    // use cached hashes of files whose size didn't change
+    cache = nxt_sync_cache_load(job->nxt,job->cache);
+    for (entry=files;entry!=NULL;entry = entry->next) {
+      cached = nxt_sync_entry_find(cache,entry->name);
+      if (cached!=NULL && cached->size==entry->size) {
+        entry->hash = cached->hash;
+        entry->hashed = 1;
+      }
+    }
+    nxt_sync_entry_free(cache);
+  }
+
+  for (i=0;i<job->num_files;i++) {
+    file = job->files+i;
+    entry = nxt_sync_entry_find(files,file->dest);
+
+    if (entry==NULL) {
+      action = NXT_SYNC_NEW;
+    }
+    else if (entry->size!=file->size) {
+      action = NXT_SYNC_CHANGED;
+    }
+    else {
+      // same size: compare content, read back from NXT only if not cached
+      if ((!entry->hashed || (job->flags&NXT_SYNC_VERIFY)) && nxt_sync_hash_nxt(job->nxt,entry)!=0) {
+        job->callback(job->nxt,file->dest,NXT_SYNC_FAILED,job->data);
+        job->ret = -1;
+        continue;
+      }
+      action = entry->hash==file->hash?NXT_SYNC_UNCHANGED:NXT_SYNC_CHANGED;
+    }
+
+    if (action!=NXT_SYNC_UNCHANGED && !(job->flags&NXT_SYNC_DRYRUN)) {
+      if (entry==NULL) {
+        entry = nxt_sync_entry_add(&files,file->dest,file->size);
+      }
+      if (nxt_upload(job->nxt,file->src,file->dest,job->oflag|NXT_OWOVER)==0) {
+        entry->size = file->size;
+        entry->hash = file->hash;
+        entry->hashed = 1;
+      }
+      else {
+        // content on NXT is unknown now
+        entry->hashed = 0;
+        action = NXT_SYNC_FAILED;
+        job->ret = -1;
+      }
+    }
+    job->callback(job->nxt,file->dest,action,job->data);
+  }
+
+  if (job->cache!=NULL) {
+    nxt_sync_cache_save(job->nxt,job->cache,files);
+  }
+  nxt_sync_entry_free(files);
+  return NULL;
+}
+
+/**
+ * Callback that does nothing
+ */
+static void nxt_sync_nop(nxt_t *nxt,const char *filename,int action,void *data) {
+}
+
+/**
+ * Uploads files to NXTs, skipping files that are already on them
+ *  @param nxts NXT handles
+ *  @param num_nxts Number of NXTs
+ *  @param src Filenames on host (uploaded with their basename)
+ *  @param num_src Number of files
+ *  @param cache Cache directory (NULL for default)
+ *  @param oflag Open flags for nxt_file_open (NXT_OWFRAG or NXT_OWLINE)
+ *  @param flags Flags (NXT_SYNC_VERIFY, NXT_SYNC_DRYRUN, NXT_SYNC_PARALLEL)
+ *  @param callback Called with the action taken for each file on each NXT (optional)
+ *  @param data Data for callback
+ *  @return Success?
+ *  @note Files on a NXT are compared by name and size first. If they match,
+ *        the contents are compared by hash. The hash of a file on a NXT is
+ *        computed by reading the file back once and is then cached on the host
+ *        per NXT ID. A file changed on the NXT by something else without
+ *        changing its size is only noticed with NXT_SYNC_VERIFY.
+ *  @note With NXT_SYNC_PARALLEL each NXT is synchronized by its own thread, so
+ *        the callback may be called from several threads at the same time
+ */
+int nxt_sync(nxt_t **nxts,size_t num_nxts,char **src,size_t num_src,const char *cache,int oflag,int flags,nxt_sync_callback callback,void *data) {
+  struct nxt_sync_file *files;
+  struct nxt_sync_job *jobs;
+  pthread_t *threads;
+  char *cache_default = NULL;
+  char *base;
+  size_t i;
+  int ret = 0;
+
+  files = malloc(num_src*sizeof(struct nxt_sync_file));
+  for (i=0;i<num_src;i++) {
+    files[i].src = src[i];
+    base = strrchr(src[i],'/');
+    files[i].dest = base!=NULL?base+1:src[i];
+    if (nxt_sync_hash_host(files+i)!=0) {
+      free(files);
+      return -1;
+    }
+  }
+
+  if (cache==NULL) {
+    cache = cache_default = nxt_sync_cache_default();
+  }
+  if (cache!=NULL && nxt_sync_mkdir(cache)!=0) {
+    fprintf(stderr,"Warning: Could not create cache %s: %s\n",cache,strerror(errno));
+    cache = NULL;
+  }
+
+  jobs = malloc(num_nxts*sizeof(struct nxt_sync_job));
+  threads = malloc(num_nxts*sizeof(pthread_t));
+  for (i=0;i<num_nxts;i++) {
+    jobs[i].nxt = nxts[i];
+    jobs[i].files = files;
+    jobs[i].num_files = num_src;
+    jobs[i].cache = cache;
+    jobs[i].oflag = oflag;
+    jobs[i].flags = flags;
+    jobs[i].callback = callback!=NULL?callback:nxt_sync_nop;
+    jobs[i].data = data;
+    if (!(flags&NXT_SYNC_PARALLEL) || pthread_create(threads+i,NULL,nxt_sync_nxt,jobs+i)!=0) {
+      // synchronize in this thread
+      nxt_sync_nxt(jobs+i);
+      threads[i] = pthread_self();
+    }
+  }
+  for (i=0;i<num_nxts;i++) {
+    if (!pthread_equal(threads[i],pthread_self())) {
+      pthread_join(threads[i],NULL);
+    }
+    if (jobs[i].ret!=0) {
+      ret = -1;
+    }
+  }
+
+  free(threads);
+  free(jobs);
+  free(files);
+  free(cache_default);
+  return ret;
+}
@@ -19,16 +19,25 @@
     along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
 #include <errno.h>
+#include <ctype.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <unistd.h>
+#include <pthread.h>
 
 #include <anxt/tools.h>
 #include <anxt/mod.h>
 #include <anxt/file.h>
+#include <anxt/motor.h>
 
 #define NXT_BUFSIZE 4096
+/// Sampling interval for recording motor tacho (in microseconds)
+#define NXT_MOTOR_RECORD_INTERVAL 5000
 
 typedef struct {
   FILE *out;
@@ -48,6 +57,7 @@ int nxt_list(nxt_t *nxt,char *wildcard,nxt_list_one_file_callback callback,void
   char *filename;
   size_t filesize;
   int fh,valid_fh;
+  int error;
   char *wild = wildcard;
 
   if (wildcard==NULL)
@@ -57,16 +67,20 @@ int nxt_list(nxt_t *nxt,char *wildcard,nxt_list_one_file_callback callback,void
     do {
       valid_fh = fh;
       callback(filename,filesize,data);
+      free(filename);
     }
     while ((fh = nxt_file_find_next(nxt,fh,&filename,&filesize))!=NXT_FAIL);
+    // the NXT may have closed the handle already
+    error = nxt_error(nxt);
     nxt_file_close(nxt,valid_fh);
   }
+  else error = nxt_error(nxt);
 
-  if (nxt_error(nxt)==NXT_ERR_FILE_NOT_FOUND) {
+  if (error==NXT_ERR_FILE_NOT_FOUND || error==NXT_ERR_NO_MORE_FILES) {
     nxt_reset_error(nxt);
     return 0;
   } else {
-    fprintf(stderr,"Error: %s\n",nxt_strerror(nxt_error(nxt)));
+    fprintf(stderr,"Error: %s\n",nxt_strerror(error));
     return -1;
   }
 }
@@ -132,27 +146,32 @@ int nxt_list_modules(nxt_t *nxt,FILE *out,char *wildcard) {
  */
 
 void nxt_motor_record(nxt_t *nxt,int motor,double t,nxt_motor_record_callback callback,void *data) {
-  struct timeval tv, starttv;
-  int rot;
-  int err;
+  struct timespec tv, starttv;
+  int sub;
   double time = 0;
-  int capacity = 256;
-  int fill_counter = 0;
   //nxt_set_motor(nxt,motor,0,0,NXT_MOTORON,NXT_REGMODE_MOTOR_SPEED,0);
   nxt_motor_stop(nxt, motor, 0);
-  gettimeofday(&starttv,NULL);
-  while (1) {
-    //rot = nxt_get_tacho(nxt,motor);
-    rot = nxt_motor_get_rotation_count(nxt, motor);
-    err = nxt_error(nxt);
-    if (err != 0) 
-      break;
-    gettimeofday(&tv,NULL);
-    time = tv.tv_sec - starttv.tv_sec + (tv.tv_usec - starttv.tv_usec) * 1e-6;
-    if (time > t) 
-      break;
-    callback(time,rot,data);
+
+  // let nxtd sample the motor state, so network latency doesn't limit the rate
+  nxt_batch_begin(nxt);
+  nxt_motor_get_state(nxt, motor);
+  sub = nxt_subscribe(nxt, NXT_MOTOR_RECORD_INTERVAL);
+  if (sub == NXT_FAIL)
+    return;
+
+  if (nxt_sample(nxt, sub, &starttv) == NXT_SUCC) {
+    tv = starttv;
+    while (1) {
+      time = tv.tv_sec - starttv.tv_sec + (tv.tv_nsec - starttv.tv_nsec) * 1e-9;
+      if (time > t) 
+        break;
+      callback(time,nxt->motors[motor].rotation_count,data);
+      if (nxt_sample(nxt, sub, &tv) != NXT_SUCC)
+        break;
+    }
   }
+
+  nxt_unsubscribe(nxt, sub);
 }
 
 /**
@@ -229,7 +248,7 @@ void nxt_motor_playback(nxt_t *nxt,int motor,int power,int numvalues,double *tim
 
   if (stop == 1)
     //nxt_set_motor_coast(nxt,motor);
-    nxt_motor_stop(nxt, 0);
+    nxt_motor_stop(nxt, motor, 0);
 }
 
 /**
@@ -435,80 +454,425 @@ int nxt_str2fileformat(char *str) {
 }
 
 #define BUFSIZE 4096
+/// Number of blocks buffered between host I/O thread and NXT I/O
+#define NXT_STREAM_BLOCKS 4
+
+/// Blocks passed from a producing to a consuming thread
+struct nxt_stream {
+  /// Mutex for the following fields
+  pthread_mutex_t mutex;
+  /// Signaled when a block was filled or released
+  pthread_cond_t cond;
+  /// Blocks (BUFSIZE bytes each)
+  char *blocks[NXT_STREAM_BLOCKS];
+  /// How many bytes are in each block
+  size_t lens[NXT_STREAM_BLOCKS];
+  /// Index of first filled block
+  size_t first;
+  /// Number of filled blocks
+  size_t num;
+  /// If producer won't fill any more blocks
+  int done;
+  /// If consumer stopped (producer should stop too)
+  int aborted;
+  /// Host file (read by upload thread or written by download thread)
+  FILE *file;
+  /// How many bytes upload thread has to read
+  size_t size;
+  /// errno of host file I/O (0 if none)
+  int error;
+};
+
+/// Offset of transfer of a block (see nxt_stream_progress())
+struct nxt_stream_progress {
+  /// Bytes transferred before this block
+  size_t base;
+  /// Bytes to transfer in total
+  size_t total;
+  /// Progress function of caller
+  nxt_file_progress_t func;
+  /// Context for progress function
+  void *ctx;
+};
 
 /**
- * Download a file src from NXT brick to file dest on host filesystem
+ * Initializes a stream
+ *  @param stream Stream
+ *  @param file Host file
+ *  @param size Bytes to transfer
+ *  @return Success?
+ */
+static int nxt_stream_init(struct nxt_stream *stream,FILE *file,size_t size) {
+  size_t i;
+
+  memset(stream,0,sizeof(struct nxt_stream));
+  for (i=0;i<NXT_STREAM_BLOCKS;i++) {
+    if ((stream->blocks[i] = malloc(BUFSIZE))==NULL) {
+      while (i>0) {
+        free(stream->blocks[--i]);
+      }
+      return -1;
+    }
+  }
+  pthread_mutex_init(&stream->mutex,NULL);
+  pthread_cond_init(&stream->cond,NULL);
+  stream->file = file;
+  stream->size = size;
+  return 0;
+}
+
+/**
+ * Frees blocks of a stream
+ *  @param stream Stream
+ */
+static void nxt_stream_destroy(struct nxt_stream *stream) {
+  size_t i;
+
+  for (i=0;i<NXT_STREAM_BLOCKS;i++) {
+    free(stream->blocks[i]);
+  }
+  pthread_cond_destroy(&stream->cond);
+  pthread_mutex_destroy(&stream->mutex);
+}
+
+/**
+ * Waits for a free block (producer)
+ *  @param stream Stream
+ *  @return Block (NULL if consumer stopped)
+ */
+static char *nxt_stream_get_free(struct nxt_stream *stream) {
+  char *block = NULL;
+
+  pthread_mutex_lock(&stream->mutex);
+  while (stream->num==NXT_STREAM_BLOCKS && !stream->aborted) {
+    pthread_cond_wait(&stream->cond,&stream->mutex);
+  }
+  if (!stream->aborted) {
+    block = stream->blocks[(stream->first+stream->num)%NXT_STREAM_BLOCKS];
+  }
+  pthread_mutex_unlock(&stream->mutex);
+  return block;
+}
+
+/**
+ * Passes block returned by nxt_stream_get_free() to consumer
+ *  @param stream Stream
+ *  @param len How many bytes are in block
+ */
+static void nxt_stream_put(struct nxt_stream *stream,size_t len) {
+  pthread_mutex_lock(&stream->mutex);
+  stream->lens[(stream->first+stream->num)%NXT_STREAM_BLOCKS] = len;
+  stream->num++;
+  pthread_cond_broadcast(&stream->cond);
+  pthread_mutex_unlock(&stream->mutex);
+}
+
+/**
+ * Tells consumer that no more blocks follow
+ *  @param stream Stream
+ */
+static void nxt_stream_finish(struct nxt_stream *stream) {
+  pthread_mutex_lock(&stream->mutex);
+  stream->done = 1;
+  pthread_cond_broadcast(&stream->cond);
+  pthread_mutex_unlock(&stream->mutex);
+}
+
+/**
+ * Waits for a filled block (consumer)
+ *  @param stream Stream
+ *  @param len Reference for how many bytes are in block
+ *  @return Block (NULL if producer finished)
+ *  @note Release block with nxt_stream_release()
+ */
+static char *nxt_stream_get_filled(struct nxt_stream *stream,size_t *len) {
+  char *block = NULL;
+
+  pthread_mutex_lock(&stream->mutex);
+  while (stream->num==0 && !stream->done) {
+    pthread_cond_wait(&stream->cond,&stream->mutex);
+  }
+  if (stream->num>0) {
+    block = stream->blocks[stream->first];
+    *len = stream->lens[stream->first];
+  }
+  pthread_mutex_unlock(&stream->mutex);
+  return block;
+}
+
+/**
+ * Releases block returned by nxt_stream_get_filled()
+ *  @param stream Stream
+ */
+static void nxt_stream_release(struct nxt_stream *stream) {
+  pthread_mutex_lock(&stream->mutex);
+  stream->first = (stream->first+1)%NXT_STREAM_BLOCKS;
+  stream->num--;
+  pthread_cond_broadcast(&stream->cond);
+  pthread_mutex_unlock(&stream->mutex);
+}
+
+/**
+ * Stops producer (consumer)
+ *  @param stream Stream
+ */
+static void nxt_stream_abort(struct nxt_stream *stream) {
+  pthread_mutex_lock(&stream->mutex);
+  stream->aborted = 1;
+  pthread_cond_broadcast(&stream->cond);
+  pthread_mutex_unlock(&stream->mutex);
+}
+
+/**
+ * Passes progress of a block's transfer as progress of whole transfer
+ *  @param done Bytes of block transferred
+ *  @param total Size of block
+ *  @param ctx Offset of block
+ */
+static void nxt_stream_progress(size_t done,size_t total,void *ctx) {
+  struct nxt_stream_progress *progress = (struct nxt_stream_progress*)ctx;
+
+  progress->func(progress->base+done,progress->total,progress->ctx);
+}
+
+/**
+ * Writes blocks to host file (download thread)
+ *  @param arg Stream
+ */
+static void *nxt_stream_writer(void *arg) {
+  struct nxt_stream *stream = (struct nxt_stream*)arg;
+  char *block;
+  size_t len;
+
+  while ((block = nxt_stream_get_filled(stream,&len))!=NULL) {
+    if (fwrite(block,1,len,stream->file)!=len) {
+      stream->error = errno!=0?errno:EIO;
+      nxt_stream_abort(stream);
+      break;
+    }
+    nxt_stream_release(stream);
+  }
+  return NULL;
+}
+
+/**
+ * Reads blocks from host file (upload thread)
+ *  @param arg Stream
+ */
+static void *nxt_stream_reader(void *arg) {
+  struct nxt_stream *stream = (struct nxt_stream*)arg;
+  char *block;
+  size_t len;
+
+  while (stream->size>0 && (block = nxt_stream_get_free(stream))!=NULL) {
+    len = fread(block,1,stream->size<BUFSIZE?stream->size:BUFSIZE,stream->file);
+    if (len==0) {
+      // input is shorter than announced
+      stream->error = ferror(stream->file)?(errno!=0?errno:EIO):EPIPE;
+      break;
+    }
+    stream->size -= len;
+    nxt_stream_put(stream,len);
+  }
+  nxt_stream_finish(stream);
+  return NULL;
+}
+
+/**
+ * Downloads a file from NXT brick to a stream on host
  *  @param nxt NXT handle
  *  @param src file on NXT
- *  @param dest filename on host
+ *  @param output stream on host
+ *  @param func Function called with number of bytes downloaded so far (optional)
+ *  @param ctx Context for progress function
  *  @return Success?
+ *  @note The file is read from the NXT in blocks, while another thread writes
+ *        the previous blocks to the host, so the whole file is never in memory
  */
-int nxt_download(nxt_t *nxt,char *src,char *dest) {
-  size_t size = 0;
+int nxt_download_stream(nxt_t *nxt,char *src,FILE *output,nxt_file_progress_t func,void *ctx) {
+  struct nxt_stream stream;
+  struct nxt_stream_progress progress = {
+    .func = func,
+    .ctx = ctx
+  };
+  pthread_t writer;
+  size_t size = 0,n;
+  ssize_t r;
+  char *block;
   int fh;
   int ret = 0;
-  char *buffer = NULL;
 
   fh = nxt_file_open(nxt,src,NXT_OREAD,&size);
-  if (fh>=0) {
-    FILE *output = NULL;
-    if (strcmp(dest,"-")==0) output = stdout;
-    else {
-      output = fopen(dest,"w");
-      if (output==NULL) {
-        fprintf(stderr,"Error: %s\n",strerror(errno));
-        return -1;
-      }
+  if (fh<0) {
+    fprintf(stderr,"Error: %s\n",nxt_strerror(nxt_error(nxt)));
+    return -1;
+  }
+
+  if (nxt_stream_init(&stream,output,size)==-1) {
+    fprintf(stderr,"Error: %s\n",strerror(ENOMEM));
+    nxt_file_close(nxt,fh);
+    return -1;
+  }
+  if ((ret = pthread_create(&writer,NULL,nxt_stream_writer,&stream))!=0) {
+    fprintf(stderr,"Error: %s\n",strerror(ret));
+    nxt_stream_destroy(&stream);
+    nxt_file_close(nxt,fh);
+    return -1;
+  }
+
+  progress.total = size;
+  while (progress.base<size && (block = nxt_stream_get_free(&stream))!=NULL) {
+    n = size-progress.base<BUFSIZE?size-progress.base:BUFSIZE;
+    r = nxt_file_read_progress(nxt,fh,block,n,func!=NULL?nxt_stream_progress:NULL,&progress);
+    if (r!=n) {
+      fprintf(stderr,"Error: %s\n",nxt_strerror(nxt_error(nxt)));
+      ret = -1;
+      break;
     }
-    if (size>0) {
-      buffer = malloc(size);
-      size = nxt_file_read(nxt,fh,buffer,size);
-      if (size>=0) {
-        int rest;
-        rest = size;
-        do {
-          int written;
-          written = fwrite(buffer,1,rest,output);
-          if (written<=0) {
-            perror(dest);
-            ret = -1;
-          }
-          rest -= written;
-        } while (rest>0);
-      } else {
-        fprintf(stderr,"Error: %s\n",nxt_strerror(nxt_error(nxt)));
-        ret = -1;
-      }
+    nxt_stream_put(&stream,n);
+    progress.base += n;
+  }
+  nxt_stream_finish(&stream);
+  pthread_join(writer,NULL);
+
+  if (stream.error!=0) {
+    fprintf(stderr,"Error: %s\n",strerror(stream.error));
+    ret = -1;
+  }
+  nxt_stream_destroy(&stream);
+  nxt_file_close(nxt,fh);
+  return ret;
+}
+
+/**
+ * Download a file src from NXT brick to file dest on host filesystem
+ *  @param nxt NXT handle
+ *  @param src file on NXT
+ *  @param dest filename on host ("-" for standard output)
+ *  @return Success?
+ *  @note If the download fails, dest is removed
+ */
+int nxt_download(nxt_t *nxt,char *src,char *dest) {
+  FILE *output = NULL;
+  int ret;
+
+  if (strcmp(dest,"-")==0) output = stdout;
+  else {
+    output = fopen(dest,"w");
+    if (output==NULL) {
+      fprintf(stderr,"Error: %s\n",strerror(errno));
+      return -1;
     }
-    if (output!=stdout)
-      if (fclose(output)!=0) {
-        perror(dest);
-        ret = -1;
-      }
-  } else {
+  }
+
+  ret = nxt_download_stream(nxt,src,output,NULL,NULL);
+
+  if (output!=stdout) {
+    if (fclose(output)!=0) {
+      perror(dest);
+      ret = -1;
+    }
+    if (ret!=0) {
+      // don't leave an empty or partial file behind
+      unlink(dest);
+    }
+  }
+  else fflush(stdout);
+  return ret;
+}
+
+/**
+ * Uploads data from a stream on host to file dest on NXT brick
+ *  @param nxt NXT handle
+ *  @param input stream on host
+ *  @param size how many bytes to upload from stream
+ *  @param dest file on NXT
+ *  @param oflag open flags for nxt_file_open
+ *  @param func Function called with number of bytes uploaded so far (optional)
+ *  @param ctx Context for progress function
+ *  @return Success?
+ *  @note Another thread reads the input in blocks, while the previous blocks
+ *        are written to the NXT, so the whole file is never in memory
+ */
+int nxt_upload_stream(nxt_t *nxt,FILE *input,size_t size,char *dest,int oflag,nxt_file_progress_t func,void *ctx) {
+  struct nxt_stream stream;
+  struct nxt_stream_progress progress = {
+    .total = size,
+    .func = func,
+    .ctx = ctx
+  };
+  pthread_t reader;
+  size_t avail = 0,len;
+  ssize_t w;
+  char *block;
+  int handle;
+  int ret = 0;
+
+  if (oflag&NXT_OAPPND) {
+    handle = nxt_file_open(nxt,dest,oflag,&avail);
+    if (handle>=0 && avail<size) {
+      fprintf(stderr,"Error: %s\n",nxt_strerror(NXT_ERR_FILE_IS_FULL));
+      nxt_file_close(nxt,handle);
+      return -1;
+    }
+  }
+  else handle = nxt_file_open(nxt,dest,oflag,size);
+  if (handle<0) {
     fprintf(stderr,"Error: %s\n",nxt_strerror(nxt_error(nxt)));
-    ret = -1;
+    return -1;
+  }
+
+  if (nxt_stream_init(&stream,input,size)==-1) {
+    fprintf(stderr,"Error: %s\n",strerror(ENOMEM));
+    nxt_file_close(nxt,handle);
+    return -1;
+  }
+  if ((ret = pthread_create(&reader,NULL,nxt_stream_reader,&stream))!=0) {
+    fprintf(stderr,"Error: %s\n",strerror(ret));
+    nxt_stream_destroy(&stream);
+    nxt_file_close(nxt,handle);
+    return -1;
+  }
+
+  while ((block = nxt_stream_get_filled(&stream,&len))!=NULL) {
+    w = nxt_file_write_progress(nxt,handle,block,len,func!=NULL?nxt_stream_progress:NULL,&progress);
+    if (w!=len) {
+      fprintf(stderr,"Error: %s\n",nxt_strerror(nxt_error(nxt)));
+      ret = -1;
+      nxt_stream_abort(&stream);
+      break;
+    }
+    nxt_stream_release(&stream);
+    progress.base += len;
   }
+  pthread_join(reader,NULL);
 
-  if (buffer!=NULL) free(buffer);
-  if (fh>=0) nxt_file_close(nxt,fh);
+  if (stream.error!=0) {
+    fprintf(stderr,"Error: %s\n",strerror(stream.error));
+    ret = -1;
+  }
+  nxt_stream_destroy(&stream);
+  nxt_file_close(nxt,handle);
   return ret;
 }
 
 /**
  * Upload a file src from host filesystem to file dest on NXT brick
  *  @param nxt NXT handle
- *  @param src filename on host
+ *  @param src filename on host ("-" for standard input)
  *  @param dest file on NXT
  *  @param oflag open flags for nxt_file_open
  *  @return Success?
+ *  @note The NXT needs the file size when the file is opened. Input whose
+ *        size isn't known (e.g. a pipe) is spooled to a temporary file first.
  */
-
 int nxt_upload(nxt_t *nxt,char *src,char *dest,int oflag) {
-  char *buf = malloc(BUFSIZE);
-  size_t size = 0;
-  int ret = 0;
+  struct stat st;
   FILE *input;
+  FILE *spool = NULL;
+  size_t size = 0,len;
+  off_t pos;
+  int ret;
 
   if (strcmp(src,"-")==0) input = stdin;
   else {
@@ -519,21 +883,36 @@ int nxt_upload(nxt_t *nxt,char *src,char *dest,int oflag) {
     }
   }
 
-  while (!feof(input)) {
-    size += fread(buf+size,1,BUFSIZE,input);
-    buf = realloc(buf,size+BUFSIZE);
-  }
-
-  int handle = nxt_file_open(nxt,dest,oflag,size);
-  if (handle>=0) {
-    nxt_file_write(nxt,handle,buf,size);
-    nxt_file_close(nxt,handle);
+  if (fstat(fileno(input),&st)==0 && S_ISREG(st.st_mode) && (pos = ftello(input))!=-1) {
+    size = st.st_size-pos;
   }
   else {
-    fprintf(stderr,"Error: %s\n",nxt_strerror(nxt_error(nxt)));
-    ret = -1;
+    char *buf = malloc(BUFSIZE);
+
+    spool = tmpfile();
+    if (spool==NULL) {
+      fprintf(stderr,"Error: %s\n",strerror(errno));
+      free(buf);
+      if (input!=stdin) fclose(input);
+      return -1;
+    }
+    while ((len = fread(buf,1,BUFSIZE,input))>0) {
+      if (fwrite(buf,1,len,spool)!=len) {
+        fprintf(stderr,"Error: %s\n",strerror(errno));
+        free(buf);
+        fclose(spool);
+        if (input!=stdin) fclose(input);
+        return -1;
+      }
+      size += len;
+    }
+    free(buf);
+    rewind(spool);
   }
 
-  free(buf);
+  ret = nxt_upload_stream(nxt,spool!=NULL?spool:input,size,dest,oflag,NULL,NULL);
+
+  if (spool!=NULL) fclose(spool);
+  if (input!=stdin) fclose(input);
   return ret;
 }
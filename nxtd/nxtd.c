@@ -1,5 +1,6 @@
 /*
-    nxtd.c - A daemon for managing NXT connections
+    nxtd.c - Core of nxtd: NXT list, I/O and sampler threads
+             (used by the daemon and by libanxt_direct)
     aNXT - a NXt Toolkit
     Libraries and tools for LEGO Mindstorms NXT robots
     Copyright (C) 2008  Janosch Gräf <janosch.graef@gmx.net>
@@ -23,18 +24,59 @@
 #include <signal.h>
 #include <stdarg.h>
 #include <stdlib.h>
+#include <string.h>
 #include <pthread.h>
+#include <time.h>
 
 #include <anxt/net.h>
 
 #include "nxtd.h"
 
-static pthread_t scanner_tid = -1;
-static char *pidfile = "/var/run/nxtd.pid";
-static nxtnet_srv_t *server = NULL;
+static pthread_mutex_t scan_usb_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t scan_bt_mutex = PTHREAD_MUTEX_INITIALIZER;
 static FILE *logfd = NULL;
-static int use_usb = 1;
-static int use_bt = 1;
+static int use_usb = 0;
+static int use_bt = 0;
+static struct timespec started;
+
+struct nxtd_list nxts;
+
+/// State of scanner threads
+static struct {
+  /// USB scanner thread (handles hotplug events)
+  pthread_t usb_tid;
+  /// Bluetooth scanner thread (runs inquiries)
+  pthread_t bt_tid;
+  /// Health monitor thread (checks idle NXTs)
+  pthread_t health_tid;
+  /// If USB scanner is running
+  int usb_running;
+  /// If Bluetooth scanner is running
+  int bt_running;
+  /// If health monitor is running
+  int health_running;
+  /// Mutex for the following fields
+  pthread_mutex_t mutex;
+  /// Signaled when an inquiry is requested or scanners have to quit
+  pthread_cond_t cond;
+  /// If scanners have to quit
+  int quit;
+  /// If an inquiry was requested (by LIST)
+  int bt_request;
+  /// If a health check was requested (by a new NXT)
+  int health_request;
+  /// Number of inquiries done
+  unsigned int bt_scans;
+  /// Interval of periodic inquiries (in seconds; 0 for only on request)
+  unsigned int bt_interval;
+  /// When next periodic inquiry is due (CLOCK_MONOTONIC)
+  struct timespec bt_next;
+  /// When next requested inquiry may be done (CLOCK_MONOTONIC)
+  struct timespec bt_earliest;
+} scanner = {
+  .mutex = PTHREAD_MUTEX_INITIALIZER,
+  .bt_interval = NXTD_BT_SCAN_INTERVAL
+};
 
 /**
  * Prints log message
@@ -54,74 +96,710 @@ static void logmsg(const char *fmt,...) {
   }
 }
 
-const char *nxtd_id2str(nxtd_id_t id) {
-  static char buf[18];
-
-  snprintf(buf,18,"%02X:%02X:%02X:%02X:%02X:%02X",id[0]&0xFF,id[1]&0xFF,id[2]&0xFF,id[3]&0xFF,id[4]&0xFF,id[5]&0xFF);
+/**
+ * Formats NXT ID like a Bluetooth address
+ *  @param id NXT ID
+ *  @param buf Buffer (NXTD_IDSTR_LEN bytes)
+ *  @return buf
+ */
+const char *nxtd_id2str(nxtd_id_t id,char *buf) {
+  snprintf(buf,NXTD_IDSTR_LEN,"%02X:%02X:%02X:%02X:%02X:%02X",id[0]&0xFF,id[1]&0xFF,id[2]&0xFF,id[3]&0xFF,id[4]&0xFF,id[5]&0xFF);
   return buf;
 }
 
 /**
- * Registers a NXT in NXT list
+ * Gets time passed since a point in time
+ *  @param t Point in time (CLOCK_MONOTONIC)
+ *  @param now Current time (CLOCK_MONOTONIC)
+ *  @return Microseconds between 't' and 'now' (saturates at UINT32_MAX)
+ */
+static uint32_t nxtd_time_usec(const struct timespec *t,const struct timespec *now) {
+  int64_t usec = (int64_t)(now->tv_sec-t->tv_sec)*1000000+(now->tv_nsec-t->tv_nsec)/1000;
+
+  if (usec<0) {
+    return 0;
+  }
+  return usec>UINT32_MAX?UINT32_MAX:usec;
+}
+
+/**
+ * Sends data to NXT and receives its reply
  *  @param nxt NXT
- *  @return Success?
+ *  @param sbuf Data to send (NULL for none)
+ *  @param ssize How many bytes to send
+ *  @param rbuf Buffer for received data (NULL for none)
+ *  @param rsize How many bytes to receive
+ *  @return Bytes sent (only sending) or received; -1 on failure
+ *  @note Only called from NXT's worker thread. The transfer is counted in
+ *        the NXT's statistics.
  */
-int nxtd_nxt_reg(struct nxtd_nxt *nxt) {
+static ssize_t nxtd_io_transact(struct nxtd_nxt *nxt,const void *sbuf,size_t ssize,void *rbuf,size_t rsize) {
+  struct timespec start,end;
+  ssize_t ret = -1;
+  size_t sent = 0,received = 0;
+  int opcode;
+
+  clock_gettime(CLOCK_MONOTONIC,&start);
+  if (sbuf!=NULL) {
+    if (nxt->conn_type==NXTD_USB) ret = nxtd_usb_send((struct nxtd_nxt_usb*)nxt,sbuf,ssize);
+    else if (nxt->conn_type==NXTD_BT) ret = nxtd_bt_send((struct nxtd_nxt_bt*)nxt,sbuf,ssize);
+    if (ret==ssize) {
+      sent = ssize;
+    }
+    else {
+      ret = -1;
+    }
+  }
+  if (rbuf!=NULL && (sbuf==NULL || ret!=-1)) {
+    ret = 0;
+    if (nxt->conn_type==NXTD_USB) ret = nxtd_usb_recv((struct nxtd_nxt_usb*)nxt,rbuf,rsize);
+    else if (nxt->conn_type==NXTD_BT) ret = nxtd_bt_recv((struct nxtd_nxt_bt*)nxt,rbuf,rsize);
+    if (ret==rsize) {
+      received = rsize;
+    }
+    else {
+      ret = -1;
+    }
+  }
+  clock_gettime(CLOCK_MONOTONIC,&end);
+
+  // opcode is in second byte of command or reply
+  if (sbuf!=NULL && ssize>=2) opcode = ((const unsigned char*)sbuf)[1];
+  else if (rbuf!=NULL && received>=2) opcode = ((unsigned char*)rbuf)[1];
+  else opcode = -1;
+
+  pthread_mutex_lock(&nxt->stats_mutex);
+  nxt->stats.telegrams++;
+  nxt->stats.bytes_sent += sent;
+  nxt->stats.bytes_recv += received;
+  nxtd_hist_add(&nxt->stats.transfer,nxtd_time_usec(&start,&end));
+  if (opcode!=-1) {
+    nxt->stats.opcodes[opcode].telegrams++;
+    if (ret==-1) {
+      nxt->stats.opcodes[opcode].errors++;
+    }
+  }
+  pthread_mutex_unlock(&nxt->stats_mutex);
+
+  return ret;
+}
+
+/**
+ * Performs an I/O request on the NXT's connection
+ *  @param nxt NXT
+ *  @param req Request
+ *  @return Bytes sent (SEND) or received (RECV, TRANSACT), transactions done (BATCH)
+ *  @note Only called from NXT's worker thread
+ */
+static ssize_t nxtd_io(struct nxtd_nxt *nxt,struct nxtd_request *req) {
   size_t i;
 
-  pthread_mutex_lock(&nxts.mutex);
+  if (req->type==NXTD_REQ_SEND) {
+    return nxtd_io_transact(nxt,req->send_buf,req->send_size,NULL,0);
+  }
+  else if (req->type==NXTD_REQ_RECV) {
+    return nxtd_io_transact(nxt,NULL,0,req->recv_buf,req->recv_size);
+  }
+  else if (req->type==NXTD_REQ_TRANSACT) {
+    return nxtd_io_transact(nxt,req->send_buf,req->send_size,req->recv_buf,req->recv_size);
+  }
+  else if (req->type==NXTD_REQ_BATCH) {
+    for (i=0;i<req->num_items;i++) {
+      struct nxtnet_batch_item *item = req->items+i;
+
+      item->ret = nxtd_io_transact(nxt,item->send_buf,item->send_size,item->recv_size>0?item->recv_buf:NULL,item->recv_size);
+      if (item->ret==-1) {
+        // connection is broken; don't try the rest
+        return -1;
+      }
+      else if (item->recv_size==0) {
+        item->ret = 0;
+      }
+    }
+    return i;
+  }
+  else {
+    return -1;
+  }
+}
+
+/**
+ * Resets connection to NXT after a request failed, so that the next request
+ * connects again
+ *  @param nxt NXT
+ *  @note Only called from NXT's worker thread. For USB this also discards
+ *        replies that arrive late, so they aren't taken for the reply of
+ *        the next request.
+ */
+static void nxtd_io_reset(struct nxtd_nxt *nxt) {
+  if (nxt->conn_type==NXTD_USB) {
+    nxtd_usb_disconnect((struct nxtd_nxt_usb*)nxt);
+  }
+  else if (nxt->conn_type==NXTD_BT) {
+    nxtd_bt_disconnect((struct nxtd_nxt_bt*)nxt);
+  }
+
+  pthread_mutex_lock(&nxt->stats_mutex);
+  nxt->stats.reconnects++;
+  pthread_mutex_unlock(&nxt->stats_mutex);
+}
+
+/**
+ * Worker thread of a NXT. Executes the NXT's requests one after another.
+ *  @param arg NXT
+ */
+static void *nxtd_worker(void *arg) {
+  struct nxtd_nxt *nxt = (struct nxtd_nxt*)arg;
+  struct nxtd_request *req;
+  struct timespec now;
+
+  pthread_mutex_lock(&nxt->io_mutex);
+  while (1) {
+    while (nxt->io_first==NULL && !nxt->io_quit) {
+      pthread_cond_wait(&nxt->io_cond,&nxt->io_mutex);
+    }
+    if (nxt->io_first==NULL) {
+      break;
+    }
+
+    // dequeue request
+    req = nxt->io_first;
+    nxt->io_first = req->next;
+    if (nxt->io_first==NULL) {
+      nxt->io_last = NULL;
+    }
+
+    if (nxt->io_quit) {
+      req->ret = -1;
+    }
+    else {
+      pthread_mutex_unlock(&nxt->io_mutex);
+      clock_gettime(CLOCK_MONOTONIC,&now);
+      req->ret = nxtd_io(nxt,req);
+      if (req->ret==-1) {
+        nxtd_io_reset(nxt);
+      }
+
+      pthread_mutex_lock(&nxt->stats_mutex);
+      nxt->stats.requests++;
+      if (req->ret==-1) {
+        nxt->stats.errors++;
+      }
+      nxtd_hist_add(&nxt->stats.queue,nxtd_time_usec(&req->queued,&now));
+      pthread_mutex_unlock(&nxt->stats_mutex);
+
+      pthread_mutex_lock(&nxt->io_mutex);
+      if (req->ret!=-1) {
+        clock_gettime(CLOCK_MONOTONIC,&nxt->last_seen);
+        nxt->fails = 0;
+      }
+      else {
+        clock_gettime(CLOCK_MONOTONIC,&nxt->last_fail);
+        nxt->fails++;
+      }
+    }
+
+    req->done = 1;
+    pthread_cond_broadcast(&nxt->io_done);
+  }
+  pthread_mutex_unlock(&nxt->io_mutex);
+
+  return NULL;
+}
+
+static void *nxtd_sampler(void *arg);
+
+/**
+ * Chooses handle for a NXT
+ *  @param nxt NXT
+ *  @return Handle (-1 if list is full)
+ *  @note The NXT gets the handle it had before if it's free. Otherwise
+ *        handles that were never used are preferred, so that other NXTs
+ *        can get their handles back too.
+ *  @note List mutex must be locked
+ */
+static int nxtd_nxt_slot(struct nxtd_nxt *nxt) {
+  int i,unused = -1,any = -1;
+
   for (i=0;i<NXTD_MAXNUM;i++) {
     if (nxts.list[i]==NULL) {
-      nxts.list[i] = nxt;
-      logmsg("Added %s (%d; %s; %s)\n",nxts.list[i]->name,i,nxtd_id2str(nxts.list[i]->id),nxts.list[i]->conn_type==NXTD_USB?"USB":"BT");
-      pthread_mutex_unlock(&nxts.mutex);
-      return 0;
+      if (nxts.slots[i].used && nxts.slots[i].conn_type==nxt->conn_type && memcmp(nxts.slots[i].id,nxt->id,sizeof(nxtd_id_t))==0) {
+        return i;
+      }
+      if (!nxts.slots[i].used && unused==-1) {
+        unused = i;
+      }
+      if (any==-1) {
+        any = i;
+      }
     }
   }
+
+  return unused!=-1?unused:any;
+}
+
+/**
+ * Registers a NXT in NXT list and starts its worker thread
+ *  @param nxt NXT
+ *  @return Success?
+ */
+int nxtd_nxt_reg(struct nxtd_nxt *nxt) {
+  pthread_condattr_t attr;
+  char idstr[NXTD_IDSTR_LEN];
+  int i;
+
+  nxt->refs = 1;
+  nxt->io_first = NULL;
+  nxt->io_last = NULL;
+  nxt->io_quit = 0;
+  memset(&nxt->last_seen,0,sizeof(nxt->last_seen));
+  nxt->fails = 0;
+  memset(&nxt->stats,0,sizeof(nxt->stats));
+  pthread_mutex_init(&nxt->stats_mutex,NULL);
+  pthread_mutex_init(&nxt->io_mutex,NULL);
+  pthread_cond_init(&nxt->io_cond,NULL);
+  pthread_cond_init(&nxt->io_done,NULL);
+
+  nxt->sub_first = NULL;
+  nxt->sub_quit = 0;
+  pthread_mutex_init(&nxt->sub_mutex,NULL);
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr,CLOCK_MONOTONIC);
+  pthread_cond_init(&nxt->sub_cond,&attr);
+  pthread_condattr_destroy(&attr);
+
+  pthread_mutex_lock(&nxts.mutex);
+  i = nxtd_nxt_slot(nxt);
+  if (i==-1) {
+    pthread_mutex_unlock(&nxts.mutex);
+    return -1;
+  }
+  nxt->handle = i;
+  if (pthread_create(&nxt->io_tid,NULL,nxtd_worker,nxt)!=0) {
+    pthread_mutex_unlock(&nxts.mutex);
+    return -1;
+  }
+  if (pthread_create(&nxt->sub_tid,NULL,nxtd_sampler,nxt)!=0) {
+    pthread_mutex_lock(&nxt->io_mutex);
+    nxt->io_quit = 1;
+    pthread_cond_signal(&nxt->io_cond);
+    pthread_mutex_unlock(&nxt->io_mutex);
+    pthread_join(nxt->io_tid,NULL);
+    pthread_mutex_unlock(&nxts.mutex);
+    return -1;
+  }
+  nxts.list[i] = nxt;
+  memcpy(nxts.slots[i].id,nxt->id,sizeof(nxtd_id_t));
+  nxts.slots[i].conn_type = nxt->conn_type;
+  nxts.slots[i].used = 1;
+  logmsg("Added %s (%d; %s; %s)\n",nxt->name,i,nxtd_id2str(nxt->id,idstr),nxt->conn_type==NXTD_USB?"USB":"BT");
   pthread_mutex_unlock(&nxts.mutex);
-  return -1;
+
+  // let health monitor check new NXT
+  pthread_mutex_lock(&scanner.mutex);
+  scanner.health_request = 1;
+  pthread_cond_broadcast(&scanner.cond);
+  pthread_mutex_unlock(&scanner.mutex);
+  return 0;
 }
 
-void nxtd_nxt_remove(int handle) {
-  if (nxts.list[handle]==NULL) return;
-  logmsg("Removing %s (%d; %s)\n", nxts.list[handle]->name, handle, nxts.list[handle]->conn_type==NXTD_USB?"USB":"BT");
-  if (nxts.list[handle]->conn_type==NXTD_USB) nxtd_usb_close((struct nxtd_nxt_usb*)nxts.list[handle]);
-  else if (nxts.list[handle]->conn_type==NXTD_BT) nxtd_bt_close((struct nxtd_nxt_bt*)nxts.list[handle]);
-  nxts.list[handle] = 0;
+/**
+ * Gets a reference to a NXT
+ *  @param handle NXT handle
+ *  @return NXT (NULL if there is no NXT with this handle)
+ *  @note Release reference with nxtd_nxt_put()
+ */
+static struct nxtd_nxt *nxtd_nxt_get(int handle) {
+  struct nxtd_nxt *nxt = NULL;
+
+  if (handle<0 || handle>=NXTD_MAXNUM) {
+    return NULL;
+  }
+
+  pthread_mutex_lock(&nxts.mutex);
+  if (nxts.list[handle]!=NULL) {
+    nxt = nxts.list[handle];
+    nxt->refs++;
+  }
+  pthread_mutex_unlock(&nxts.mutex);
+
+  return nxt;
 }
 
 /**
- * Scans for NXTs
+ * Releases a reference to a NXT. Closes the NXT if this was the last one.
+ *  @param nxt NXT
  */
-static void *nxtd_scanner(void *x) {
-  while (1) {
-    size_t i;
+void nxtd_nxt_put(struct nxtd_nxt *nxt) {
+  int last;
+
+  pthread_mutex_lock(&nxts.mutex);
+  last = --nxt->refs==0;
+  pthread_mutex_unlock(&nxts.mutex);
+
+  if (last) {
+    // there are no subscriptions left, since they hold references
+    pthread_mutex_lock(&nxt->sub_mutex);
+    nxt->sub_quit = 1;
+    pthread_cond_broadcast(&nxt->sub_cond);
+    pthread_mutex_unlock(&nxt->sub_mutex);
+    pthread_join(nxt->sub_tid,NULL);
+    pthread_cond_destroy(&nxt->sub_cond);
+    pthread_mutex_destroy(&nxt->sub_mutex);
+
+    pthread_join(nxt->io_tid,NULL);
+    pthread_cond_destroy(&nxt->io_done);
+    pthread_cond_destroy(&nxt->io_cond);
+    pthread_mutex_destroy(&nxt->io_mutex);
+    pthread_mutex_destroy(&nxt->stats_mutex);
+    if (nxt->conn_type==NXTD_USB) nxtd_usb_close((struct nxtd_nxt_usb*)nxt);
+    else if (nxt->conn_type==NXTD_BT) nxtd_bt_close((struct nxtd_nxt_bt*)nxt);
+  }
+}
+
+/**
+ * Removes a NXT from NXT list and stops its worker thread
+ *  @param nxt NXT
+ *  @note The NXT is closed when its last reference is released
+ */
+void nxtd_nxt_remove(struct nxtd_nxt *nxt) {
+  pthread_mutex_lock(&nxts.mutex);
+  if (nxts.list[nxt->handle]!=nxt) {
+    // already removed
+    pthread_mutex_unlock(&nxts.mutex);
+    return;
+  }
+  logmsg("Removing %s (%d; %s)\n", nxt->name, nxt->handle, nxt->conn_type==NXTD_USB?"USB":"BT");
+  nxts.list[nxt->handle] = NULL;
+  pthread_mutex_unlock(&nxts.mutex);
+
+  pthread_mutex_lock(&nxt->io_mutex);
+  nxt->io_quit = 1;
+  pthread_cond_signal(&nxt->io_cond);
+  pthread_mutex_unlock(&nxt->io_mutex);
 
-    // Scan for NXTs
-    if (use_usb) {
-      nxtd_usb_scan();
+  nxtd_nxt_put(nxt);
+}
+
+/**
+ * Queues a request for NXT's worker thread and waits until it is done
+ *  @param nxt NXT
+ *  @param req Request
+ *  @return Bytes sent (SEND) or received (RECV, TRANSACT), transactions done (BATCH); -1 on failure
+ *  @note The NXT is removed if NXTD_MAXFAILS requests failed in a row
+ */
+static ssize_t nxtd_nxt_request(struct nxtd_nxt *nxt,struct nxtd_request *req) {
+  int remove = 0;
+
+  req->next = NULL;
+  req->done = 0;
+  req->ret = -1;
+  clock_gettime(CLOCK_MONOTONIC,&req->queued);
+
+  pthread_mutex_lock(&nxt->io_mutex);
+  if (!nxt->io_quit) {
+    if (nxt->io_last!=NULL) {
+      nxt->io_last->next = req;
     }
-    if (use_bt) {
-      nxtd_bt_scan();
+    else {
+      nxt->io_first = req;
     }
+    nxt->io_last = req;
+    pthread_cond_signal(&nxt->io_cond);
 
-    // Find NXTs that have timed out
-    /*pthread_mutex_lock(&nxts.mutex);
-    time_t now = time(NULL);
-    for (i=0;i<NXTD_MAXNUM;i++) {
-      if (nxts.list[i]!=NULL) {
-        if (nxts.list[i]->conn_timeout!=0 && nxts.list[i]->conn_timeout<now) {
-          if (nxts.list[i]->conn_type==NXTD_USB) nxtd_usb_disconnect((struct nxtd_nxt_usb*)nxts.list[i]);
-          else if (nxts.list[i]->conn_type==NXTD_BT) nxtd_bt_disconnect((struct nxtd_nxt_bt*)nxts.list[i]);
-          logmsg("Timeout: %s (%d;%s)\n",nxts.list[i]->name,i,nxts.list[i]->conn_type==NXTD_USB?"USB":"BT");
+    while (!req->done) {
+      pthread_cond_wait(&nxt->io_done,&nxt->io_mutex);
+    }
+    remove = nxt->fails>=NXTD_MAXFAILS;
+  }
+  pthread_mutex_unlock(&nxt->io_mutex);
+
+  if (remove) {
+    nxtd_nxt_remove(nxt);
+  }
+
+  return req->ret;
+}
+
+/**
+ * Compares two points in time
+ *  @param a Point in time
+ *  @param b Point in time
+ *  @return <0 if a is before b, 0 if equal, >0 if a is after b
+ */
+static int nxtd_time_cmp(const struct timespec *a,const struct timespec *b) {
+  if (a->tv_sec!=b->tv_sec) {
+    return a->tv_sec<b->tv_sec?-1:1;
+  }
+  else if (a->tv_nsec!=b->tv_nsec) {
+    return a->tv_nsec<b->tv_nsec?-1:1;
+  }
+  else {
+    return 0;
+  }
+}
+
+/**
+ * Adds microseconds to a point in time
+ *  @param t Point in time
+ *  @param usec Microseconds
+ */
+static void nxtd_time_add(struct timespec *t,unsigned int usec) {
+  t->tv_sec += usec/1000000;
+  t->tv_nsec += (usec%1000000)*1000;
+  if (t->tv_nsec>=1000000000) {
+    t->tv_sec++;
+    t->tv_nsec -= 1000000000;
+  }
+}
+
+/**
+ * Sampler thread of a NXT. Executes all due subscriptions in one batch and
+ * passes the results to the subscribers.
+ *  @param arg NXT
+ *  @note Identical telegrams of different subscriptions are only executed
+ *        once per sampling round.
+ */
+static void *nxtd_sampler(void *arg) {
+  struct nxtd_nxt *nxt = (struct nxtd_nxt*)arg;
+  struct nxtd_sub *sub,**due = NULL,**new_due;
+  struct nxtnet_batch_item *items = NULL,*new_items;
+  size_t num_due,max_due = 0,num_items,max_items = 0,first_item;
+  size_t i,j,k;
+  struct timespec now,next;
+  struct nxtd_request req;
+
+  pthread_mutex_lock(&nxt->sub_mutex);
+  while (!nxt->sub_quit) {
+    if (nxt->sub_first==NULL) {
+      pthread_cond_wait(&nxt->sub_cond,&nxt->sub_mutex);
+      continue;
+    }
+
+    // find due subscriptions
+    clock_gettime(CLOCK_MONOTONIC,&now);
+    next = nxt->sub_first->due;
+    num_due = 0;
+    for (sub=nxt->sub_first;sub!=NULL;sub=sub->next) {
+      if (nxtd_time_cmp(&sub->due,&now)<=0) {
+        if (num_due==max_due) {
+          // out of memory: the others stay due for the next round
+          if ((new_due = realloc(due,(max_due>0?2*max_due:8)*sizeof(struct nxtd_sub*)))==NULL) {
+            break;
+          }
+          due = new_due;
+          max_due = max_due>0?2*max_due:8;
         }
+        due[num_due++] = sub;
+      }
+      else if (nxtd_time_cmp(&sub->due,&next)<0) {
+        next = sub->due;
       }
     }
-    pthread_mutex_unlock(&nxts.mutex);*/
+    if (num_due==0) {
+      if (nxtd_time_cmp(&next,&now)<=0) {
+        // couldn't allocate due list, try again later
+        next = now;
+        nxtd_time_add(&next,NXTD_SAMPLE_MININTERVAL);
+      }
+      pthread_cond_timedwait(&nxt->sub_cond,&nxt->sub_mutex,&next);
+      continue;
+    }
+
+    // merge telegrams of due subscriptions
+    num_items = 0;
+    for (i=0;i<num_due;i++) {
+      first_item = num_items;
+      for (k=0;k<due[i]->num_items;k++) {
+        struct nxtnet_batch_item *item = due[i]->items+k;
 
-    usleep(1000);
-    pthread_testcancel();
+        for (j=0;j<num_items;j++) {
+          if (items[j].send_size==item->send_size && items[j].recv_size==item->recv_size
+           && memcmp(items[j].send_buf,item->send_buf,item->send_size)==0) {
+            break;
+          }
+        }
+        if (j==num_items) {
+          if (num_items==max_items) {
+            if ((new_items = realloc(items,(max_items>0?2*max_items:8)*sizeof(struct nxtnet_batch_item)))==NULL) {
+              break;
+            }
+            items = new_items;
+            max_items = max_items>0?2*max_items:8;
+          }
+          items[num_items] = *item;
+          items[num_items].ret = -1;
+          num_items++;
+        }
+        due[i]->merged[k] = j;
+      }
+      if (k<due[i]->num_items) {
+        // out of memory: this and later subscriptions stay due
+        num_items = first_item;
+        num_due = i;
+        break;
+      }
+      due[i]->sampling = 1;
+    }
+    if (num_due==0) {
+      next = now;
+      nxtd_time_add(&next,NXTD_SAMPLE_MININTERVAL);
+      pthread_cond_timedwait(&nxt->sub_cond,&nxt->sub_mutex,&next);
+      continue;
+    }
+
+    // execute telegrams; due subscriptions are not freed meanwhile
+    pthread_mutex_unlock(&nxt->sub_mutex);
+
+    memset(&req,0,sizeof(req));
+    req.type = NXTD_REQ_BATCH;
+    req.items = items;
+    req.num_items = num_items;
+    nxtd_nxt_request(nxt,&req);
+    clock_gettime(CLOCK_MONOTONIC,&now);
+
+    pthread_mutex_lock(&nxt->sub_mutex);
+    for (i=0;i<num_due;i++) {
+      sub = due[i];
+      sub->sampling = 0;
+      if (sub->removed) {
+        continue;
+      }
+
+      for (k=0;k<sub->num_items;k++) {
+        j = sub->merged[k];
+        if (items[j].ret>0 && items[j].recv_buf!=sub->items[k].recv_buf) {
+          memcpy(sub->items[k].recv_buf,items[j].recv_buf,items[j].ret);
+        }
+        sub->items[k].ret = items[j].ret;
+      }
+      sub->sample(sub->ctx,&now,sub->items,sub->num_items);
+
+      // samples that were missed are skipped
+      nxtd_time_add(&sub->due,sub->interval);
+      if (nxtd_time_cmp(&sub->due,&now)<0) {
+        sub->due = now;
+        nxtd_time_add(&sub->due,sub->interval);
+      }
+    }
+    pthread_cond_broadcast(&nxt->sub_cond);
+  }
+  pthread_mutex_unlock(&nxt->sub_mutex);
+
+  free(due);
+  free(items);
+  return NULL;
+}
+
+/**
+ * Scans for NXTs once
+ *  @param usb If USB is scanned
+ *  @param bt If Bluetooth is scanned
+ *  @note Only modules that were initialized by nxtd_init() are scanned
+ *  @note If a Bluetooth inquiry is already running, its result is used
+ *        instead of doing another one.
+ */
+void nxtd_scan(int usb,int bt) {
+  unsigned int bt_scans;
+
+  if (usb && use_usb) {
+    pthread_mutex_lock(&scan_usb_mutex);
+    nxtd_usb_scan();
+    pthread_mutex_unlock(&scan_usb_mutex);
+  }
+  if (bt && use_bt) {
+    pthread_mutex_lock(&scanner.mutex);
+    bt_scans = scanner.bt_scans;
+    pthread_mutex_unlock(&scanner.mutex);
+
+    pthread_mutex_lock(&scan_bt_mutex);
+    pthread_mutex_lock(&scanner.mutex);
+    if (bt_scans==scanner.bt_scans) {
+      pthread_mutex_unlock(&scanner.mutex);
+      nxtd_bt_scan();
+      pthread_mutex_lock(&scanner.mutex);
+      scanner.bt_scans++;
+      scanner.bt_request = 0;
+      clock_gettime(CLOCK_MONOTONIC,&scanner.bt_earliest);
+      scanner.bt_next = scanner.bt_earliest;
+      scanner.bt_earliest.tv_sec += NXTD_BT_SCAN_MININTERVAL;
+      scanner.bt_next.tv_sec += scanner.bt_interval;
+    }
+    pthread_mutex_unlock(&scanner.mutex);
+    pthread_mutex_unlock(&scan_bt_mutex);
+  }
+}
+
+/**
+ * Requests a Bluetooth inquiry from scanner thread
+ *  @note The inquiry is done in background and not more often than every
+ *        NXTD_BT_SCAN_MININTERVAL seconds.
+ */
+static void nxtd_scan_request() {
+  pthread_mutex_lock(&scanner.mutex);
+  scanner.bt_request = 1;
+  pthread_cond_broadcast(&scanner.cond);
+  pthread_mutex_unlock(&scanner.mutex);
+}
+
+/**
+ * Scans for NXTs on USB. Waits for hotplug events if the USB module
+ * supports them, otherwise enumerates the devices periodically.
+ */
+static void *nxtd_usb_scanner(void *x) {
+  int quit = 0;
+
+  nxtd_scan(1,0);
+  while (!quit) {
+    if (nxtd_usb_wait(NXTD_USB_SCAN_INTERVAL)) {
+      nxtd_scan(1,0);
+    }
+
+    pthread_mutex_lock(&scanner.mutex);
+    quit = scanner.quit;
+    pthread_mutex_unlock(&scanner.mutex);
+  }
+
+  return NULL;
+}
+
+/**
+ * Scans for NXTs on Bluetooth. Inquiries are done periodically and when
+ * requested by LIST, but not more often than every NXTD_BT_SCAN_MININTERVAL
+ * seconds, since they disturb connections to other NXTs.
+ */
+static void *nxtd_bt_scanner(void *x) {
+  struct timespec now,*next;
+
+  pthread_mutex_lock(&scanner.mutex);
+  while (!scanner.quit) {
+    clock_gettime(CLOCK_MONOTONIC,&now);
+    if ((scanner.bt_interval>0 && nxtd_time_cmp(&scanner.bt_next,&now)<=0)
+     || (scanner.bt_request && nxtd_time_cmp(&scanner.bt_earliest,&now)<=0)) {
+      pthread_mutex_unlock(&scanner.mutex);
+      nxtd_scan(0,1);
+      pthread_mutex_lock(&scanner.mutex);
+      continue;
+    }
+
+    // wait until periodic inquiry is due or requested inquiry is allowed
+    next = NULL;
+    if (scanner.bt_interval>0) {
+      next = &scanner.bt_next;
+    }
+    if (scanner.bt_request && (next==NULL || nxtd_time_cmp(&scanner.bt_earliest,next)<0)) {
+      next = &scanner.bt_earliest;
+    }
+    if (next!=NULL) {
+      pthread_cond_timedwait(&scanner.cond,&scanner.mutex,next);
+    }
+    else {
+      pthread_cond_wait(&scanner.cond,&scanner.mutex);
+    }
   }
+  pthread_mutex_unlock(&scanner.mutex);
+
+  return NULL;
 }
 
 /**
@@ -131,48 +809,157 @@ static void *nxtd_scanner(void *x) {
  */
 static int nxtd_keepalive(struct nxtd_nxt *nxt) {
   char buf[] = { 0x00,0x0D,0,0,0,0,0 };
+  struct nxtd_request req = {
+    .type = NXTD_REQ_TRANSACT,
+    .send_buf = buf,
+    .send_size = 2,
+    .recv_buf = buf,
+    .recv_size = 7
+  };
 
-  if (nxt->conn_type==NXTD_USB) {
-    if (nxtd_usb_send((struct nxtd_nxt_usb*)nxt,buf,2)!=2) {
-      return -1;
-    }
+  if (nxtd_nxt_request(nxt,&req)!=7) {
+    return -1;
+  }
+
+  return buf[2]==0?0:-1;
+}
+
+/**
+ * Health monitor. Sends KEEPALIVE to NXTs that were idle for
+ * NXTD_HEALTH_INTERVAL seconds or were never talked to. NXTs whose last
+ * request failed are checked again after NXTD_RETRY_DELAY milliseconds (with
+ * backoff) until they answer or are removed.
+ */
+static void *nxtd_monitor(void *x) {
+  struct nxtd_nxt *list[NXTD_MAXNUM];
+  struct timespec now,next,due;
+  size_t i,num;
+  unsigned int fails;
+  int never;
+
+  pthread_mutex_lock(&scanner.mutex);
+  while (!scanner.quit) {
+    scanner.health_request = 0;
+    pthread_mutex_unlock(&scanner.mutex);
 
-    if (nxtd_usb_recv((struct nxtd_nxt_usb*)nxt,buf,7)!=7) {
-      return -1;
+    // take references of idle NXTs
+    clock_gettime(CLOCK_MONOTONIC,&now);
+    next = now;
+    next.tv_sec += NXTD_HEALTH_INTERVAL;
+    num = 0;
+    pthread_mutex_lock(&nxts.mutex);
+    for (i=0;i<NXTD_MAXNUM;i++) {
+      if (nxts.list[i]!=NULL) {
+        pthread_mutex_lock(&nxts.list[i]->io_mutex);
+        fails = nxts.list[i]->fails;
+        due = fails>0?nxts.list[i]->last_fail:nxts.list[i]->last_seen;
+        pthread_mutex_unlock(&nxts.list[i]->io_mutex);
+        never = fails==0 && due.tv_sec==0 && due.tv_nsec==0;
+        if (fails>0) {
+          nxtd_time_add(&due,(NXTD_RETRY_DELAY*1000)<<((fails<NXTD_MAXFAILS?fails:NXTD_MAXFAILS)-1));
+        }
+        else {
+          due.tv_sec += NXTD_HEALTH_INTERVAL;
+        }
+        if (never || nxtd_time_cmp(&due,&now)<=0) {
+          list[num] = nxts.list[i];
+          list[num++]->refs++;
+        }
+        else if (nxtd_time_cmp(&due,&next)<0) {
+          next = due;
+        }
+      }
     }
-  }
-  else if (nxt->conn_type==NXTD_BT) {
-    if (nxtd_bt_send((struct nxtd_nxt_bt*)nxt,buf,2)!=2) {
-      return -1;
+    pthread_mutex_unlock(&nxts.mutex);
+
+    // NXT is removed by nxtd_nxt_request() if it didn't answer too often
+    for (i=0;i<num;i++) {
+      if (nxtd_keepalive(list[i])==-1) {
+        logmsg("No answer from %s (%d)\n",list[i]->name,list[i]->handle);
+      }
+      nxtd_nxt_put(list[i]);
     }
 
-    if (nxtd_bt_recv((struct nxtd_nxt_bt*)nxt,buf,7)!=7) {
-      return -1;
+    pthread_mutex_lock(&scanner.mutex);
+    if (num==0 && !scanner.health_request && !scanner.quit) {
+      pthread_cond_timedwait(&scanner.cond,&scanner.mutex,&next);
     }
   }
-  
-  return buf[2]==0?0:-1;
+  pthread_mutex_unlock(&scanner.mutex);
+
+  return NULL;
 }
 
 /**
- * Lists all NXTs that are connected via BT
+ * Lists all NXTs
  *  @param packer Packer function
+ *  @note NXTs are listed from the NXT list without any I/O. NXTs that don't
+ *        answer anymore are removed by the health monitor.
  */
 static void nxtd_list(void (*packer)(int handle, char *name, void *id, int is_bt)) {
   size_t i;
 
+  // look for new NXTs on Bluetooth for the next LIST
+  nxtd_scan_request();
+
   pthread_mutex_lock(&nxts.mutex);
   for (i=0;i<NXTD_MAXNUM;i++) {
     if (nxts.list[i]!=NULL) {
-      if (nxtd_keepalive(nxts.list[i])==0) {
-        packer(i, nxts.list[i]->name, nxts.list[i]->id, nxts.list[i]->conn_type==NXTD_BT);
-      }
-      else {
-        nxtd_nxt_remove(i);
-      }
+      packer(nxts.list[i]->handle, nxts.list[i]->name, nxts.list[i]->id, nxts.list[i]->conn_type==NXTD_BT);
+    }
+  }
+  pthread_mutex_unlock(&nxts.mutex);
+}
+
+/**
+ * Writes statistics of all NXTs as text
+ *  @param out Output stream
+ *  @note Used for STATS requests and on SIGUSR1
+ */
+void nxtd_stats(FILE *out) {
+  struct {
+    char name[NXTNET_NXTNAME_LEN];
+    int handle;
+    nxtd_id_t id;
+    nxtd_conn_t conn_type;
+    struct nxtd_stats stats;
+  } *snap = NULL;
+  struct timespec now;
+  char idstr[NXTD_IDSTR_LEN];
+  size_t i,num = 0;
+
+  clock_gettime(CLOCK_MONOTONIC,&now);
+
+  // take a snapshot, so requests aren't held up while printing
+  pthread_mutex_lock(&nxts.mutex);
+  for (i=0;i<NXTD_MAXNUM;i++) {
+    if (nxts.list[i]!=NULL) num++;
+  }
+  snap = num>0?malloc(num*sizeof(*snap)):NULL;
+  num = 0;
+  for (i=0;i<NXTD_MAXNUM && snap!=NULL;i++) {
+    struct nxtd_nxt *nxt = nxts.list[i];
+
+    if (nxt!=NULL) {
+      snprintf(snap[num].name,NXTNET_NXTNAME_LEN,"%s",nxt->name);
+      snap[num].handle = nxt->handle;
+      memcpy(snap[num].id,nxt->id,sizeof(nxtd_id_t));
+      snap[num].conn_type = nxt->conn_type;
+      pthread_mutex_lock(&nxt->stats_mutex);
+      memcpy(&snap[num].stats,&nxt->stats,sizeof(struct nxtd_stats));
+      pthread_mutex_unlock(&nxt->stats_mutex);
+      num++;
     }
   }
   pthread_mutex_unlock(&nxts.mutex);
+
+  fprintf(out,"nxtd statistics (up %u s)\n",(unsigned int)(nxtd_time_usec(&started,&now)/1000000));
+  for (i=0;i<num;i++) {
+    fprintf(out,"%s (%d; %s; %s)\n",snap[i].name,snap[i].handle,nxtd_id2str(snap[i].id,idstr),snap[i].conn_type==NXTD_USB?"USB":"BT");
+    nxtd_stats_print(out,&snap[i].stats);
+  }
+
+  free(snap);
 }
 
 /**
@@ -183,14 +970,18 @@ static void nxtd_list(void (*packer)(int handle, char *name, void *id, int is_bt
  *  @return How many bytes sent
  */
 static ssize_t nxtd_send(int handle,const void *buf,size_t size) {
+  struct nxtd_request req = {
+    .type = NXTD_REQ_SEND,
+    .send_buf = buf,
+    .send_size = size
+  };
+  struct nxtd_nxt *nxt = nxtd_nxt_get(handle);
   ssize_t ret = -1;
-  pthread_mutex_lock(&nxts.mutex);
-  if (nxts.list[handle]!=NULL) {
-    if (nxts.list[handle]->conn_type==NXTD_USB) ret = nxtd_usb_send((struct nxtd_nxt_usb*)nxts.list[handle],buf,size);
-    else if (nxts.list[handle]->conn_type==NXTD_BT) ret = nxtd_bt_send((struct nxtd_nxt_bt*)nxts.list[handle],buf,size);
+
+  if (nxt!=NULL) {
+    ret = nxtd_nxt_request(nxt,&req);
+    nxtd_nxt_put(nxt);
   }
-  pthread_mutex_unlock(&nxts.mutex);
-  if (ret!=size) nxtd_nxt_remove(handle);
   return ret;
 }
 
@@ -202,176 +993,281 @@ static ssize_t nxtd_send(int handle,const void *buf,size_t size) {
  *  @return How many bytes received
  */
 static ssize_t nxtd_recv(int handle,void *buf,size_t size) {
+  struct nxtd_request req = {
+    .type = NXTD_REQ_RECV,
+    .recv_buf = buf,
+    .recv_size = size
+  };
+  struct nxtd_nxt *nxt = nxtd_nxt_get(handle);
   ssize_t ret = 0;
-  pthread_mutex_lock(&nxts.mutex);
-  if (nxts.list[handle]!=NULL) {
-    if (nxts.list[handle]->conn_type==NXTD_USB) ret = nxtd_usb_recv((struct nxtd_nxt_usb*)nxts.list[handle],buf,size);
-    else if (nxts.list[handle]->conn_type==NXTD_BT) ret = nxtd_bt_recv((struct nxtd_nxt_bt*)nxts.list[handle],buf,size);
+
+  if (nxt!=NULL) {
+    ret = nxtd_nxt_request(nxt,&req);
+    nxtd_nxt_put(nxt);
   }
-  pthread_mutex_unlock(&nxts.mutex);
-  if (ret!=size) nxtd_nxt_remove(handle);
   return ret;
 }
 
 /**
- * Displays program usage
- *  @param cmd Program name
- *  @param r Return value
+ * Sends data to NXT and receives its reply without other requests in between
+ *  @param handle NXT handle
+ *  @param sbuf Data to send
+ *  @param ssize How many bytes to send
+ *  @param rbuf Buffer for received data
+ *  @param rsize How many bytes to receive
+ *  @return How many bytes received
  */
-static void usage(char *cmd,int r) {
-  FILE *out = r==0?stdout:stderr;
-  fprintf(out,"Usage: %s [OPTIONS]\n",cmd);
-  fprintf(out,"A daemon for managing NXT connections\n");
-  fprintf(out,"Options:\n");
-  fprintf(out,"\t-h           Show help\n");
-  fprintf(out,"\t-p PORT      Set TCP port (Default: %d)\n",NXTNET_DEFAULT_PORT);
-  fprintf(out,"\t-l FILE      Set log file (Default: /var/log/nxtd.log)\n");
-  fprintf(out,"\t-P PASSWORD  Set password\n");
-  fprintf(out,"\t-d           Run as daemon\n");
-  fprintf(out,"\t-i FILE      Set pid file (Default: /var/run/nxtd.pid)\n");
-  fprintf(out,"\t-N           Use network mode (Default: local mode)\n");
-  fprintf(out,"\t-U           Disable USB\n");
-  fprintf(out,"\t-B           Disable Bluetooth\n");
-  exit(r);
+static ssize_t nxtd_transact(int handle,const void *sbuf,size_t ssize,void *rbuf,size_t rsize) {
+  struct nxtd_request req = {
+    .type = rsize>0?NXTD_REQ_TRANSACT:NXTD_REQ_SEND,
+    .send_buf = sbuf,
+    .send_size = ssize,
+    .recv_buf = rbuf,
+    .recv_size = rsize
+  };
+  struct nxtd_nxt *nxt = nxtd_nxt_get(handle);
+  ssize_t ret = -1;
+
+  if (nxt!=NULL) {
+    ret = nxtd_nxt_request(nxt,&req);
+    nxtd_nxt_put(nxt);
+    if (rsize==0 && ret==ssize) {
+      ret = 0;
+    }
+  }
+  return ret;
 }
 
 /**
- * Shuts nxtd down
+ * Executes transactions with NXT back-to-back
+ *  @param handle NXT handle
+ *  @param items Transactions
+ *  @param num_items Number of transactions
+ *  @return Number of successful transactions
  */
-static void quit() {
-  size_t i;
+static size_t nxtd_batch(int handle,struct nxtnet_batch_item *items,size_t num_items) {
+  struct nxtd_request req = {
+    .type = NXTD_REQ_BATCH,
+    .items = items,
+    .num_items = num_items
+  };
+  struct nxtd_nxt *nxt = nxtd_nxt_get(handle);
+  size_t i,ret = 0;
 
-  if (scanner_tid!=-1) pthread_cancel(scanner_tid);
+  for (i=0;i<num_items;i++) {
+    items[i].ret = -1;
+  }
+  if (nxt!=NULL) {
+    nxtd_nxt_request(nxt,&req);
+    nxtd_nxt_put(nxt);
+    for (i=0;i<num_items;i++) {
+      if (items[i].ret>=0) {
+        ret++;
+      }
+    }
+  }
+  return ret;
+}
 
-  if (server!=NULL) nxtnet_srv_destroy(server);
+/**
+ * Subscribes to periodic transactions with NXT
+ *  @param handle NXT handle
+ *  @param interval Sampling interval (in microseconds)
+ *  @param items Transactions
+ *  @param num_items Number of transactions
+ *  @param sample Function receiving samples
+ *  @param ctx Context for sample function
+ *  @return Subscription
+ */
+static void *nxtd_subscribe(int handle,unsigned int interval,const struct nxtnet_batch_item *items,size_t num_items,nxtnet_sample_func_t sample,void *ctx) {
+  struct nxtd_nxt *nxt = nxtd_nxt_get(handle);
+  struct nxtd_sub *sub;
+  size_t i,size = 0;
+  char *ptr;
 
-  for (i=0;i<NXTD_MAXNUM;i++) {
-    if (nxts.list[i]!=NULL) {
-      if (nxts.list[i]->conn_type==NXTD_USB) nxtd_usb_close((struct nxtd_nxt_usb*)nxts.list[i]);
-      else if (nxts.list[i]->conn_type==NXTD_BT) nxtd_bt_close((struct nxtd_nxt_bt*)nxts.list[i]);
-    }
+  if (nxt==NULL) {
+    return NULL;
+  }
+
+  // copy transactions, they are only valid during call
+  for (i=0;i<num_items;i++) {
+    size += items[i].send_size+items[i].recv_size;
+  }
+  sub = malloc(sizeof(struct nxtd_sub)+num_items*(sizeof(struct nxtnet_batch_item)+sizeof(size_t))+size);
+  if (sub==NULL) {
+    nxtd_nxt_put(nxt);
+    return NULL;
   }
+  sub->items = (struct nxtnet_batch_item*)(sub+1);
+  sub->merged = (size_t*)(sub->items+num_items);
+  ptr = (char*)(sub->merged+num_items);
+  for (i=0;i<num_items;i++) {
+    memcpy(ptr,items[i].send_buf,items[i].send_size);
+    sub->items[i].send_buf = ptr;
+    sub->items[i].send_size = items[i].send_size;
+    ptr += items[i].send_size;
+    sub->items[i].recv_buf = ptr;
+    sub->items[i].recv_size = items[i].recv_size;
+    ptr += items[i].recv_size;
+    sub->items[i].ret = -1;
+  }
+  sub->num_items = num_items;
+  sub->nxt = nxt;
+  sub->interval = interval<NXTD_SAMPLE_MININTERVAL?NXTD_SAMPLE_MININTERVAL:interval;
+  sub->sample = sample;
+  sub->ctx = ctx;
+  sub->sampling = 0;
+  sub->removed = 0;
+  clock_gettime(CLOCK_MONOTONIC,&sub->due);
 
-  nxtd_usb_shutdown();
-  nxtd_bt_shutdown();
+  pthread_mutex_lock(&nxt->sub_mutex);
+  sub->next = nxt->sub_first;
+  nxt->sub_first = sub;
+  pthread_cond_broadcast(&nxt->sub_cond);
+  pthread_mutex_unlock(&nxt->sub_mutex);
 
-  unlink(pidfile);
+  return sub;
 }
 
 /**
- * Runs nxtd
- *  @param argc Number of arguments
- *  @param argv Arguments
- *  @return Program's return value
+ * Cancels a subscription
+ *  @param x Subscription
  */
-int main(int argc,char *argv[]) {
-  int port = NXTNET_DEFAULT_PORT;
-  char *logfile = "/var/log/nxtd.log";
-  FILE *pidfd;
-  char *password = NULL;
-  int c;
-  int local = 1;
-  int run_as_daemon = 0;
+static void nxtd_unsubscribe(void *x) {
+  struct nxtd_sub *sub = (struct nxtd_sub*)x;
+  struct nxtd_nxt *nxt = sub->nxt;
+  struct nxtd_sub **prev;
 
-  while ((c = getopt(argc,argv,":hp:P:l:Ndi:UB"))!=-1) {
-    switch (c) {
-      case 'h':
-        usage(argv[0],0);
-        break;
-      case 'p':
-        port = atoi(optarg);
-        break;
-      case 'P':
-        password = optarg;
-        break;
-      case 'l':
-        logfile = optarg;
-        break;
-      case 'N':
-        local = 0;
-        break;
-      case 'd':
-        run_as_daemon = 1;
-        break;
-      case 'i':
-        pidfile = optarg;
-        break;
-      case 'U':
-        use_usb = 0;
-        break;
-      case 'B':
-        use_bt = 0;
-        break;
-      case ':':
-        fprintf(stderr,"Option -%c requires an operand\n",optopt);
-        usage(argv[0],1);
-        break;
-      case '?':
-        fprintf(stderr,"Unrecognized option: -%c\n", optopt);
-        usage(argv[0],1);
-        break;
+  pthread_mutex_lock(&nxt->sub_mutex);
+  for (prev=&nxt->sub_first;*prev!=NULL;prev=&(*prev)->next) {
+    if (*prev==sub) {
+      *prev = sub->next;
+      break;
     }
   }
+  sub->removed = 1;
+  // wait until sampler doesn't use subscription anymore
+  while (sub->sampling) {
+    pthread_cond_wait(&nxt->sub_cond,&nxt->sub_mutex);
+  }
+  pthread_mutex_unlock(&nxt->sub_mutex);
+
+  free(sub);
+  nxtd_nxt_put(nxt);
+}
+
+/// Operations for NXTNET server or in-process clients
+const struct nxtnet_srv_ops nxtd_ops = {
+  .list = nxtd_list,
+  .send = nxtd_send,
+  .recv = nxtd_recv,
+  .transact = nxtd_transact,
+  .batch = nxtd_batch,
+  .subscribe = nxtd_subscribe,
+  .unsubscribe = nxtd_unsubscribe,
+  .stats = nxtd_stats
+};
 
-  // Initialze
-  atexit(quit);
-  signal(SIGTERM,exit);
-  signal(SIGQUIT,exit);
-  signal(SIGINT,exit);
+/**
+ * Initializes USB and Bluetooth
+ *  @param usb If USB is used
+ *  @param bt If Bluetooth is used
+ *  @return Success? (fails if neither is available)
+ */
+int nxtd_init(int usb,int bt) {
+  pthread_condattr_t attr;
+
+  clock_gettime(CLOCK_MONOTONIC,&started);
   memset(nxts.list,0,sizeof(nxts.list));
+  memset(nxts.slots,0,sizeof(nxts.slots));
   pthread_mutex_init(&nxts.mutex,NULL);
-  if (use_usb) {
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr,CLOCK_MONOTONIC);
+  pthread_cond_init(&scanner.cond,&attr);
+  pthread_condattr_destroy(&attr);
+  if (usb) {
     if (nxtd_usb_init()==-1) {
       fprintf(stderr,"Could not initialize USB\n");
-      use_usb = 0;
     }
+    else use_usb = 1;
   }
-  if (use_bt) {
+  if (bt) {
     if (nxtd_bt_init()==-1) {
       fprintf(stderr,"Could not initialize Bluetooth.\n");
-      use_bt = 0;
     }
+    else use_bt = 1;
   }
   if (use_usb==0 && use_bt==0) {
     fprintf(stderr,"Neither USB nor Bluetooth available\n");
-    return 1;
+    return -1;
   }
+  return 0;
+}
 
-  // Write PID to file
-  pidfd = fopen(pidfile,"w");
-  if (pidfd) {
-    fprintf(pidfd,"%d\n",getpid());
-    fclose(pidfd);
-  }
-  else perror(pidfile);
+/**
+ * Sets log file
+ *  @param log Log file stream (NULL for no logging)
+ */
+void nxtd_set_log(FILE *log) {
+  logfd = log;
+}
 
-  // Open logfile
-  if (strcmp(logfile,"-")==0) logfd = stdout;
-  else logfd = fopen(logfile,"a");
-  if (logfd == 0) {
-    perror(logfile);
-    printf("using standard output as logfile\n");
-    logfd = stdout;
+/**
+ * Sets interval of periodic Bluetooth inquiries
+ *  @param interval Interval in seconds (0 for only on LIST)
+ */
+void nxtd_set_bt_interval(unsigned int interval) {
+  pthread_mutex_lock(&scanner.mutex);
+  scanner.bt_interval = interval;
+  pthread_cond_broadcast(&scanner.cond);
+  pthread_mutex_unlock(&scanner.mutex);
+}
+
+/**
+ * Starts threads that scan for NXTs and check their health
+ */
+void nxtd_start_scanner() {
+  scanner.quit = 0;
+  scanner.health_running = pthread_create(&scanner.health_tid,NULL,nxtd_monitor,NULL)==0;
+  if (use_usb) {
+    scanner.usb_running = pthread_create(&scanner.usb_tid,NULL,nxtd_usb_scanner,NULL)==0;
   }
-  server = nxtnet_srv_create(port,password,logfd,local);
-  if (server==NULL) {
-    perror("creating nxt daemon");
-    return 1;
+  if (use_bt) {
+    scanner.bt_running = pthread_create(&scanner.bt_tid,NULL,nxtd_bt_scanner,NULL)==0;
   }
+}
 
-  // daemonize
-  if (run_as_daemon) {
-    daemon(0,0);
-  }
+/**
+ * Stops scanner, closes all NXTs and shuts USB and Bluetooth down
+ */
+void nxtd_shutdown() {
+  size_t i;
 
-  // Spawn thread for scanning
-  pthread_create(&scanner_tid,NULL,nxtd_scanner,NULL);
+  pthread_mutex_lock(&scanner.mutex);
+  scanner.quit = 1;
+  pthread_cond_broadcast(&scanner.cond);
+  pthread_mutex_unlock(&scanner.mutex);
+  if (scanner.usb_running) {
+    pthread_join(scanner.usb_tid,NULL);
+    scanner.usb_running = 0;
+  }
+  if (scanner.bt_running) {
+    pthread_join(scanner.bt_tid,NULL);
+    scanner.bt_running = 0;
+  }
+  if (scanner.health_running) {
+    pthread_join(scanner.health_tid,NULL);
+    scanner.health_running = 0;
+  }
 
-  // Start server
-  server->ops.list = nxtd_list;
-  server->ops.recv = nxtd_recv;
-  server->ops.send = nxtd_send;
-  nxtnet_srv_mainloop(server);
+  for (i=0;i<NXTD_MAXNUM;i++) {
+    if (nxts.list[i]!=NULL) {
+      nxtd_nxt_remove(nxts.list[i]);
+    }
+  }
 
-  return 0;
+  if (use_usb) nxtd_usb_shutdown();
+  if (use_bt) nxtd_bt_shutdown();
+  use_usb = 0;
+  use_bt = 0;
 }
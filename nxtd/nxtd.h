@@ -21,13 +21,52 @@
 #ifndef _NXTD_H_
 #define _NXTD_H_
 
+#include <stdio.h>
+#include <stdint.h>
 #include <pthread.h>
 
+#include <anxt/net.h>
+
 /// Max. number of NXTs
 #define NXTD_MAXNUM 256
 
+/// Min. sampling interval of subscriptions (in microseconds)
+#define NXTD_SAMPLE_MININTERVAL 1000
+
+/// Timeout for waiting for USB hotplug events (in milliseconds). Modules
+/// without hotplug support enumerate USB devices with this interval.
+#define NXTD_USB_SCAN_INTERVAL 1000
+
+/// Default interval of periodic Bluetooth inquiries (in seconds)
+#define NXTD_BT_SCAN_INTERVAL 60
+
+/// Min. interval between Bluetooth inquiries requested by LIST (in seconds)
+#define NXTD_BT_SCAN_MININTERVAL 30
+
+/// Interval of health checks (in seconds). NXTs that were idle for this
+/// long get a KEEPALIVE and are removed if they don't answer.
+#define NXTD_HEALTH_INTERVAL 10
+
+/// Number of consecutive failed requests after which a NXT is removed.
+/// Before that, the connection is reset and used again.
+#define NXTD_MAXFAILS 3
+
+/// Delay before the health monitor checks a NXT whose last request failed
+/// (in milliseconds; doubled with each further failure)
+#define NXTD_RETRY_DELAY 500
+
+/// Number of bits of latency histograms' sub-buckets. Each power of two is
+/// split into 2^NXTD_HIST_SUBBITS buckets, so percentiles are off by at most
+/// 1/2^NXTD_HIST_SUBBITS.
+#define NXTD_HIST_SUBBITS 3
+
+/// Number of buckets in latency histograms (covers all 32 bit values)
+#define NXTD_HIST_BUCKETS ((33-NXTD_HIST_SUBBITS)<<NXTD_HIST_SUBBITS)
+
 /// NXT ID (unique for ALL NXTs)
 typedef char nxtd_id_t[6];
+/// Size of NXT ID as string (see nxtd_id2str())
+#define NXTD_IDSTR_LEN 18
 
 /// Enumeration of connection types
 typedef enum {
@@ -37,6 +76,83 @@ typedef enum {
   NXTD_BT
 } nxtd_conn_t;
 
+/// Enumeration of I/O request types
+typedef enum {
+  /// Send data to NXT
+  NXTD_REQ_SEND,
+  /// Receive data from NXT
+  NXTD_REQ_RECV,
+  /// Send data to NXT and receive its reply
+  NXTD_REQ_TRANSACT,
+  /// Several transactions back-to-back
+  NXTD_REQ_BATCH
+} nxtd_req_t;
+
+/// I/O request for a NXT's worker thread
+struct nxtd_request {
+  /// Next request in queue
+  struct nxtd_request *next;
+  /// Request type
+  nxtd_req_t type;
+  /// Data to send
+  const void *send_buf;
+  /// How many bytes to send
+  size_t send_size;
+  /// Buffer for received data
+  void *recv_buf;
+  /// How many bytes to receive
+  size_t recv_size;
+  /// Transactions (BATCH)
+  struct nxtnet_batch_item *items;
+  /// Number of transactions (BATCH)
+  size_t num_items;
+  /// Bytes sent (SEND) or received (RECV, TRANSACT), transactions done (BATCH); -1 on failure
+  ssize_t ret;
+  /// If request is done
+  int done;
+  /// When request was queued (CLOCK_MONOTONIC)
+  struct timespec queued;
+};
+
+/// Latency histogram with log-linear buckets (like HdrHistogram)
+struct nxtd_hist {
+  /// Number of values
+  uint64_t count;
+  /// Sum of values
+  uint64_t sum;
+  /// Smallest value
+  uint32_t min;
+  /// Largest value
+  uint32_t max;
+  /// Number of values in each bucket
+  uint32_t buckets[NXTD_HIST_BUCKETS];
+};
+
+/// Counters and latencies of a NXT
+struct nxtd_stats {
+  /// Requests done (a BATCH counts once)
+  uint64_t requests;
+  /// Failed requests
+  uint64_t errors;
+  /// Telegrams sent or received
+  uint64_t telegrams;
+  /// Bytes sent to NXT
+  uint64_t bytes_sent;
+  /// Bytes received from NXT
+  uint64_t bytes_recv;
+  /// Connection resets after failed requests
+  uint64_t reconnects;
+  /// Time requests waited in queue (in microseconds)
+  struct nxtd_hist queue;
+  /// Time of each USB/Bluetooth transfer, sending and receiving (in microseconds)
+  struct nxtd_hist transfer;
+  /// Telegrams and failed telegrams per opcode (second byte of telegram)
+  struct {
+    uint32_t telegrams;
+    uint32_t errors;
+  } opcodes[256];
+};
+
 /// Descriptor for NXTs
 struct nxtd_nxt {
   /// The NXTs name
@@ -48,17 +164,111 @@ struct nxtd_nxt {
   /// UNIX timestamp when connection times out.
   /// 0 if no connection timeout is set
   time_t conn_timeout;
+  /// Handle (index in NXT list)
+  int handle;
+  /// Reference count (protected by list mutex)
+  int refs;
+  /// I/O worker thread
+  pthread_t io_tid;
+  /// Mutex for request queue
+  pthread_mutex_t io_mutex;
+  /// Signaled when a request is queued or the worker has to quit
+  pthread_cond_t io_cond;
+  /// Signaled when a request is done
+  pthread_cond_t io_done;
+  /// First request in queue
+  struct nxtd_request *io_first;
+  /// Last request in queue
+  struct nxtd_request *io_last;
+  /// If worker has to quit
+  int io_quit;
+  /// When NXT answered last time (CLOCK_MONOTONIC; zero if never)
+  struct timespec last_seen;
+  /// Number of consecutive failed requests (protected by io_mutex)
+  unsigned int fails;
+  /// When last request failed (CLOCK_MONOTONIC)
+  struct timespec last_fail;
+  /// Mutex for statistics
+  pthread_mutex_t stats_mutex;
+  /// Statistics (since NXT was added)
+  struct nxtd_stats stats;
+  /// Sampler thread (executes subscriptions)
+  pthread_t sub_tid;
+  /// Mutex for subscriptions
+  pthread_mutex_t sub_mutex;
+  /// Signaled when subscriptions change or a sampling round is done
+  pthread_cond_t sub_cond;
+  /// Subscriptions
+  struct nxtd_sub *sub_first;
+  /// If sampler has to quit
+  int sub_quit;
+};
+
+/// Subscription (transactions executed periodically by sampler thread)
+struct nxtd_sub {
+  /// Next subscription of NXT
+  struct nxtd_sub *next;
+  /// NXT (holds a reference)
+  struct nxtd_nxt *nxt;
+  /// Sampling interval (in microseconds)
+  unsigned int interval;
+  /// When next sample is due (CLOCK_MONOTONIC)
+  struct timespec due;
+  /// Transactions (data is stored behind array)
+  struct nxtnet_batch_item *items;
+  /// Number of transactions
+  size_t num_items;
+  /// Index of each transaction in current sampling round
+  size_t *merged;
+  /// Function receiving samples
+  nxtnet_sample_func_t sample;
+  /// Context for sample function
+  void *ctx;
+  /// If subscription is part of current sampling round
+  int sampling;
+  /// If subscription was cancelled during sampling round
+  int removed;
+};
+
+/// Last NXT that had a handle
+struct nxtd_slot {
+  /// ID of NXT
+  nxtd_id_t id;
+  /// How the NXT was connected
+  nxtd_conn_t conn_type;
+  /// If handle was ever used
+  int used;
 };
 
 /// List of NXTs
-struct {
+struct nxtd_list {
   /// Mutex for list
   pthread_mutex_t mutex;
   /// List of NXTs
   struct nxtd_nxt *list[NXTD_MAXNUM];
-} nxts;
+  /// Last NXT of each handle. A NXT that is registered again (e.g. after
+  /// it was replugged) gets its old handle back, so clients can go on.
+  struct nxtd_slot slots[NXTD_MAXNUM];
+};
+
+extern struct nxtd_list nxts;
+extern const struct nxtnet_srv_ops nxtd_ops;
 
+int nxtd_init(int usb,int bt);
+void nxtd_set_log(FILE *log);
+void nxtd_scan(int usb,int bt);
+void nxtd_set_bt_interval(unsigned int interval);
+void nxtd_start_scanner();
+void nxtd_shutdown();
 int nxtd_nxt_reg(struct nxtd_nxt *nxt);
 struct nxtd_nxt *nxtd_nxt_find(const char *name,nxtd_conn_t conn_type);
+void nxtd_nxt_remove(struct nxtd_nxt *nxt);
+void nxtd_nxt_put(struct nxtd_nxt *nxt);
+void nxtd_stats(FILE *out);
+
+// Statistics
+void nxtd_hist_add(struct nxtd_hist *hist,uint32_t value);
+uint32_t nxtd_hist_percentile(const struct nxtd_hist *hist,double percent);
+void nxtd_stats_print(FILE *out,const struct nxtd_stats *stats);
 
 #endif /* _NXTD_H_ */
@@ -24,8 +24,14 @@
 #include <bluetooth/hci.h>
 #include <bluetooth/hci_lib.h>
 #include <bluetooth/rfcomm.h>
+#include <sys/uio.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <errno.h>
+#include <endian.h>
+#include <unistd.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
 #include <pthread.h>
 
@@ -33,7 +39,7 @@
 #include "nxtd_bt_bluez.h"
 
 #ifdef NXT_BT_IDLE_TIMEOUT
-  #define nxtd_bt_timeout(n) (n)->nxt.conn_timeout = time(NULL)+NXT_USB_IDLE_TIMEOUT;
+  #define nxtd_bt_timeout(n) (n)->nxt.conn_timeout = time(NULL)+NXT_BT_IDLE_TIMEOUT;
 #else
   #define nxtd_bt_timeout(n) (n)->nxt.conn_timeout = 0;
 #endif
@@ -142,14 +148,12 @@ int nxtd_bt_scan() {
 
           nxt->nxt.conn_type = NXTD_BT;
           bacpy(&(nxt->bt_addr),&(ii+i)->bdaddr);
-          nxtd_nxt_reg((struct nxtd_nxt*)nxt);
+          if (nxtd_nxt_reg((struct nxtd_nxt*)nxt)==-1) {
+            nxtd_bt_close(nxt);
+          }
         }
       }
     }
-    else {
-      free(ii);
-      return -1;
-    }
   }
 
   free(ii);
@@ -207,39 +211,105 @@ int nxtd_bt_disconnect(struct nxtd_nxt_bt *nxt) {
   return 0;
 }
 
-static uint64_t useconds(void) {
-  struct timeval current;
-  gettimeofday(&current,NULL);
-  return current.tv_sec*1000000+current.tv_usec;
+/**
+ * Gets current time
+ *  @return Milliseconds (CLOCK_MONOTONIC)
+ */
+static uint64_t mseconds(void) {
+  struct timespec current;
+  clock_gettime(CLOCK_MONOTONIC,&current);
+  return (uint64_t)current.tv_sec*1000+current.tv_nsec/1000000;
 }
 
-static size_t write_timeout(int sock,const void *data,size_t size) {
-  uint64_t timeout = useconds()+NXT_BT_WAIT_TIMEOUT*1000;
+/**
+ * Waits until socket is ready
+ *  @param sock Socket
+ *  @param events Events to wait for (POLLIN or POLLOUT)
+ *  @param deadline Deadline (see mseconds())
+ *  @return Success? (-1 on timeout or error)
+ */
+static int wait_ready(int sock,short events,uint64_t deadline) {
+  struct pollfd pfd = {
+    .fd = sock,
+    .events = events
+  };
+  uint64_t now;
+  int ret;
+
+  do {
+    now = mseconds();
+    if (now>=deadline) {
+      return -1;
+    }
+    ret = poll(&pfd,1,deadline-now);
+  }
+  while (ret==-1 && errno==EINTR);
+
+  return ret>0 && (pfd.revents&events)?0:-1;
+}
+
+/**
+ * Writes data to non-blocking socket
+ *  @param sock Socket
+ *  @param iov Data to write (is modified)
+ *  @param iovcnt Number of elements in iov
+ *  @return How many bytes written
+ */
+static size_t write_timeout(int sock,struct iovec *iov,int iovcnt) {
+  uint64_t deadline = mseconds()+NXT_BT_WAIT_TIMEOUT;
   size_t i = 0;
   ssize_t c;
 
-  while (i<size && useconds()<timeout) {
-    c = write(sock,data+i,size-i);
+  while (iovcnt>0) {
+    c = writev(sock,iov,iovcnt);
     if (c>0) {
       i += c;
+      // skip what was written
+      while (iovcnt>0 && c>=iov->iov_len) {
+        c -= iov->iov_len;
+        iov++;
+        iovcnt--;
+      }
+      if (iovcnt>0) {
+        iov->iov_base += c;
+        iov->iov_len -= c;
+      }
+    }
+    else if (c==-1 && errno!=EAGAIN && errno!=EWOULDBLOCK && errno!=EINTR) {
+      break;
+    }
+    else if (wait_ready(sock,POLLOUT,deadline)==-1) {
+      break;
     }
-    usleep(1000);
   }
 
   return i;
 }
 
+/**
+ * Reads data from non-blocking socket
+ *  @param sock Socket
+ *  @param data Buffer for data
+ *  @param size How many bytes to read
+ *  @return How many bytes read
+ */
 static size_t read_timeout(int sock,void *data,size_t size) {
-  uint64_t timeout = useconds()+NXT_BT_WAIT_TIMEOUT*1000;
+  uint64_t deadline = mseconds()+NXT_BT_WAIT_TIMEOUT;
   size_t i = 0;
   ssize_t c;
 
-  while (i<size && useconds()<timeout) {
+  while (i<size) {
     c = read(sock,data+i,size-i);
     if (c>0) {
       i += c;
     }
-    usleep(1000);
+    else if (c==0 || (errno!=EAGAIN && errno!=EWOULDBLOCK && errno!=EINTR)) {
+      // connection closed or broken
+      break;
+    }
+    else if (wait_ready(sock,POLLIN,deadline)==-1) {
+      break;
+    }
   }
 
   return i;
@@ -253,18 +323,26 @@ static size_t read_timeout(int sock,void *data,size_t size) {
  *  @return How many bytes sent
  */
 ssize_t nxtd_bt_send(struct nxtd_nxt_bt *nxt,const void *data,size_t size) {
-  uint16_t sz = size;
+  uint16_t sz = htole16(size);
+  struct iovec iov[2] = {
+    { .iov_base = &sz, .iov_len = 2 },
+    { .iov_base = (void*)data, .iov_len = size }
+  };
+  size_t ret;
 
   if (nxtd_bt_connect(nxt)==-1) {
     return -1;
   }
 
   nxtd_bt_timeout(nxt);
-  if (write_timeout(nxt->bt_sock, &sz, 2)!=2) {
+
+  // length and telegram in one write
+  ret = write_timeout(nxt->bt_sock,iov,2);
+  if (ret<2) {
     return -1;
   }
 
-  return write_timeout(nxt->bt_sock, data, size);
+  return ret-2;
 }
 
 /**
@@ -273,9 +351,12 @@ ssize_t nxtd_bt_send(struct nxtd_nxt_bt *nxt,const void *data,size_t size) {
  *  @param data Buffer for data
  *  @param size How many bytes to receive
  *  @return How many bytes received
+ *  @note If the telegram is longer than the buffer, the rest is discarded.
  */
 ssize_t nxtd_bt_recv(struct nxtd_nxt_bt *nxt,void *data,size_t size) {
   uint16_t sz;
+  char discard[64];
+  size_t ret,n;
 
   if (nxtd_bt_connect(nxt)==-1)  {
     return 0;
@@ -286,7 +367,18 @@ ssize_t nxtd_bt_recv(struct nxtd_nxt_bt *nxt,void *data,size_t size) {
   if (read_timeout(nxt->bt_sock, &sz, 2)!=2) {
     return 0;
   }
+  sz = le16toh(sz);
 
-  return read_timeout(nxt->bt_sock, data, sz);
-}
+  ret = read_timeout(nxt->bt_sock, data, sz<size?sz:size);
 
+  // discard rest of telegram, so the next one is read correctly
+  while (ret==size && sz>size) {
+    n = sz-size<sizeof(discard)?sz-size:sizeof(discard);
+    if (read_timeout(nxt->bt_sock, discard, n)!=n) {
+      break;
+    }
+    sz -= n;
+  }
+
+  return ret;
+}
@@ -0,0 +1,72 @@
+/*
+    nxtd_direct.c - Use nxtd's USB and Bluetooth modules in-process
+    aNXT - a NXt Toolkit
+    Libraries and tools for LEGO Mindstorms NXT robots
+    Copyright (C) 2008  Janosch Gräf <janosch.graef@gmx.net>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#include <anxt/nxt.h>
+#include <anxt/net.h>
+#include <anxt/direct.h>
+
+#include "nxtd.h"
+
+static pthread_once_t direct_once = PTHREAD_ONCE_INIT;
+static int direct_ready = 0;
+
+/**
+ * Initializes USB and Bluetooth once per process
+ */
+static void nxtd_direct_init() {
+  if (nxtd_init(1,1)==0) {
+    nxtd_start_scanner();
+    atexit(nxtd_shutdown);
+    direct_ready = 1;
+  }
+}
+
+/**
+ * Opens a NXT without nxtd. The NXT is accessed by the program itself, so no
+ * daemon and no network round trip is involved.
+ *  @param name Name, Bluetooth address or ID of NXT
+ *  @return NXT handle
+ *  @note You can pass a NULL pointer as name if you wish to use the first NXT found
+ *  @note Only one process can access a NXT at a time, so nxtd must not be
+ *        running for the NXT.
+ *  @note USB is scanned before the NXT is looked up. Bluetooth is only
+ *        scanned, if the NXT was not found, since that takes several seconds.
+ */
+nxt_t *nxt_open_direct(const char *name) {
+  nxt_t *nxt;
+
+  pthread_once(&direct_once,nxtd_direct_init);
+  if (!direct_ready) {
+    return NULL;
+  }
+
+  nxtd_scan(1,0);
+  nxt = nxt_open_cli(name,nxtnet_cli_open_local(&nxtd_ops));
+  if (nxt==NULL) {
+    nxtd_scan(0,1);
+    nxt = nxt_open_cli(name,nxtnet_cli_open_local(&nxtd_ops));
+  }
+
+  return nxt;
+}
@@ -0,0 +1,205 @@
+/*
+    nxtd_main.c - A daemon for managing NXT connections
+    aNXT - a NXt Toolkit
+    Libraries and tools for LEGO Mindstorms NXT robots
+    Copyright (C) 2008  Janosch Gräf <janosch.graef@gmx.net>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <unistd.h>
+#include <stdio.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include <anxt/net.h>
+
+#include "nxtd.h"
+
+static char *pidfile = "/var/run/nxtd.pid";
+static nxtnet_srv_t *server = NULL;
+static FILE *logfd = NULL;
+
+/**
+ * Displays program usage
+ *  @param cmd Program name
+ *  @param r Return value
+ */
+static void usage(char *cmd,int r) {
+  FILE *out = r==0?stdout:stderr;
+  fprintf(out,"Usage: %s [OPTIONS]\n",cmd);
+  fprintf(out,"A daemon for managing NXT connections\n");
+  fprintf(out,"Options:\n");
+  fprintf(out,"\t-h           Show help\n");
+  fprintf(out,"\t-p PORT      Set TCP port (Default: %d)\n",NXTNET_DEFAULT_PORT);
+  fprintf(out,"\t-l FILE      Set log file (Default: /var/log/nxtd.log)\n");
+  fprintf(out,"\t-P PASSWORD  Set password\n");
+  fprintf(out,"\t-d           Run as daemon\n");
+  fprintf(out,"\t-i FILE      Set pid file (Default: /var/run/nxtd.pid)\n");
+  fprintf(out,"\t-N           Use network mode (Default: local mode)\n");
+  fprintf(out,"\t-U           Disable USB\n");
+  fprintf(out,"\t-B           Disable Bluetooth\n");
+  fprintf(out,"\t-I SECONDS   Set interval of Bluetooth inquiries, 0 for only on LIST (Default: %d)\n",NXTD_BT_SCAN_INTERVAL);
+  fprintf(out,"Statistics are written to the log file on SIGUSR1\n");
+  exit(r);
+}
+
+/**
+ * Shuts nxtd down
+ */
+static void quit() {
+  if (server!=NULL) nxtnet_srv_destroy(server);
+
+  nxtd_shutdown();
+
+  unlink(pidfile);
+}
+
+/**
+ * Writes statistics to log file whenever SIGUSR1 is received
+ *  @param arg Set of signals to wait for
+ *  @note SIGUSR1 must be blocked in all threads, so it is only taken here.
+ */
+static void *stats_dumper(void *arg) {
+  sigset_t *sigset = (sigset_t*)arg;
+  int sig;
+
+  while (sigwait(sigset,&sig)==0) {
+    if (logfd!=NULL) {
+      nxtd_stats(logfd);
+      fflush(logfd);
+    }
+  }
+  return NULL;
+}
+
+/**
+ * Runs nxtd
+ *  @param argc Number of arguments
+ *  @param argv Arguments
+ *  @return Program's return value
+ */
+int main(int argc,char *argv[]) {
+  int port = NXTNET_DEFAULT_PORT;
+  char *logfile = "/var/log/nxtd.log";
+  FILE *pidfd;
+  char *password = NULL;
+  int c;
+  int local = 1;
+  int run_as_daemon = 0;
+  int use_usb = 1;
+  int use_bt = 1;
+  static sigset_t stats_sigset;
+  pthread_t stats_tid;
+
+  while ((c = getopt(argc,argv,":hp:P:l:Ndi:UBI:"))!=-1) {
+    switch (c) {
+      case 'h':
+        usage(argv[0],0);
+        break;
+      case 'p':
+        port = atoi(optarg);
+        break;
+      case 'P':
+        password = optarg;
+        break;
+      case 'l':
+        logfile = optarg;
+        break;
+      case 'N':
+        local = 0;
+        break;
+      case 'd':
+        run_as_daemon = 1;
+        break;
+      case 'i':
+        pidfile = optarg;
+        break;
+      case 'U':
+        use_usb = 0;
+        break;
+      case 'B':
+        use_bt = 0;
+        break;
+      case 'I':
+        nxtd_set_bt_interval(atoi(optarg));
+        break;
+      case ':':
+        fprintf(stderr,"Option -%c requires an operand\n",optopt);
+        usage(argv[0],1);
+        break;
+      case '?':
+        fprintf(stderr,"Unrecognized option: -%c\n", optopt);
+        usage(argv[0],1);
+        break;
+    }
+  }
+
+  // Initialze
+  atexit(quit);
+  signal(SIGTERM,exit);
+  signal(SIGQUIT,exit);
+  signal(SIGINT,exit);
+  // block SIGUSR1 before any thread is created; it is taken by stats_dumper
+  sigemptyset(&stats_sigset);
+  sigaddset(&stats_sigset,SIGUSR1);
+  pthread_sigmask(SIG_BLOCK,&stats_sigset,NULL);
+  // Open logfile
+  if (strcmp(logfile,"-")==0) logfd = stdout;
+  else logfd = fopen(logfile,"a");
+  if (logfd == 0) {
+    perror(logfile);
+    printf("using standard output as logfile\n");
+    logfd = stdout;
+  }
+  nxtd_set_log(logfd);
+  server = nxtnet_srv_create(port,password,logfd,local);
+  if (server==NULL) {
+    perror("creating nxt daemon");
+    return 1;
+  }
+
+  // daemonize (before any thread is started, threads don't survive fork())
+  if (run_as_daemon) {
+    daemon(0,0);
+  }
+
+  if (nxtd_init(use_usb,use_bt)==-1) {
+    return 1;
+  }
+
+  // Write PID to file
+  pidfd = fopen(pidfile,"w");
+  if (pidfd) {
+    fprintf(pidfd,"%d\n",getpid());
+    fclose(pidfd);
+  }
+  else perror(pidfile);
+
+  // Spawn thread for scanning
+  nxtd_start_scanner();
+
+  // Dump statistics on SIGUSR1
+  if (pthread_create(&stats_tid,NULL,stats_dumper,&stats_sigset)==0) {
+    pthread_detach(stats_tid);
+  }
+
+  // Start server
+  server->ops = nxtd_ops;
+  nxtnet_srv_mainloop(server);
+
+  return 0;
+}
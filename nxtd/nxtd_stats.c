@@ -0,0 +1,142 @@
+/*
+    nxtd_stats.c
+    aNXT - a NXt Toolkit
+    Libraries and tools for LEGO Mindstorms NXT robots
+    Copyright (C) 2008  Janosch Gräf <janosch.graef@gmx.net>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <inttypes.h>
+
+#include "nxtd.h"
+
+/// Number of sub-buckets per power of two
+#define NXTD_HIST_SUB (1<<NXTD_HIST_SUBBITS)
+
+/**
+ * Gets bucket of a value
+ *  @param value Value
+ *  @return Bucket index
+ *  @note Values below NXTD_HIST_SUB have a bucket each. Above, each power of
+ *        two is split into NXTD_HIST_SUB buckets of equal width.
+ */
+static unsigned int nxtd_hist_bucket(uint32_t value) {
+  unsigned int shift;
+
+  if (value<NXTD_HIST_SUB) {
+    return value;
+  }
+  shift = 31-__builtin_clz(value)-NXTD_HIST_SUBBITS;
+  return ((shift+1)<<NXTD_HIST_SUBBITS)+(value>>shift)-NXTD_HIST_SUB;
+}
+
+/**
+ * Gets highest value of a bucket
+ *  @param bucket Bucket index
+ *  @return Highest value that falls into bucket
+ */
+static uint32_t nxtd_hist_bucket_max(unsigned int bucket) {
+  unsigned int shift;
+
+  if (bucket<NXTD_HIST_SUB) {
+    return bucket;
+  }
+  shift = (bucket>>NXTD_HIST_SUBBITS)-1;
+  return (((uint64_t)(bucket&(NXTD_HIST_SUB-1))+NXTD_HIST_SUB+1)<<shift)-1;
+}
+
+/**
+ * Adds a value to a histogram
+ *  @param hist Histogram
+ *  @param value Value
+ */
+void nxtd_hist_add(struct nxtd_hist *hist,uint32_t value) {
+  if (hist->count==0 || value<hist->min) {
+    hist->min = value;
+  }
+  if (value>hist->max) {
+    hist->max = value;
+  }
+  hist->count++;
+  hist->sum += value;
+  hist->buckets[nxtd_hist_bucket(value)]++;
+}
+
+/**
+ * Gets a percentile of a histogram
+ *  @param hist Histogram
+ *  @param percent Percentile (0 to 100)
+ *  @return Value below or equal to which 'percent' percent of the values are
+ *          (0 for an empty histogram)
+ *  @note The value is the upper bound of the bucket, but not above the
+ *        largest value.
+ */
+uint32_t nxtd_hist_percentile(const struct nxtd_hist *hist,double percent) {
+  uint64_t rank = (uint64_t)(percent*hist->count/100.0+0.5);
+  uint64_t n = 0;
+  unsigned int i;
+
+  if (hist->count==0) {
+    return 0;
+  }
+  if (rank<1) {
+    rank = 1;
+  }
+  for (i=0;i<NXTD_HIST_BUCKETS;i++) {
+    n += hist->buckets[i];
+    if (n>=rank) {
+      uint32_t value = nxtd_hist_bucket_max(i);
+      return value<hist->max?value:hist->max;
+    }
+  }
+  return hist->max;
+}
+
+/**
+ * Prints a line with a histogram's summary
+ *  @param out Output stream
+ *  @param name Name of histogram
+ *  @param hist Histogram
+ */
+static void nxtd_hist_print(FILE *out,const char *name,const struct nxtd_hist *hist) {
+  fprintf(out,"  %s [us]: count %"PRIu64,name,hist->count);
+  if (hist->count>0) {
+    fprintf(out,", mean %"PRIu64", min %"PRIu32", p50 %"PRIu32", p90 %"PRIu32", p99 %"PRIu32", max %"PRIu32,
+            hist->sum/hist->count,hist->min,nxtd_hist_percentile(hist,50.0),nxtd_hist_percentile(hist,90.0),
+            nxtd_hist_percentile(hist,99.0),hist->max);
+  }
+  fprintf(out,"\n");
+}
+
+/**
+ * Prints statistics of a NXT
+ *  @param out Output stream
+ *  @param stats Statistics
+ */
+void nxtd_stats_print(FILE *out,const struct nxtd_stats *stats) {
+  unsigned int i;
+
+  fprintf(out,"  requests %"PRIu64", errors %"PRIu64", reconnects %"PRIu64"\n",stats->requests,stats->errors,stats->reconnects);
+  fprintf(out,"  telegrams %"PRIu64", bytes sent %"PRIu64", bytes received %"PRIu64"\n",stats->telegrams,stats->bytes_sent,stats->bytes_recv);
+  nxtd_hist_print(out,"queue",&stats->queue);
+  nxtd_hist_print(out,"transfer",&stats->transfer);
+  for (i=0;i<256;i++) {
+    if (stats->opcodes[i].telegrams>0) {
+      fprintf(out,"  opcode 0x%02X: telegrams %"PRIu32", errors %"PRIu32"\n",i,stats->opcodes[i].telegrams,stats->opcodes[i].errors);
+    }
+  }
+}
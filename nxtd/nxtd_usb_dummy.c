@@ -19,6 +19,7 @@
 */
 
 #include <sys/types.h>
+#include <unistd.h>
 
 #include "nxtd.h"
 
@@ -32,6 +33,10 @@ void nxtd_usb_close(struct nxtd_nxt_usb *nxt) {
 int nxtd_usb_scan() {
   return 0;
 }
+int nxtd_usb_wait(unsigned int timeout) {
+  usleep(timeout*1000);
+  return 0;
+}
 int nxtd_usb_connect(struct nxtd_nxt_usb *nxt) {
   return 0;
 }
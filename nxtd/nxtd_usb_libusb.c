@@ -22,22 +22,174 @@
 #include <libusb.h>
 #include <time.h>
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
 
 #include "nxtd.h"
 #include "nxtd_usb_libusb.h"
 
+/// Hotplug event, queued until nxtd_usb_scan() is called
+struct nxtd_usb_event {
+  /// Next event
+  struct nxtd_usb_event *next;
+  /// USB device (holds a reference)
+  libusb_device *dev;
+  /// Whether device arrived or left
+  libusb_hotplug_event event;
+};
+
 static libusb_context *nxtd_usb_context;
+static pthread_t nxtd_usb_event_tid;
+static int nxtd_usb_quit = 0;
+static int nxtd_usb_hotplug = 0;
+static libusb_hotplug_callback_handle nxtd_usb_hotplug_handle;
+static pthread_mutex_t nxtd_usb_events_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t nxtd_usb_events_cond;
+static struct nxtd_usb_event *nxtd_usb_events_first = NULL;
+static struct nxtd_usb_event *nxtd_usb_events_last = NULL;
+/// NXTs that were removed without being unplugged (hold a reference)
+static libusb_device *nxtd_usb_lost[NXTD_MAXNUM];
+static size_t nxtd_usb_num_lost = 0;
+
+/**
+ * Gets a point in time relative to now
+ *  @param t Reference for point in time (CLOCK_MONOTONIC)
+ *  @param timeout Milliseconds from now
+ */
+static void nxtd_usb_deadline(struct timespec *t, unsigned int timeout) {
+  clock_gettime(CLOCK_MONOTONIC, t);
+  t->tv_sec += timeout/1000;
+  t->tv_nsec += (timeout%1000)*1000000;
+  if (t->tv_nsec>=1000000000) {
+    t->tv_sec++;
+    t->tv_nsec -= 1000000000;
+  }
+}
+
+/**
+ * Initializes a condition variable that uses CLOCK_MONOTONIC
+ *  @param cond Condition variable
+ */
+static void nxtd_usb_cond_init(pthread_cond_t *cond) {
+  pthread_condattr_t attr;
+
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(cond, &attr);
+  pthread_condattr_destroy(&attr);
+}
+
+/**
+ * Event thread. Completes transfers and delivers hotplug events.
+ *  @param arg Unused
+ */
+static void *nxtd_usb_events(void *arg) {
+  struct timeval tv = {
+    .tv_sec = 1,
+    .tv_usec = 0
+  };
+
+  while (!nxtd_usb_quit) {
+    libusb_handle_events_timeout_completed(nxtd_usb_context, &tv, &nxtd_usb_quit);
+  }
+
+  return NULL;
+}
+
+/**
+ * Called by libusb when a NXT is plugged or unplugged
+ *  @param ctx libusb context
+ *  @param dev USB device
+ *  @param event Whether device arrived or left
+ *  @param user_data Unused
+ *  @return 0 (keep callback registered)
+ *  @note No I/O must be done in here, so the event is just queued.
+ */
+static int LIBUSB_CALL nxtd_usb_hotplug_cb(libusb_context *ctx, libusb_device *dev, libusb_hotplug_event event, void *user_data) {
+  struct nxtd_usb_event *ev = malloc(sizeof(struct nxtd_usb_event));
+
+  if (ev==NULL) {
+    return 0;
+  }
+  ev->next = NULL;
+  ev->dev = libusb_ref_device(dev);
+  ev->event = event;
+
+  pthread_mutex_lock(&nxtd_usb_events_mutex);
+  if (nxtd_usb_events_last!=NULL) {
+    nxtd_usb_events_last->next = ev;
+  }
+  else {
+    nxtd_usb_events_first = ev;
+  }
+  nxtd_usb_events_last = ev;
+  pthread_cond_broadcast(&nxtd_usb_events_cond);
+  pthread_mutex_unlock(&nxtd_usb_events_mutex);
 
+  return 0;
+}
 
+/**
+ * Initializes USB
+ *  @return Success?
+ *  @note NXTs that are already plugged in are reported as hotplug events.
+ */
 int nxtd_usb_init() {
   if (libusb_init(&nxtd_usb_context)!=0) {
     return -1;
   }
   libusb_set_debug(nxtd_usb_context, 0);
+  nxtd_usb_cond_init(&nxtd_usb_events_cond);
+
+  if (libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)) {
+    if (libusb_hotplug_register_callback(nxtd_usb_context, LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED|LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT, LIBUSB_HOTPLUG_ENUMERATE, NXT_USB_VENDORID, NXT_USB_PRODUCTID, LIBUSB_HOTPLUG_MATCH_ANY, nxtd_usb_hotplug_cb, NULL, &nxtd_usb_hotplug_handle)==LIBUSB_SUCCESS) {
+      nxtd_usb_hotplug = 1;
+    }
+  }
+
+  nxtd_usb_quit = 0;
+  if (pthread_create(&nxtd_usb_event_tid, NULL, nxtd_usb_events, NULL)!=0) {
+    if (nxtd_usb_hotplug) {
+      libusb_hotplug_deregister_callback(nxtd_usb_context, nxtd_usb_hotplug_handle);
+      nxtd_usb_hotplug = 0;
+    }
+    libusb_exit(nxtd_usb_context);
+    return -1;
+  }
+
   return 0;
 }
 
+/**
+ * Shuts down USB
+ */
 void nxtd_usb_shutdown() {
+  struct nxtd_usb_event *ev;
+
+  // deregistering the callback wakes the event thread up
+  nxtd_usb_quit = 1;
+  if (nxtd_usb_hotplug) {
+    libusb_hotplug_deregister_callback(nxtd_usb_context, nxtd_usb_hotplug_handle);
+    nxtd_usb_hotplug = 0;
+  }
+#if defined(LIBUSB_API_VERSION) && LIBUSB_API_VERSION>=0x01000105
+  libusb_interrupt_event_handler(nxtd_usb_context);
+#endif
+  pthread_join(nxtd_usb_event_tid, NULL);
+
+  while (nxtd_usb_events_first!=NULL) {
+    ev = nxtd_usb_events_first;
+    nxtd_usb_events_first = ev->next;
+    libusb_unref_device(ev->dev);
+    free(ev);
+  }
+  nxtd_usb_events_last = NULL;
+  while (nxtd_usb_num_lost>0) {
+    libusb_unref_device(nxtd_usb_lost[--nxtd_usb_num_lost]);
+  }
+  pthread_cond_destroy(&nxtd_usb_events_cond);
+
   libusb_exit(nxtd_usb_context);
 }
 
@@ -108,12 +260,183 @@ static libusb_device_handle *nxtd_usb_opendev(libusb_device *dev) {
   return handle;
 }
 
+/**
+ * Called by libusb when an IN transfer is completed
+ *  @param transfer Transfer
+ *  @note Completed transfers are queued until their data is received.
+ */
+static void LIBUSB_CALL nxtd_usb_in_cb(struct libusb_transfer *transfer) {
+  struct nxtd_nxt_usb *nxt = (struct nxtd_nxt_usb*)transfer->user_data;
+
+  pthread_mutex_lock(&nxt->usb_mutex);
+  if (transfer->status==LIBUSB_TRANSFER_COMPLETED) {
+    nxt->usb_in_done[(nxt->usb_in_first+nxt->usb_in_num)%NXT_USB_IN_TRANSFERS] = transfer;
+    nxt->usb_in_num++;
+  }
+  else if (transfer->status!=LIBUSB_TRANSFER_CANCELLED) {
+    nxt->usb_error = 1;
+  }
+  nxt->usb_pending--;
+  pthread_cond_broadcast(&nxt->usb_cond);
+  pthread_mutex_unlock(&nxt->usb_mutex);
+}
+
+/**
+ * Called by libusb when the OUT transfer is completed
+ *  @param transfer Transfer
+ */
+static void LIBUSB_CALL nxtd_usb_out_cb(struct libusb_transfer *transfer) {
+  struct nxtd_nxt_usb *nxt = (struct nxtd_nxt_usb*)transfer->user_data;
+
+  pthread_mutex_lock(&nxt->usb_mutex);
+  if (transfer->status==LIBUSB_TRANSFER_NO_DEVICE) {
+    nxt->usb_error = 1;
+  }
+  nxt->usb_out_done = 1;
+  nxt->usb_pending--;
+  pthread_cond_broadcast(&nxt->usb_cond);
+  pthread_mutex_unlock(&nxt->usb_mutex);
+}
+
+/**
+ * Submits a transfer
+ *  @param nxt NXT handle
+ *  @param transfer Transfer
+ *  @return Success?
+ *  @note Must be called with NXT's USB mutex locked
+ */
+static int nxtd_usb_submit(struct nxtd_nxt_usb *nxt, struct libusb_transfer *transfer) {
+  if (libusb_submit_transfer(transfer)!=0) {
+    nxt->usb_error = 1;
+    return -1;
+  }
+  nxt->usb_pending++;
+  return 0;
+}
+
+/**
+ * Allocates transfers of a NXT and submits its IN transfers
+ *  @param nxt NXT handle
+ *  @return Success?
+ */
+static int nxtd_usb_start(struct nxtd_nxt_usb *nxt) {
+  size_t i;
+  int ret = 0;
+
+  nxt->usb_in_first = 0;
+  nxt->usb_in_num = 0;
+  nxt->usb_pending = 0;
+  nxt->usb_error = 0;
+  nxt->usb_out = libusb_alloc_transfer(0);
+  nxt->usb_out_done = 1;
+  if (nxt->usb_out==NULL) {
+    ret = -1;
+  }
+
+  pthread_mutex_lock(&nxt->usb_mutex);
+  for (i=0;i<NXT_USB_IN_TRANSFERS;i++) {
+    nxt->usb_in[i] = libusb_alloc_transfer(0);
+    if (nxt->usb_in[i]==NULL) {
+      ret = -1;
+      continue;
+    }
+    libusb_fill_bulk_transfer(nxt->usb_in[i], nxt->usb_handle, NXT_USB_IN_ENDPOINT, malloc(NXT_USB_PACKET_SIZE), NXT_USB_PACKET_SIZE, nxtd_usb_in_cb, nxt, 0);
+    nxt->usb_in[i]->flags = LIBUSB_TRANSFER_FREE_BUFFER;
+    if (nxtd_usb_submit(nxt, nxt->usb_in[i])==-1) {
+      ret = -1;
+    }
+  }
+  pthread_mutex_unlock(&nxt->usb_mutex);
+
+  return ret;
+}
+
+/**
+ * Cancels transfers of a NXT and frees them
+ *  @param nxt NXT handle
+ *  @note Waits until libusb completed every transfer, since their callbacks
+ *        still use the NXT handle. The event thread completes cancelled
+ *        transfers and runs until nxtd_usb_shutdown(), which is called after
+ *        all NXTs are closed.
+ */
+static void nxtd_usb_stop(struct nxtd_nxt_usb *nxt) {
+  size_t i;
+
+  pthread_mutex_lock(&nxt->usb_mutex);
+  for (i=0;i<NXT_USB_IN_TRANSFERS;i++) {
+    if (nxt->usb_in[i]!=NULL) {
+      libusb_cancel_transfer(nxt->usb_in[i]);
+    }
+  }
+  if (!nxt->usb_out_done) {
+    libusb_cancel_transfer(nxt->usb_out);
+  }
+  while (nxt->usb_pending>0) {
+    pthread_cond_wait(&nxt->usb_cond, &nxt->usb_mutex);
+  }
+  pthread_mutex_unlock(&nxt->usb_mutex);
+
+  for (i=0;i<NXT_USB_IN_TRANSFERS;i++) {
+    libusb_free_transfer(nxt->usb_in[i]);
+    nxt->usb_in[i] = NULL;
+  }
+  libusb_free_transfer(nxt->usb_out);
+  nxt->usb_out = NULL;
+}
+
+/**
+ * Remembers a USB device of a NXT that was removed, although it wasn't
+ * unplugged (e.g. because it didn't answer)
+ *  @param dev USB device
+ *  @note There is no hotplug event for such a NXT, so nxtd_usb_scan() looks
+ *        for it again until it is found or unplugged.
+ */
+static void nxtd_usb_lose(libusb_device *dev) {
+  size_t i;
+
+  pthread_mutex_lock(&nxtd_usb_events_mutex);
+  for (i=0;i<nxtd_usb_num_lost && nxtd_usb_lost[i]!=dev;i++);
+  if (i==nxtd_usb_num_lost && nxtd_usb_num_lost<NXTD_MAXNUM) {
+    nxtd_usb_lost[nxtd_usb_num_lost++] = libusb_ref_device(dev);
+  }
+  pthread_mutex_unlock(&nxtd_usb_events_mutex);
+}
+
+/**
+ * Forgets a USB device remembered by nxtd_usb_lose()
+ *  @param dev USB device
+ */
+static void nxtd_usb_forget(libusb_device *dev) {
+  size_t i;
+
+  pthread_mutex_lock(&nxtd_usb_events_mutex);
+  for (i=0;i<nxtd_usb_num_lost;i++) {
+    if (nxtd_usb_lost[i]==dev) {
+      libusb_unref_device(dev);
+      nxtd_usb_lost[i] = nxtd_usb_lost[--nxtd_usb_num_lost];
+      break;
+    }
+  }
+  pthread_mutex_unlock(&nxtd_usb_events_mutex);
+}
+
 /**
  * Closes a NXT over USB
  *  @param nxt NXT handle
  */
 void nxtd_usb_close(struct nxtd_nxt_usb *nxt) {
+  int left;
+
+  pthread_mutex_lock(&nxts.mutex);
+  left = nxt->usb_left;
+  pthread_mutex_unlock(&nxts.mutex);
+  if (nxtd_usb_hotplug && !left) {
+    nxtd_usb_lose(nxt->usb_dev);
+  }
   nxtd_usb_disconnect(nxt);
+  libusb_unref_device(nxt->usb_dev);
+  pthread_cond_destroy(&nxt->usb_cond);
+  pthread_mutex_destroy(&nxt->usb_mutex);
   free(nxt->nxt.name);
   free(nxt);
 }
@@ -122,77 +445,189 @@ void nxtd_usb_close(struct nxtd_nxt_usb *nxt) {
  * Find NXT by USB Device
  *  @param dev USB Device
  *  @return NXT
+ *  @note Release reference with nxtd_nxt_put()
  */
 struct nxtd_nxt_usb *nxtd_usb_finddev(libusb_device *dev) {
   struct nxtd_nxt_usb *nxt;
   size_t i;
 
+  pthread_mutex_lock(&nxts.mutex);
   for (i=0;i<NXTD_MAXNUM;i++) {
     if (nxts.list[i]!=NULL && nxts.list[i]->conn_type==NXTD_USB) {
       nxt = (struct nxtd_nxt_usb*)nxts.list[i];
       if (nxt->usb_dev==dev) {
+        nxt->nxt.refs++;
+        pthread_mutex_unlock(&nxts.mutex);
         return nxt;
       }
     }
   }
+  pthread_mutex_unlock(&nxts.mutex);
 
   return NULL;
 }
 
 /**
- * Scans for NXTs on USB
- *  @return Success?
+ * Adds a USB device to NXT list, if it is a NXT
+ *  @param dev USB device
  */
-int nxtd_usb_scan() {
-  libusb_device **devlist;
-  int i;
+static void nxtd_usb_add(libusb_device *dev) {
   struct libusb_device_descriptor devdesc;
   libusb_device_handle *handle;
   char *id;
   char *name;
   struct nxtd_nxt_usb *nxt;
 
-  libusb_get_device_list(nxtd_usb_context, &devlist);
-  for (i=0; devlist[i]!=NULL; i++) {
-    // check if we don't already have this device listed
-    if (nxtd_usb_finddev(devlist[i])==NULL) {
-      // get USB device descriptor
-      if (libusb_get_device_descriptor(devlist[i], &devdesc)==0) {
-        // check against vendor ID and product ID
-        if (devdesc.idVendor==NXT_USB_VENDORID && devdesc.idProduct==NXT_USB_PRODUCTID) {
-          // open device
-          handle = nxtd_usb_opendev(devlist[i]);
-          if (handle!=NULL) {
-            // get NXT name
-            name = nxtd_usb_getname(handle, &id);
-            if (name!=NULL) {
-              // put NXT into list
-              nxt = malloc(sizeof(struct nxtd_nxt_usb));
-              memcpy(&nxt->nxt.id, id, sizeof(nxtd_id_t));
-              nxt->nxt.name = strdup(name);
-              nxt->nxt.conn_type = NXTD_USB;
-              nxt->nxt.conn_timeout = 0;
-	      // nxt->usb_handle = NULL; // TODO why set this NULL and close handle?
-              nxt->usb_handle = handle;
-              nxt->usb_dev = devlist[i];
-              libusb_ref_device(devlist[i]);
-              nxtd_nxt_reg((struct nxtd_nxt*)nxt);
-              nxtd_usb_timeout(nxt);
+  // check if we don't already have this device listed
+  if ((nxt = nxtd_usb_finddev(dev))!=NULL) {
+    nxtd_nxt_put((struct nxtd_nxt*)nxt);
+  }
+  else {
+    // get USB device descriptor
+    if (libusb_get_device_descriptor(dev, &devdesc)==0) {
+      // check against vendor ID and product ID
+      if (devdesc.idVendor==NXT_USB_VENDORID && devdesc.idProduct==NXT_USB_PRODUCTID) {
+        // open device
+        handle = nxtd_usb_opendev(dev);
+        if (handle!=NULL) {
+          // get NXT name
+          name = nxtd_usb_getname(handle, &id);
+          if (name!=NULL) {
+            // put NXT into list
+            nxt = malloc(sizeof(struct nxtd_nxt_usb));
+            if (nxt==NULL) {
+              libusb_close(handle);
+              return;
             }
-            else {
-              libusb_close(handle); // TODO why do we close this, even if NXT is added
+            memcpy(&nxt->nxt.id, id, sizeof(nxtd_id_t));
+            nxt->nxt.name = strdup(name);
+            nxt->nxt.conn_type = NXTD_USB;
+            nxt->nxt.conn_timeout = 0;
+            nxt->usb_handle = handle;
+            nxt->usb_dev = libusb_ref_device(dev);
+            nxt->usb_left = 0;
+            pthread_mutex_init(&nxt->usb_mutex, NULL);
+            nxtd_usb_cond_init(&nxt->usb_cond);
+            if (nxtd_usb_start(nxt)==-1) {
+              // looked for again, since usb_left isn't set
+              nxtd_usb_close(nxt);
+              return;
             }
+            nxtd_usb_timeout(nxt);
+            if (nxtd_nxt_reg((struct nxtd_nxt*)nxt)==-1) {
+              nxt->usb_left = 1;
+              nxtd_usb_close(nxt);
+            }
+          }
+          else {
+            libusb_close(handle);
           }
         }
       }
     }
   }
+}
+
+/**
+ * Scans for NXTs on USB. Handles queued hotplug events or, if hotplug is
+ * not supported, enumerates all USB devices.
+ *  @return Success?
+ *  @note With hotplug, NXTs that were removed without being unplugged are
+ *        looked for again, too.
+ */
+int nxtd_usb_scan() {
+  libusb_device **devlist;
+  libusb_device *lost[NXTD_MAXNUM];
+  struct nxtd_usb_event *ev;
+  struct nxtd_nxt_usb *nxt;
+  size_t num_lost;
+  int i;
 
-  libusb_free_device_list(devlist, 1);
+  if (nxtd_usb_hotplug) {
+    while (1) {
+      pthread_mutex_lock(&nxtd_usb_events_mutex);
+      ev = nxtd_usb_events_first;
+      if (ev!=NULL) {
+        nxtd_usb_events_first = ev->next;
+        if (nxtd_usb_events_first==NULL) {
+          nxtd_usb_events_last = NULL;
+        }
+      }
+      pthread_mutex_unlock(&nxtd_usb_events_mutex);
+      if (ev==NULL) {
+        break;
+      }
+
+      if (ev->event==LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED) {
+        nxtd_usb_add(ev->dev);
+      }
+      else if ((nxt = nxtd_usb_finddev(ev->dev))!=NULL) {
+        pthread_mutex_lock(&nxts.mutex);
+        nxt->usb_left = 1;
+        pthread_mutex_unlock(&nxts.mutex);
+        nxtd_nxt_remove((struct nxtd_nxt*)nxt);
+        nxtd_nxt_put((struct nxtd_nxt*)nxt);
+      }
+      else {
+        nxtd_usb_forget(ev->dev);
+      }
+      libusb_unref_device(ev->dev);
+      free(ev);
+    }
+
+    pthread_mutex_lock(&nxtd_usb_events_mutex);
+    num_lost = nxtd_usb_num_lost;
+    memcpy(lost, nxtd_usb_lost, num_lost*sizeof(libusb_device*));
+    for (i=0; i<num_lost; i++) {
+      libusb_ref_device(lost[i]);
+    }
+    pthread_mutex_unlock(&nxtd_usb_events_mutex);
+    for (i=0; i<num_lost; i++) {
+      nxtd_usb_add(lost[i]);
+      if ((nxt = nxtd_usb_finddev(lost[i]))!=NULL) {
+        nxtd_usb_forget(lost[i]);
+        nxtd_nxt_put((struct nxtd_nxt*)nxt);
+      }
+      libusb_unref_device(lost[i]);
+    }
+  }
+  else {
+    if (libusb_get_device_list(nxtd_usb_context, &devlist)<0) {
+      return -1;
+    }
+    for (i=0; devlist[i]!=NULL; i++) {
+      nxtd_usb_add(devlist[i]);
+    }
+    libusb_free_device_list(devlist, 1);
+  }
 
   return 0;
 }
 
+/**
+ * Waits for NXTs being plugged or unplugged
+ *  @param timeout Timeout in milliseconds
+ *  @return Whether nxtd_usb_scan() should be called
+ *  @note Without hotplug support this just sleeps, so that USB is
+ *        enumerated every timeout milliseconds.
+ */
+int nxtd_usb_wait(unsigned int timeout) {
+  struct timespec deadline;
+  int pending;
+
+  nxtd_usb_deadline(&deadline, timeout);
+
+  pthread_mutex_lock(&nxtd_usb_events_mutex);
+  if (nxtd_usb_events_first==NULL) {
+    pthread_cond_timedwait(&nxtd_usb_events_cond, &nxtd_usb_events_mutex, &deadline);
+  }
+  // lost NXTs are looked for every timeout milliseconds
+  pending = nxtd_usb_events_first!=NULL || nxtd_usb_num_lost>0;
+  pthread_mutex_unlock(&nxtd_usb_events_mutex);
+
+  return nxtd_usb_hotplug?pending:1;
+}
+
 /**
  * Connect to NXT over USB
  *  @param nxt NXT to connect to
@@ -202,6 +637,10 @@ int nxtd_usb_connect(struct nxtd_nxt_usb *nxt) {
   if (nxt->usb_handle==NULL) {
     nxt->usb_handle = nxtd_usb_opendev(nxt->usb_dev);
     if (nxt->usb_handle!=NULL) {
+      if (nxtd_usb_start(nxt)==-1) {
+        nxtd_usb_disconnect(nxt);
+        return -1;
+      }
       nxtd_usb_timeout(nxt);
       return 0;
     }
@@ -221,9 +660,9 @@ int nxtd_usb_connect(struct nxtd_nxt_usb *nxt) {
  */
 int nxtd_usb_disconnect(struct nxtd_nxt_usb *nxt) {
   if (nxt->usb_handle!=NULL) {
+    nxtd_usb_stop(nxt);
     libusb_release_interface(nxt->usb_handle, NXT_USB_INTERFACE);
     libusb_close(nxt->usb_handle);
-    libusb_unref_device(nxt->usb_dev);
     nxt->usb_handle = NULL;
     nxt->nxt.conn_timeout = 0;
   }
@@ -238,21 +677,41 @@ int nxtd_usb_disconnect(struct nxtd_nxt_usb *nxt) {
  *  @return How many bytes sent
  */
 ssize_t nxtd_usb_send(struct nxtd_nxt_usb *nxt, const void *data, size_t size) {
-  int transferred;
-  size_t absolute = 0;
+  struct timespec deadline;
+  ssize_t ret = -1;
+  int timedout = 0;
 
-  nxtd_usb_connect(nxt);
+  if (nxtd_usb_connect(nxt)==-1) {
+    return -1;
+  }
 
-  while (absolute<size) {
-    if (libusb_bulk_transfer(nxt->usb_handle, NXT_USB_OUT_ENDPOINT, (void*)data+absolute, size-absolute, &transferred, NXT_USB_WAIT_TIMEOUT)!=0) {
-      return -1;
+  pthread_mutex_lock(&nxt->usb_mutex);
+  // libusb completes the transfer after NXT_USB_WAIT_TIMEOUT at latest
+  libusb_fill_bulk_transfer(nxt->usb_out, nxt->usb_handle, NXT_USB_OUT_ENDPOINT, (unsigned char*)data, size, nxtd_usb_out_cb, nxt, NXT_USB_WAIT_TIMEOUT);
+  nxt->usb_out_done = 0;
+  if (nxtd_usb_submit(nxt, nxt->usb_out)==0) {
+    // don't rely on libusb alone: without event handling it never completes
+    nxtd_usb_deadline(&deadline, 2*NXT_USB_WAIT_TIMEOUT);
+    while (!nxt->usb_out_done && !timedout) {
+      timedout = pthread_cond_timedwait(&nxt->usb_cond, &nxt->usb_mutex, &deadline)==ETIMEDOUT;
+    }
+    if (!nxt->usb_out_done) {
+      // transfer still points to data, so wait until the cancellation completed
+      libusb_cancel_transfer(nxt->usb_out);
+      while (!nxt->usb_out_done) {
+        pthread_cond_wait(&nxt->usb_cond, &nxt->usb_mutex);
+      }
+      nxt->usb_error = 1;
+    }
+    else if (nxt->usb_out->status==LIBUSB_TRANSFER_COMPLETED) {
+      ret = nxt->usb_out->actual_length;
     }
-    absolute += transferred;
   }
+  pthread_mutex_unlock(&nxt->usb_mutex);
 
   nxtd_usb_timeout(nxt);
 
-  return absolute;
+  return ret;
 }
 
 /**
@@ -261,20 +720,44 @@ ssize_t nxtd_usb_send(struct nxtd_nxt_usb *nxt, const void *data, size_t size) {
  *  @param data Buffer for data
  *  @param size How many bytes to receive
  *  @return How many bytes received
+ *  @note Data is taken from IN transfers that already completed. Each
+ *        USB packet is received as a whole; bytes that don't fit into the
+ *        buffer are discarded.
  */
 ssize_t nxtd_usb_recv(struct nxtd_nxt_usb *nxt,void *data,size_t size) {
-  int transferred;
-  size_t absolute = 0;
+  struct libusb_transfer *transfer;
+  struct timespec deadline;
+  size_t absolute = 0,n;
+  int timedout = 0;
+
+  if (nxtd_usb_connect(nxt)==-1) {
+    return -1;
+  }
 
-  nxtd_usb_connect(nxt);
+  nxtd_usb_deadline(&deadline, NXT_USB_WAIT_TIMEOUT);
 
-  do {
-    if (libusb_bulk_transfer(nxt->usb_handle, NXT_USB_IN_ENDPOINT, data+absolute, size-absolute, &transferred, NXT_USB_WAIT_TIMEOUT)!=0) {
+  pthread_mutex_lock(&nxt->usb_mutex);
+  while (absolute<size) {
+    while (nxt->usb_in_num==0 && !nxt->usb_error && !timedout) {
+      timedout = pthread_cond_timedwait(&nxt->usb_cond, &nxt->usb_mutex, &deadline)==ETIMEDOUT;
+    }
+    if (nxt->usb_in_num==0) {
+      pthread_mutex_unlock(&nxt->usb_mutex);
       return -1;
     }
-    absolute += transferred;
+
+    transfer = nxt->usb_in_done[nxt->usb_in_first];
+    nxt->usb_in_first = (nxt->usb_in_first+1)%NXT_USB_IN_TRANSFERS;
+    nxt->usb_in_num--;
+
+    n = transfer->actual_length<size-absolute?transfer->actual_length:size-absolute;
+    memcpy(data+absolute, transfer->buffer, n);
+    absolute += n;
+
+    // resubmit transfer for next reply
+    nxtd_usb_submit(nxt, transfer);
   }
-  while (absolute<size);
+  pthread_mutex_unlock(&nxt->usb_mutex);
 
   nxtd_usb_timeout(nxt);
 
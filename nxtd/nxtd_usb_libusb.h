@@ -23,6 +23,7 @@
 
 #include <sys/types.h>
 #include <libusb.h>
+#include <pthread.h>
 
 #include "nxtd.h"
 
@@ -34,17 +35,42 @@
 #define NXT_USB_CONFIG        1
 #define NXT_USB_WAIT_TIMEOUT  1000 /* milliseconds */
 #define NXT_USB_IDLE_TIMEOUT  30   /* seconds */
+#define NXT_USB_PACKET_SIZE   64
+#define NXT_USB_IN_TRANSFERS  4    /* IN transfers submitted in advance */
 
 struct nxtd_nxt_usb {
   struct nxtd_nxt nxt;
   libusb_device_handle *usb_handle;
   libusb_device *usb_dev;
+  /// Mutex for transfers
+  pthread_mutex_t usb_mutex;
+  /// Signaled when a transfer completes
+  pthread_cond_t usb_cond;
+  /// IN transfers (submitted in advance, so replies are already buffered)
+  struct libusb_transfer *usb_in[NXT_USB_IN_TRANSFERS];
+  /// Completed IN transfers in order of completion
+  struct libusb_transfer *usb_in_done[NXT_USB_IN_TRANSFERS];
+  /// Index of first completed IN transfer
+  size_t usb_in_first;
+  /// Number of completed IN transfers
+  size_t usb_in_num;
+  /// OUT transfer
+  struct libusb_transfer *usb_out;
+  /// If OUT transfer is completed
+  int usb_out_done;
+  /// Number of submitted transfers
+  int usb_pending;
+  /// If a transfer failed (e.g. NXT was unplugged)
+  int usb_error;
+  /// If NXT was unplugged (otherwise it is looked for again when removed)
+  int usb_left;
 };
 
 int nxtd_usb_init();
 void nxtd_usb_shutdown();
 void nxtd_usb_close(struct nxtd_nxt_usb *nxt);
 int nxtd_usb_scan();
+int nxtd_usb_wait(unsigned int timeout);
 int nxtd_usb_connect(struct nxtd_nxt_usb *nxt);
 int nxtd_usb_disconnect(struct nxtd_nxt_usb *nxt);
 ssize_t nxtd_usb_send(struct nxtd_nxt_usb *nxt,const void *data,size_t size);
@@ -21,6 +21,8 @@
 #include <sys/types.h>
 #include <usb.h>
 #include <time.h>
+#include <unistd.h>
+#include <pthread.h>
 
 #include "nxtd.h"
 #include "nxtd_usb_libusb_old.h"
@@ -100,12 +102,17 @@ struct nxtd_nxt_usb *nxtd_usb_finddev(struct usb_device *dev) {
   struct nxtd_nxt_usb *nxt;
   size_t i;
 
+  pthread_mutex_lock(&nxts.mutex);
   for (i=0;i<NXTD_MAXNUM;i++) {
     if (nxts.list[i]!=NULL && nxts.list[i]->conn_type==NXTD_USB) {
       nxt = (struct nxtd_nxt_usb*)nxts.list[i];
-      if (nxt->usb_dev==dev) return nxt;
+      if (nxt->usb_dev==dev) {
+        pthread_mutex_unlock(&nxts.mutex);
+        return nxt;
+      }
     }
   }
+  pthread_mutex_unlock(&nxts.mutex);
 
   return NULL;
 }
@@ -148,6 +155,17 @@ int nxtd_usb_scan() {
   return 0;
 }
 
+/**
+ * Waits until USB should be scanned again
+ *  @param timeout Timeout in milliseconds
+ *  @return Whether nxtd_usb_scan() should be called
+ *  @note libusb 0.1 has no hotplug support, so this just sleeps.
+ */
+int nxtd_usb_wait(unsigned int timeout) {
+  usleep(timeout*1000);
+  return 1;
+}
+
 /**
  * Connect to NXT over USB
  *  @param nxt NXT to connect to
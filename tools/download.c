@@ -41,6 +41,7 @@ int main(int argc,char *argv[]) {
   char *name = NULL;
   char *src,*dest;
   int c;
+  int failed = 0;
 
   while ((c = getopt(argc,argv,":hn:"))!=-1) {
     switch(c) {
@@ -74,14 +75,15 @@ int main(int argc,char *argv[]) {
     if (optind<argc) dest = argv[optind];
     else dest = src;
 
-    nxt_download(nxt,src,dest);
+    failed = nxt_download(nxt,src,dest)!=0;
   }
   else {
     fprintf(stderr,"No input file\n");
     usage(argv[0],1);
   }
 
-  int ret = nxt_error(nxt);
+  int ret = failed?nxt_error(nxt):0;
+  if (failed && ret==0) ret = 1;
   if (name!=NULL) free(name);
   nxt_close(nxt);
 
@@ -20,11 +20,14 @@
 
 #include <sys/types.h>
 #include <stdlib.h>
+#include <stdio.h>
 #include <string.h>
 #include <stdint.h>
 #include <stddef.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
 
 #ifdef FUSE_VERSION_2_5
 # define FUSE_USE_VERSION 25
@@ -35,28 +38,100 @@
 #include <fuse_opt.h>
 
 #include <anxt/nxt.h>
+#include <anxt/net.h>
 #include <anxt/file.h>
 #include <anxt/tools.h>
 
-/// Data needed to add a file to a directory
-struct nxtfs_dir_file {
-  /// Fuse filler function
-  fuse_fill_dir_t filler;
-  /// Directory buffer
-  void *buf;
+/// Size of blocks read from NXT
+#define NXTFS_BLOCKSIZE 4096
+/// Default time in seconds a directory listing is used
+#define NXTFS_DEFAULT_TTL 2
+/// Seconds after last use of a NXT its directory isn't prefetched anymore
+#define NXTFS_PREFETCH_IDLE 10
+/// Nothing to write back (see nxt_file_t)
+#define NXTFS_CLEAN ((size_t)-1)
+
+/// Cached directory entry
+struct nxtfs_entry {
+  /// Filename
+  char *name;
+  /// Filesize
+  size_t size;
+  /// Next entry
+  struct nxtfs_entry *next;
 };
 
-/// Opened file
-typedef struct {
+/// Cached directory (filled by one nxt_list() scan)
+struct nxtfs_dir {
+  /// Files
+  struct nxtfs_entry *entries;
+  /// When directory was scanned (see nxtfs_time())
+  double scanned;
+  /// If directory was scanned
+  int valid;
+};
+
+struct nxtfs_brick;
+
+/// Opened file (shared by all handles of a file)
+typedef struct nxt_file {
+  /// NXT of file
+  struct nxtfs_brick *brick;
+  /// Filename
   char *filename;
+  /// Content
   char *buf;
+  /// Size of buffer
+  size_t bufsize;
+  /// Size of file
   size_t size;
-  int dirty;
+  /// Size of file on NXT (when opened or written back)
+  size_t nxt_size;
+  /// How many bytes from the file on NXT are still part of the file (less than nxt_size after truncating)
+  size_t keep;
+  /// How many bytes were read from NXT so far
+  size_t loaded;
+  /// Handle for reading from NXT (-1 if not open)
+  int fh;
+  /// Lowest offset changed since last write-back (NXTFS_CLEAN if nothing changed)
+  size_t dirty;
+  /// Number of FUSE handles
+  int refs;
+  /// Next opened file
+  struct nxt_file *next;
 } nxt_file_t;
 
+/// Mounted NXT
+struct nxtfs_brick {
+  /// Name of directory (NULL if NXT is mounted as root directory)
+  char *dirname;
+  /// NXT handle
+  nxt_t *nxt;
+  /// Cached directory
+  struct nxtfs_dir dir;
+  /// Opened files
+  nxt_file_t *files;
+  /// Protects queue
+  pthread_mutex_t mutex;
+  /// Signals that next request in queue may run
+  pthread_cond_t cond;
+  /// Ticket of next request in queue
+  unsigned long next;
+  /// Ticket of running request
+  unsigned long serving;
+  /// When NXT was used last (see nxtfs_time())
+  double used;
+  /// Thread prefetching directory
+  pthread_t prefetch;
+  /// If prefetching thread runs
+  int prefetching;
+};
+
 /// Filesystem options
 struct options {
   char* name;
+  unsigned int ttl;
+  int all;
 } options;
 
 /** macro to define options */
@@ -70,6 +145,8 @@ enum {
 
 static struct fuse_opt nxtfs_opts[] = {
   NXTFS_OPT_KEY("-n %s",name,0),
+  NXTFS_OPT_KEY("-t %u",ttl,0),
+  NXTFS_OPT_KEY("-a",all,1),
   // #define FUSE_OPT_KEY(templ, key) { templ, -1U, key }
   FUSE_OPT_KEY("-V",KEY_VERSION),
   FUSE_OPT_KEY("--version",KEY_VERSION),
@@ -78,11 +155,21 @@ static struct fuse_opt nxtfs_opts[] = {
   FUSE_OPT_END
 };
 
-static nxt_t *nxt;
+/// Mounted NXTs
+static struct nxtfs_brick *nxtfs_bricks = NULL;
+/// Number of mounted NXTs
+static size_t nxtfs_num_bricks = 0;
+
+/// Protects nxtfs_stopping
+static pthread_mutex_t nxtfs_prefetch_mutex = PTHREAD_MUTEX_INITIALIZER;
+/// Wakes up prefetching threads when filesystem is unmounted
+static pthread_cond_t nxtfs_prefetch_cond = PTHREAD_COND_INITIALIZER;
+/// If filesystem is being unmounted
+static int nxtfs_stopping = 0;
 
 // Filesystem operations ////
 
-static int nxtfs_error() {
+static int nxtfs_error(nxt_t *nxt) {
   int err = nxt_error(nxt);
   if (err==NXT_ERR_NO_MORE_HANDLES) return -ENFILE;
   else if (err==NXT_ERR_NO_SPACE) return -ENOSPC;
@@ -102,140 +189,623 @@ static int nxtfs_error() {
   else if (err==NXT_ERR_ILLEGAL_MAILBOX_QUEUE_ID) return -EINVAL;
   else if (err==NXT_ERR_BAD_INPUT_OUTPUT) return -EIO;
   else if (err==NXT_ERR_BAD_ARGUMENTS) return -EINVAL;
-  else return 0;
+  else return -EIO;
 }
 
 /**
- * Opens a file on NXT
- *  @param filename Filename
- *  @param fi File info
+ * Gets time
+ *  @return Monotonic time in seconds
+ */
+static double nxtfs_time() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC,&now);
+  return now.tv_sec+now.tv_nsec/1000000000.0;
+}
+
+/**
+ * Waits until it's the turn of the calling thread to access a NXT
+ *  @param brick NXT
+ *  @note Requests to a NXT run one after another in the order they arrived.
+ *        Requests to different NXTs run at the same time.
+ */
+static void nxtfs_brick_queue(struct nxtfs_brick *brick) {
+  unsigned long ticket;
+
+  pthread_mutex_lock(&brick->mutex);
+  ticket = brick->next++;
+  while (ticket!=brick->serving) {
+    pthread_cond_wait(&brick->cond,&brick->mutex);
+  }
+  pthread_mutex_unlock(&brick->mutex);
+}
+
+/**
+ * Starts a request to a NXT
+ *  @param brick NXT
+ */
+static void nxtfs_brick_lock(struct nxtfs_brick *brick) {
+  nxtfs_brick_queue(brick);
+  pthread_mutex_lock(&brick->mutex);
+  brick->used = nxtfs_time();
+  pthread_mutex_unlock(&brick->mutex);
+}
+
+/**
+ * Ends a request to a NXT (next request in queue runs)
+ *  @param brick NXT
+ */
+static void nxtfs_brick_unlock(struct nxtfs_brick *brick) {
+  pthread_mutex_lock(&brick->mutex);
+  brick->serving++;
+  pthread_cond_broadcast(&brick->cond);
+  pthread_mutex_unlock(&brick->mutex);
+}
+
+/**
+ * Resolves a path
+ *  @param path Path
+ *  @param brick Reference for NXT (NULL for root directory with several NXTs)
+ *  @param filename Reference for filename on NXT ("" for directory of NXT)
  *  @return Success?
  */
-static int nxtfs_open(const char *fn,struct fuse_file_info *fi) {
-  char *filename = ((char*)fn)+1;
-  int fh;
-  size_t filesize;
-  if ((fh = nxt_file_open(nxt,filename,NXT_OREAD,&filesize))!=-1) {
-    nxt_file_t *new = malloc(sizeof(nxt_file_t));
-    fi->fh = (intptr_t)new;
-    new->filename = strdup(filename);
-    new->buf = malloc(filesize);
-    new->size = filesize;
-    new->dirty = 0;
-    nxt_file_read(nxt,fh,new->buf,filesize);
-    nxt_file_close(nxt,fh);
+static int nxtfs_resolve(const char *path,struct nxtfs_brick **brick,const char **filename) {
+  size_t i,len;
+
+  path++;
+  if (nxtfs_bricks[0].dirname==NULL) {
+    // one NXT mounted as root directory
+    *brick = nxtfs_bricks;
+    *filename = path;
+    return 0;
+  }
+  if (*path==0) {
+    *brick = NULL;
+    *filename = path;
     return 0;
   }
-  else return -errno;
+
+  len = strcspn(path,"/");
+  for (i=0;i<nxtfs_num_bricks;i++) {
+    if (strlen(nxtfs_bricks[i].dirname)==len && strncmp(nxtfs_bricks[i].dirname,path,len)==0) {
+      *brick = nxtfs_bricks+i;
+      *filename = path[len]=='/'?path+len+1:path+len;
+      return strchr(*filename,'/')==NULL?0:-ENOENT;
+    }
+  }
+  return -ENOENT;
 }
 
 /**
- * Flushs buffered data to NXT
+ * Resolves path of a file
+ *  @param path Path
+ *  @param brick Reference for NXT
+ *  @param filename Reference for filename on NXT
+ *  @return Success?
+ */
+static int nxtfs_resolve_file(const char *path,struct nxtfs_brick **brick,const char **filename) {
+  int ret = nxtfs_resolve(path,brick,filename);
+  if (ret==0 && **filename==0) ret = -EISDIR;
+  return ret;
+}
+
+/**
+ * Removes all entries from directory cache
+ *  @param dir Directory
+ */
+static void nxtfs_dir_clear(struct nxtfs_dir *dir) {
+  struct nxtfs_entry *next;
+  for (;dir->entries!=NULL;dir->entries = next) {
+    next = dir->entries->next;
+    free(dir->entries->name);
+    free(dir->entries);
+  }
+  dir->valid = 0;
+}
+
+/**
+ * Adds file to directory cache
  *  @param filename Filename
- *  @param fi File info
+ *  @param filesize Filesize
+ *  @param data Directory
+ */
+static void nxtfs_dir_add(char *filename,size_t filesize,void *data) {
+  struct nxtfs_dir *dir = (struct nxtfs_dir*)data;
+  struct nxtfs_entry *entry = malloc(sizeof(struct nxtfs_entry));
+  entry->name = strdup(filename);
+  entry->size = filesize;
+  entry->next = dir->entries;
+  dir->entries = entry;
+}
+
+/**
+ * Scans directory of a NXT
+ *  @param brick NXT
  *  @return Success?
  */
-static int nxtfs_flush(const char *filename,struct fuse_file_info *fi) {
-  nxt_file_t *file = (nxt_file_t*)((intptr_t)(fi->fh));
-  if (file->dirty==0) return 0;
-  int fh;
-  if ((fh = nxt_file_open(nxt,file->filename,NXT_OWLINE|NXT_OWOVER,file->size))!=-1) {
-    nxt_file_write(nxt,fh,file->buf,file->size);
-    nxt_file_close(nxt,fh);
-    file->dirty = 0;
+static int nxtfs_dir_rescan(struct nxtfs_brick *brick) {
+  nxtfs_dir_clear(&brick->dir);
+  if (nxt_list(brick->nxt,"*.*",nxtfs_dir_add,&brick->dir)!=0) {
+    nxtfs_dir_clear(&brick->dir);
+    return nxtfs_error(brick->nxt);
+  }
+  brick->dir.scanned = nxtfs_time();
+  brick->dir.valid = 1;
+  return 0;
+}
+
+/**
+ * Scans directory of a NXT, if cached listing is older than TTL
+ *  @param brick NXT
+ *  @return Success?
+ */
+static int nxtfs_dir_scan(struct nxtfs_brick *brick) {
+  if (brick->dir.valid && nxtfs_time()-brick->dir.scanned<options.ttl) return 0;
+  return nxtfs_dir_rescan(brick);
+}
+
+/**
+ * Finds file in directory cache
+ *  @param brick NXT
+ *  @param filename Filename
+ *  @return Entry (NULL if not found)
+ */
+static struct nxtfs_entry *nxtfs_dir_find(struct nxtfs_brick *brick,const char *filename) {
+  struct nxtfs_entry *entry;
+  for (entry=brick->dir.entries;entry!=NULL && strcmp(entry->name,filename)!=0;entry = entry->next);
+  return entry;
+}
+
+/**
+ * Sets size of file in directory cache (adds file, if needed)
+ *  @param brick NXT
+ *  @param filename Filename
+ *  @param filesize Filesize
+ */
+static void nxtfs_dir_set(struct nxtfs_brick *brick,const char *filename,size_t filesize) {
+  struct nxtfs_entry *entry;
+  if (!brick->dir.valid) return;
+  if ((entry = nxtfs_dir_find(brick,filename))!=NULL) entry->size = filesize;
+  else nxtfs_dir_add((char*)filename,filesize,&brick->dir);
+}
+
+/**
+ * Removes file from directory cache
+ *  @param brick NXT
+ *  @param filename Filename
+ */
+static void nxtfs_dir_remove(struct nxtfs_brick *brick,const char *filename) {
+  struct nxtfs_entry **prev,*entry;
+  for (prev=&brick->dir.entries;*prev!=NULL && strcmp((*prev)->name,filename)!=0;prev = &(*prev)->next);
+  if ((entry = *prev)!=NULL) {
+    *prev = entry->next;
+    free(entry->name);
+    free(entry);
+  }
+}
+
+/**
+ * Prefetches directory of a NXT in background
+ *  @param arg NXT
+ *  @return NULL
+ *  @note The directory is scanned again when half of the TTL is over, as long
+ *        as the NXT is used, so requests don't have to wait for a scan
+ */
+static void *nxtfs_prefetch(void *arg) {
+  struct nxtfs_brick *brick = (struct nxtfs_brick*)arg;
+  double interval = options.ttl/2.0;
+  struct timespec wakeup;
+  double used;
+
+  pthread_mutex_lock(&nxtfs_prefetch_mutex);
+  while (!nxtfs_stopping) {
+    pthread_mutex_unlock(&nxtfs_prefetch_mutex);
+
+    pthread_mutex_lock(&brick->mutex);
+    used = brick->used;
+    pthread_mutex_unlock(&brick->mutex);
+    if (nxtfs_time()-used<NXTFS_PREFETCH_IDLE) {
+      nxtfs_brick_queue(brick);
+      if (!brick->dir.valid || nxtfs_time()-brick->dir.scanned>=interval) nxtfs_dir_rescan(brick);
+      nxtfs_brick_unlock(brick);
+    }
+
+    clock_gettime(CLOCK_REALTIME,&wakeup);
+    wakeup.tv_sec += (time_t)interval;
+    wakeup.tv_nsec += (long)((interval-(time_t)interval)*1000000000.0);
+    if (wakeup.tv_nsec>=1000000000) {
+      wakeup.tv_sec++;
+      wakeup.tv_nsec -= 1000000000;
+    }
+    pthread_mutex_lock(&nxtfs_prefetch_mutex);
+    if (!nxtfs_stopping) pthread_cond_timedwait(&nxtfs_prefetch_cond,&nxtfs_prefetch_mutex,&wakeup);
+  }
+  pthread_mutex_unlock(&nxtfs_prefetch_mutex);
+  return NULL;
+}
+
+/**
+ * Finds opened file
+ *  @param brick NXT
+ *  @param filename Filename
+ *  @return File (NULL if not opened)
+ */
+static nxt_file_t *nxtfs_file_find(struct nxtfs_brick *brick,const char *filename) {
+  nxt_file_t *file;
+  for (file=brick->files;file!=NULL && strcmp(file->filename,filename)!=0;file = file->next);
+  return file;
+}
+
+/**
+ * Gets size of a file
+ *  @param brick NXT
+ *  @param filename Filename
+ *  @param size Reference for filesize
+ *  @return Success?
+ *  @note Opened files have their current size. Other files are looked up in
+ *        the directory cache.
+ */
+static int nxtfs_lookup(struct nxtfs_brick *brick,const char *filename,size_t *size) {
+  nxt_file_t *file = nxtfs_file_find(brick,filename);
+  struct nxtfs_entry *entry;
+  int ret;
+
+  if (file!=NULL) {
+    *size = file->size;
     return 0;
   }
-  else return -1;
+  if ((ret = nxtfs_dir_scan(brick))!=0) return ret;
+  if ((entry = nxtfs_dir_find(brick,filename))==NULL) return -ENOENT;
+  *size = entry->size;
+  return 0;
 }
 
 /**
- * Closes a file (inclusive flushing)
+ * Adds an opened file
+ *  @param brick NXT
  *  @param filename Filename
+ *  @param size Size of file on NXT (0 for a new file)
+ *  @return File
+ *  @note Nothing is read from NXT yet
+ */
+static nxt_file_t *nxtfs_file_new(struct nxtfs_brick *brick,const char *filename,size_t size) {
+  nxt_file_t *file = malloc(sizeof(nxt_file_t));
+  file->brick = brick;
+  file->filename = strdup(filename);
+  file->bufsize = size>0?size:1;
+  file->buf = malloc(file->bufsize);
+  file->size = size;
+  file->nxt_size = size;
+  file->keep = size;
+  file->loaded = 0;
+  file->fh = -1;
+  file->dirty = NXTFS_CLEAN;
+  file->refs = 0;
+  file->next = brick->files;
+  brick->files = file;
+  return file;
+}
+
+/**
+ * Gets an opened file (and opens it, if needed)
+ *  @param brick NXT
+ *  @param filename Filename
+ *  @param file Reference for file
+ *  @return Success?
+ *  @note Release file with nxtfs_file_put()
+ */
+static int nxtfs_file_get(struct nxtfs_brick *brick,const char *filename,nxt_file_t **file) {
+  size_t size;
+  int ret;
+
+  if ((*file = nxtfs_file_find(brick,filename))==NULL) {
+    if ((ret = nxtfs_lookup(brick,filename,&size))!=0) return ret;
+    *file = nxtfs_file_new(brick,filename,size);
+  }
+  (*file)->refs++;
+  return 0;
+}
+
+/**
+ * Closes handle for reading file from NXT
+ *  @param file File
+ */
+static void nxtfs_file_close_nxt(nxt_file_t *file) {
+  if (file->fh!=-1) {
+    nxt_file_close(file->brick->nxt,file->fh);
+    file->fh = -1;
+  }
+}
+
+/**
+ * Releases an opened file (and frees it, if it was the last reference)
+ *  @param file File
+ *  @note Changes that weren't written back are lost
+ */
+static void nxtfs_file_put(nxt_file_t *file) {
+  nxt_file_t **prev;
+
+  if (--file->refs>0) return;
+  nxtfs_file_close_nxt(file);
+  for (prev=&file->brick->files;*prev!=file;prev = &(*prev)->next);
+  *prev = file->next;
+  free(file->filename);
+  free(file->buf);
+  free(file);
+}
+
+/**
+ * Makes buffer of a file big enough
+ *  @param file File
+ *  @param size Needed size
+ */
+static void nxtfs_file_reserve(nxt_file_t *file,size_t size) {
+  if (size>file->bufsize) {
+    file->bufsize = size>2*file->bufsize?size:2*file->bufsize;
+    file->buf = realloc(file->buf,file->bufsize);
+  }
+}
+
+/**
+ * Reads file from NXT up to an offset
+ *  @param file File
+ *  @param offset Offset (rounded up to whole blocks)
+ *  @return Success?
+ *  @note The NXT reads files only sequentially, so the handle stays open
+ *        until all of the file is read
+ */
+static int nxtfs_file_load(nxt_file_t *file,size_t offset) {
+  nxt_t *nxt = file->brick->nxt;
+  size_t filesize,n;
+
+  if (offset>file->keep) offset = file->keep;
+  if (file->loaded>=offset) return 0;
+  offset = (offset+NXTFS_BLOCKSIZE-1)/NXTFS_BLOCKSIZE*NXTFS_BLOCKSIZE;
+  if (offset>file->keep) offset = file->keep;
+
+  if (file->fh==-1) {
+    if ((file->fh = nxt_file_open(nxt,file->filename,NXT_OREAD,&filesize))==-1) return nxtfs_error(nxt);
+    if (filesize<file->keep) {
+      // file was changed on NXT
+      nxtfs_file_close_nxt(file);
+      return -EIO;
+    }
+    if (file->loaded>0) {
+      // handle was closed after an error, skip what was already read
+      char *skip = malloc(file->loaded);
+      n = nxt_file_read(nxt,file->fh,skip,file->loaded);
+      free(skip);
+      if (n!=file->loaded) {
+        nxtfs_file_close_nxt(file);
+        return nxtfs_error(nxt);
+      }
+    }
+  }
+
+  n = nxt_file_read(nxt,file->fh,file->buf+file->loaded,offset-file->loaded);
+  if (n!=offset-file->loaded) {
+    nxtfs_file_close_nxt(file);
+    return nxtfs_error(nxt);
+  }
+  file->loaded = offset;
+  if (file->loaded==file->keep) nxtfs_file_close_nxt(file);
+  return 0;
+}
+
+/**
+ * Changes size of an opened file
+ *  @param file File
+ *  @param size New size
+ */
+static void nxtfs_file_truncate(nxt_file_t *file,size_t size) {
+  if (size==file->size) return;
+  if (size<file->keep) {
+    file->keep = size;
+    if (file->loaded>size) file->loaded = size;
+    if (file->loaded==file->keep) nxtfs_file_close_nxt(file);
+  }
+  nxtfs_file_reserve(file,size);
+  if (size>file->size) memset(file->buf+file->size,0,size-file->size);
+  if (file->dirty>file->size) file->dirty = file->size;
+  if (file->dirty>size) file->dirty = size;
+  file->size = size;
+}
+
+/**
+ * Writes changes of an opened file back to NXT
+ *  @param file File
+ *  @return Success?
+ *  @note Files on the NXT can't be changed, only be appended to (as far as
+ *        there is space left in them). So a file is written as a whole, unless
+ *        data was only appended.
+ */
+static int nxtfs_file_flush(nxt_file_t *file) {
+  nxt_t *nxt = file->brick->nxt;
+  size_t size,avail;
+  int fh,ret;
+
+  if (file->dirty==NXTFS_CLEAN) return 0;
+  if ((ret = nxtfs_file_load(file,file->keep))!=0) return ret;
+  nxtfs_file_close_nxt(file);
+
+  ret = -1;
+  if (file->nxt_size>0 && file->keep==file->nxt_size && file->dirty>=file->nxt_size) {
+    // only appended: try remaining space of file on NXT
+    size = file->size-file->nxt_size;
+    if ((fh = nxt_file_open(nxt,file->filename,NXT_OAPPND,&avail))!=-1) {
+      if (avail>=size) ret = nxt_file_write(nxt,fh,file->buf+file->nxt_size,size)==size?0:nxtfs_error(nxt);
+      nxt_file_close(nxt,fh);
+      if (ret==0) size = file->size;
+    }
+  }
+  if (ret==-1) {
+    // NXT can't store empty files
+    size = file->size>0?file->size:1;
+    nxtfs_file_reserve(file,size);
+    if (file->size==0) file->buf[0] = 0;
+    if ((fh = nxt_file_open(nxt,file->filename,NXT_OWLINE|NXT_OWOVER,size))==-1) return nxtfs_error(nxt);
+    ret = nxt_file_write(nxt,fh,file->buf,size)==size?0:nxtfs_error(nxt);
+    nxt_file_close(nxt,fh);
+  }
+
+  if (ret==0) {
+    file->nxt_size = size;
+    file->keep = file->size;
+    file->loaded = file->size;
+    file->dirty = NXTFS_CLEAN;
+    nxtfs_dir_set(file->brick,file->filename,size);
+  }
+  return ret;
+}
+
+/**
+ * Opens a file on NXT
+ *  @param path Path
  *  @param fi File info
  *  @return Success?
+ *  @note Nothing is read from NXT until it's needed
  */
-static int nxtfs_close(const char *filename,struct fuse_file_info *fi) {
-  if (nxtfs_flush(filename,fi)!=-1) {
-    nxt_file_t *file = (nxt_file_t*)((intptr_t)(fi->fh));
-    free(file->filename);
-    free(file->buf);
-    free(file);
-    return 0;
+static int nxtfs_open(const char *path,struct fuse_file_info *fi) {
+  struct nxtfs_brick *brick;
+  const char *filename;
+  nxt_file_t *file;
+  int ret;
+
+  if ((ret = nxtfs_resolve_file(path,&brick,&filename))!=0) return ret;
+  nxtfs_brick_lock(brick);
+  if ((ret = nxtfs_file_get(brick,filename,&file))==0) {
+    fi->fh = (intptr_t)file;
+    if (fi->flags&O_TRUNC) nxtfs_file_truncate(file,0);
   }
-  else return -1;
+  nxtfs_brick_unlock(brick);
+  return ret;
+}
+
+/**
+ * Flushs buffered data to NXT
+ *  @param path Path
+ *  @param fi File info
+ *  @return Success?
+ */
+static int nxtfs_flush(const char *path,struct fuse_file_info *fi) {
+  nxt_file_t *file = (nxt_file_t*)((intptr_t)(fi->fh));
+  struct nxtfs_brick *brick = file->brick;
+  int ret;
+
+  nxtfs_brick_lock(brick);
+  ret = nxtfs_file_flush(file);
+  nxtfs_brick_unlock(brick);
+  return ret;
+}
+
+/**
+ * Closes a file (inclusive flushing)
+ *  @param path Path
+ *  @param fi File info
+ *  @return Success?
+ */
+static int nxtfs_close(const char *path,struct fuse_file_info *fi) {
+  nxt_file_t *file = (nxt_file_t*)((intptr_t)(fi->fh));
+  struct nxtfs_brick *brick = file->brick;
+  int ret;
+
+  nxtfs_brick_lock(brick);
+  ret = nxtfs_file_flush(file);
+  nxtfs_file_put(file);
+  nxtfs_brick_unlock(brick);
+  return ret;
 }
 
 /**
  * Truncates file
- *  @param filename Filename
+ *  @param path Path
  *  @param newsize New filesize
  *  @param fi File info
  *  @return Success?
  */
-static int nxtfs_ftruncate(const char *filename,off_t newsize,struct fuse_file_info *fi) {
+static int nxtfs_ftruncate(const char *path,off_t newsize,struct fuse_file_info *fi) {
   nxt_file_t *file = (nxt_file_t*)((intptr_t)(fi->fh));
-  file->buf = realloc(file->buf,newsize);
-  //if (newsize>file->size) memset(file->buf+file->size,0,newsize-file->size);
-  file->size = newsize;
-  file->dirty = 1;
+  struct nxtfs_brick *brick = file->brick;
+
+  nxtfs_brick_lock(brick);
+  nxtfs_file_truncate(file,newsize);
+  nxtfs_brick_unlock(brick);
   return 0;
 }
 
 /**
  * Reads from file
- *  @param filename Filename
+ *  @param path Path
  *  @param buf Buffer
  *  @param count How many bytes to read
  *  @param offset Offset in file
  *  @param fi File info
  *  @return How many bytes read
  */
-static int nxtfs_read(const char *filename,char *buf,size_t count,off_t offset,struct fuse_file_info *fi) {
+static int nxtfs_read(const char *path,char *buf,size_t count,off_t offset,struct fuse_file_info *fi) {
   nxt_file_t *file = (nxt_file_t*)((intptr_t)(fi->fh));
-  if (offset>file->size) return -EINVAL;
-  if (offset+count>file->size) count = file->size-offset;
-  memcpy(buf,file->buf+offset,count);
-  return count;
+  struct nxtfs_brick *brick = file->brick;
+  int ret = 0;
+
+  nxtfs_brick_lock(brick);
+  if (offset<file->size) {
+    if (offset+count>file->size) count = file->size-offset;
+    if ((ret = nxtfs_file_load(file,offset+count))==0) {
+      memcpy(buf,file->buf+offset,count);
+      ret = count;
+    }
+  }
+  nxtfs_brick_unlock(brick);
+  return ret;
 }
 
 /**
  * Writes to file
- *  @param filename Filename
+ *  @param path Path
  *  @param buf Buffer
  *  @param count How many bytes to write
  *  @param offset Offset in file
  *  @param fi File info
  *  @return How many bytes written
+ *  @note Data is written to NXT by nxtfs_flush()
  */
-static int nxtfs_write(const char *filename,const char *buf,size_t count,off_t offset,struct fuse_file_info *fi) {
+static int nxtfs_write(const char *path,const char *buf,size_t count,off_t offset,struct fuse_file_info *fi) {
   nxt_file_t *file = (nxt_file_t*)((intptr_t)(fi->fh));
-  if (offset>file->size) return -EINVAL;
-  if (offset+count>file->size) nxtfs_ftruncate(filename,offset+count,fi);
-  memcpy(file->buf+offset,buf,count);
-  file->dirty = 1;
-  return count;
+  struct nxtfs_brick *brick = file->brick;
+  int ret;
+
+  nxtfs_brick_lock(brick);
+  // data from NXT after this write must not overwrite it
+  if ((ret = nxtfs_file_load(file,offset+count))==0) {
+    if (offset+count>file->size) nxtfs_file_truncate(file,offset+count);
+    memcpy(file->buf+offset,buf,count);
+    if (offset<file->dirty) file->dirty = offset;
+    ret = count;
+  }
+  nxtfs_brick_unlock(brick);
+  return ret;
 }
 
 /**
  * Adds file to directory
+ *  @param buf Directory buffer
+ *  @param filler Fuse filler function
  *  @param filename Filename
+ *  @param mode Mode
  *  @param filesize Filesize
- *  @param vdata Void pointer to dir_file data
  */
-static void nxtfs_dir_file_add(char *filename,size_t filesize,void *vdata) {
-  struct nxtfs_dir_file *data = (struct nxtfs_dir_file*)vdata;
+static void nxtfs_dir_file_add(void *buf,fuse_fill_dir_t filler,const char *filename,mode_t mode,size_t filesize) {
   struct stat stbuf;
 
   memset(&stbuf,0,sizeof(stbuf));
-  stbuf.st_mode = S_IFREG|0777;
+  stbuf.st_mode = mode;
   stbuf.st_size = filesize;
   stbuf.st_nlink = 1;
-  data->filler(data->buf,filename,&stbuf,0);
+  filler(buf,filename,&stbuf,0);
 }
 
 /**
  * Reads directory
- *  @param path Path (should always be /)
+ *  @param path Path (root directory or directory of a NXT)
  *  @param buf Buffer
  *  @param filler Filler function
  *  @param offset Offset (ignored)
@@ -243,159 +813,289 @@ static void nxtfs_dir_file_add(char *filename,size_t filesize,void *vdata) {
  *  @return Success?
  */
 static int nxtfs_readdir(const char *path,void *buf,fuse_fill_dir_t filler,off_t offset,struct fuse_file_info *fi) {
-  if (strcmp(path,"/")==0) {
-    struct nxtfs_dir_file data = {
-      .filler = filler,
-      .buf = buf
-    };
+  struct nxtfs_brick *brick;
+  struct nxtfs_entry *entry;
+  const char *filename;
+  nxt_file_t *file;
+  size_t i;
+  int ret;
 
-    filler(buf,".",NULL,0);
-    filler(buf,"..",NULL,0);
+  if ((ret = nxtfs_resolve(path,&brick,&filename))!=0) return ret;
+  if (*filename!=0) return -ENOTDIR;
 
-    return nxt_list(nxt,"*.*",nxtfs_dir_file_add,&data)==0?0:nxtfs_error();
+  filler(buf,".",NULL,0);
+  filler(buf,"..",NULL,0);
+
+  if (brick==NULL) {
+    // one directory per NXT
+    for (i=0;i<nxtfs_num_bricks;i++) {
+      nxtfs_dir_file_add(buf,filler,nxtfs_bricks[i].dirname,S_IFDIR|0777,0);
+    }
+    return 0;
   }
-  else return -ENOENT;
+
+  nxtfs_brick_lock(brick);
+  if ((ret = nxtfs_dir_scan(brick))==0) {
+    for (entry=brick->dir.entries;entry!=NULL;entry = entry->next) {
+      file = nxtfs_file_find(brick,entry->name);
+      nxtfs_dir_file_add(buf,filler,entry->name,S_IFREG|0777,file!=NULL?file->size:entry->size);
+    }
+    // created files that aren't written back yet
+    for (file=brick->files;file!=NULL;file = file->next) {
+      if (nxtfs_dir_find(brick,file->filename)==NULL) nxtfs_dir_file_add(buf,filler,file->filename,S_IFREG|0777,file->size);
+    }
+  }
+  nxtfs_brick_unlock(brick);
+  return ret;
 }
 
 /**
  * Gets attributes of a file
- *  @param filename Filename
+ *  @param path Path
  *  @param stbuf Stat buffer
  *  @return Success?
+ *  @note Uses the directory cache, so the NXT isn't asked for each file
  */
-static int nxtfs_getattr(const char *filename,struct stat *stbuf) {
-  if (strcmp(filename,"/")==0) {
+static int nxtfs_getattr(const char *path,struct stat *stbuf) {
+  struct nxtfs_brick *brick;
+  const char *filename;
+  size_t size;
+  int ret;
+
+  if ((ret = nxtfs_resolve(path,&brick,&filename))!=0) return ret;
+  if (*filename==0) {
     stbuf->st_mode = S_IFDIR|0777;
     stbuf->st_nlink = 1;
     return 0;
   }
   else {
-    int fh;
-    if ((fh = nxt_file_open(nxt,((char*)filename)+1,NXT_OREAD,&(stbuf->st_size)))!=-1) {
-      nxt_file_close(nxt,fh);
+    nxtfs_brick_lock(brick);
+    ret = nxtfs_lookup(brick,filename,&size);
+    nxtfs_brick_unlock(brick);
+    if (ret==0) {
       stbuf->st_mode = S_IFREG|0777;
       stbuf->st_nlink = 1;
-      return 0;
+      stbuf->st_size = size;
     }
-    else return nxtfs_error();
+    return ret;
   }
 }
 
 /**
  * Makes a new node (only regular files)
- *  @param filename Filename
+ *  @param path Path
  *  @param mode Mode
  *  @param dev Device (ignored)
  *  @return Success?
  */
-static int nxtfs_mknod(const char *filename,mode_t mode,dev_t dev) {
+static int nxtfs_mknod(const char *path,mode_t mode,dev_t dev) {
   if (mode&S_IFREG) {
-    int fh;
-    if ((fh = nxt_file_open(nxt,((char*)filename)+1,NXT_OWLINE,1))!=-1) {
-      nxt_file_write(nxt,fh,"\0",1);
-      nxt_file_close(nxt,fh);
-      return 0;
+    struct nxtfs_brick *brick;
+    const char *filename;
+    int fh,ret;
+
+    if ((ret = nxtfs_resolve_file(path,&brick,&filename))!=0) return ret;
+    nxtfs_brick_lock(brick);
+    if ((fh = nxt_file_open(brick->nxt,filename,NXT_OWLINE,1))!=-1) {
+      nxt_file_write(brick->nxt,fh,"\0",1);
+      nxt_file_close(brick->nxt,fh);
+      nxtfs_dir_set(brick,filename,1);
+      ret = 0;
     }
-    else return nxtfs_error();
+    else ret = nxtfs_error(brick->nxt);
+    nxtfs_brick_unlock(brick);
+    return ret;
   }
   return -EINVAL;
 }
 
 /**
  * Creates a file
- *  @param filename Filename
+ *  @param path Path
  *  @param mode Mode
  *  @param fi File info
  *  @return Success?
+ *  @note The file is created on NXT by nxtfs_flush()
  */
-static int nxtfs_create(const char *filename,mode_t mode,struct fuse_file_info *fi) {
-  int err;
-  if ((err = nxtfs_mknod(filename,mode|S_IFREG,0))!=-1) {
-    fi->flags |= O_WRONLY;
-    return nxtfs_open(filename,fi);
+static int nxtfs_create(const char *path,mode_t mode,struct fuse_file_info *fi) {
+  struct nxtfs_brick *brick;
+  const char *filename;
+  nxt_file_t *file;
+  size_t size;
+  int ret;
+
+  if ((ret = nxtfs_resolve_file(path,&brick,&filename))!=0) return ret;
+  nxtfs_brick_lock(brick);
+  ret = nxtfs_lookup(brick,filename,&size);
+  if (ret==0) ret = -EEXIST;
+  else if (ret==-ENOENT) {
+    file = nxtfs_file_new(brick,filename,0);
+    file->dirty = 0;
+    file->refs++;
+    fi->fh = (intptr_t)file;
+    ret = 0;
   }
-  else return err;
+  nxtfs_brick_unlock(brick);
+  return ret;
 }
 
 /**
  * Removes a file
- *  @param filename Filename
+ *  @param path Path
  *  @return Success?
  */
-static int nxtfs_unlink(const char *filename) {
-  if (nxt_file_remove(nxt,((char*)filename)+1)==0) return 0;
-  else return nxtfs_error();
+static int nxtfs_unlink(const char *path) {
+  struct nxtfs_brick *brick;
+  const char *filename;
+  int ret;
+
+  if ((ret = nxtfs_resolve_file(path,&brick,&filename))!=0) return ret;
+  nxtfs_brick_lock(brick);
+  if (nxt_file_remove(brick->nxt,(char*)filename)==0) {
+    nxtfs_dir_remove(brick,filename);
+    ret = 0;
+  }
+  else ret = nxtfs_error(brick->nxt);
+  nxtfs_brick_unlock(brick);
+  return ret;
 }
 
 /**
  * Renames a file
- *  @param _old Old filename
- *  @param _new New filename
+ *  @param _old Old path
+ *  @param _new New path
  *  @return Success?
  */
 static int nxtfs_rename(const char *_old,const char *_new) {
-  char *old = ((char*)_old)+1;
-  char *new = ((char*)_new)+1;
+  struct nxtfs_brick *brick,*brick_new;
+  const char *old,*new;
+  nxt_t *nxt;
+  nxt_file_t *file;
   size_t filesize;
   int fh_old,fh_new,ret;
 
+  if ((ret = nxtfs_resolve_file(_old,&brick,&old))!=0) return ret;
+  if ((ret = nxtfs_resolve_file(_new,&brick_new,&new))!=0) return ret;
+  if (brick!=brick_new) return -EXDEV;
+  nxt = brick->nxt;
+
+  nxtfs_brick_lock(brick);
+  // NXT must have the current content and no handle may be left open on it
+  if ((file = nxtfs_file_find(brick,old))!=NULL) {
+    if ((ret = nxtfs_file_flush(file))!=0) {
+      nxtfs_brick_unlock(brick);
+      return ret;
+    }
+    nxtfs_file_close_nxt(file);
+  }
+
   if ((fh_old = nxt_file_open(nxt,old,NXT_OREAD,&filesize))!=-1) {
     void *buf = malloc(filesize);
-    nxt_file_read(nxt,fh_old,buf,filesize);
-    if ((fh_new = nxt_file_open(nxt,new,NXT_OWLINE,filesize))!=-1) {
-      nxt_file_write(nxt,fh_new,buf,filesize);
+    if (nxt_file_read(nxt,fh_old,buf,filesize)!=filesize) ret = nxtfs_error(nxt);
+    else if ((fh_new = nxt_file_open(nxt,new,NXT_OWLINE,filesize))!=-1) {
+      ret = nxt_file_write(nxt,fh_new,buf,filesize)==filesize?0:nxtfs_error(nxt);
       nxt_file_close(nxt,fh_new);
-      ret = 0;
+      // don't leave an incomplete copy behind
+      if (ret!=0) nxt_file_remove(nxt,new);
     }
-    else ret = nxtfs_error();
+    else ret = nxtfs_error(nxt);
     free(buf);
     nxt_file_close(nxt,fh_old);
-    if (ret==0) nxt_file_remove(nxt,old);
+    if (ret==0) {
+      if (nxt_file_remove(nxt,(char*)old)==0) {
+        nxtfs_dir_remove(brick,old);
+        nxtfs_dir_set(brick,new,filesize);
+        if (file!=NULL) {
+          free(file->filename);
+          file->filename = strdup(new);
+        }
+      }
+      else ret = nxtfs_error(nxt);
+    }
   }
-  else ret = nxtfs_error();
+  else ret = nxtfs_error(nxt);
+  nxtfs_brick_unlock(brick);
   return ret;
 }
 
 /**
  * Truncates a file
- *  @param fn Filename
+ *  @param path Path
  *  @param newsize New size
  *  @return Success?
+ *  @note If the file is opened, the change is written back when it's flushed
  */
-static int nxtfs_truncate(const char *fn,off_t newsize) {
-  char *filename = ((char*)fn)+1;
-  size_t filesize;
-  int fh,ret;
+static int nxtfs_truncate(const char *path,off_t newsize) {
+  struct nxtfs_brick *brick;
+  const char *filename;
+  nxt_file_t *file;
+  int ret;
 
-  if (newsize==0) newsize = 1;
-  if ((fh = nxt_file_open(nxt,filename,NXT_OREAD,&filesize))!=-1) {
-    void *buf = malloc(newsize);
-    nxt_file_read(nxt,fh,buf,filesize<newsize?filesize:newsize);
-    //if (newsize>filesize) memset(buf+filesize,0,newsize-filesize);
-    nxt_file_close(nxt,fh);
-    if ((fh = nxt_file_open(nxt,filename,NXT_OWLINE|NXT_OWOVER,newsize))!=-1) {
-      nxt_file_write(nxt,fh,buf,newsize);
-      nxt_file_close(nxt,fh);
-      ret = 0;
-    }
-    else ret = nxtfs_error();
-    free(buf);
+  if ((ret = nxtfs_resolve_file(path,&brick,&filename))!=0) return ret;
+  nxtfs_brick_lock(brick);
+  if ((ret = nxtfs_file_get(brick,filename,&file))==0) {
+    nxtfs_file_truncate(file,newsize);
+    if (file->refs==1) ret = nxtfs_file_flush(file);
+    nxtfs_file_put(file);
   }
-  else ret = nxtfs_error();
+  nxtfs_brick_unlock(brick);
   return ret;
 }
 
-static int nxtfs_chown(const char *filename,uid_t uid,gid_t gid) {
+static int nxtfs_chown(const char *path,uid_t uid,gid_t gid) {
   return 0;
 }
 
-static int nxtfs_chmod(const char *filename,mode_t mode) {
+static int nxtfs_chmod(const char *path,mode_t mode) {
   return 0;
 }
 
+/**
+ * Starts prefetching directories
+ *  @return Unused
+ *  @note Called after FUSE went to background, so threads keep running
+ */
+#ifdef FUSE_VERSION_2_5
+static void *nxtfs_init(void) {
+#else
+static void *nxtfs_init(struct fuse_conn_info *conn) {
+#endif
+  size_t i;
+
+  if (options.ttl>0) {
+    for (i=0;i<nxtfs_num_bricks;i++) {
+      // prefetch first listing right away
+      nxtfs_bricks[i].used = nxtfs_time();
+      nxtfs_bricks[i].prefetching = pthread_create(&nxtfs_bricks[i].prefetch,NULL,nxtfs_prefetch,nxtfs_bricks+i)==0;
+    }
+  }
+  return NULL;
+}
+
+/**
+ * Stops prefetching directories
+ *  @param data Unused
+ */
+static void nxtfs_destroy(void *data) {
+  size_t i;
+
+  pthread_mutex_lock(&nxtfs_prefetch_mutex);
+  nxtfs_stopping = 1;
+  pthread_cond_broadcast(&nxtfs_prefetch_cond);
+  pthread_mutex_unlock(&nxtfs_prefetch_mutex);
+  for (i=0;i<nxtfs_num_bricks;i++) {
+    if (nxtfs_bricks[i].prefetching) {
+      pthread_join(nxtfs_bricks[i].prefetch,NULL);
+      nxtfs_bricks[i].prefetching = 0;
+    }
+  }
+}
+
 // Run filesystem ////
 
 static struct fuse_operations nxtfs_oper = {
+  .init      = nxtfs_init,
+  .destroy   = nxtfs_destroy,
   .open      = nxtfs_open,
   .flush     = nxtfs_flush,
   .release   = nxtfs_close,
@@ -414,22 +1114,115 @@ static struct fuse_operations nxtfs_oper = {
   .chmod     = nxtfs_chmod,
 };
 
+/**
+ * Adds a NXT to mount
+ *  @param nxt NXT handle
+ *  @param dirname Name of directory (NULL to mount NXT as root directory)
+ */
+static void nxtfs_brick_add(nxt_t *nxt,const char *dirname) {
+  struct nxtfs_brick *brick;
+
+  nxtfs_bricks = realloc(nxtfs_bricks,(nxtfs_num_bricks+1)*sizeof(struct nxtfs_brick));
+  brick = nxtfs_bricks+nxtfs_num_bricks++;
+  memset(brick,0,sizeof(struct nxtfs_brick));
+  brick->dirname = dirname!=NULL?strdup(dirname):NULL;
+  brick->nxt = nxt;
+  pthread_mutex_init(&brick->mutex,NULL);
+  pthread_cond_init(&brick->cond,NULL);
+}
+
+/**
+ * Adds all NXTs connected to nxtd, each as a directory named like the NXT
+ *  @note A NXT connected over USB and Bluetooth is added once. If several
+ *        NXTs have the same name, their ID is appended to the directory name.
+ */
+static void nxtfs_brick_add_all() {
+  struct nxtnet_proto_list_sc *list;
+  struct nxtnet_proto_list_nxts *item;
+  nxtnet_cli_t *cli;
+  nxt_t *nxt;
+  char id[18];
+  char *dirname;
+  size_t i,j;
+
+  cli = nxtnet_cli_connect_shared("localhost",NXTNET_DEFAULT_PORT,NULL);
+  if (cli==NULL) {
+    fprintf(stderr,"Could not connect to nxtd, make sure nxtd is running\n");
+    return;
+  }
+
+  list = nxtnet_cli_list(cli);
+  if (list!=NULL) {
+    for (i=0;i<list->num_items;i++) {
+      item = list->nxts+i;
+      for (j=0;j<nxtfs_num_bricks && memcmp(nxtfs_bricks[j].nxt->id,item->id,6)!=0;j++);
+      if (j<nxtfs_num_bricks) continue;
+
+      sprintf(id,"%02X:%02X:%02X:%02X:%02X:%02X",item->id[0],item->id[1],item->id[2],item->id[3],item->id[4],item->id[5]);
+      if ((nxt = nxt_open(id))==NULL) continue;
+
+      dirname = malloc(strlen(nxt->name)+14);
+      strcpy(dirname,nxt->name);
+      for (j=0;j<nxtfs_num_bricks && strcmp(nxtfs_bricks[j].dirname,dirname)!=0;j++);
+      if (j<nxtfs_num_bricks || *dirname==0 || strchr(dirname,'/')!=NULL || strcmp(dirname,".")==0 || strcmp(dirname,"..")==0) {
+        sprintf(dirname,"%s-%02X%02X%02X%02X%02X%02X",nxt->name,item->id[0],item->id[1],item->id[2],item->id[3],item->id[4],item->id[5]);
+        for (j=0;dirname[j]!=0;j++) {
+          if (dirname[j]=='/') dirname[j] = '_';
+        }
+      }
+      nxtfs_brick_add(nxt,dirname);
+      free(dirname);
+    }
+    free(list);
+  }
+
+  nxtnet_cli_disconnect(cli);
+}
+
+/**
+ * Closes a mounted NXT
+ *  @param brick NXT
+ */
+static void nxtfs_brick_close(struct nxtfs_brick *brick) {
+  while (brick->files!=NULL) {
+    brick->files->refs = 1;
+    nxtfs_file_put(brick->files);
+  }
+  nxtfs_dir_clear(&brick->dir);
+  nxt_close(brick->nxt);
+  pthread_cond_destroy(&brick->cond);
+  pthread_mutex_destroy(&brick->mutex);
+  free(brick->dirname);
+}
+
 int main(int argc,char *argv[]) {
   int ret = 0;
+  size_t i;
+  nxt_t *nxt;
   struct fuse_args args = FUSE_ARGS_INIT(argc,argv);
   memset(&options,0,sizeof(struct options));
+  options.ttl = NXTFS_DEFAULT_TTL;
   if (fuse_opt_parse(&args,&options,nxtfs_opts,NULL)==-1) return 1;
 
-  nxt = nxt_open(options.name);
-  if (nxt!=NULL) {
+  if (options.all) nxtfs_brick_add_all();
+  else if ((nxt = nxt_open(options.name))!=NULL) nxtfs_brick_add(nxt,NULL);
+
+  if (nxtfs_num_bricks>0) {
+    // FUSE calls operations from several threads, requests are queued per NXT
 #ifdef FUSE_VERSION_2_5
     ret = fuse_main(args.argc,args.argv,&nxtfs_oper);
 #else
     ret = fuse_main(args.argc,args.argv,&nxtfs_oper,NULL);
 #endif
-    nxt_close(nxt);
+    for (i=0;i<nxtfs_num_bricks;i++) {
+      nxtfs_brick_close(nxtfs_bricks+i);
+    }
+    free(nxtfs_bricks);
+  }
+  else {
+    fprintf(stderr,"Could not find NXT\n");
+    ret = 1;
   }
-  else ret = 1;
 
   fuse_opt_free_args(&args);
   return ret;
@@ -61,6 +61,7 @@ void nxtnet_scan(nxtnet_cli_t *cli) {
                                                            nxt->id[0],nxt->id[1],nxt->id[2],
                                                            nxt->id[3],nxt->id[4],nxt->id[5]);
     }
+    free(list);
   }
 }
 
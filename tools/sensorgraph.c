@@ -218,6 +218,17 @@ int main(int argc,char *argv[]) {
 
   nxt_set_sensor_mode(nxt,sensor,type,NXT_SENSOR_MODE_RAW);
 
+  // let nxtd sample the sensor every 10ms
+  struct nxt_sensor_values values;
+  nxt_batch_begin(nxt);
+  nxt_get_sensor_values(nxt,sensor,&values);
+  int sub = nxt_subscribe(nxt,10000);
+  if (sub==-1) {
+    fprintf(stderr,"Could not subscribe to sensor values: %s\n",nxt_strerror(nxt_error(nxt)));
+    nxt_close(nxt);
+    return 1;
+  }
+
   int lasty = 0;
   while (!done) {
     SDL_Event event;
@@ -229,7 +240,14 @@ int main(int argc,char *argv[]) {
       }
     }
 
-    int val = nxt_get_sensor(nxt,sensor);
+    int val = -1;
+    if (nxt_sample(nxt,sub,NULL)==0) {
+      val = values.is_calibrated?values.calibrated:values.scaled;
+    }
+    else if (nxt_error(nxt)==0) {
+      // sensor values not valid yet
+      continue;
+    }
     unsigned int y = screen.height-(val*screen.height/1023);
     if (x==screen.width) {
       x = 0;
@@ -252,8 +270,8 @@ int main(int argc,char *argv[]) {
     x++;
     lasty = y;
     SDL_Flip(display);
-    SDL_Delay(10);
   }
+  nxt_unsubscribe(nxt,sub);
 
   if (reset) nxt_set_sensor_mode(nxt,sensor,NXT_SENSOR_TYPE_NONE,NXT_SENSOR_MODE_RAW);
 
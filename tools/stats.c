@@ -0,0 +1,96 @@
+/*
+    tools/stats.c
+    aNXT - a NXt Toolkit
+    Libraries and tools for LEGO Mindstorms NXT robots
+    Copyright (C) 2008  Janosch Gräf <janosch.graef@gmx.net>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <sys/types.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+
+#include <anxt/net.h>
+
+/**
+ * Display usage
+ *  @param cmd Program's name
+ *  @param r Exit value
+ */
+void usage(char *cmd,int r) {
+  FILE *out = r==0?stdout:stderr;
+  fprintf(out,"Usage: %s [OPTION]... [HOST]\n",cmd);
+  fprintf(out,"Shows statistics of nxtd (requests, errors and latencies of each NXT)\n");
+  fprintf(out,"Options:\n");
+  fprintf(out,"\t-h           Show help\n");
+  fprintf(out,"\t-p PORT      Set port (Default: %d)\n",NXTNET_DEFAULT_PORT);
+  fprintf(out,"\t-P PASSWORD  Set password\n");
+  exit(r);
+}
+
+/// Main function
+int main(int argc,char *argv[]) {
+  int c;
+  int port = NXTNET_DEFAULT_PORT;
+  char *password = NULL;
+  char *hostname = "127.0.0.1";
+  nxtnet_cli_t *cli;
+  char *text;
+
+  while ((c = getopt(argc,argv,":hp:P:"))!=-1) {
+    switch (c) {
+      case 'h':
+        usage(argv[0],0);
+        break;
+      case 'p':
+        port = atoi(optarg);
+        break;
+      case 'P':
+        password = optarg;
+        break;
+      case ':':
+        fprintf(stderr,"Option -%c requires an operand\n",optopt);
+        usage(argv[0],1);
+        break;
+      case '?':
+        fprintf(stderr,"Unrecognized option: -%c\n", optopt);
+        usage(argv[0],1);
+        break;
+    }
+  }
+  if (optind<argc) {
+    hostname = argv[optind];
+  }
+
+  cli = nxtnet_cli_connect(hostname,port,password);
+  if (cli==NULL) {
+    fprintf(stderr,"nxt_stats: %s: %s\n",hostname,strerror(errno));
+    return 1;
+  }
+
+  text = nxtnet_cli_stats(cli);
+  nxtnet_cli_disconnect(cli);
+  if (text==NULL) {
+    fprintf(stderr,"nxt_stats: %s: Server has no statistics\n",hostname);
+    return 1;
+  }
+  fputs(text,stdout);
+  free(text);
+
+  return 0;
+}
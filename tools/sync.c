@@ -0,0 +1,231 @@
+/*
+    tools/sync.c
+    aNXT - a NXt Toolkit
+    Libraries and tools for LEGO Mindstorms NXT robots
+    Copyright (C) 2008  Janosch Gräf <janosch.graef@gmx.net>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+
+#include <anxt/nxt.h>
+#include <anxt/net.h>
+#include <anxt/file.h>
+#include <anxt/tools.h>
+
+/// Names of nxt_sync() actions
+static const char *actions[] = {
+  [NXT_SYNC_UNCHANGED] = "unchanged",
+  [NXT_SYNC_NEW]       = "new",
+  [NXT_SYNC_CHANGED]   = "changed",
+  [NXT_SYNC_FAILED]    = "failed"
+};
+
+/// Options for printing actions
+struct sync_output {
+  /// Also print unchanged files
+  int verbose;
+  /// Print NXT names
+  int names;
+};
+
+void usage(char *cmd,int r) {
+  FILE *out = r==0?stdout:stderr;
+  fprintf(out,"Usage: %s [OPTION]... FILE...\n",cmd);
+  fprintf(out,"Upload files from computer to NXTs, skipping files that are already on them\n");
+  fprintf(out,"Options:\n");
+  fprintf(out,"\t-h                        Show help\n");
+  fprintf(out,"\t-n NXTNAME                Name of NXT or bluetooth address (can be given several times; Default: first found)\n");
+  fprintf(out,"\t-a                        All NXTs connected to nxtd\n");
+  fprintf(out,"\t-o {f|fragment|l|linear}  Select write mode\n");
+  fprintf(out,"\t-j                        Synchronize NXTs in parallel\n");
+  fprintf(out,"\t-c                        Read back files of same size instead of using cached hashes\n");
+  fprintf(out,"\t-d                        Dry run: only show what would be uploaded\n");
+  fprintf(out,"\t-C DIR                    Cache directory (Default: ~/.cache/anxt/sync)\n");
+  fprintf(out,"\t-v                        Also show unchanged files\n");
+  exit(r);
+}
+
+/**
+ * Prints action taken for a file
+ *  @param nxt NXT handle
+ *  @param filename File on NXT
+ *  @param action Action (NXT_SYNC_*)
+ *  @param data Output options
+ */
+static void print_action(nxt_t *nxt,const char *filename,int action,void *data) {
+  struct sync_output *output = (struct sync_output*)data;
+
+  if (action==NXT_SYNC_UNCHANGED && !output->verbose) {
+    return;
+  }
+  if (output->names) {
+    printf("%s: %s: %s\n",nxt->name,filename,actions[action]);
+  }
+  else {
+    printf("%s: %s\n",filename,actions[action]);
+  }
+}
+
+/**
+ * Opens all NXTs connected to nxtd
+ *  @param nxts Reference for NXT handles
+ *  @return Number of NXTs
+ *  @note A NXT connected over USB and Bluetooth is opened once
+ */
+static size_t open_all(nxt_t ***nxts) {
+  struct nxtnet_proto_list_sc *list;
+  nxtnet_cli_t *cli;
+  nxt_t *nxt;
+  char id[18];
+  size_t i,j,num = 0;
+
+  *nxts = NULL;
+  cli = nxtnet_cli_connect_shared("localhost",NXTNET_DEFAULT_PORT,NULL);
+  if (cli==NULL) {
+    fprintf(stderr,"Could not connect to nxtd, make sure nxtd is running\n");
+    return 0;
+  }
+
+  list = nxtnet_cli_list(cli);
+  if (list!=NULL) {
+    *nxts = malloc(list->num_items*sizeof(nxt_t*));
+    for (i=0;i<list->num_items;i++) {
+      for (j=0;j<num && memcmp((*nxts)[j]->id,list->nxts[i].id,6)!=0;j++);
+      if (j<num) {
+        continue;
+      }
+      sprintf(id,"%02X:%02X:%02X:%02X:%02X:%02X",list->nxts[i].id[0],list->nxts[i].id[1],list->nxts[i].id[2],
+                                                  list->nxts[i].id[3],list->nxts[i].id[4],list->nxts[i].id[5]);
+      nxt = nxt_open(id);
+      if (nxt!=NULL) {
+        (*nxts)[num++] = nxt;
+      }
+      else {
+        fprintf(stderr,"Could not open NXT %s\n",id);
+      }
+    }
+    free(list);
+  }
+
+  nxtnet_cli_disconnect(cli);
+  return num;
+}
+
+int main(int argc,char *argv[]) {
+  struct sync_output output = {
+    .verbose = 0,
+    .names = 0
+  };
+  char **names = NULL;
+  size_t num_names = 0;
+  nxt_t **nxts = NULL;
+  size_t num_nxts = 0;
+  char *cache = NULL;
+  int all = 0;
+  int flags = 0;
+  int oflag = NXT_OWLINE;
+  int c,ret;
+  size_t i;
+
+  while ((c = getopt(argc,argv,":hn:ao:jcdC:v"))!=-1) {
+    switch(c) {
+      case 'h':
+        usage(argv[0],0);
+        break;
+      case 'n':
+        names = realloc(names,(num_names+1)*sizeof(char*));
+        names[num_names++] = optarg;
+        break;
+      case 'a':
+        all = 1;
+        break;
+      case 'o':
+        if (strcmp(optarg,"fragment")==0 || strcmp(optarg,"f")==0) oflag = NXT_OWFRAG;
+        else if (strcmp(optarg,"linear")==0 || strcmp(optarg,"l")==0) oflag = NXT_OWLINE;
+        else {
+          fprintf(stderr,"Invalid write mode: %s\n",optarg);
+          usage(argv[0],1);
+        }
+        break;
+      case 'j':
+        flags |= NXT_SYNC_PARALLEL;
+        break;
+      case 'c':
+        flags |= NXT_SYNC_VERIFY;
+        break;
+      case 'd':
+        flags |= NXT_SYNC_DRYRUN;
+        break;
+      case 'C':
+        cache = optarg;
+        break;
+      case 'v':
+        output.verbose = 1;
+        break;
+      case ':':
+        fprintf(stderr,"Option -%c requires an operand\n",optopt);
+        usage(argv[0],1);
+        break;
+      case '?':
+        fprintf(stderr,"Unrecognized option: -%c\n", optopt);
+        usage(argv[0],1);
+        break;
+    }
+  }
+
+  if (optind>=argc) {
+    fprintf(stderr,"No input file\n");
+    usage(argv[0],1);
+  }
+
+  if (all) {
+    num_nxts = open_all(&nxts);
+  }
+  else if (num_names==0) {
+    nxts = malloc(sizeof(nxt_t*));
+    nxts[0] = nxt_open(NULL);
+    num_nxts = nxts[0]!=NULL;
+  }
+  else {
+    nxts = malloc(num_names*sizeof(nxt_t*));
+    for (i=0;i<num_names;i++) {
+      nxts[num_nxts] = nxt_open(names[i]);
+      if (nxts[num_nxts]!=NULL) num_nxts++;
+      else fprintf(stderr,"Could not find NXT %s\n",names[i]);
+    }
+  }
+  if (num_nxts==0) {
+    fprintf(stderr,"Could not find NXT\n");
+    free(nxts);
+    free(names);
+    return 1;
+  }
+
+  output.names = all || num_names>1;
+  ret = nxt_sync(nxts,num_nxts,argv+optind,argc-optind,cache,oflag,flags,print_action,&output)!=0;
+
+  for (i=0;i<num_nxts;i++) {
+    nxt_close(nxts[i]);
+  }
+  free(nxts);
+  free(names);
+
+  return ret;
+}
@@ -45,6 +45,7 @@ int main(int argc,char *argv[]) {
   char *name = NULL;
   char *src,*dest;
   int c;
+  int failed = 0;
   int oflag = NXT_OWLINE;
   int force = 0;
 
@@ -89,14 +90,16 @@ int main(int argc,char *argv[]) {
     else dest = basename(src);
 
     oflag |= (force && oflag!=NXT_OAPPND)?NXT_OWOVER:0;
-    nxt_upload(nxt,src,dest,oflag);
+    failed = nxt_upload(nxt,src,dest,oflag)!=0;
   }
   else {
     fprintf(stderr,"No input file\n");
     usage(argv[0],1);
   }
 
-  int ret = nxt_error(nxt);
+  // errors of probing commands (e.g. for NXT_OWOVER) don't count
+  int ret = failed?nxt_error(nxt):0;
+  if (failed && ret==0) ret = 1;
   if (name!=NULL) free(name);
   nxt_close(nxt);
 